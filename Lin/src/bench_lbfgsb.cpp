@@ -0,0 +1,219 @@
+// Microbenchmark of the L-BFGS-B engines.
+//
+// Solves a batch of bounded 5 variable Rosenbrock problems from random
+// starting points the same way bfgsb_cl() drives its solvers: every solver
+// is stepped once per round and f(x) and its gradient are evaluated for the
+// whole batch between rounds. Only the solver steps are timed, so the result
+// is the cost of one L-BFGS-B step (ns/step) of the Fortran and the native
+// engine, at m = 6 (the hyperspectral setting) and m = 30.
+// The dense BFGS-B engine takes other iterates, so its iterations and
+// evaluations are compared with those of L-BFGS-B as well as its step cost.
+//
+// usage: bench_lbfgsb [number of problems] [number of repeats]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "solver.h"
+#include "time_util.h"
+
+#define BENCH_N 5
+
+// bounded Rosenbrock function and its gradient
+static double rosenbrock(const double *x, double *g)
+{
+   double f = 0;
+
+   for(int i = 0; i < BENCH_N; i++) g[i] = 0;
+
+   for(int i = 0; i < BENCH_N - 1; i++)
+   {
+      double a = x[i+1] - x[i]*x[i];
+      double b = 1 - x[i];
+      f += 100*a*a + b*b;
+      g[i] += -400*a*x[i] - 2*b;
+      g[i+1] += 200*a;
+   }
+
+   return f;
+}
+
+
+// result of solving the batch with one engine
+typedef struct s_benchResult {
+   double step_ns;		// ns per solver step (best of the repeats)
+   long steps;			// solver steps per batch
+   long evals;			// function evaluations per batch
+   long iters;			// iterations per batch
+   double *x;			// final x of all problems
+   double *f;			// final f of all problems
+} benchResult;
+
+
+// solve the batch num_funcs problems starting at x_inits with m corrections
+static void runBatch(SolverEngine engine, int m, int num_funcs, double *x_inits, int repeats, benchResult *res)
+{
+   double L[BENCH_N], U[BENCH_N];
+   int btype[BENCH_N];
+
+   for(int i = 0; i < BENCH_N; i++)
+   {
+      L[i] = -1.5;
+      U[i] = 0.8;
+      btype[i] = 2;
+   }
+
+   res->x = (double *) malloc(num_funcs * BENCH_N * sizeof(double));
+   res->f = (double *) malloc(num_funcs * sizeof(double));
+   res->step_ns = -1;
+
+   double *g = (double *) malloc(num_funcs * BENCH_N * sizeof(double));
+   SolverExtEval **solvers = (SolverExtEval **) malloc(num_funcs * sizeof(SolverExtEval *));
+   int *live = (int *) malloc(num_funcs * sizeof(int));
+
+   for(int rep = 0; rep < repeats; rep++)
+   {
+      for(int id = 0; id < num_funcs; id++)
+      {
+         solvers[id] = new SolverExtEval(BENCH_N, x_inits + id*BENCH_N, L, U, btype,
+               res->x + id*BENCH_N, res->f + id, g + id*BENCH_N, m, 2000, id, engine);
+         live[id] = id;
+      }
+
+      int num_live = num_funcs;
+      double step_ms = 0;
+      res->steps = 0;
+      res->evals = 0;
+
+      while(num_live > 0)
+      {
+         struct timeval start, end;
+
+         // step all running solvers
+         gettimeofday(&start, NULL);
+
+         for(int i = 0; i < num_live; i++)
+         {
+            solvers[live[i]]->runSolver();
+         }
+
+         gettimeofday(&end, NULL);
+         step_ms += calc_time(&start, &end);
+         res->steps += num_live;
+
+         // drop finished solvers, evaluate the others
+         int num_run = 0;
+
+         for(int i = 0; i < num_live; i++)
+         {
+            int id = live[i];
+            if(solvers[id]->finished()) continue;
+
+            res->f[id] = rosenbrock(res->x + id*BENCH_N, g + id*BENCH_N);
+            live[num_run++] = id;
+         }
+
+         res->evals += num_run;
+         num_live = num_run;
+      }
+
+      double ns = step_ms * 1e6 / res->steps;
+      if(res->step_ns < 0 || ns < res->step_ns) res->step_ns = ns;
+
+      res->iters = 0;
+      for(int id = 0; id < num_funcs; id++) res->iters += solvers[id]->getIterations();
+
+      for(int id = 0; id < num_funcs; id++) delete solvers[id];
+   }
+
+   free(g);
+   free(solvers);
+   free(live);
+}
+
+
+int main(int argc, char *argv[])
+{
+   int num_funcs = 4096;
+   int repeats = 5;
+
+   if(argc > 1) num_funcs = atoi(argv[1]);
+   if(argc > 2) repeats = atoi(argv[2]);
+
+   if(num_funcs < 1 || repeats < 1)
+   {
+      printf("usage: bench_lbfgsb [number of problems] [number of repeats]\n");
+      return 1;
+   }
+
+   // random starting points inside the bounds
+   double *x_inits = (double *) malloc(num_funcs * BENCH_N * sizeof(double));
+   srand(1);
+
+   for(int i = 0; i < num_funcs * BENCH_N; i++)
+   {
+      x_inits[i] = -1.5 + 2.3 * ((double) rand() / RAND_MAX);
+   }
+
+   printf("L-BFGS-B step benchmark: n = %d, %d problems, best of %d runs\n", BENCH_N, num_funcs, repeats);
+
+   int ms[2] = { 6, 30 };
+
+   for(int k = 0; k < 2; k++)
+   {
+      int m = ms[k];
+      benchResult fres, nres, dres;
+
+      runBatch(fortranEngine, m, num_funcs, x_inits, repeats, &fres);
+      runBatch(nativeEngine, m, num_funcs, x_inits, repeats, &nres);
+      runBatch(denseEngine, m, num_funcs, x_inits, repeats, &dres);
+
+      // compare the results of the two engines
+      double max_dx = 0;
+      double max_df = 0;
+      int num_diff = 0;
+
+      for(int id = 0; id < num_funcs; id++)
+      {
+         bool diff = false;
+
+         for(int i = 0; i < BENCH_N; i++)
+         {
+            double dx = fabs(fres.x[id*BENCH_N + i] - nres.x[id*BENCH_N + i]);
+            if(dx > max_dx) max_dx = dx;
+            if(dx != 0) diff = true;
+         }
+
+         double df = fabs(fres.f[id] - nres.f[id]);
+         if(df > max_df) max_df = df;
+         if(df != 0) diff = true;
+
+         if(diff) num_diff++;
+      }
+
+      printf("m = %2d  fortran: %8.1f ns/step (%ld steps, %ld evals, %ld iters)\n", m, fres.step_ns, fres.steps, fres.evals, fres.iters);
+      printf("m = %2d  native:  %8.1f ns/step (%ld steps, %ld evals, %ld iters)  speedup %.2fx\n", m, nres.step_ns, nres.steps, nres.evals,
+            nres.iters, fres.step_ns / nres.step_ns);
+      printf("m = %2d  results differ for %d of %d problems (max |dx| %g, max |df| %g)\n", m, num_diff, num_funcs, max_dx, max_df);
+
+      // the dense engine takes other iterates, compare the solve times and the final f
+      double sum_nf = 0, sum_df = 0;
+      for(int id = 0; id < num_funcs; id++) { sum_nf += nres.f[id]; sum_df += dres.f[id]; }
+
+      printf("m = %2d  dense:   %8.1f ns/step (%ld steps, %ld evals, %ld iters)  solve time %.2fx native\n", m, dres.step_ns, dres.steps,
+            dres.evals, dres.iters, (dres.step_ns * dres.steps) / (nres.step_ns * nres.steps));
+      printf("m = %2d  mean final f: native %g, dense %g\n", m, sum_nf / num_funcs, sum_df / num_funcs);
+
+      free(fres.x);
+      free(fres.f);
+      free(nres.x);
+      free(nres.f);
+      free(dres.x);
+      free(dres.f);
+   }
+
+   free(x_inits);
+
+   return 0;
+}
@@ -19,46 +19,39 @@
 
 #include <iostream>
 #include <fstream>
-#include <list>
-#include <queue>
+#include <new>
 using namespace std;
 
 #include "bfgsb_cl.h"
 #include "time_util.h"
 #include "solver.h"
 #include "parallel_eval.h"
-
-// CPU work-thread status
-typedef enum e_workerStatus
-{
-   busy,
-   idle
-} workerStatus;
-
-// solver status
-typedef enum e_bfgsbCLStatus
+#include "phase_barrier.h"
+#include "completion_queue.h"
+#include "work_steal.h"
+#include "solver_arena.h"
+
+// arguments to a CPU work thread
+struct s_bfgsbCLWorkerArg {
+   BfgsbCL *session;
+   long tid;
+};
+typedef struct s_bfgsbCLWorkerArg bfgsbCLWorkerArg;
+
+
+// evaluation done callback of the OpenCL evaluation module, runs in an OpenCL
+// runtime thread and hands the cohort over to the master
+static void cohortEvalDone(int cohort, void *readyCohorts)
 {
-   running,
-   finished
-} bfgsbCLStatus;
-
-// Thread structures
-
-static void *WorkThread4(void *threadid);  // cpu work thread
-
-static workerStatus *workThreadStatus;  
-static bfgsbCLStatus *solverStatus; 
-static pthread_mutex_t *workThreadStatusMutex;
-static pthread_mutex_t *solverStatusMutex;
-
-static pthread_mutex_t *queueMutex;
-static queue<SolverExtEval *> *solverWorkQueue;
+   ((CompletionQueue *) readyCohorts)->push(cohort);
+}
 
 
 // This is the main BFGS-B CL Solver function.
 // It solves a num_funcs sized array of non-linear bound constrained optimization problems of num_vars variables
 // using multi-threaded CPU code + OpenCL on a GPU.
 // It returns the result in x_ret and f_ret.
+// It sets up a BfgsbCL session, solves one batch and tears the session down again.
 void bfgsb_cl(
       int num_vars,
       double *x_init,
@@ -78,59 +71,213 @@ void bfgsb_cl(
       bool use_coarse_grain_search,
       unsigned int coarse_grain_n,
       double *coarse_grain_points,
-	  bool verbosePrint)
+	  bool verbosePrint,
+      bfgsb_cl_options *options,
+      bfgsb_cl_coarse_grain_bank *coarse_grain_bank)
 {
 
    struct timeval start, end;
    gettimeofday(&start, NULL); 
+   double cpu_start = get_cpu_time();
 
-   // initialize parallel evaluation module
-   pEval pe(
+   BfgsbCL session(
          num_vars,
-         num_funcs,
          evalSrcFileNameFull,
          OpenCL_incDir,
+         num_cpu_work_threads,
+         options);
+
+   session.solve(
+         x_init,
+         b,
+         L,
+         U,
+         num_funcs,
          num_user_args,
          user_args,
+         max_iterations,
+         hessian_approx_factor,
+         x_ret,
+         f_ret,
          use_coarse_grain_search,
          coarse_grain_n,
-         coarse_grain_points);
-         
+         coarse_grain_points,
+         verbosePrint,
+         coarse_grain_bank);
+
+   session.printStats();
+
+   gettimeofday(&end, NULL); 
+   printf("SOLVER EXECUTION TIME: %f (ms)\n", calc_time(&start, &end));
+   printf("SOLVER CPU TIME: %f (ms)\n", get_cpu_time() - cpu_start);
+}
+
+
+// fill in the default bfgsb_cl options
+void bfgsb_cl_set_default_options(bfgsb_cl_options *options)
+{
+   options->num_cohorts = 1;
+   options->fortran_engine = false;
+   options->dense_engine = false;
+   options->lm_solver = false;
+   options->solver_arenas = true;
+   options->solver_window = 0;
+   options->eval_kernel = NULL;
+   options->eval_variant = NULL;
+   options->program_cache_dir = NULL;
+   options->host_memory = BFGSB_CL_HOST_MEMORY_AUTO;
+   options->out_of_order_queue = false;
+   options->platform_select = NULL;
+   options->device_select = NULL;
+   options->num_devices = 0;
+   options->sub_device_units = 0;
+   options->tune_launch = true;
+   options->precision = BFGSB_CL_PRECISION_DOUBLE;
+   options->polish_iterations = 20;
+   options->device_solver = false;
+   options->device_solver_iterations = 50;
+   options->line_search_points = 1;
+}
+
+
+// set up a solver session: initialize OpenCL (context, queue and compiled
+// evaluation kernels) and start the CPU work threads
+BfgsbCL::BfgsbCL(
+      int num_vars,
+      const char *evalSrcFileNameFull,
+      const char *OpenCL_incDir,
+      int num_cpu_work_threads,
+      bfgsb_cl_options *options)
+{
+   if(options != NULL) opts = *options;
+   else bfgsb_cl_set_default_options(&opts);
+
+   if(opts.num_cohorts < 1) opts.num_cohorts = 1;
+
+   // the Levenberg-Marquardt engine steps one function at a time on the CPU work-threads
+   if(opts.lm_solver)
+   {
+      opts.device_solver = false;
+   }
+
+   // the candidates are only proposed by the native L-BFGS-B engine stepping one function at a time
+   if(opts.line_search_points > LBFGSB_MAX_CANDIDATES + 1) opts.line_search_points = LBFGSB_MAX_CANDIDATES + 1;
+   if(opts.line_search_points < 1 || opts.fortran_engine || opts.dense_engine || opts.lm_solver || 
+         opts.device_solver) opts.line_search_points = 1;
+
+   this->num_vars = num_vars;
+   this->num_cpu_work_threads = num_cpu_work_threads;
+
+   // initialize parallel evaluation module
+   pe = new pEval(
+         num_vars,
+         evalSrcFileNameFull,
+         OpenCL_incDir,
+         &opts);
+
+   // the master handles the cohorts in the order the device finishes them
+   readyCohorts = new CompletionQueue(opts.num_cohorts);
+   pe->setEvalDoneCallback(cohortEvalDone, readyCohorts);
+
    // init thread structures
-   long t;
-   pthread_t *threads = (pthread_t *) malloc(num_cpu_work_threads * sizeof(pthread_t));
-   workThreadStatus = (workerStatus *) malloc(num_cpu_work_threads * sizeof(workerStatus));
-   solverStatus = (bfgsbCLStatus *) malloc(num_cpu_work_threads * sizeof(solverStatus));
-   workThreadStatusMutex = (pthread_mutex_t *) malloc(num_cpu_work_threads * sizeof(pthread_mutex_t));
-   solverStatusMutex = (pthread_mutex_t *) malloc(num_cpu_work_threads * sizeof(pthread_mutex_t));
-   queueMutex = (pthread_mutex_t *) malloc(num_cpu_work_threads * sizeof(pthread_mutex_t));
-   solverWorkQueue = new queue<SolverExtEval *>[num_cpu_work_threads];
-
-   for(t = 0; t < num_cpu_work_threads; t++)
+   threads = (pthread_t *) malloc(num_cpu_work_threads * sizeof(pthread_t));
+   workerArgs = (bfgsbCLWorkerArg *) malloc(num_cpu_work_threads * sizeof(bfgsbCLWorkerArg));
+   iterBarrier = new PhaseBarrier(num_cpu_work_threads);
+   workScheduler = new WorkStealScheduler(num_cpu_work_threads);
+   solverArray = NULL;
+   solverRunIds = NULL;
+
+   arenas = NULL;
+   if(opts.solver_arenas)
    {
-      solverStatus[t] = running;
-      workThreadStatus[t] = idle;
-      pthread_mutex_init(&queueMutex[t], NULL);
-      pthread_mutex_init(&workThreadStatusMutex[t], NULL);
-      pthread_mutex_init(&solverStatusMutex[t], NULL);
+      arenas = (SolverArena **) malloc(num_cpu_work_threads * sizeof(SolverArena *));
+      for(int t = 0; t < num_cpu_work_threads; t++) arenas[t] = new SolverArena();
    }
 
+   evalRounds = 0;
+   funcEvals = 0;
+   candidateEvals = 0;
+   solverIterations = 0;
+   solverObjectAllocs = 0;
+   workspaceAllocs = 0;
 
-   // initialize OpenCL and required buffers
-   pe.OpenCL_setup();
+   // initialize OpenCL
+   pe->OpenCL_setup();
 
-   // solver working list
-   list<SolverExtEval *> solverWorkList;
+   if(opts.device_solver && !pe->hasSolveKernel())
+   {
+      printf("The OpenCL file has no solve kernel for every device, solving on the CPU\n\n");
+      opts.device_solver = false;
+   }
+
+   // launch CPU work threads, they sleep in the barrier until there is work
+   for(long t = 0; t < num_cpu_work_threads; t++)
+   {
+      workerArgs[t].session = this;
+      workerArgs[t].tid = t;
+      pthread_create(&threads[t], NULL, workThread, (void *)&workerArgs[t]);
+   }
+}
 
-   // master solver array
-   SolverExtEval **masterSolverArray;
-   masterSolverArray = (SolverExtEval **) malloc(num_funcs * sizeof(SolverExtEval *));   
-  
-   // get host memory pointers from PE module
-   double *x = pe.getx();
-   double *f = pe.getF();
-   double *g = pe.getg();
-   int *active = pe.getActive();
+
+// stop the CPU work threads and release OpenCL resources
+BfgsbCL::~BfgsbCL()
+{
+   // signal to all worker threads that we are done
+   iterBarrier->shutdown();
+
+   // join CPU work threads
+   for(int t = 0; t < num_cpu_work_threads; t++)
+   {
+       pthread_join(threads[t], NULL);
+   }
+
+   free(threads);
+   free(workerArgs);
+   delete iterBarrier;
+   delete workScheduler;
+
+   if(arenas != NULL)
+   {
+      for(int t = 0; t < num_cpu_work_threads; t++) delete arenas[t];
+      free(arenas);
+   }
+
+   delete pe;
+   delete readyCohorts;
+}
+
+
+// solve one batch of num_funcs functions, returns the result in x_ret and f_ret
+// OpenCL buffers are only reallocated if the batch is larger than any 
+// batch solved before in this session
+void BfgsbCL::solve(
+      double *x_init,
+      int *b,
+      double *L,
+      double *U,
+      int num_funcs,
+      int num_user_args,
+      bfgsb_cl_user_data_arg *user_args,
+      int max_iterations,
+      int hessian_approx_factor,
+      double *x_ret,
+      double *f_ret,
+      bool use_coarse_grain_search,
+      unsigned int coarse_grain_n,
+      double *coarse_grain_points,
+	  bool verbosePrint,
+      bfgsb_cl_coarse_grain_bank *coarse_grain_bank)
+{
+   // upload the problem data, growing the OpenCL buffers if needed
+   pe->setProblem(
+         num_funcs,
+         num_user_args,
+         user_args,
+         use_coarse_grain_search,
+         coarse_grain_n,
+         coarse_grain_points,
+         coarse_grain_bank);
 
    // will serve as initializers for x to pass to solver drivers
    double *x_inits = (double *) malloc(num_vars * num_funcs * sizeof(double));
@@ -148,164 +295,353 @@ void bfgsb_cl(
    // use coarse grain search
    else
    {
-      pe.coarse_grain_search(x_inits);
+      pe->coarse_grain_search(x_inits);
    }
 
-   // initialize solver drivers
-   for(int id = 0; id < num_funcs; id++)
+   // the device solver runs the iterations and evaluations in device memory
+   // and leaves the solutions in the evaluation module like the CPU solvers
+   if(opts.device_solver)
    {
-      masterSolverArray[id] = new SolverExtEval(num_vars, x_inits+(id * num_vars), L, U, b, x, f, g, hessian_approx_factor, max_iterations, id);
-      f++;
-      g = g+num_vars;
-      x = x+num_vars;
+      pe->deviceSolve(x_inits, b, L, U, hessian_approx_factor, defaultfactr, defaultpgtol, 
+            max_iterations, opts.device_solver_iterations, opts.solver_window, verbosePrint);
+
+      memcpy(x_ret, pe->getx(), num_vars * num_funcs * sizeof(double));
+      memcpy(f_ret, pe->getF(), num_funcs * sizeof(double));
+
+      free(x_inits);
+      return;
    }
 
-   // initialize work list
-   solverWorkList.assign(masterSolverArray, masterSolverArray+num_funcs);
+   // in single or mixed precision the solvers converge on the single precision 
+   // evaluation, mixed precision then restarts them from their solutions for
+   // a few polishing iterations in double precision
+   bool single = (opts.precision != BFGSB_CL_PRECISION_DOUBLE) && pe->setSinglePrecision(true);
+
+   runSolvers(num_funcs, x_inits, b, L, U, max_iterations, hessian_approx_factor, verbosePrint);
 
-  // launch CPU work threads
-   for(t = 0; t < num_cpu_work_threads; t++)
+   if(single)
    {
-      pthread_create(&threads[t], NULL, WorkThread4, (void *)t);
+      pe->setSinglePrecision(false);
+
+      if(opts.precision == BFGSB_CL_PRECISION_MIXED && opts.polish_iterations > 0)
+      {
+         memcpy(x_inits, pe->getx(), num_vars * num_funcs * sizeof(double));
+
+         runSolvers(num_funcs, x_inits, b, L, U, opts.polish_iterations, hessian_approx_factor, verbosePrint);
+      }
    }
 
+   // copy data back to output parameters (passed from calling function)
+   memcpy(x_ret, pe->getx(), num_vars * num_funcs * sizeof(double));
+   memcpy(f_ret, pe->getF(), num_funcs * sizeof(double));
 
-   // start main bfgs_cl solver loop
+   free(x_inits);
+}
 
-   long wt = 0; // work thread
-   int r = 0;
-   while(1)
+
+// run the solvers of the num_funcs functions of the current problem, starting 
+// from x_inits, until they all converged or ran max_iterations iterations
+// (x, F and the gradient are left in pe's host arrays)
+void BfgsbCL::runSolvers(
+      int num_funcs,
+      double *x_inits,
+      int *b,
+      double *L,
+      double *U,
+      int max_iterations,
+      int hessian_approx_factor,
+	  bool verbosePrint)
+{
+   // every function has points evaluation slots: its x and the speculative
+   // line search candidates of its solver
+   int points = pe->getEvalPoints();
+   double *xc = pe->getxCandidates();
+   double *fc = pe->getFCandidates();
+   double *gc = pe->getgCandidates();
+
+   // with a solver window only num_slots solvers are live at once, a slot 
+   // whose solver finished is restarted on the next function not yet
+   // started (function nextSolver), reusing its workspace
+   int num_slots = num_funcs;
+   if(opts.solver_window > 0 && opts.solver_window < num_slots) num_slots = opts.solver_window;
+   int nextSolver = num_slots;
+
+   int num_cohorts = opts.num_cohorts;
+   if(num_cohorts > num_slots) num_cohorts = num_slots;
+
+   // compacted list of the solver slots still running in each cohort
+   // cohort c holds the slots [cohortFirst[c], cohortFirst[c+1]),
+   // the cohortLive[c] running ones are stored in ascending order at 
+   // liveIds[cohortFirst[c]] onwards
+   int *liveIds = (int *) malloc(num_slots * sizeof(int));
+   int *cohortFirst = (int *) malloc((num_cohorts + 1) * sizeof(int));
+   int *cohortLive = (int *) malloc(num_cohorts * sizeof(int));
+
+   for(int c = 0; c <= num_cohorts; c++)
    {
+      cohortFirst[c] = (int) (((long) num_slots * c) / num_cohorts);
+   }
 
-      if(verbosePrint) printf("iter %d\n", r++);
-      wt = 0;
+   // ids of the functions to evaluate for each cohort
+   // (the cohort's running solvers and their line search candidates)
+   int *evalIds = (int *) malloc(num_slots * points * sizeof(int));
 
-      // iterate over solver list
-      for(list<SolverExtEval *>::iterator it = solverWorkList.begin(); it != solverWorkList.end();)
-      {
-         SolverExtEval *s = *it;
+   // master solver array, indexed by slot
+   SolverExtEval **masterSolverArray = (SolverExtEval **) malloc(num_slots * sizeof(SolverExtEval *));   
+  
+   // get host memory pointers from PE module
+   double *x = pe->getx();
+   double *f = pe->getF();
+   double *g = pe->getg();
+   int gStride = pe->getGradientStride();
 
-         list<SolverExtEval *>::iterator tmp_it = it; 
-         it++;
+   // initialize solver drivers
+   // with arenas each solver is placed in the arena of the work thread whose
+   // chunk of its cohort it starts out in (see WorkStealScheduler::assign()),
+   // so the solvers a thread steps are contiguous in memory
+   if(arenas != NULL)
+   {
+      for(int t = 0; t < num_cpu_work_threads; t++) arenas[t]->reset();
+   }
 
-         // if solver is finished, remove from work list, set PE active flag to
-         // inactive
-         if(s->finished())
-         {
-            int id = s->getId();
-            active[id] = 0;
-            solverWorkList.erase(tmp_it);
-         }
+   int cohort = 0;
+   for(int id = 0; id < num_slots; id++)
+   {
+      SolverArena *arena = NULL;
 
-         // else push on to a work queue
-         else
-         {
-            pthread_mutex_lock(&queueMutex[wt]);
-            solverWorkQueue[wt].push(s);
-            pthread_mutex_unlock(&queueMutex[wt]);
+      if(arenas != NULL)
+      {
+         while(id >= cohortFirst[cohort+1]) cohort++;
 
-            wt++;
-            if(wt == num_cpu_work_threads) wt = 0;
-         }
+         int i = id - cohortFirst[cohort];
+         int size = cohortFirst[cohort+1] - cohortFirst[cohort];
+         int chunk = size / num_cpu_work_threads;
+         int extra = size % num_cpu_work_threads;
+         int t;
+
+         if(i < extra * (chunk + 1)) t = i / (chunk + 1);
+         else t = extra + (i - extra * (chunk + 1)) / chunk;
 
+         arena = arenas[t];
       }
 
-      bool wait = true;
+      // slot id starts out solving function id
+      void *mem;
+      if(arena != NULL) mem = arena->alloc(sizeof(SolverExtEval));
+      else { mem = ::operator new(sizeof(SolverExtEval)); solverObjectAllocs++; }
+
+      masterSolverArray[id] = new (mem) SolverExtEval(num_vars, x_inits+(id * num_vars), L, U, b, 
+            x+(id * num_vars), f+id, g+(id * gStride), hessian_approx_factor, max_iterations, id,
+            opts.lm_solver ? lmEngine : (opts.fortran_engine ? fortranEngine : 
+            (opts.dense_engine ? denseEngine : nativeEngine)), arena);
 
-      // wait for all work threads to be done with their work for this
-      // iteration
-      while(1)
+      if(points > 1)
       {
-         // make sure all work queues are empty and all work threads are idle
-         for(t = 0; t < num_cpu_work_threads; t++)
-         {
-            pthread_mutex_lock(&workThreadStatusMutex[t]);
-            workerStatus status = workThreadStatus[t];
-            pthread_mutex_unlock(&workThreadStatusMutex[t]);
+         masterSolverArray[id]->setCandidates(xc+(id * (points-1) * num_vars), fc+(id * (points-1)), 
+               gc+(id * (points-1) * gStride), points-1);
+      }
+   }
+
+   // initialize work lists
+   for(int id = 0; id < num_slots; id++)
+   {
+      liveIds[id] = id;
+   }
+
+   for(int c = 0; c < num_cohorts; c++)
+   {
+      cohortLive[c] = cohortFirst[c+1] - cohortFirst[c];
+   }
+
+   solverArray = masterSolverArray;
+
+   // start main bfgs_cl solver loop
+   // the master takes the cohorts in the order the GPU finishes their evaluations:
+   // a cohort collects its results, its live list is updated, its solvers are 
+   // stepped on the CPU and its next evaluation is started on the GPU, so with
+   // several cohorts the GPU evaluates the others while the CPU works on one.
+   // At the start none of them has an evaluation in flight.
 
-            if(status == busy) break;
+   int cohorts_running = num_cohorts;
 
-            pthread_mutex_lock(&queueMutex[t]);
-            bool empty = solverWorkQueue[t].empty();
-            pthread_mutex_unlock(&queueMutex[t]);
+   readyCohorts->clear();
+   for(int c = 0; c < num_cohorts; c++) readyCohorts->push(c);
 
-            if(!empty) break;
+   int r = 0;
+   while(cohorts_running > 0)
+   {
+      // sleep until the GPU has finished a cohort
+      int c = readyCohorts->pop();
+
+      if(verbosePrint) printf("iter %d (cohort %d)\n", r++, c);
+
+      // collect GPU results of this cohort
+      pe->evalWait(c);
+
+      // compact the cohort's live list, dropping finished solvers
+      // (or restarting their slots on the next functions with a solver window)
+      int *cohortIds = liveIds + cohortFirst[c];
+      int num_run = 0;
+
+      for(int i = 0; i < cohortLive[c]; i++)
+      {
+         int id = cohortIds[i];
+
+         if(masterSolverArray[id]->finished())
+         {
+            if(nextSolver >= num_funcs) continue;
 
-            if(t == (num_cpu_work_threads - 1)) wait = false; // all threads are finished with work
+            int next = nextSolver++;
 
+            solverIterations += masterSolverArray[id]->getIterations();
+            masterSolverArray[id]->restart(x_inits+(next * num_vars), x+(next * num_vars), f+next, 
+                  g+(next * gStride), next);
+
+            if(points > 1)
+            {
+               masterSolverArray[id]->setCandidates(xc+(next * (points-1) * num_vars), fc+(next * (points-1)), 
+                     gc+(next * (points-1) * gStride), points-1);
+            }
          }
 
-         if(wait == false) break; // work is all done for this iteration, break out
+         cohortIds[num_run++] = id;
+      }
+
+      cohortLive[c] = num_run;
 
+      // if the cohort's work list is empty it is done
+      if(num_run == 0)
+      {
+         cohorts_running--;
+         continue;
       }
 
+      // split the run list into contiguous chunks, one per work thread
+      // (work threads are all asleep in the barrier here so no locking is needed)
+      solverRunIds = cohortIds;
+      workScheduler->assign(num_run);
+
+      // wake up the work threads and sleep until all of them are done with 
+      // their work for this iteration
+      iterBarrier->publish();
+      iterBarrier->waitForWorkers();
+      workScheduler->iterationDone();
+
       // GPU parallel evaluation
       if(verbosePrint) printf("GPU calc\n");
-      pe.eval(); 
-      if(verbosePrint) printf("Done GPU calc\n");
 
-      // if solver work list is empty we are done
-      if(solverWorkList.empty()) 
+      // evaluate the unfinished functions (and the line search candidates their solvers 
+      // proposed), the cohort's evaluation slots start at its first function
+      int first_slot = cohortFirst[c] * points;
+      int *cohortEvalIds = evalIds + first_slot;
+      int num_eval = 0;
+
+      for(int i = 0; i < num_run; i++)
       {
- 
-         // signal to all worker threads that we are done
-         for(t = 0; t < num_cpu_work_threads; t++)
+         SolverExtEval *solver = masterSolverArray[cohortIds[i]];
+         int candidates = solver->candidates();
+
+         cohortEvalIds[num_eval++] = solver->getId();
+
+         for(int k = 0; k < candidates; k++)
          {
-            pthread_mutex_lock(&solverStatusMutex[t]);
-            solverStatus[t] = finished;
-            pthread_mutex_unlock(&solverStatusMutex[t]);
+            cohortEvalIds[num_eval++] = pe->candidateId(solver->getId(), k);
          }
-
-         break; // exit bfgs_cl solver loop 
+         candidateEvals += candidates;
       }
 
-
+      pe->evalAsync(c, first_slot, cohortEvalIds, num_eval);
+      evalRounds++;
+      funcEvals += num_eval;
    }
 
-   // join CPU work threads
-   for(t = 0; t < num_cpu_work_threads; t++)
+   // cleanup
+   free(liveIds);
+   free(cohortFirst);
+   free(cohortLive);
+   free(evalIds);
+
+   solverArray = NULL;
+   solverRunIds = NULL;
+
+   // free masterSolverArray
+   // (solvers in arenas are only destroyed, their memory is reused by the next batch)
+   for(int id = 0; id < num_slots; id++)
    {
-       pthread_join(threads[t], NULL);
+      solverIterations += masterSolverArray[id]->getIterations();
+      workspaceAllocs += masterSolverArray[id]->heapAllocations();
+
+      if(arenas != NULL) masterSolverArray[id]->~SolverExtEval();
+      else delete masterSolverArray[id];
    }
 
-   // copy data back to output parameters (passed from calling function)
-   x = pe.getx();
-   f = pe.getF();
+   free(masterSolverArray);
+}
 
-   memcpy(x_ret, x, num_vars * num_funcs * sizeof(double));
-   memcpy(f_ret, f, num_funcs * sizeof(double));
 
-   // cleanup
+// print load balance and pipelining statistics of all batches solved so far
+void BfgsbCL::printStats()
+{
+   workScheduler->printStats();
 
-   free(x_inits);
+   if(pe->getNumDevices() > 1) pe->printDeviceStats();
 
-   free(threads);
-   free(workThreadStatus);
-   free(solverStatus);
-   free(workThreadStatusMutex);
-   free(solverStatusMutex);
-   free(queueMutex);
-   delete[] solverWorkQueue;
+   if(opts.device_solver)
+   {
+      printf("DEVICE SOLVER: %ld functions, %ld launches, %f (ms)\n", 
+            pe->getSolveFuncs(), pe->getSolveLaunches(), pe->getSolveTime());
+   }
 
-   // free masterSolverArray
-   for(int id = 0; id < num_funcs; id++)
+   if(!opts.device_solver)
    {
-      delete masterSolverArray[id];
+      printf("SOLVER: %ld evaluations in %ld evaluation rounds", funcEvals - candidateEvals, evalRounds);
+      if(solverIterations > 0) printf(", %ld iterations", solverIterations);
+      printf("\n");
    }
 
-   free(masterSolverArray);
+   if(opts.line_search_points > 1)
+   {
+      printf("LINE SEARCH: %d candidates with each first trial step, %ld candidates evaluated in %ld evaluation rounds\n",
+            opts.line_search_points - 1, candidateEvals, evalRounds);
+   }
 
-	
-   gettimeofday(&end, NULL); 
-   printf("SOLVER EXECUTION TIME: %f (ms)\n", calc_time(&start, &end));
+   if(opts.num_cohorts > 1)
+   {
+      double busy = pe->getDeviceBusyTime();
+      double blocked = pe->getHostWaitTime();
+      double overlap = 0;
+      if(busy > 0) overlap = 100.0 * (busy - blocked) / busy;
+      if(overlap < 0) overlap = 0;
+
+      printf("PIPELINE: %d cohorts, GPU busy %f (ms), CPU blocked on GPU %f (ms), overlap %.1f%%\n", 
+            opts.num_cohorts, busy, blocked, overlap);
+   }
+
+   // solver memory: heap allocations for solver objects and workspaces
+   long arenaBlocks = 0;
+   size_t arenaBytes = 0;
+
+   if(arenas != NULL)
+   {
+      for(int t = 0; t < num_cpu_work_threads; t++)
+      {
+         arenaBlocks += arenas[t]->numBlocks();
+         arenaBytes += arenas[t]->bytesUsed();
+      }
+   }
+
+   printf("MEMORY: %ld solver heap allocations (%ld solvers, %ld workspaces, %ld arena blocks), "
+         "%.1f MB in arenas, peak RSS %.1f MB\n", 
+         solverObjectAllocs + workspaceAllocs + arenaBlocks, solverObjectAllocs, workspaceAllocs, arenaBlocks,
+         arenaBytes / (1024.0 * 1024.0), get_peak_rss());
 }
 
 
 // worker thread for bfgs_cl solver
-static void *WorkThread4(void *threadid)
+void *BfgsbCL::workThread(void *arg)
 {
-
-   long tid = (long) threadid;
+   BfgsbCL *session = ((bfgsbCLWorkerArg *) arg)->session;
+   long tid = ((bfgsbCLWorkerArg *) arg)->tid;
 
 //   These are experimental pthread options to set thread affinity, they are not really needed. 
 //   And they are not supported under pthread-w32. Turning off to for now.
@@ -314,57 +650,25 @@ static void *WorkThread4(void *threadid)
 //   CPU_SET(tid, &cpuset);
 //   pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
 
-   printf("work thread %d started\n", tid);
+   unsigned int phase = 0;
 
-   while(1)
+   // sleep until the master publishes an iteration, exit when it shuts us down
+   while(session->iterBarrier->waitForPhase(&phase))
    {
-      bool qEmpty;
-
-      // check if work queue is empty
-      pthread_mutex_lock(&queueMutex[tid]);
-      qEmpty = solverWorkQueue[tid].empty();
-
-      // if queue is empty
-      if(qEmpty) 
-      {
-         pthread_mutex_unlock(&queueMutex[tid]);
-
-         // check signal to shut down worker
-         pthread_mutex_lock(&solverStatusMutex[tid]);
-         bfgsbCLStatus status = solverStatus[tid];
-         pthread_mutex_unlock(&solverStatusMutex[tid]);
-
-         // if we are done, shut down worker thread
-         if(status == finished) break;
-      }
+      int i;
 
-      else 
+      // step solvers until there is no work left to take or steal in this iteration
+      while(session->workScheduler->next(tid, &i))
       {
-         // set worker state to being busy
-         pthread_mutex_lock(&workThreadStatusMutex[tid]);
-         workThreadStatus[tid] = busy;
-         pthread_mutex_unlock(&workThreadStatusMutex[tid]);
-
-         // get work item and do work
-         SolverExtEval*&  s = solverWorkQueue[tid].front();
-         solverWorkQueue[tid].pop();
-         SolverExtEval *s_tmp = s;
-         pthread_mutex_unlock(&queueMutex[tid]);
-
-         s_tmp->runSolver(); // do work
-
-         // set worker state to being idle
-         pthread_mutex_lock(&workThreadStatusMutex[tid]);
-         workThreadStatus[tid] = idle;
-         pthread_mutex_unlock(&workThreadStatusMutex[tid]);
+         session->solverArray[session->solverRunIds[i]]->runSolver(); // do work
       }
 
+      // let the master know this thread is done
+      session->workScheduler->finish(tid);
+      session->iterBarrier->arrive();
    }
 
-
-  printf("work thread %d ending\n", tid);
   pthread_exit(NULL);
 
   return NULL;
 }
-
@@ -1,6 +1,8 @@
 #ifndef BFGSB_CL_H
 #define BFGSB_CL_H
 
+#include <pthread.h>
+
 // user argument info struct to give to the bfgsb CL solver (one for each user argument)
 typedef struct s_bfgsb_cl_user_data_arg {
    bool buffer;                 // should be set true if data should be stored in a buffer on the GPU (and not simply passed by a kernel arg)
@@ -10,6 +12,87 @@ typedef struct s_bfgsb_cl_user_data_arg {
    bool small_const;			// should be set true if data is small constant data (usually < 64k on most GPUs)
 } bfgsb_cl_user_data_arg;
 
+// precomputed model bank for the coarse-grained search of least squares objectives, f(x) = |data - model(x)|
+// (times a scale factor of each function). The search kernel (<coarse_grained_search>_bank) scores the data
+// of every function against the model vector of every coarse-grain point as |m|^2 - 2*data.m, a matrix
+// product, instead of evaluating f at every point. The models only depend on the point (and on what the
+// banks are built for, e.g. a quantized function parameter), so they are computed once for all functions.
+typedef struct s_bfgsb_cl_coarse_grain_bank {
+   int dim;						// values in each model vector
+   int num_banks;				// number of banks, each one holds the model vectors of all coarse-grain points
+   double *models;				// num_banks * coarse_grain_n * dim model values (bank by bank, point by point)
+   int *bank_ids;				// bank of every function (num_funcs values, NULL if there is one bank)
+} bfgsb_cl_coarse_grain_bank;
+
+// how the packed x, F, gradient and function id buffers are shared between the host and the device
+typedef enum e_bfgsb_cl_host_memory {
+   BFGSB_CL_HOST_MEMORY_AUTO = 0,		// zero-copy if the device shares the host memory 
+										// (CL_DEVICE_HOST_UNIFIED_MEMORY), pinned otherwise
+   BFGSB_CL_HOST_MEMORY_COPY,			// malloc'ed host buffers copied to and from the device
+   BFGSB_CL_HOST_MEMORY_PINNED,			// pinned (CL_MEM_ALLOC_HOST_PTR) host buffers copied to and from the device
+   BFGSB_CL_HOST_MEMORY_ZERO_COPY		// the device buffers are allocated in host memory and mapped by the host,
+										// nothing is copied
+} bfgsb_cl_host_memory;
+
+// precision of the function evaluations
+typedef enum e_bfgsb_cl_precision {
+   BFGSB_CL_PRECISION_DOUBLE = 0,		// double precision evaluation kernel
+   BFGSB_CL_PRECISION_FLOAT,			// single precision variant of the evaluation kernel (<kernel>_float) on 
+										// the devices that have it, for devices with slow double arithmetic
+   BFGSB_CL_PRECISION_MIXED				// converge in single precision, then polish the solutions with
+										// polish_iterations more iterations in double precision
+} bfgsb_cl_precision;
+
+// optional settings for the BFGS-B CL solver
+// (use bfgsb_cl_set_default_options() to fill in the defaults before changing any of them)
+typedef struct s_bfgsb_cl_options {
+   int num_cohorts;				// number of cohorts to split the functions into, the GPU evaluates one 
+								// cohort while the CPU work-threads step the next one (1 = no pipelining)
+   bool fortran_engine;			// use the Fortran L-BFGS-B routine instead of the native C++ engine
+   bool dense_engine;			// use the dense BFGS-B engine (dense_bfgsb_engine.h) instead of L-BFGS-B, it keeps
+								// the full inverse Hessian of the few variables (ignored with fortran_engine or device_solver)
+   bool lm_solver;				// solve with the bounded Levenberg-Marquardt engine (lm_engine.h) instead of BFGS-B, the
+								// evaluation kernel must return the Gauss-Newton matrix J'J of the residuals after the
+								// gradient of every function (num_vars*(num_vars+1)/2 values, see eval_kernel_analytic_lm
+								// in eval_kernel.cl), the other engine and device solver options are ignored
+   bool solver_arenas;			// place the solvers and their workspaces in one arena per CPU work-thread
+								// and share the bounds between them (false = one heap allocation each)
+   int solver_window;			// maximum number of functions being solved at once (0 = all), a finished 
+								// solver is restarted on the next function and reuses its workspace
+   const char *eval_kernel;		// name of the kernel in the OpenCL file that evaluates f(x) and its gradient
+								// (NULL for "eval_kernel")
+   const char *eval_variant;	// variant of the evaluation kernel to use: "private" (eval_kernel itself) or
+								// "local" (eval_kernel_local) if the OpenCL file has it, or "auto" (NULL)
+								// to time the variants on the first evaluation of each device and use the fastest
+   const char *program_cache_dir;	// directory to cache the compiled OpenCL program binaries in, they are
+								// reused while the source, build options and devices are the same (NULL = no cache)
+   bfgsb_cl_host_memory host_memory;	// how the evaluation buffers are shared with the device
+   bool out_of_order_queue;		// use an out-of-order OpenCL command queue so the device can evaluate
+								// several cohorts at once (if the device supports it)
+   const char *platform_select;	// OpenCL platforms and devices to run on, by index, type or name (NULL = the
+   const char *device_select;		// GPUs, or all devices if there are none), see device_select.h
+   int num_devices;				// number of selected OpenCL devices to split the evaluations over (0 = all of them),
+								// the split follows their measured evaluation rates
+   int sub_device_units;		// split each device into sub-devices of this many compute units and use
+								// them as separate devices (0 = no split, needs OpenCL 1.2)
+   bool tune_launch;			// try work-group sizes and functions per work-item on the first launches and
+								// use the fastest, kept in program_cache_dir (kernels that take the end of 
+								// their slots as last argument only, see launch_tuner.h)
+   bfgsb_cl_precision precision;	// precision of the evaluations (the solvers always run in double)
+   int polish_iterations;		// double precision iterations after the single precision ones (MIXED only)
+   bool device_solver;			// run the L-BFGS-B iterations on the devices with the solve kernel of the OpenCL
+								// file (<eval_kernel>_solve) instead of on the CPU work-threads, the evaluations
+								// are always in double precision (ignored if the file has no solve kernel)
+   int device_solver_iterations;	// iterations of each function per solve kernel launch (device_solver only)
+   int line_search_points;		// points evaluated with the first trial step of every line search: the trial point
+								// and line_search_points-1 shorter candidate steps in the same launch, the line
+								// search takes a good enough candidate instead of asking for another trial point
+								// (1 = off, up to LBFGSB_MAX_CANDIDATES+1, native L-BFGS-B engine only)
+} bfgsb_cl_options;
+
+// fills in the default solver options
+void bfgsb_cl_set_default_options(bfgsb_cl_options *options);
+
 
 // This is the main BFGS-B CL Solver function.
 // It solves a num_funcs sized array of non-linear bound constrained optimization problems of num_vars variables
@@ -34,6 +117,96 @@ void bfgsb_cl(
       bool use_coarse_grain_search,			// set to true if using coarse-grained search to determine initial values
       unsigned int coarse_grain_n,			// number of start points to search during coarse-grained search
       double *coarse_grain_points,			// array of starting points to search during coarse grained search, size of coarse_grain_n * num_vars
-	  bool verbosePrint);					// turn printing of solver progress on
+	  bool verbosePrint,					// turn printing of solver progress on
+      bfgsb_cl_options *options = NULL,		// optional solver settings (NULL to use the defaults)
+      bfgsb_cl_coarse_grain_bank *coarse_grain_bank = NULL);	// optional model bank of the coarse_grain_points 
+																// (NULL = evaluate the objective at every point)
+
+
+class pEval;
+class PhaseBarrier;
+class CompletionQueue;
+class WorkStealScheduler;
+class SolverExtEval;
+class SolverArena;
+struct s_bfgsbCLWorkerArg;
+
+// BFGS-B CL solver session.
+// Sets up OpenCL (context, queue, compiled evaluation kernels) and starts the
+// CPU work threads once, then solves any number of batches with solve().
+// OpenCL buffers are kept between batches and only grow when a batch is larger
+// than all batches before it. Use this instead of bfgsb_cl() when solving
+// several batches (e.g. image tiles or frames) in one program.
+// A session must only be used by one thread at a time.
+class BfgsbCL {
+
+   public:
+
+   BfgsbCL(
+      int num_vars,							// number of variables in the objective functions 
+      const char *evalSrcfilenamefull,		// name of the OpenCL file that contains the objective function to be evaluated (and optionally coarse-grained search)
+      const char *opencl_incDir,			// directory to find any additional files that are #included in the OpenCL file (use "" string if none)
+      int num_cpu_work_threads,				// number of CPU work-threads to use (must be at >= 1)
+      bfgsb_cl_options *options = NULL);	// optional solver settings (NULL to use the defaults)
+
+   ~BfgsbCL();
+
+   // solve a batch of num_funcs functions, the arguments are the same as for bfgsb_cl()
+   void solve(
+      double *x_init,
+      int *b,
+      double *L,
+      double *U,
+      int num_funcs,
+      int num_user_args,
+      bfgsb_cl_user_data_arg *user_args,
+      int max_iterations,
+      int hessian_approx_factor,
+      double *x_ret,
+      double *f_ret,
+      bool use_coarse_grain_search,
+      unsigned int coarse_grain_n,
+      double *coarse_grain_points,
+	  bool verbosePrint,
+      bfgsb_cl_coarse_grain_bank *coarse_grain_bank = NULL);
+
+   // print load balance and pipelining statistics of all batches solved so far
+   void printStats();
+
+   private:
+
+   // The copy constructor and copy assignment operator are kept
+   // private so that they are not used.
+   BfgsbCL            (const BfgsbCL& source) { };
+   BfgsbCL& operator= (const BfgsbCL& source) { return *this; };
+
+   static void *workThread(void *arg);		// cpu work thread
+
+   // run the solvers of the current problem from x_inits (see solve())
+   void runSolvers(int num_funcs, double *x_inits, int *b, double *L, double *U, 
+         int max_iterations, int hessian_approx_factor, bool verbosePrint);
+
+   int num_vars;
+   int num_cpu_work_threads;
+   bfgsb_cl_options opts;
+
+   pEval *pe;								// OpenCL evaluation module
+   pthread_t *threads;
+   struct s_bfgsbCLWorkerArg *workerArgs;
+
+   PhaseBarrier *iterBarrier;				// master/worker iteration handshake
+   WorkStealScheduler *workScheduler;		// hands out the solvers to step in each iteration
+   CompletionQueue *readyCohorts;			// cohorts whose evaluation the device has finished
+   SolverExtEval **solverArray;				// all solvers of the current batch, indexed by id
+   int *solverRunIds;						// ids of the solvers to step in the current iteration (ascending)
+
+   SolverArena **arenas;					// solver memory, one arena per work thread (NULL if not used)
+   long evalRounds;							// evaluations started (host to device round trips)
+   long funcEvals;							// function evaluations requested by the solvers in them
+   long candidateEvals;						// line search candidates evaluated with them
+   long solverIterations;					// iterations of all solved functions
+   long solverObjectAllocs;					// solvers allocated on the heap so far
+   long workspaceAllocs;					// workspaces the solvers allocated on the heap so far
+};
 
 #endif
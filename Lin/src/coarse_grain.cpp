@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include <iostream>
 #include <fstream>
@@ -46,4 +47,111 @@ void coarse_grain_search(
 }
 
 
+// functions and models scored per block by coarse_grain_search_bank(), a block
+// of models (64 * 42 bands of doubles, 21 KB) stays in the L1 cache while the
+// functions of a block are scored against it
+#define COARSE_GRAIN_FUNC_BLOCK 16
+#define COARSE_GRAIN_POINT_BLOCK 64
 
+
+// carrys out a num_points coarse grain search on num_funcs functions with the
+// models of the points in bank. The score of a function against a model is
+// |m|^2 - 2 data.m, which is |data - m|^2 without the |data|^2 all of its scores share,
+// so the search is a blocked matrix product of the data vectors and the models.
+// The functions are visited bank by bank, a function takes the first point with the
+// lowest score like coarse_grain_search()
+void coarse_grain_search_bank(
+      int num_vars,
+      int num_points,
+      double *coarse_grain_points,
+      int dim,
+      int num_banks,
+      const double *bank,
+      const int *bank_ids,
+      int num_funcs,
+      const double *data,
+      double *x_ret
+      )
+{
+   int num_models = num_banks * num_points;
+
+   // squared norms of the models
+   double *norm2 = (double *) malloc(num_models * sizeof(double));
+
+   for(int i = 0; i < num_models; i++)
+   {
+      const double *m = bank + (size_t) i * dim;
+      double sum = 0;
+      for(int j = 0; j < dim; j++) sum += m[j] * m[j];
+      norm2[i] = sum;
+   }
+
+   // the functions ordered by bank (counting sort), bank k holds order[bankFirst[k]] 
+   // to order[bankFirst[k+1]-1]
+   int *order = (int *) malloc(num_funcs * sizeof(int));
+   int *bankFirst = (int *) calloc(num_banks + 1, sizeof(int));
+
+   for(int i = 0; i < num_funcs; i++) bankFirst[(bank_ids != NULL) ? bank_ids[i] + 1 : 1]++;
+   for(int k = 0; k < num_banks; k++) bankFirst[k+1] += bankFirst[k];
+
+   int *fill = (int *) malloc(num_banks * sizeof(int));
+   memcpy(fill, bankFirst, num_banks * sizeof(int));
+   for(int i = 0; i < num_funcs; i++) order[fill[(bank_ids != NULL) ? bank_ids[i] : 0]++] = i;
+   free(fill);
+
+   double bestScore[COARSE_GRAIN_FUNC_BLOCK];
+   int bestPoint[COARSE_GRAIN_FUNC_BLOCK];
+
+   for(int k = 0; k < num_banks; k++)
+   {
+      const double *models = bank + (size_t) k * num_points * dim;
+      const double *models_norm2 = norm2 + k * num_points;
+
+      for(int f0 = bankFirst[k]; f0 < bankFirst[k+1]; f0 += COARSE_GRAIN_FUNC_BLOCK)
+      {
+         int nf = bankFirst[k+1] - f0;
+         if(nf > COARSE_GRAIN_FUNC_BLOCK) nf = COARSE_GRAIN_FUNC_BLOCK;
+
+         for(int fi = 0; fi < nf; fi++)
+         {
+            bestScore[fi] = HUGE_VAL;
+            bestPoint[fi] = 0;
+         }
+
+         for(int p0 = 0; p0 < num_points; p0 += COARSE_GRAIN_POINT_BLOCK)
+         {
+            int p_end = p0 + COARSE_GRAIN_POINT_BLOCK;
+            if(p_end > num_points) p_end = num_points;
+
+            for(int fi = 0; fi < nf; fi++)
+            {
+               const double *r = data + (size_t) order[f0 + fi] * dim;
+
+               for(int p = p0; p < p_end; p++)
+               {
+                  const double *m = models + (size_t) p * dim;
+                  double dot = 0;
+                  for(int j = 0; j < dim; j++) dot += r[j] * m[j];
+
+                  double score = models_norm2[p] - 2.0 * dot;
+                  if(score < bestScore[fi])
+                  {
+                     bestScore[fi] = score;
+                     bestPoint[fi] = p;
+                  }
+               }
+            }
+         }
+
+         for(int fi = 0; fi < nf; fi++)
+         {
+            memcpy(x_ret + (size_t) order[f0 + fi] * num_vars, coarse_grain_points + (bestPoint[fi] * num_vars), 
+                  num_vars * sizeof(double));
+         }
+      }
+   }
+
+   free(order);
+   free(bankFirst);
+   free(norm2);
+}
@@ -14,6 +14,26 @@ void coarse_grain_search(
       double *x_ret
       );
 
+// runs a num_points point coarse-grained search on num_funcs least squares
+// objectives at once, f_i(x) = |data_i - model(x)| (times a scale factor of each
+// function), with the model vectors of the points precomputed: bank holds num_banks
+// banks of num_points model vectors of dim values each and function i is scored against
+// bank bank_ids[i] (NULL = all against bank 0). data holds the dim values of the data
+// vector of every function one after the other. Returns the best point of every
+// function in x_ret (num_vars values each).
+void coarse_grain_search_bank(
+      int num_vars,
+      int num_points,
+      double *coarse_grain_points,
+      int dim,
+      int num_banks,
+      const double *bank,
+      const int *bank_ids,
+      int num_funcs,
+      const double *data,
+      double *x_ret
+      );
+
 
 
 #endif
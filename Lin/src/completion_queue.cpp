@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "completion_queue.h"
+
+
+CompletionQueue::CompletionQueue(int capacity)
+{
+   this->capacity = capacity;
+   items = (int *) malloc(capacity * sizeof(int));
+   head = 0;
+   count = 0;
+
+   pthread_mutex_init(&mutex, NULL);
+   pthread_cond_init(&readyCond, NULL);
+}
+
+CompletionQueue::~CompletionQueue()
+{
+   pthread_cond_destroy(&readyCond);
+   pthread_mutex_destroy(&mutex);
+   free(items);
+}
+
+
+// queue a finished item, can be called from any thread
+void CompletionQueue::push(int item)
+{
+   pthread_mutex_lock(&mutex);
+
+   if(count == capacity)
+   {
+      printf("CompletionQueue overflow\n");
+      exit(-1);
+   }
+
+   items[(head + count) % capacity] = item;
+   count++;
+
+   pthread_cond_signal(&readyCond);
+   pthread_mutex_unlock(&mutex);
+}
+
+// sleep until an item is queued and take out the oldest one
+int CompletionQueue::pop()
+{
+   pthread_mutex_lock(&mutex);
+   while(count == 0)
+   {
+      pthread_cond_wait(&readyCond, &mutex);
+   }
+
+   int item = items[head];
+   head = (head + 1) % capacity;
+   count--;
+
+   pthread_mutex_unlock(&mutex);
+
+   return item;
+}
+
+// forget the queued items
+void CompletionQueue::clear()
+{
+   pthread_mutex_lock(&mutex);
+   head = 0;
+   count = 0;
+   pthread_mutex_unlock(&mutex);
+}
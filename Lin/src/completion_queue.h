@@ -0,0 +1,38 @@
+#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+
+#include <pthread.h>
+
+// Queue of finished work items (cohort numbers) handed from the thread that
+// sees them finish (e.g. an OpenCL event callback) to the master thread.
+// The master takes them out in the order they finished and sleeps on a
+// condition variable while the queue is empty.
+// It holds at most capacity items, each item must be in the queue only once.
+class CompletionQueue {
+
+   public:
+
+   CompletionQueue(int capacity);	// maximum number of items queued at once
+   ~CompletionQueue();
+
+   void push(int item);			// add a finished item and wake up the master
+   int pop();					// block until an item is queued and return the oldest one
+   void clear();				// drop all queued items
+
+   private:
+
+   // The copy constructor and copy assignment operator are kept
+   // private so that they are not used.
+   CompletionQueue            (const CompletionQueue& source) { };
+   CompletionQueue& operator= (const CompletionQueue& source) { return *this; };
+
+   pthread_mutex_t mutex;
+   pthread_cond_t readyCond;	// signaled when an item is pushed
+
+   int *items;					// ring buffer of capacity items
+   int capacity;
+   int head;					// index of the oldest item
+   int count;					// number of items queued
+};
+
+#endif
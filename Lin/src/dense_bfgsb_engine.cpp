@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <new>
+
+#include "dense_bfgsb_engine.h"
+
+// The dense engine is instantiated for these problem dimensions (the same as
+// the native engine, it does not depend on m). Other sizes return NULL from
+// createDenseBfgsbEngine() and the solver uses the native engine instead.
+
+#define DENSE_BFGSB_ENGINE_N_LIST(CASE) \
+   CASE(1) CASE(2) CASE(3) CASE(4) CASE(5) CASE(6) CASE(7) CASE(8)
+
+#define DENSE_BFGSB_ENGINE_CASE_N(N) \
+   case N: \
+      if(mem != NULL) return new (mem) DenseBfgsbEngine<N>(x, f, g, l, u, nbd, factr, pgtol); \
+      return new DenseBfgsbEngine<N>(x, f, g, l, u, nbd, factr, pgtol);
+
+#define DENSE_BFGSB_ENGINE_SIZE_N(N) \
+   case N: return sizeof(DenseBfgsbEngine<N>);
+
+
+// returns true if createDenseBfgsbEngine() supports n variables
+bool denseBfgsbEngineSupported(int n)
+{
+   return denseBfgsbEngineSize(n) > 0;
+}
+
+
+// returns the size in bytes of the dense engine for n variables
+// (0 if that size is not compiled in)
+size_t denseBfgsbEngineSize(int n)
+{
+   switch(n)
+   {
+   DENSE_BFGSB_ENGINE_N_LIST(DENSE_BFGSB_ENGINE_SIZE_N)
+   default: return 0;
+   }
+}
+
+
+// create the dense engine for an n variable problem (in mem if it is not
+// NULL), returns NULL if that size is not compiled in
+LbfgsbEngineBase *createDenseBfgsbEngine(
+      int n,
+      double *x,
+      double *f,
+      double *g,
+      double *l,
+      double *u,
+      int *nbd,
+      double factr,
+      double pgtol,
+      void *mem)
+{
+   switch(n)
+   {
+   DENSE_BFGSB_ENGINE_N_LIST(DENSE_BFGSB_ENGINE_CASE_N)
+   default: return NULL;
+   }
+}
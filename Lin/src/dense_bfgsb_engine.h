@@ -0,0 +1,796 @@
+#ifndef DENSE_BFGSB_ENGINE_H
+#define DENSE_BFGSB_ENGINE_H
+
+#include <stddef.h>
+#include <math.h>
+#include <float.h>
+
+#include "lbfgsb_engine.h"
+
+// Dense BFGS-B engine for problems with very few variables.
+//
+// DenseBfgsbEngine<N> solves the same bound constrained problems as
+// LbfgsbEngine through the same reverse communication interface
+// (LbfgsbEngineBase), but keeps the whole N x N inverse Hessian
+// approximation instead of m correction pairs. For the handful of variables
+// of a pixel that is smaller than the limited memory matrices, and every
+// step costs O(N^2) whatever the number of corrections.
+//
+// An iteration:
+// - fixes the variables that are at a bound with the gradient (or the
+//   direction) pointing out of the box,
+// - takes d = -H g on the free variables (the free block of H is positive
+//   definite, so d is a descent direction),
+// - searches along the projection of x + stp*d onto the box with the
+//   Minpack-2 line search (dcsrch) used by L-BFGS-B, so a step can take
+//   several variables to their bounds like the Cauchy point of L-BFGS-B
+//   (cutting the step at the first bound stalls on variables near a bound),
+// - and applies the BFGS update to H, skipping it when the curvature s'y is
+//   too small. The update only takes the gradient change of the free
+//   variables. H starts as the identity and is scaled by s'y/y'y at the
+//   first update.
+// The termination tests (projected gradient and relative reduction of f,
+// pgtol and factr) are those of L-BFGS-B, but the iterates are not.
+
+// Creates the dense engine for an n variable problem.
+// Returns NULL if that n is not compiled in (see dense_bfgsb_engine.cpp).
+// If mem is not NULL the engine is constructed in mem (at least
+// denseBfgsbEngineSize(n) bytes, 16 byte aligned) instead of being allocated
+// with new, destroy it by calling its destructor instead of delete.
+LbfgsbEngineBase *createDenseBfgsbEngine(
+      int n,
+      double *x,				// array of size n, the current x
+      double *f,				// f(x)
+      double *g,				// array of size n, the gradient of f at x
+      double *l,				// array of size n of lower bounds
+      double *u,				// array of size n of upper bounds
+      int *nbd,					// array of size n of bound types
+      double factr,
+      double pgtol,
+      void *mem = NULL);
+
+// returns true if createDenseBfgsbEngine() supports n variables
+bool denseBfgsbEngineSupported(int n);
+
+// returns the size in bytes of the dense engine for n variables
+// (0 if that size is not compiled in)
+size_t denseBfgsbEngineSize(int n);
+
+
+template <int N>
+class DenseBfgsbEngine : public LbfgsbEngineBase {
+
+   public:
+
+   DenseBfgsbEngine(double *x, double *f, double *g, double *l, double *u, int *nbd, double factr, double pgtol)
+   {
+      this->x = x;
+      this->f = f;
+      this->g = g;
+      this->l = l;
+      this->u = u;
+      this->nbd = nbd;
+      this->factr = factr;
+      this->pgtol = pgtol;
+
+      for(int i = 0; i < N*N; i++) h[i] = 0;
+      for(int i = 0; i < N; i++) { d[i] = 0; t[i] = 0; r[i] = 0; freeVar[i] = true; }
+
+      resume = resumeFGStart;
+      lsTask = lsStart;
+   }
+
+   LbfgsbTask start();
+   LbfgsbTask step();
+   LbfgsbTask stop() { return lbfgsbStop; }
+
+   private:
+
+   // where step() picks up again
+   enum DenseResume {
+      resumeFGStart,		// f and g at the starting point are ready
+      resumeLineSearch,		// f and g at a line search trial point are ready
+      resumeNewX			// the caller has seen the new iterate
+   };
+
+   // line search (dcsrch) task
+   enum DenseLineSearchTask {
+      lsStart,
+      lsFG,
+      lsConverged,
+      lsWarning,
+      lsError
+   };
+
+   // problem (owned by the caller)
+   double *x;
+   double *f;
+   double *g;
+   double *l;
+   double *u;
+   int *nbd;
+   double factr;
+   double pgtol;
+
+   double h[N*N];			// inverse Hessian approximation (symmetric, row major)
+   double d[N];				// search direction
+   double t[N];				// x at the start of the line search
+   double r[N];				// g at the start of the line search
+   bool freeVar[N];			// the variable moves along d
+
+   // saved state
+   DenseResume resume;
+   int iter, ifun, iback, info, nfgv, nskip, nupdat;
+   double fold, tol, epsmch, dnorm, gd, gdold, stp, stpmx, sbgnrm;
+
+   // dcsrch saved state
+   DenseLineSearchTask lsTask;
+   bool brackt;
+   int stage;
+   double ginit, gtest, gx, gy, finit, fx, fy, stx, sty, stmin, stmax, width, width1;
+
+   void resetHessian();
+   void update();
+   void searchDirection();
+   void lineSearchStart();
+   bool lineSearch(LbfgsbTask *task);
+   void projgr();
+   void dcsrch(double f, double g, double ftol, double gtol, double xtol, double stpmin, double stpmax);
+
+   static void dcstep(double &stx, double &fx, double &dx, double &sty, double &fy, double &dy,
+         double &stp, double fp, double dp, bool &brackt, double stpmin, double stpmax);
+
+   // bound types with a lower / an upper bound
+   bool hasLower(int i) const { return nbd[i] == 1 || nbd[i] == 2; }
+   bool hasUpper(int i) const { return nbd[i] == 2 || nbd[i] == 3; }
+
+   static double ddot(int n, const double *dx, const double *dy)
+   {
+      double dtemp = 0;
+      for(int i = 0; i < n; i++) dtemp = dtemp + dx[i]*dy[i];
+      return dtemp;
+   }
+
+   static double dmax(double a, double b) { return (a >= b) ? a : b; }
+   static double dmin(double a, double b) { return (a <= b) ? a : b; }
+};
+
+
+// initialize the solver for a new problem, returns lbfgsbFG (evaluate at the
+// projected starting point) or lbfgsbError
+template <int N>
+LbfgsbTask DenseBfgsbEngine<N>::start()
+{
+   epsmch = DBL_EPSILON;
+
+   fold = 0;
+   dnorm = 0;
+   gd = 0;
+   gdold = 0;
+   sbgnrm = 0;
+   stp = 0;
+   stpmx = 0;
+
+   iter = 0;
+   ifun = 0;
+   iback = 0;
+   info = 0;
+   nfgv = 0;
+   nskip = 0;
+
+   tol = factr*epsmch;
+
+   // check the input arguments for errors
+   if(factr < 0) return lbfgsbError;
+
+   for(int i = 0; i < N; i++)
+   {
+      if((nbd[i] < 0) || (nbd[i] > 3)) return lbfgsbError;
+      if((nbd[i] == 2) && (l[i] > u[i])) return lbfgsbError;
+   }
+
+   // project x onto the feasible set
+   for(int i = 0; i < N; i++)
+   {
+      if(hasLower(i) && x[i] < l[i]) x[i] = l[i];
+      if(hasUpper(i) && x[i] > u[i]) x[i] = u[i];
+   }
+
+   resetHessian();
+
+   resume = resumeFGStart;
+   return lbfgsbFG;
+}
+
+
+// continue the optimization after the caller evaluated f and g (lbfgsbFG)
+// or saw the new iterate (lbfgsbNewX)
+template <int N>
+LbfgsbTask DenseBfgsbEngine<N>::step()
+{
+   LbfgsbTask task;
+
+   switch(resume)
+   {
+   case resumeFGStart:
+      nfgv = 1;
+
+      projgr();
+
+      if(sbgnrm <= pgtol) return lbfgsbConverged;
+      break;
+
+   case resumeLineSearch:
+      if(!lineSearch(&task)) return task;
+      break;
+
+   case resumeNewX:
+      {
+         // test for termination
+         if(sbgnrm <= pgtol) return lbfgsbConverged;
+
+         double ddum = dmax(dmax(fabs(fold), fabs(*f)), 1.0);
+         if((fold - *f) <= tol*ddum) return lbfgsbConverged;
+
+         update();
+      }
+      break;
+   }
+
+   // compute the next search direction and start the line search along it,
+   // until the line search does not need a restart
+   while(true)
+   {
+      searchDirection();
+      lineSearchStart();
+
+      if(!lineSearch(&task)) return task;
+   }
+}
+
+
+// start again from the identity
+template <int N>
+void DenseBfgsbEngine<N>::resetHessian()
+{
+   for(int i = 0; i < N; i++)
+   {
+      for(int j = 0; j < N; j++) h[i*N + j] = (i == j) ? 1 : 0;
+   }
+
+   nupdat = 0;
+}
+
+
+// BFGS update of the inverse Hessian with s = newx - oldx and y = newg - oldg
+// over the free variables: H = H + (s'y + y'Hy)/(s'y)^2 ss' - (Hys' + sy'H)/s'y
+template <int N>
+void DenseBfgsbEngine<N>::update()
+{
+   double s[N];
+   double y[N];
+   double hy[N];
+
+   // the step only moved the free variables, the change of the gradient of the
+   // fixed ones says nothing about the Hessian on the free subspace
+   for(int i = 0; i < N; i++)
+   {
+      s[i] = x[i] - t[i];
+      y[i] = freeVar[i] ? g[i] - r[i] : 0;
+   }
+
+   double sy = ddot(N, s, y);
+
+   // skip the update if the curvature is not positive enough to keep H
+   // positive definite (the test L-BFGS-B uses)
+   if(sy <= epsmch*(-gdold*stp))
+   {
+      nskip++;
+      return;
+   }
+
+   if(nupdat == 0)
+   {
+      // scale the identity to the size of the Hessian along s
+      double scale = sy/ddot(N, y, y);
+      for(int i = 0; i < N; i++) h[i*N + i] = scale;
+   }
+
+   for(int i = 0; i < N; i++) hy[i] = ddot(N, h + i*N, y);
+
+   double yhy = ddot(N, y, hy);
+   double a = (sy + yhy)/(sy*sy);
+
+   for(int i = 0; i < N; i++)
+   {
+      for(int j = 0; j < N; j++)
+      {
+         h[i*N + j] += a*s[i]*s[j] - (hy[i]*s[j] + s[i]*hy[j])/sy;
+      }
+   }
+
+   nupdat++;
+}
+
+
+// compute d = -H g over the free variables. A variable at a bound is fixed
+// if the gradient points out of the box there, and after that if d does
+// (H couples the variables), until the direction keeps all of them in.
+template <int N>
+void DenseBfgsbEngine<N>::searchDirection()
+{
+   for(int i = 0; i < N; i++)
+   {
+      bool atLower = hasLower(i) && x[i] <= l[i];
+      bool atUpper = hasUpper(i) && x[i] >= u[i];
+
+      freeVar[i] = !((atLower && g[i] >= 0) || (atUpper && g[i] <= 0));
+   }
+
+   while(true)
+   {
+      for(int i = 0; i < N; i++)
+      {
+         double di = 0;
+
+         if(freeVar[i])
+         {
+            for(int j = 0; j < N; j++)
+            {
+               if(freeVar[j]) di -= h[i*N + j]*g[j];
+            }
+         }
+
+         d[i] = di;
+      }
+
+      bool fixed = false;
+
+      for(int i = 0; i < N; i++)
+      {
+         if(!freeVar[i]) continue;
+
+         if((hasLower(i) && x[i] <= l[i] && d[i] < 0) || (hasUpper(i) && x[i] >= u[i] && d[i] > 0))
+         {
+            freeVar[i] = false;
+            fixed = true;
+         }
+      }
+
+      if(!fixed) break;
+   }
+}
+
+
+// start a line search along the projection of x + stp*d onto the box
+template <int N>
+void DenseBfgsbEngine<N>::lineSearchStart()
+{
+   const double big = 1.0e10;
+
+   dnorm = sqrt(ddot(N, d, d));
+
+   // the path stops moving at the last bound it reaches (no variable with
+   // d[i] != 0 is at the bound d[i] points to)
+   stpmx = 0;
+
+   for(int i = 0; i < N; i++)
+   {
+      double brk = big;
+
+      if(d[i] < 0 && hasLower(i)) brk = (l[i] - x[i])/d[i];
+      else if(d[i] > 0 && hasUpper(i)) brk = (u[i] - x[i])/d[i];
+      else if(d[i] == 0) brk = 0;
+
+      stpmx = dmax(stpmx, dmin(brk, big));
+   }
+
+   // until H is scaled the first step moves x by 1
+   if(nupdat == 0) stp = dmin(1/dnorm, stpmx);
+   else stp = dmin(1, stpmx);
+
+   for(int i = 0; i < N; i++)
+   {
+      t[i] = x[i];
+      r[i] = g[i];
+   }
+
+   fold = *f;
+   ifun = 0;
+   iback = 0;
+   info = 0;
+   lsTask = lsStart;
+}
+
+
+// run the line search with the current f and g. Returns true if the line
+// search failed and the iteration must be restarted, else returns false with
+// the task for the caller.
+template <int N>
+bool DenseBfgsbEngine<N>::lineSearch(LbfgsbTask *task)
+{
+   const double ftol = 1.0e-3;
+   const double gtol = 0.9;
+   const double xtol = 0.1;
+
+   bool evaluate = false;
+
+   // the derivative along the path, the variables it has taken to a bound do not move
+   gd = 0;
+
+   for(int i = 0; i < N; i++)
+   {
+      if((d[i] < 0 && hasLower(i) && x[i] <= l[i]) || (d[i] > 0 && hasUpper(i) && x[i] >= u[i])) continue;
+      gd += g[i]*d[i];
+   }
+
+   if(ifun == 0)
+   {
+      gdold = gd;
+      if(gd >= 0)
+      {
+         // the directional derivative >=0, line search is impossible
+         info = -4;
+      }
+   }
+
+   if(info == 0)
+   {
+      dcsrch(*f, gd, ftol, gtol, xtol, 0, stpmx);
+
+      if(lsTask != lsConverged && lsTask != lsWarning)
+      {
+         evaluate = true;
+         ifun++;
+         nfgv++;
+         iback = ifun - 1;
+
+         // project stp*d + t onto the box
+         for(int i = 0; i < N; i++)
+         {
+            double xi = stp*d[i] + t[i];
+            if(hasLower(i) && xi < l[i]) xi = l[i];
+            if(hasUpper(i) && xi > u[i]) xi = u[i];
+            x[i] = xi;
+         }
+      }
+   }
+
+   if(info != 0 || iback >= 20)
+   {
+      // restore the previous iterate
+      for(int i = 0; i < N; i++)
+      {
+         x[i] = t[i];
+         g[i] = r[i];
+      }
+
+      *f = fold;
+
+      if(nupdat == 0)
+      {
+         // abnormal termination, H is the identity already
+         iter++;
+         *task = lbfgsbAbnormal;
+         return false;
+      }
+
+      // restart the iteration from the identity
+      resetHessian();
+      return true;
+   }
+
+   if(evaluate)
+   {
+      // return to the driver for calculating f and g
+      resume = resumeLineSearch;
+      *task = lbfgsbFG;
+      return false;
+   }
+
+   iter++;
+
+   projgr();
+
+   resume = resumeNewX;
+   *task = lbfgsbNewX;
+   return false;
+}
+
+
+// the infinity norm of the projected gradient
+template <int N>
+void DenseBfgsbEngine<N>::projgr()
+{
+   sbgnrm = 0;
+
+   for(int i = 0; i < N; i++)
+   {
+      double gi = g[i];
+
+      if(nbd[i] != 0)
+      {
+         if(gi < 0)
+         {
+            if(nbd[i] >= 2) gi = dmax(x[i] - u[i], gi);
+         }
+         else
+         {
+            if(nbd[i] <= 2) gi = dmin(x[i] - l[i], gi);
+         }
+      }
+
+      sbgnrm = dmax(sbgnrm, fabs(gi));
+   }
+}
+
+
+// ----------------------------------------------------------------------------
+// line search (Minpack-2 dcsrch and dcstep, as in lbfgsb_engine.h)
+// ----------------------------------------------------------------------------
+
+// find a step stp that satisfies a sufficient decrease condition and a
+// curvature condition, using the function value f and derivative g at stp
+template <int N>
+void DenseBfgsbEngine<N>::dcsrch(double f, double g, double ftol, double gtol, double xtol, double stpmin, double stpmax)
+{
+   const double p5 = 0.5;
+   const double p66 = 0.66;
+   const double xtrapl = 1.1;
+   const double xtrapu = 4.0;
+
+   if(lsTask == lsStart)
+   {
+      // check the input arguments for errors
+      if((stp < stpmin) || (stp > stpmax) || (g >= 0) || (ftol < 0) || (gtol < 0) ||
+            (xtol < 0) || (stpmin < 0) || (stpmax < stpmin))
+      {
+         lsTask = lsError;
+         return;
+      }
+
+      // initialize local variables
+      brackt = false;
+      stage = 1;
+      finit = f;
+      ginit = g;
+      gtest = ftol*ginit;
+      width = stpmax - stpmin;
+      width1 = width/p5;
+
+      stx = 0;
+      fx = finit;
+      gx = ginit;
+      sty = 0;
+      fy = finit;
+      gy = ginit;
+      stmin = 0;
+      stmax = stp + xtrapu*stp;
+      lsTask = lsFG;
+      return;
+   }
+
+   // if psi(stp) <= 0 and f'(stp) >= 0 for some step, then the
+   // algorithm enters the second stage
+   double ftest = finit + stp*gtest;
+   if(stage == 1 && f <= ftest && g >= 0) stage = 2;
+
+   // test for warnings
+   bool warning = false;
+   if(brackt && (stp <= stmin || stp >= stmax)) warning = true;
+   if(brackt && stmax - stmin <= xtol*stmax) warning = true;
+   if(stp == stpmax && f <= ftest && g <= gtest) warning = true;
+   if(stp == stpmin && (f > ftest || g >= gtest)) warning = true;
+   if(stp == stx) warning = true;
+
+   // test for convergence
+   if(f <= ftest && fabs(g) <= gtol*(-ginit))
+   {
+      lsTask = lsConverged;
+      return;
+   }
+
+   if(warning)
+   {
+      lsTask = lsWarning;
+      return;
+   }
+
+   // a modified function is used to predict the step during the
+   // first stage if a lower function value has been obtained but
+   // the decrease is not sufficient
+   if(stage == 1 && f <= fx && f > ftest)
+   {
+      // define the modified function and derivative values
+      double fm = f - stp*gtest;
+      double fxm = fx - stx*gtest;
+      double fym = fy - sty*gtest;
+      double gm = g - gtest;
+      double gxm = gx - gtest;
+      double gym = gy - gtest;
+
+      // call dcstep to update stx, sty, and to compute the new step
+      dcstep(stx, fxm, gxm, sty, fym, gym, stp, fm, gm, brackt, stmin, stmax);
+
+      // reset the function and derivative values for f
+      fx = fxm + stx*gtest;
+      fy = fym + sty*gtest;
+      gx = gxm + gtest;
+      gy = gym + gtest;
+   }
+   else
+   {
+      // call dcstep to update stx, sty, and to compute the new step
+      dcstep(stx, fx, gx, sty, fy, gy, stp, f, g, brackt, stmin, stmax);
+   }
+
+   // decide if a bisection step is needed
+   if(brackt)
+   {
+      if(fabs(sty - stx) >= p66*width1) stp = stx + p5*(sty - stx);
+      width1 = width;
+      width = fabs(sty - stx);
+   }
+
+   // set the minimum and maximum steps allowed for stp
+   if(brackt)
+   {
+      stmin = dmin(stx, sty);
+      stmax = dmax(stx, sty);
+   }
+   else
+   {
+      stmin = stp + xtrapl*(stp - stx);
+      stmax = stp + xtrapu*(stp - stx);
+   }
+
+   // force the step to be within the bounds stpmax and stpmin
+   stp = dmax(stp, stpmin);
+   stp = dmin(stp, stpmax);
+
+   // if further progress is not possible, let stp be the best
+   // point obtained during the search
+   if((brackt && (stp <= stmin || stp >= stmax)) || (brackt && stmax - stmin <= xtol*stmax)) stp = stx;
+
+   // obtain another function and derivative
+   lsTask = lsFG;
+}
+
+
+// compute a safeguarded step for a search procedure and update an interval
+// that contains a step that satisfies a sufficient decrease and a curvature condition
+template <int N>
+void DenseBfgsbEngine<N>::dcstep(double &stx, double &fx, double &dx, double &sty, double &fy, double &dy,
+      double &stp, double fp, double dp, bool &brackt, double stpmin, double stpmax)
+{
+   const double p66 = 0.66;
+   const double two = 2.0;
+   const double three = 3.0;
+
+   double gamma, p, q, r, s, stpc, stpf, stpq, theta;
+
+   double sgnd = dp*(dx/fabs(dx));
+
+   if(fp > fx)
+   {
+      // first case: a higher function value. The minimum is bracketed.
+      theta = three*(fx - fp)/(stp - stx) + dx + dp;
+      s = dmax(dmax(fabs(theta), fabs(dx)), fabs(dp));
+      gamma = s*sqrt((theta/s)*(theta/s) - (dx/s)*(dp/s));
+      if(stp < stx) gamma = -gamma;
+      p = (gamma - dx) + theta;
+      q = ((gamma - dx) + gamma) + dp;
+      r = p/q;
+      stpc = stx + r*(stp - stx);
+      stpq = stx + ((dx/((fx - fp)/(stp - stx) + dx))/two)*(stp - stx);
+      if(fabs(stpc - stx) < fabs(stpq - stx)) stpf = stpc;
+      else stpf = stpc + (stpq - stpc)/two;
+      brackt = true;
+   }
+   else if(sgnd < 0)
+   {
+      // second case: a lower function value and derivatives of opposite
+      // sign. The minimum is bracketed.
+      theta = three*(fx - fp)/(stp - stx) + dx + dp;
+      s = dmax(dmax(fabs(theta), fabs(dx)), fabs(dp));
+      gamma = s*sqrt((theta/s)*(theta/s) - (dx/s)*(dp/s));
+      if(stp > stx) gamma = -gamma;
+      p = (gamma - dp) + theta;
+      q = ((gamma - dp) + gamma) + dx;
+      r = p/q;
+      stpc = stp + r*(stx - stp);
+      stpq = stp + (dp/(dp - dx))*(stx - stp);
+      if(fabs(stpc - stp) > fabs(stpq - stp)) stpf = stpc;
+      else stpf = stpq;
+      brackt = true;
+   }
+   else if(fabs(dp) < fabs(dx))
+   {
+      // third case: a lower function value, derivatives of the same sign,
+      // and the magnitude of the derivative decreases.
+      theta = three*(fx - fp)/(stp - stx) + dx + dp;
+      s = dmax(dmax(fabs(theta), fabs(dx)), fabs(dp));
+
+      // the case gamma = 0 only arises if the cubic does not tend
+      // to infinity in the direction of the step
+      gamma = s*sqrt(dmax(0.0, (theta/s)*(theta/s) - (dx/s)*(dp/s)));
+      if(stp > stx) gamma = -gamma;
+      p = (gamma - dp) + theta;
+      q = (gamma + (dx - dp)) + gamma;
+      r = p/q;
+      if(r < 0 && gamma != 0) stpc = stp + r*(stx - stp);
+      else if(stp > stx) stpc = stpmax;
+      else stpc = stpmin;
+      stpq = stp + (dp/(dp - dx))*(stx - stp);
+
+      if(brackt)
+      {
+         // a minimizer has been bracketed. If the cubic step is
+         // closer to stp than the secant step, the cubic step is
+         // taken, otherwise the secant step is taken.
+         if(fabs(stpc - stp) < fabs(stpq - stp)) stpf = stpc;
+         else stpf = stpq;
+
+         if(stp > stx) stpf = dmin(stp + p66*(sty - stp), stpf);
+         else stpf = dmax(stp + p66*(sty - stp), stpf);
+      }
+      else
+      {
+         // a minimizer has not been bracketed. If the cubic step is
+         // farther from stp than the secant step, the cubic step is
+         // taken, otherwise the secant step is taken.
+         if(fabs(stpc - stp) > fabs(stpq - stp)) stpf = stpc;
+         else stpf = stpq;
+
+         stpf = dmin(stpmax, stpf);
+         stpf = dmax(stpmin, stpf);
+      }
+   }
+   else
+   {
+      // fourth case: a lower function value, derivatives of the same sign,
+      // and the magnitude of the derivative does not decrease. If the
+      // minimum is not bracketed, the step is either stpmin or stpmax,
+      // otherwise the cubic step is taken.
+      if(brackt)
+      {
+         theta = three*(fp - fy)/(sty - stp) + dy + dp;
+         s = dmax(dmax(fabs(theta), fabs(dy)), fabs(dp));
+         gamma = s*sqrt((theta/s)*(theta/s) - (dy/s)*(dp/s));
+         if(stp > sty) gamma = -gamma;
+         p = (gamma - dp) + theta;
+         q = ((gamma - dp) + gamma) + dy;
+         r = p/q;
+         stpc = stp + r*(sty - stp);
+         stpf = stpc;
+      }
+      else if(stp > stx) stpf = stpmax;
+      else stpf = stpmin;
+   }
+
+   // update the interval which contains a minimizer
+   if(fp > fx)
+   {
+      sty = stp;
+      fy = fp;
+      dy = dp;
+   }
+   else
+   {
+      if(sgnd < 0)
+      {
+         sty = stx;
+         fy = fx;
+         dy = dx;
+      }
+
+      stx = stp;
+      fx = fp;
+      dx = dp;
+   }
+
+   // compute the new step
+   stp = stpf;
+}
+
+#endif
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <CL/cl.h>
+
+#include "device_select.h"
+
+#define MAX_STR_SZ 512			// maximum string size
+#define MAX_NAME_SZ 100			// maximum platform or device name size
+
+// a device found on one of the searched platforms
+typedef struct s_foundDevice {
+   cl_device_id device;
+   cl_platform_id platform;
+   cl_device_type type;
+   char name[MAX_NAME_SZ];
+   char vendor[MAX_NAME_SZ];
+} foundDevice;
+
+static bool isIndex(const char *str);
+static bool containsNoCase(const char *str, const char *part);
+static const char *deviceTypeName(cl_device_type type);
+static bool deviceMatches(const char *deviceSpec, cl_uint index, const foundDevice *dev);
+
+
+cl_uint selectDevices(
+      const char *platformSpec,
+      const char *deviceSpec,
+      cl_device_id **devices,
+      cl_platform_id **platforms)
+{
+   cl_int status;  // use as return value for most OpenCL functions
+
+   cl_uint numPlatforms = 0;
+   cl_platform_id *allPlatforms;
+
+   // Query for the number of recongnized platforms
+   status = clGetPlatformIDs(0, NULL, &numPlatforms);
+   if(status != CL_SUCCESS) {
+      printf("clGetPlatformIDs failed\n");
+      exit(-1);
+   }
+
+   // Make sure some platforms were found
+   if(numPlatforms == 0) {
+      printf("No platforms detected.\n");
+      exit(-1);
+   }
+
+   // Allocate enough space for each platform
+   allPlatforms = (cl_platform_id*)malloc(numPlatforms*sizeof(cl_platform_id));
+   if(allPlatforms == NULL) {
+      perror("malloc");
+      exit(-1);
+   }
+
+   // Fill in platforms
+   status = clGetPlatformIDs(numPlatforms, allPlatforms, NULL);
+   if(status != CL_SUCCESS) {
+      printf("clGetPlatformIDs failed\n");
+      exit(-1);
+   }
+
+   bool anyPlatform = (platformSpec == NULL || platformSpec[0] == '\0');
+
+   foundDevice *found = NULL;
+   cl_uint numFound = 0;
+
+   // Print out some basic information about each platform and collect the
+   // devices of the platforms that match platformSpec
+   printf("%u platforms detected\n", numPlatforms);
+   for(cl_uint i = 0; i < numPlatforms; i++) {
+      char vendor[MAX_NAME_SZ];
+      char name[MAX_NAME_SZ];
+      printf("Platform %u: \n", i);
+      status = clGetPlatformInfo(allPlatforms[i], CL_PLATFORM_VENDOR,
+                       sizeof(vendor), vendor, NULL);
+      printf("\tVendor: %s\n", vendor);
+      status |= clGetPlatformInfo(allPlatforms[i], CL_PLATFORM_NAME,
+                       sizeof(name), name, NULL);
+      printf("\tName: %s\n", name);
+
+      if(status != CL_SUCCESS) {
+         printf("clGetPlatformInfo failed\n");
+         exit(-1);
+      }
+
+      bool searched = anyPlatform ||
+            (isIndex(platformSpec) ? (cl_uint) atoi(platformSpec) == i :
+             (containsNoCase(name, platformSpec) || containsNoCase(vendor, platformSpec)));
+      if(!searched) {
+         printf("\t(not searched)\n");
+         continue;
+      }
+
+      // a platform without any devices returns CL_DEVICE_NOT_FOUND
+      cl_uint numDevices = 0;
+      status = clGetDeviceIDs(allPlatforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
+      if(status == CL_DEVICE_NOT_FOUND || numDevices == 0) continue;
+      if(status != CL_SUCCESS) {
+         printf("clGetDeviceIDs failed\n");
+         exit(-1);
+      }
+
+      cl_device_id *platformDevices = (cl_device_id*)malloc(numDevices*sizeof(cl_device_id));
+      found = (foundDevice *) realloc(found, (numFound + numDevices) * sizeof(foundDevice));
+      if(platformDevices == NULL || found == NULL) {
+         perror("malloc");
+         exit(-1);
+      }
+
+      status = clGetDeviceIDs(allPlatforms[i], CL_DEVICE_TYPE_ALL, numDevices, platformDevices, NULL);
+      if(status != CL_SUCCESS) {
+         printf("clGetDeviceIDs failed\n");
+         exit(-1);
+      }
+
+      for(cl_uint j = 0; j < numDevices; j++) {
+         foundDevice *dev = &found[numFound++];
+         dev->device = platformDevices[j];
+         dev->platform = allPlatforms[i];
+
+         status = clGetDeviceInfo(dev->device, CL_DEVICE_TYPE, sizeof(cl_device_type), &dev->type, NULL);
+         status |= clGetDeviceInfo(dev->device, CL_DEVICE_VENDOR, sizeof(dev->vendor), dev->vendor, NULL);
+         status |= clGetDeviceInfo(dev->device, CL_DEVICE_NAME, sizeof(dev->name), dev->name, NULL);
+         if(status != CL_SUCCESS) {
+            printf("clGetDeviceInfo failed\n");
+            exit(-1);
+         }
+      }
+
+      free(platformDevices);
+   }
+   printf("\n");
+
+   // Print out some basic information about each device
+   printf("%u devices detected\n", numFound);
+   for(cl_uint i = 0; i < numFound; i++) {
+      printf("Device %u: \n", i);
+      printf("\tDevice: %s\n", found[i].vendor);
+      printf("\tName: %s\n", found[i].name);
+      printf("\tType: %s\n", deviceTypeName(found[i].type));
+   }
+   printf("\n");
+
+   // by default run on the GPUs, and on whatever there is if there are none
+   const char *spec = deviceSpec;
+   if(spec == NULL || spec[0] == '\0') {
+      spec = "gpu";
+
+      bool anyGPU = false;
+      for(cl_uint i = 0; i < numFound; i++) {
+         if(deviceMatches(spec, i, &found[i])) anyGPU = true;
+      }
+
+      if(!anyGPU && numFound > 0) {
+         printf("No GPU detected, using all devices\n");
+         spec = "all";
+      }
+   }
+
+   // the devices are found platform by platform, so the selection stays grouped by platform
+   cl_uint numSelected = 0;
+   *devices = (cl_device_id*)malloc((numFound + 1)*sizeof(cl_device_id));
+   *platforms = (cl_platform_id*)malloc((numFound + 1)*sizeof(cl_platform_id));
+   if(*devices == NULL || *platforms == NULL) {
+      perror("malloc");
+      exit(-1);
+   }
+
+   for(cl_uint i = 0; i < numFound; i++) {
+      if(!deviceMatches(spec, i, &found[i])) continue;
+
+      (*devices)[numSelected] = found[i].device;
+      (*platforms)[numSelected] = found[i].platform;
+      numSelected++;
+   }
+
+   // Make sure some devices were found
+   if(numSelected == 0) {
+      printf("No devices detected (platform \"%s\", devices \"%s\").\n",
+            anyPlatform ? "" : platformSpec, spec);
+      exit(-1);
+   }
+
+   printf("Using device%s", numSelected > 1 ? "s" : "");
+   for(cl_uint i = 0, k = 0; i < numFound; i++) {
+      if(k < numSelected && (*devices)[k] == found[i].device) {
+         printf(" %u (%s)", i, found[i].name);
+         k++;
+      }
+   }
+   printf("\n\n");
+
+   free(found);
+   free(allPlatforms);
+
+   return numSelected;
+}
+
+
+// true if str is a non-empty string of digits
+static bool isIndex(const char *str)
+{
+   if(*str == '\0') return false;
+
+   for(; *str != '\0'; str++) {
+      if(!isdigit((unsigned char) *str)) return false;
+   }
+
+   return true;
+}
+
+// true if part is a substring of str, ignoring case
+static bool containsNoCase(const char *str, const char *part)
+{
+   size_t partLen = strlen(part);
+
+   for(; *str != '\0'; str++) {
+      size_t i;
+      for(i = 0; i < partLen; i++) {
+         if(str[i] == '\0' || tolower((unsigned char) str[i]) != tolower((unsigned char) part[i])) break;
+      }
+      if(i == partLen) return true;
+   }
+
+   return partLen == 0;
+}
+
+static const char *deviceTypeName(cl_device_type type)
+{
+   if(type & CL_DEVICE_TYPE_GPU) return "GPU";
+   if(type & CL_DEVICE_TYPE_CPU) return "CPU";
+   if(type & CL_DEVICE_TYPE_ACCELERATOR) return "accelerator";
+   return "other";
+}
+
+// true if the device with the given index in the device list matches any term of deviceSpec
+static bool deviceMatches(const char *deviceSpec, cl_uint index, const foundDevice *dev)
+{
+   char term[MAX_STR_SZ];
+
+   while(*deviceSpec != '\0') {
+      // copy out the next term without the surrounding spaces
+      while(*deviceSpec == ' ') deviceSpec++;
+      size_t len = strcspn(deviceSpec, ",");
+      size_t n = (len < MAX_STR_SZ - 1) ? len : MAX_STR_SZ - 1;
+      memcpy(term, deviceSpec, n);
+      while(n > 0 && term[n - 1] == ' ') n--;
+      term[n] = '\0';
+
+      deviceSpec += len;
+      if(*deviceSpec == ',') deviceSpec++;
+
+      if(term[0] == '\0') continue;
+
+      bool match;
+      if(!strcmp(term, "all")) match = true;
+      else if(!strcmp(term, "gpu")) match = (dev->type & CL_DEVICE_TYPE_GPU) != 0;
+      else if(!strcmp(term, "cpu")) match = (dev->type & CL_DEVICE_TYPE_CPU) != 0;
+      else if(!strcmp(term, "accelerator")) match = (dev->type & CL_DEVICE_TYPE_ACCELERATOR) != 0;
+      else if(isIndex(term)) match = (cl_uint) atoi(term) == index;
+      else match = containsNoCase(dev->name, term) || containsNoCase(dev->vendor, term);
+
+      if(match) return true;
+   }
+
+   return false;
+}
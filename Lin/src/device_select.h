@@ -0,0 +1,34 @@
+#ifndef DEVICE_SELECT_H
+#define DEVICE_SELECT_H
+
+#include <CL/cl.h>
+
+// Selection of the OpenCL platforms and devices to run on, shared by the
+// solver (pEval) and yexp_calc_cl().
+//
+// platformSpec picks the platforms to search: a platform index or a part of
+// the platform name or vendor (case-insensitive). NULL or "" searches all of them.
+//
+// deviceSpec is a comma separated list of terms, a device is selected if it
+// matches any of them:
+//    gpu, cpu, accelerator, all   device type
+//    a number                     device index in the list printed by selectDevices()
+//    anything else                part of the device name or vendor (case-insensitive)
+// NULL or "" selects the GPUs, or all the devices if there are no GPUs (e.g. a
+// node that only has a CPU OpenCL runtime).
+//
+// For example "cpu,gpu" selects the CPU runtime and the GPUs, so a run can be
+// split between them. A context can not span platforms, so the devices are
+// returned grouped by platform and the caller creates a context for each group.
+
+
+// list the platforms and devices, select the ones matching platformSpec and deviceSpec
+// and return their number. *devices and *platforms (the platform of each device) are
+// malloc'ed, free() them when done. Exits if no device matches.
+cl_uint selectDevices(
+      const char *platformSpec,
+      const char *deviceSpec,
+      cl_device_id **devices,
+      cl_platform_id **platforms);
+
+#endif
@@ -50,7 +50,6 @@ hyperspect::hyperspect(char *imageFullFilename, int num_image_rows, int num_imag
 	}
 
 	image_device = (double*) malloc (lSize*2);
-    rss_calc_device = (double*) malloc(lSize*2);
 
 	//FILE* imgOutFile; 
 	//imgOutFile = fopen ("reals_file_reflectance.txt", "w");
@@ -146,6 +145,15 @@ hyperspect::hyperspect(char *imageFullFilename, int num_image_rows, int num_imag
 
   //printf("yexp = %f\n", yexp_device[0]);
 
+  inv_cosz = 1.0 / cos(zenith*PI/180.0);
+  inv_cosv = 1.0 / cos(view * PI/180.0);
+
+  exp_spectral = (double *) malloc(total_bands * sizeof(double));
+  pow_yexp = (double *) malloc(cols_rows * total_bands * sizeof(double));
+  sum2_meas = (double *) malloc(cols_rows * sizeof(double));
+
+  tables_calc();
+
 }
 
 hyperspect::~hyperspect()
@@ -160,8 +168,10 @@ void hyperspect::image_cleanup()
   free(image_device);
   free(spectral_input);
   free(powf_spectral_43);
-  free(rss_calc_device);
   free(yexp_device);
+  free(exp_spectral);
+  free(pow_yexp);
+  free(sum2_meas);
   free(band440);
   free(band440p1);
   free(band490);
@@ -224,8 +234,8 @@ void hyperspect::yexp_calc()
       if (yexp_val < 0)  {
          yexp_val = 0.0;
       }
-      else if (yexp_val > 2.5) {
-         yexp_val = 2.5; 
+      else if (yexp_val > yexp_max) {
+         yexp_val = yexp_max; 
       }
  
       yexp_device[gid] = yexp_val;
@@ -236,45 +246,166 @@ void hyperspect::yexp_calc()
 }
 
 
+// build the tables of the terms that stay the same in every evaluation, the objective
+// functions (here and in the OpenCL kernels) only look them up
+void hyperspect::tables_calc()
+{
+   for(int j = 0; j < total_bands; j++)
+   {
+      exp_spectral[j] = exp((-0.015) * (spectral_input[j*6] - 440.0));
+   }
+
+   for(int gid = 0; gid < cols_rows; gid++)
+   {
+      int rss_offset_index = gid * total_bands;
+      double sum2 = 0;
+
+      for(int j = 0; j < total_bands; j++)
+      {
+         pow_yexp[rss_offset_index + j] = pow((400.0f /spectral_input[j*6]), yexp_device[gid]);
+
+         // the bands between b675 and b720 are not part of the error
+         if(j > b675_id && j < b720_id) continue;
+
+         sum2 += image_device[rss_offset_index + j] * image_device[rss_offset_index + j];
+      }
+
+      sum2_meas[gid] = sum2;
+   }
+}
+
+
+// build the coarse-grain model bank, one bank for every yexp bucket the pixels are in
+int hyperspect::model_bank(int num_points, double *points, bool kernel_geometry, double **bank_ret, int **bank_ids_ret)
+{
+   double cosz = kernel_geometry ? cl_inv_cosz : inv_cosz;
+   double cosv = kernel_geometry ? cl_inv_cosv : inv_cosv;
+
+   // bank of every bucket (-1 if no pixel is in it)
+   int num_buckets = (int) floor(yexp_max / yexp_bank_step + 0.5) + 1;
+   int *bucket_bank = (int *) malloc(num_buckets * sizeof(int));
+   int *bank_ids = (int *) malloc(cols_rows * sizeof(int));
+   int num_banks = 0;
+
+   for(int b = 0; b < num_buckets; b++) bucket_bank[b] = -1;
+
+   for(int gid = 0; gid < cols_rows; gid++)
+   {
+      int b = (int) floor(yexp_device[gid] / yexp_bank_step + 0.5);
+      if(b < 0) b = 0;
+      if(b >= num_buckets) b = num_buckets - 1;
+
+      if(bucket_bank[b] < 0) bucket_bank[b] = num_banks++;
+      bank_ids[gid] = bucket_bank[b];
+   }
+
+   double *bank = (double *) malloc((size_t) num_banks * num_points * total_bands * sizeof(double));
+   double pw[total_bands];
+
+   for(int b = 0; b < num_buckets; b++)
+   {
+      if(bucket_bank[b] < 0) continue;
+
+      for(int j = 0; j < total_bands; j++)
+      {
+         pw[j] = pow((400.0f /spectral_input[j*6]), b * yexp_bank_step);
+      }
+
+      for(int i = 0; i < num_points; i++)
+      {
+         double P = points[i*5];
+         double G = points[i*5+1];
+         double BP = points[i*5+2];
+         double B = points[i*5+3];
+         double H = points[i*5+4];
+         double lp = log(P);
+
+         double *rss_ret = bank + ((size_t) bucket_bank[b] * num_points + i) * total_bands;
+
+         for(int j = 0; j < total_bands; j++) {
+            // the bands between b675 and b720 are not part of the error
+            if(j > b675_id && j < b720_id) 
+            {
+               rss_ret[j] = 0;
+               continue;
+            }
+
+            int spect_offset_index = j*6;
+
+            double at = spectral_input[spect_offset_index + 3] + (P *            
+                (spectral_input[spect_offset_index + 1] + lp *
+                 spectral_input[spect_offset_index + 2])) + (G * exp_spectral[j]);
+
+            double bb = 0.0038 * powf_spectral_43[j] + BP * pw[j]; 
+
+            double u =  bb / (at + bb);            
+            double karpa = at + bb;                 
+            double duc = 1.03 * sqrt(1 + 2.4 * u);  
+            double dub = 1.04 * sqrt(1 + 5.4 * u);  
+
+            double rss_c = (0.084+(0.17*u))*u*(1.0-exp(-karpa*H*((cosz)+  
+                       duc*cosv)));
+
+            double rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * exp((-karpa) * 
+                  H * ((cosz) + dub*cosv));
+
+            rss_ret[j] = (0.5*(rss_c+rss_b))/(1.0-1.5*(rss_c+rss_b)); 
+         }
+      }
+   }
+
+   free(bucket_bank);
+
+   *bank_ret = bank;
+   *bank_ids_ret = bank_ids;
+
+   return num_banks;
+}
+
+
+// returns the parameter independent tables
+void hyperspect::tables_get_data(double **exp_spectral_ret, double **pow_yexp_ret, double **sum2_meas_ret)
+{
+   *exp_spectral_ret = exp_spectral;
+   *pow_yexp_ret = pow_yexp;
+   *sum2_meas_ret = sum2_meas;
+}
+
+
 // returns private image data
 void hyperspect::image_get_data(double **image_ret, double **spectral_input_ret, double **powf_spectral_43_ret, double **yexp_ret)
 {
   if(image_ret != NULL) *image_ret = image_device;
   if(spectral_input_ret != NULL) *spectral_input_ret = spectral_input;
-  if(powf_spectral_43 != NULL) *powf_spectral_43_ret = powf_spectral_43;
+  if(powf_spectral_43_ret != NULL) *powf_spectral_43_ret = powf_spectral_43;
   if(yexp_ret != NULL) *yexp_ret = yexp_device;
 }
 
 
 
 // hyperspectal objective function
+// (the modelled band values are summed up as they are computed, nothing goes to memory)
 double 
 hyperspect::obj_fun(double P, double G, double BP, double B, double H, int rss_offset_index) 
 {
    double err;
    int spect_offset_index;
-   double sum1; double sum2;
-   double sum3; double sum4;
+   double sum1 = 0;
 
-   double at, bb, u, karpa, duc, dub, rss_c, rss_b;
+   double at, bb, u, karpa, duc, dub, rss_c, rss_b, rss, meas;
    double lp = log(P);
-   double inv_cosz = 1.0 / cos(zenith*PI/180.0);
-   double inv_cosv = 1.0 / cos(view * PI/180.0);
-   double yexp = yexp_device[rss_offset_index / total_bands];
 
-   // TODO check to see if cosf is less costly than cos.  If precision is still
-   // good, use it instead.
+   for(int j = b400_id; j <= b800_id; j++) {
+      // the bands between b675 and b720 are not part of the error
+      if(j > b675_id && j < b720_id) continue;
 
-   for(int j = 0; j < total_bands; j++) {
       spect_offset_index = j*6;
 
       at = spectral_input[spect_offset_index + 3] + (P *            
           (spectral_input[spect_offset_index + 1] + lp *
-           spectral_input[spect_offset_index + 2])) + (G * exp((-0.015) *
-          (spectral_input[spect_offset_index] - 440.0)));
+           spectral_input[spect_offset_index + 2])) + (G * exp_spectral[j]);
 
-      bb = 0.0038 * powf_spectral_43[j] + BP *
-           pow((400.0f /spectral_input[spect_offset_index]), yexp); 
+      bb = 0.0038 * powf_spectral_43[j] + BP * pow_yexp[rss_offset_index + j]; 
 
       u =  bb / (at + bb);            
       karpa = at + bb;                 
@@ -287,52 +418,97 @@ hyperspect::obj_fun(double P, double G, double BP, double B, double H, int rss_o
       rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * exp((-karpa) * 
             H * ((inv_cosz) + dub*inv_cosv));
 
-      rss_calc_device[rss_offset_index + j] =
-                     (0.5*(rss_c+rss_b))/(1.0-1.5*(rss_c+rss_b)); 
+      rss = (0.5*(rss_c+rss_b))/(1.0-1.5*(rss_c+rss_b)); 
+      meas = image_device[rss_offset_index + j];
 
+      sum1 += (rss - meas) * (rss - meas);           // (Meas-est)^2
    }
 
-   // FIXME reduce these to just two variables
-   sum1 = 0;
-   sum2 = 0;
-   sum3 = 0;
-   sum4 = 0;
+   err = sqrt((sum1)/(sum2_meas[rss_offset_index / total_bands]));
 
-   for (int i= b400_id; i <= b675_id; ++i) {         // (Meas-est)^2
-        /*sum1 += (image_device[rss_offset_index + i] -
-                rss_calc_device[rss_offset_index + i]) *
-                (image_device[rss_offset_index + i] -
-                rss_calc_device[rss_offset_index + i]);*/
+   return err;
+}
 
-		//double temp = (rss_calc_device[i] - image_device[i]) * (rss_calc_device[i] - image_device[i]);
 
+// hyperspectal objective function and its analytic gradient, f is the same as obj_fun()
+double 
+hyperspect::obj_fun_grad(double P, double G, double BP, double B, double H, int rss_offset_index, double *g) 
+{
+   double err;
+   int spect_offset_index;
+   double sum1 = 0;
+   double g_P = 0; double g_G = 0; double g_BP = 0; double g_B = 0; double g_H = 0;
 
-		sum1 += (rss_calc_device[rss_offset_index + i] -
-			     image_device[rss_offset_index + i]) *
-                (rss_calc_device[rss_offset_index + i] -
-			     image_device[rss_offset_index + i]);
+   double lp = log(P);
 
+   for(int j = 0; j < total_bands; j++) {
+      // the bands between b675 and b720 are not part of the error
+      if(j > b675_id && j < b720_id) continue;
 
-        sum2 += image_device[rss_offset_index + i] * // Meas^2
-                image_device[rss_offset_index + i];
-   }
+      spect_offset_index = j*6;
 
-   for (int i= b720_id; i <= b800_id; ++i) {         // (Meas-est)^2
-        sum1 += (image_device[rss_offset_index + i] -
-                rss_calc_device[rss_offset_index + i]) *
-                (image_device[rss_offset_index + i] -
-                rss_calc_device[rss_offset_index + i]);
+      double eg = exp_spectral[j];
+      double pw = pow_yexp[rss_offset_index + j];
 
-        sum2 += image_device[rss_offset_index + i] *  // Meas^2
-                image_device[rss_offset_index + i];
+      double at = spectral_input[spect_offset_index + 3] + (P *            
+          (spectral_input[spect_offset_index + 1] + lp *
+           spectral_input[spect_offset_index + 2])) + (G * eg);
+
+      double bb = 0.0038 * powf_spectral_43[j] + BP * pw; 
+
+      double u =  bb / (at + bb);            
+      double karpa = at + bb;                 
+      double sc = sqrt(1 + 2.4 * u);
+      double sb = sqrt(1 + 5.4 * u);
+      double duc = 1.03 * sc;  
+      double dub = 1.04 * sb;  
+      double kc = (inv_cosz) + duc*inv_cosv;
+      double kb = (inv_cosz) + dub*inv_cosv;
+
+      double q = (0.084+(0.17*u))*u;
+      double ec = exp(-karpa*H*kc);
+      double eb = exp((-karpa) * H * kb);
+
+      double rss_c = q*(1.0-ec);
+      double rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * eb;
+
+      double d = 1.0-1.5*(rss_c+rss_b);
+      double rss = (0.5*(rss_c+rss_b))/d;
+      double diff = rss - image_device[rss_offset_index + j];
+
+      sum1 += diff * diff;                               // (Meas-est)^2
+
+      // derivatives of rss_c+rss_b with respect to u, karpa and H
+      double dr_du = (0.084+(0.34*u))*(1.0-ec) + 
+         karpa*H*inv_cosv*(q*ec*(1.236/sc) - rss_b*(2.808/sb));
+      double dr_dk = H*(q*ec*kc - rss_b*kb);
+      double dr_dH = karpa*(q*ec*kc - rss_b*kb);
+
+      // chain rule through u = bb/(at+bb), karpa = at+bb and rss, diff * d(rss)/d(rss_c+rss_b)
+      double w = diff*0.5/(d*d);
+      double dr_dat = dr_dk - dr_du*u/karpa;
+      double dr_dbb = dr_dk + dr_du*(1.0-u)/karpa;
+
+      g_P += w*dr_dat*(spectral_input[spect_offset_index + 1] + 
+         (lp + 1.0)*spectral_input[spect_offset_index + 2]);
+      g_G += w*dr_dat*eg;
+      g_BP += w*dr_dbb*pw;
+      g_B += w*(1.0/PI)*spectral_input[spect_offset_index+4]*eb;
+      g_H += w*dr_dH;
    }
 
-
+   double sum2 = sum2_meas[rss_offset_index / total_bands];
    err = sqrt((sum1)/(sum2));                 
-   // err = sqrt((sum1+sum3)/(sum2+sum4));                 
-   //err = sqrt(sum1+sum3)/sqrt(sum2+sum4);                
 
-   return err;
-}
+   // d(err) = d(sum1) / (2 * err * sum2), the 2 cancels with the one of d(sum1)
+   double scale = 0;
+   if(err > 0) scale = 1.0/(err*sum2);
 
+   g[0] = g_P*scale;
+   g[1] = g_G*scale;
+   g[2] = g_BP*scale;
+   g[3] = g_B*scale;
+   g[4] = g_H*scale;
 
+   return err;
+}
@@ -14,10 +14,32 @@ public:
   
   // evaluate objective function f(P, G, BP, B, H) on image element rss_offset_index
   double obj_fun(double P, double G, double BP, double B, double H, int rss_offset_index);  
+
+  // evaluate f(P, G, BP, B, H) and its analytic gradient (returned in g) on image element 
+  // rss_offset_index in one pass over the bands
+  double obj_fun_grad(double P, double G, double BP, double B, double H, int rss_offset_index, double *g);  
   
   // returns internal data of the image
   void image_get_data(double **image_ret, double **spectral_input_ret, double **powf_spectral_43_ret, double **yexp_ret);
+
+  // returns the tables of the terms of the objective function that do not depend on the parameters:
+  // exp(-0.015*(wavelength-440)) of each band, (400/wavelength)^yexp of each band of each pixel
+  // (laid out like the image) and the measured energy (sum of the squared bands) of each pixel
+  void tables_get_data(double **exp_spectral_ret, double **pow_yexp_ret, double **sum2_meas_ret);
+
+  // (re)build the tables from the image and yexp, call it after yexp was set externally
+  // (yexp_calc_cl() does)
+  void tables_calc();
   
+  // builds the model bank of a coarse-grained search over num_points points (5 parameters each):
+  // the modelled bands of every point (0 for the bands that are not part of the error) for
+  // every yexp bucket of the image (yexp rounded to a multiple of yexp_bank_step). Returns the
+  // number of banks, the banks (num_banks * num_points * total_bands values, bank by bank and
+  // point by point) in *bank_ret and the bank of every pixel in *bank_ids_ret (free both).
+  // With kernel_geometry the models use the angles of the OpenCL kernels (cl_inv_cosz and
+  // cl_inv_cosv) instead of the image's, so they match the objective of the gpu version
+  int model_bank(int num_points, double *points, bool kernel_geometry, double **bank_ret, int **bank_ids_ret);
+
   // returns size of image (rows * cols)
   void image_get_size(int *cols_rows_ret);	
 
@@ -44,9 +66,15 @@ private:
   double *image_device;
   double *spectral_input;
   double *powf_spectral_43;
-  double *rss_calc_device;
   double *yexp_device;
 
+  // tables built by tables_calc()
+  double *exp_spectral;
+  double *pow_yexp;
+  double *sum2_meas;
+  double inv_cosz;
+  double inv_cosv;
+
   double *band440;
   double *band440p1;
   double *band490;
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 // For cmd line handling
 #ifdef _WIN32
 //Windows
 #include "getopt.h"
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf		// returns -1 (and may not terminate) if the string does not fit
+#endif
 
 #else
 //Linux
@@ -46,6 +50,7 @@ static const char* OpenCL_incDir = "src";
 
 
 static const char* outputDir = "output";
+static const char* programCacheDir = "cl_cache";		// default directory of the compiled OpenCL program cache
 static const char* OpenCLEvalFileName = "eval_kernel.cl";
 static const char* OpenCLYexpCalcFileName = "yexp_calc.cl";
 
@@ -63,6 +68,9 @@ static void hyperspect_bfgsb_cl_run_cpu(double *params_ret, double *err_ret);
 static void hyperspect_bfgsb_cl_run_gpu(double *params_ret, double *err_ret);
 
 static double image_f(double *x, void *aux);
+static double image_fg(double *x, double *g, void *aux);
+static void check_gradient(hyperspect *hyp_image, const double *x_init, const double *L, const double *U);
+static void check_gradient_at(hyperspect *hyp_image, const double *x, int x_stride, const char *where);
 
 // global settings for program
 struct s_globalSettings {
@@ -80,8 +88,30 @@ struct s_globalSettings {
    bool useCoarseGrainedSearch;                  // use coarse-grained search before solver to find initial values
    unsigned int coarse_grain_n;                  // number of coarse grain points to use
    char coarseGrainInitFileNameFull[MAX_STR_SZ]; // file to read in  
+   bool useCoarseGrainBank;                      // score the pixels against the modelled bands of the points (model bank)
    bool calcYexp;                                // calculate yexp
    bool verbosePrint;							 // prints out more information about program while its running
+   int num_cohorts;                              // number of pixel cohorts to pipeline CPU and GPU work over in OpenCL version
+   bool useFortranLBFGSB;                        // use the Fortran L-BFGS-B routine instead of the native C++ engine
+   bool useDenseEngine;                          // use the dense BFGS-B engine (full inverse Hessian) instead of L-BFGS-B
+   bool useLmSolver;                             // use the Levenberg-Marquardt engine (J'J from the gpu) in OpenCL version
+   bool useSolverArenas;                         // allocate the solvers in one arena per work thread in OpenCL version
+   int solver_window;                            // maximum number of pixels being solved at once in OpenCL version (0 = all)
+   bool useFiniteDiffGradient;                   // use finite difference gradients instead of the analytic gradient
+   bool checkGradient;                           // check the analytic gradient against finite differences
+   char programCacheDir[MAX_STR_SZ];             // directory to cache the compiled OpenCL programs in ("" = no cache)
+   bfgsb_cl_host_memory hostMemory;              // how the evaluation buffers are shared with the gpu in OpenCL version
+   bool useOutOfOrderQueue;                      // let the gpu evaluate several cohorts at once in OpenCL version
+   char platformSelect[MAX_STR_SZ];              // OpenCL platforms to search ("" = all)
+   char deviceSelect[MAX_STR_SZ];                // OpenCL devices to run on ("" = the GPUs, or all devices if there are none)
+   int num_devices;                              // number of OpenCL devices to split the pixels over (0 = all)
+   int sub_device_units;                         // split the OpenCL devices into sub-devices of this many compute units (0 = don't)
+   bool tuneLaunch;                              // tune the work-group size and pixels per work-item of the OpenCL kernels
+   char evalVariant[MAX_STR_SZ];                 // variant of the OpenCL evaluation kernel (private, local or auto)
+   bfgsb_cl_precision precision;                 // precision of the OpenCL evaluations (double, float or mixed)
+   int polish_iterations;                        // double precision iterations after the float ones with mixed precision
+   int deviceSolverIterations;                   // iterations per launch of the OpenCL L-BFGS-B engine (0 = solve on the cpu)
+   int lineSearchPoints;                         // points evaluated with the first trial step of each line search (1 = no candidates)
 } globalSettings;
 
 
@@ -238,6 +268,27 @@ static void hyperspect_bfgsb_cl_run_cpu(double *params_ret, double *err_ret)
          globalSettings.spectInpFileNameFull,
          globalSettings.calcYexp);
 
+   // with the model bank the coarse grained search of all image elements is done 
+   // up front, scoring blocks of pixels against blocks of models
+   double *bank_inits = NULL;
+
+   if(globalSettings.useCoarseGrainedSearch && (globalSettings.coarse_grain_n > 0) && globalSettings.useCoarseGrainBank)
+   {
+      double *image;
+      double *bank;
+      int *bank_ids;
+
+      hyp_image.image_get_data(&image, NULL, NULL, NULL);
+      int num_banks = hyp_image.model_bank(globalSettings.coarse_grain_n, coarse_grain_points, false, &bank, &bank_ids);
+
+      bank_inits = (double *) malloc(globalSettings.cols_rows * 5 * sizeof(double));
+      coarse_grain_search_bank(5, globalSettings.coarse_grain_n, coarse_grain_points, total_bands, num_banks, bank, 
+            bank_ids, globalSettings.cols_rows, image, bank_inits);
+
+      free(bank);
+      free(bank_ids);
+   }
+
    // for each image element run the CPU solver
    for(int id = 0; id < globalSettings.cols_rows; id++)
    {
@@ -247,7 +298,11 @@ static void hyperspect_bfgsb_cl_run_cpu(double *params_ret, double *err_ret)
       aux_data.hyp_image_p = &hyp_image;
 
 	  // run coarse grained search if needed
-      if(globalSettings.useCoarseGrainedSearch && (globalSettings.coarse_grain_n > 0))
+      if(bank_inits != NULL)
+      {
+         memcpy(x_init, bank_inits + id * 5, 5 * sizeof(double));
+      }
+      else if(globalSettings.useCoarseGrainedSearch && (globalSettings.coarse_grain_n > 0))
       {
          coarse_grain_search(5, globalSettings.coarse_grain_n, coarse_grain_points, image_f, &aux_data, x_init);
       }
@@ -265,13 +320,21 @@ static void hyperspect_bfgsb_cl_run_cpu(double *params_ret, double *err_ret)
             &(params_ret[id*5]), 
             &(err_ret[id]), 
             globalSettings.hessian_approx_factor, 
-            globalSettings.max_iterations); 
+            globalSettings.max_iterations,
+            globalSettings.useFortranLBFGSB ? fortranEngine : (globalSettings.useDenseEngine ? denseEngine : nativeEngine),
+            globalSettings.useFiniteDiffGradient ? NULL : image_fg); 
    
 	  // Run BFGS-B CPU solver
       solver.runSolver();
    }
 
+   if(globalSettings.checkGradient)
+   {
+      check_gradient(&hyp_image, x_init, L, U);
+   }
+
    if(globalSettings.useCoarseGrainedSearch && globalSettings.coarse_grain_n > 0) free(coarse_grain_points);
+   free(bank_inits);
 }
 
 
@@ -286,6 +349,104 @@ static double image_f(double *x, void *aux)
 }
 
 
+// image function and its analytic gradient for use with CPU version
+static double image_fg(double *x, double *g, void *aux)
+{
+   imageFStruct aux_data = *(imageFStruct *) aux;
+   int rss_offset_index = aux_data.offset;
+   hyperspect *hyp_image_p = aux_data.hyp_image_p;
+   
+   return hyp_image_p->obj_fun_grad(x[0], x[1], x[2], x[3], x[4], rss_offset_index, g);
+}
+
+
+// check the analytic gradient of every image element at the start point x_init
+// and at a random point within the bounds L and U
+// (not at the solutions: f = sqrt(sum1/sum2) is not smooth where the fit is
+// exact, so the finite differences are wrong there)
+static void check_gradient(hyperspect *hyp_image, const double *x_init, const double *L, const double *U)
+{
+   double *x_rand = (double *) malloc(globalSettings.cols_rows * 5 * sizeof(double));
+   srand(1);
+
+   for(int i = 0; i < globalSettings.cols_rows * 5; i++)
+   {
+      int k = i % 5;
+      x_rand[i] = L[k] + (U[k] - L[k]) * ((double) rand() / RAND_MAX);
+   }
+
+   check_gradient_at(hyp_image, x_init, 0, "start point");
+   check_gradient_at(hyp_image, x_rand, 5, "random points");
+
+   free(x_rand);
+}
+
+
+// compare the analytic gradient of every image element at x (x_stride apart, 
+// 0 for the same point for all) with central finite differences and print the 
+// largest error relative to the largest gradient element of the point
+static void check_gradient_at(hyperspect *hyp_image, const double *x, int x_stride, const char *where)
+{
+   double max_err = 0;
+   double sum_err = 0;
+   double max_df = 0;
+   int max_id = 0;
+   int num_bad = 0;
+
+   for(int id = 0; id < globalSettings.cols_rows; id++)
+   {
+      const double *xi = x + id * x_stride;
+      int offset = id * total_bands;
+      double g[5];
+      double g_fd[5];
+      double xt[5];
+
+      double f = hyp_image->obj_fun_grad(xi[0], xi[1], xi[2], xi[3], xi[4], offset, g);
+      double f_ref = hyp_image->obj_fun(xi[0], xi[1], xi[2], xi[3], xi[4], offset);
+
+      double df = fabs(f - f_ref);
+      if(df > max_df) max_df = df;
+
+      // central differences with a step relative to x (all parameters are > 0)
+      double g_scale = 0;
+
+      for(int k = 0; k < 5; k++)
+      {
+         double h = 1e-6 * xi[k];
+
+         memcpy(xt, xi, 5 * sizeof(double));
+         xt[k] = xi[k] + h;
+         double fp = hyp_image->obj_fun(xt[0], xt[1], xt[2], xt[3], xt[4], offset);
+         xt[k] = xi[k] - h;
+         double fm = hyp_image->obj_fun(xt[0], xt[1], xt[2], xt[3], xt[4], offset);
+
+         g_fd[k] = (fp - fm) / (2 * h);
+         if(fabs(g_fd[k]) > g_scale) g_scale = fabs(g_fd[k]);
+      }
+
+      double err = 0;
+
+      for(int k = 0; k < 5; k++)
+      {
+         double e = fabs(g[k] - g_fd[k]);
+         if(g_scale > 0) e /= g_scale;
+         if(e > err) err = e;
+      }
+
+      sum_err += err;
+      if(err > 1e-4) num_bad++;
+      if(err > max_err) 
+      {
+         max_err = err;
+         max_id = id;
+      }
+   }
+
+   printf("GRADIENT CHECK (%s): max relative error %g (element %d), mean %g, %d of %d element(s) above 1e-4, max |f - obj_fun| %g\n",
+         where, max_err, max_id, sum_err / globalSettings.cols_rows, num_bad, globalSettings.cols_rows, max_df);
+}
+
+
 
 
 
@@ -359,7 +520,8 @@ static void hyperspect_bfgsb_cl_run_gpu(double *params_ret, double *err_ret)
       char yexpCalcSrcFileNameFull[MAX_STR_SZ];
       sprintf(yexpCalcSrcFileNameFull, "%s/%s", OpenCL_sourceDir, OpenCLYexpCalcFileName); 
 
-      yexp_calc_cl(&hyp_image, yexpCalcSrcFileNameFull, OpenCL_incDir);
+      yexp_calc_cl(&hyp_image, yexpCalcSrcFileNameFull, OpenCL_incDir, globalSettings.programCacheDir,
+            globalSettings.platformSelect, globalSettings.deviceSelect);
    }
 
    // if also using coarse grained search
@@ -385,51 +547,60 @@ static void hyperspect_bfgsb_cl_run_gpu(double *params_ret, double *err_ret)
    double *image; 
    double *spectral_input;
    double *powf_spectral43;
-   double *yexp;
+   double *exp_spectral;
+   double *pow_yexp;
+   double *sum2_meas;
 
    int total_image_elements = globalSettings.cols_rows * total_bands;
 
    // get image data to pass to solver
-   hyp_image.image_get_data(&image, &spectral_input, &powf_spectral43, &yexp);
+   // (yexp only enters the evaluations through the pow_yexp table)
+   hyp_image.image_get_data(&image, &spectral_input, &powf_spectral43, NULL);
+   hyp_image.tables_get_data(&exp_spectral, &pow_yexp, &sum2_meas);
 
-   bfgsb_cl_user_data_arg user_args[5];  // user data arguments to pass to Open CL function
+   bfgsb_cl_user_data_arg user_args[6];  // user data arguments to pass to Open CL function
 
-   // rss_calc
+   // hyperspectral image
    user_args[0].buffer = true;
    user_args[0].size = total_image_elements * sizeof(double);
-   user_args[0].init = false;
-   user_args[0].data = NULL;
+   user_args[0].init = true;
+   user_args[0].data = image;
    user_args[0].small_const = false;
 
-   // hyperspectral image
+   // spectral_input
    user_args[1].buffer = true;
-   user_args[1].size = total_image_elements * sizeof(double);
+   user_args[1].size = total_bands * 6 * sizeof(double);
    user_args[1].init = true;
-   user_args[1].data = image;
-   user_args[1].small_const = false;
+   user_args[1].data = spectral_input;
+   user_args[1].small_const = true;
 
-   // spectral_input
+   // powf_spectral43
    user_args[2].buffer = true;
-   user_args[2].size = total_bands * 6 * sizeof(double);
+   user_args[2].size = total_bands * sizeof(double); 
    user_args[2].init = true;
-   user_args[2].data = spectral_input;
+   user_args[2].data = powf_spectral43;
    user_args[2].small_const = true;
 
-   // powf_spectral43
+   // exp_spectral, exp(-0.015*(wavelength-440)) of each band
    user_args[3].buffer = true;
-   user_args[3].size = total_bands * sizeof(double); 
+   user_args[3].size = total_bands * sizeof(double);
    user_args[3].init = true;
-   user_args[3].data = powf_spectral43;
+   user_args[3].data = exp_spectral;
    user_args[3].small_const = true;
 
-   // yexp
+   // pow_yexp, (400/wavelength)^yexp of each band of each pixel
    user_args[4].buffer = true;
-   user_args[4].size = globalSettings.cols_rows * sizeof(double);
+   user_args[4].size = total_image_elements * sizeof(double);
    user_args[4].init = true;
-   user_args[4].data = yexp;
+   user_args[4].data = pow_yexp;
    user_args[4].small_const = false;
 
-   //printf("yexp = %f\n", yexp[0]);
+   // sum2_meas, measured energy of each pixel
+   user_args[5].buffer = true;
+   user_args[5].size = globalSettings.cols_rows * sizeof(double);
+   user_args[5].init = true;
+   user_args[5].data = sum2_meas;
+   user_args[5].small_const = false;
 
    // solver initializations
    double params_init[5] = {0.05, 0.2, 0.001, 0.1, 1};   // default solver start point
@@ -438,7 +609,45 @@ static void hyperspect_bfgsb_cl_run_gpu(double *params_ret, double *err_ret)
    int b[5] = {2, 2, 2, 2, 2};                           // bound types (both upper and lower)
 
    char OpenCLEvalFileNameFull[MAX_STR_SZ];
-   sprintf(OpenCLEvalFileNameFull, "%s/%s", OpenCL_incDir, "eval_kernel.cl");
+   sprintf(OpenCLEvalFileNameFull, "%s/%s", OpenCL_sourceDir, OpenCLEvalFileName);
+
+   bfgsb_cl_options options;
+   bfgsb_cl_set_default_options(&options);
+   options.num_cohorts = globalSettings.num_cohorts;
+   options.fortran_engine = globalSettings.useFortranLBFGSB;
+   options.dense_engine = globalSettings.useDenseEngine;
+   options.lm_solver = globalSettings.useLmSolver;
+   options.solver_arenas = globalSettings.useSolverArenas;
+   options.solver_window = globalSettings.solver_window;
+   options.eval_kernel = globalSettings.useFiniteDiffGradient ? "eval_kernel" : "eval_kernel_analytic";
+   if(globalSettings.useLmSolver) options.eval_kernel = "eval_kernel_analytic_lm";
+   options.program_cache_dir = globalSettings.programCacheDir;
+   options.host_memory = globalSettings.hostMemory;
+   options.out_of_order_queue = globalSettings.useOutOfOrderQueue;
+   options.platform_select = globalSettings.platformSelect;
+   options.device_select = globalSettings.deviceSelect;
+   options.num_devices = globalSettings.num_devices;
+   options.sub_device_units = globalSettings.sub_device_units;
+   options.tune_launch = globalSettings.tuneLaunch;
+   options.eval_variant = globalSettings.evalVariant;
+   options.precision = globalSettings.useLmSolver ? BFGSB_CL_PRECISION_DOUBLE : globalSettings.precision;
+   options.polish_iterations = globalSettings.polish_iterations;
+   options.device_solver = (globalSettings.deviceSolverIterations > 0);
+   options.device_solver_iterations = globalSettings.deviceSolverIterations;
+   options.line_search_points = globalSettings.lineSearchPoints;
+
+   // the modelled bands of the coarse grain points for every yexp bucket of the
+   // image, the coarse grained search kernel scores the pixels against them
+   bfgsb_cl_coarse_grain_bank bank;
+   bfgsb_cl_coarse_grain_bank *bank_p = NULL;
+
+   if(globalSettings.useCoarseGrainedSearch && (globalSettings.coarse_grain_n > 0) && globalSettings.useCoarseGrainBank)
+   {
+      bank.dim = total_bands;
+      bank.num_banks = hyp_image.model_bank(globalSettings.coarse_grain_n, coarse_grain_points, true, 
+            &bank.models, &bank.bank_ids);
+      bank_p = &bank;
+   }
 
    // call bfgsb_cl (multi-threaded CPU + GPU) solver to run on hyperspectral data
    bfgsb_cl(
@@ -450,7 +659,7 @@ static void hyperspect_bfgsb_cl_run_gpu(double *params_ret, double *err_ret)
       globalSettings.cols_rows,
       OpenCLEvalFileNameFull,
       OpenCL_incDir,
-      5,
+      6,
       user_args,
       globalSettings.max_iterations,
       globalSettings.hessian_approx_factor,
@@ -460,10 +669,21 @@ static void hyperspect_bfgsb_cl_run_gpu(double *params_ret, double *err_ret)
       globalSettings.useCoarseGrainedSearch,
       globalSettings.coarse_grain_n,
       coarse_grain_points,
-	  globalSettings.verbosePrint);
+	  globalSettings.verbosePrint,
+      &options,
+      bank_p);
 
+   if(globalSettings.checkGradient)
+   {
+      check_gradient(&hyp_image, params_init, L, U);
+   }
 
    if(globalSettings.useCoarseGrainedSearch && globalSettings.coarse_grain_n > 0) free(coarse_grain_points);
+   if(bank_p != NULL)
+   {
+      free(bank.models);
+      free(bank.bank_ids);
+   }
 }
 
 
@@ -501,12 +721,53 @@ static void display_prologue()
    else
    {
       printf("Computing on GPU using %d CPU working thread(s)\n", globalSettings.num_cpu_work_threads);
+
+      if(globalSettings.num_cohorts > 1)
+      {
+         printf("Overlapping CPU and GPU work using %d pixel cohorts\n", globalSettings.num_cohorts);
+      }
+
+      if(globalSettings.solver_window > 0)
+      {
+         printf("Solving at most %d pixels at once\n", globalSettings.solver_window);
+      }
    }
 
 
    printf("\nOptions:\n");
    printf("Max iterations = %d\n", globalSettings.max_iterations);
    printf("Hessian approx factor = %d\n", globalSettings.hessian_approx_factor);
+   if(globalSettings.useLmSolver && !globalSettings.useSerialCPUVersion)
+   {
+      printf("L-BFGS-B engine = Levenberg-Marquardt (J'J on the gpu)\n");
+   }
+   else if(globalSettings.deviceSolverIterations > 0 && !globalSettings.useSerialCPUVersion)
+   {
+      printf("L-BFGS-B engine = OpenCL device (%d iterations per launch)\n", globalSettings.deviceSolverIterations);
+   }
+   else printf("L-BFGS-B engine = %s\n", globalSettings.useFortranLBFGSB ? "Fortran" : 
+         globalSettings.useDenseEngine ? "dense BFGS-B" : "native");
+   printf("Gradient = %s\n", (globalSettings.useFiniteDiffGradient && 
+         !(globalSettings.useLmSolver && !globalSettings.useSerialCPUVersion)) ? "finite differences" : "analytic");
+   if(!globalSettings.useSerialCPUVersion && globalSettings.lineSearchPoints > 1)
+   {
+      printf("Line search points = %d (trial point and %d candidates)\n", globalSettings.lineSearchPoints,
+            globalSettings.lineSearchPoints - 1);
+   }
+   if(!globalSettings.useSerialCPUVersion && globalSettings.useFiniteDiffGradient)
+   {
+      printf("Evaluation kernel variant = %s\n", globalSettings.evalVariant);
+   }
+   if(!globalSettings.useSerialCPUVersion)
+   {
+      if(globalSettings.deviceSolverIterations > 0 || globalSettings.useLmSolver) printf("Precision = double\n");
+      else if(globalSettings.precision == BFGSB_CL_PRECISION_FLOAT) printf("Precision = float\n");
+      else if(globalSettings.precision == BFGSB_CL_PRECISION_MIXED)
+      {
+         printf("Precision = mixed (float, then %d iterations in double)\n", globalSettings.polish_iterations);
+      }
+      else printf("Precision = double\n");
+   }
    
    if(globalSettings.coarse_grain_n > 0)
    {
@@ -518,6 +779,7 @@ static void display_prologue()
       }
 
       printf("\n");
+      printf("Coarse-grain search = %s\n", globalSettings.useCoarseGrainBank ? "model bank" : "objective at every point");
 
    }
 
@@ -546,8 +808,30 @@ static void setGlobalSettings(int argc, char *argv[])
    globalSettings.useCoarseGrainedSearch = false;
    globalSettings.coarse_grain_n = 0;
    globalSettings.coarseGrainInitFileNameFull[0] = '\0';
+   globalSettings.useCoarseGrainBank = false;
    globalSettings.calcYexp = false;
    globalSettings.verbosePrint = false;
+   globalSettings.num_cohorts = 1;
+   globalSettings.useFortranLBFGSB = false;
+   globalSettings.useDenseEngine = false;
+   globalSettings.useLmSolver = false;
+   globalSettings.useSolverArenas = true;
+   globalSettings.solver_window = 0;
+   globalSettings.useFiniteDiffGradient = false;
+   globalSettings.checkGradient = false;
+   sprintf(globalSettings.programCacheDir, "%s", programCacheDir);
+   globalSettings.hostMemory = BFGSB_CL_HOST_MEMORY_AUTO;
+   globalSettings.useOutOfOrderQueue = false;
+   globalSettings.platformSelect[0] = '\0';
+   globalSettings.deviceSelect[0] = '\0';
+   globalSettings.num_devices = 0;
+   globalSettings.sub_device_units = 0;
+   globalSettings.tuneLaunch = true;
+   sprintf(globalSettings.evalVariant, "auto");
+   globalSettings.precision = BFGSB_CL_PRECISION_DOUBLE;
+   globalSettings.polish_iterations = 20;
+   globalSettings.deviceSolverIterations = 0;
+   globalSettings.lineSearchPoints = 1;
 
    // get settings from cmd line args
    processCmdArgs(argc, argv);
@@ -569,7 +853,7 @@ static void setGlobalSettings(int argc, char *argv[])
 // relies on getopt() to do the real work
 static void processCmdArgs(int argc, char *argv[])
 {
-   const char *optString = "i:w:l:r:asp:m:t:o:ac:n:yhv?";
+   const char *optString = "i:w:l:r:asp:m:t:o:ac:n:Byk:fHJeW:dgC:M:QP:D:N:S:TK:F:I:G:L:hv?";
 
    int opt = getopt(argc, argv, optString);
 
@@ -623,6 +907,11 @@ static void processCmdArgs(int argc, char *argv[])
             sprintf(globalSettings.coarseGrainInitFileNameFull, "%s/%s", dataDir, optarg);
          }
          break;
+     case 'B':
+         {
+            globalSettings.useCoarseGrainBank = true;
+         }
+         break;
       case 'm':
          {
             globalSettings.hessian_approx_factor = atoi(optarg);
@@ -643,6 +932,147 @@ static void processCmdArgs(int argc, char *argv[])
             globalSettings.calcYexp = true;
          }
          break;
+      case 'k':
+         {
+            globalSettings.num_cohorts = atoi(optarg);
+         }
+         break;
+      case 'f':
+         {
+            globalSettings.useFortranLBFGSB = true;
+         }
+         break;
+      case 'H':
+         {
+            globalSettings.useDenseEngine = true;
+         }
+         break;
+      case 'J':
+         {
+            globalSettings.useLmSolver = true;
+         }
+         break;
+      case 'e':
+         {
+            globalSettings.useSolverArenas = false;
+         }
+         break;
+      case 'W':
+         {
+            globalSettings.solver_window = atoi(optarg);
+         }
+         break;
+      case 'd':
+         {
+            globalSettings.useFiniteDiffGradient = true;
+         }
+         break;
+      case 'g':
+         {
+            globalSettings.checkGradient = true;
+         }
+         break;
+      case 'C':
+         {
+            int len = snprintf(globalSettings.programCacheDir, sizeof(globalSettings.programCacheDir), "%s", optarg);
+            if(len < 0 || (size_t) len >= sizeof(globalSettings.programCacheDir))
+            {
+               printf("Program cache directory %s is too long, not caching\n", optarg);
+               globalSettings.programCacheDir[0] = '\0';
+            }
+         }
+         break;
+      case 'M':
+         {
+            if(strcmp(optarg, "copy") == 0) globalSettings.hostMemory = BFGSB_CL_HOST_MEMORY_COPY;
+            else if(strcmp(optarg, "pinned") == 0) globalSettings.hostMemory = BFGSB_CL_HOST_MEMORY_PINNED;
+            else if(strcmp(optarg, "zero") == 0) globalSettings.hostMemory = BFGSB_CL_HOST_MEMORY_ZERO_COPY;
+            else if(strcmp(optarg, "auto") == 0) globalSettings.hostMemory = BFGSB_CL_HOST_MEMORY_AUTO;
+            else
+            {
+               display_usage();
+               exit(EXIT_FAILURE);
+            }
+         }
+         break;
+      case 'Q':
+         {
+            globalSettings.useOutOfOrderQueue = true;
+         }
+         break;
+      case 'P':
+         {
+            int len = snprintf(globalSettings.platformSelect, sizeof(globalSettings.platformSelect), "%s", optarg);
+            if(len < 0 || (size_t) len >= sizeof(globalSettings.platformSelect))
+            {
+               printf("Platform selection %s is too long\n", optarg);
+               exit(EXIT_FAILURE);
+            }
+         }
+         break;
+      case 'D':
+         {
+            int len = snprintf(globalSettings.deviceSelect, sizeof(globalSettings.deviceSelect), "%s", optarg);
+            if(len < 0 || (size_t) len >= sizeof(globalSettings.deviceSelect))
+            {
+               printf("Device selection %s is too long\n", optarg);
+               exit(EXIT_FAILURE);
+            }
+         }
+         break;
+      case 'N':
+         {
+            globalSettings.num_devices = atoi(optarg);
+         }
+         break;
+      case 'S':
+         {
+            globalSettings.sub_device_units = atoi(optarg);
+         }
+         break;
+      case 'T':
+         {
+            globalSettings.tuneLaunch = false;
+         }
+         break;
+      case 'K':
+         {
+            if(strcmp(optarg, "private") != 0 && strcmp(optarg, "local") != 0 && strcmp(optarg, "auto") != 0)
+            {
+               display_usage();
+               exit(EXIT_FAILURE);
+            }
+
+            sprintf(globalSettings.evalVariant, "%s", optarg);
+         }
+         break;
+      case 'F':
+         {
+            if(strcmp(optarg, "double") == 0) globalSettings.precision = BFGSB_CL_PRECISION_DOUBLE;
+            else if(strcmp(optarg, "float") == 0) globalSettings.precision = BFGSB_CL_PRECISION_FLOAT;
+            else if(strcmp(optarg, "mixed") == 0) globalSettings.precision = BFGSB_CL_PRECISION_MIXED;
+            else
+            {
+               display_usage();
+               exit(EXIT_FAILURE);
+            }
+         }
+         break;
+      case 'I':
+         {
+            globalSettings.polish_iterations = atoi(optarg);
+         }
+         break;
+      case 'G':
+         {
+            globalSettings.deviceSolverIterations = atoi(optarg);
+         }
+         break;
+      case 'L':
+         {
+            globalSettings.lineSearchPoints = atoi(optarg);
+         }
+         break;
       case 'h':
          {
             display_usage();
@@ -692,8 +1122,55 @@ static void display_usage()
    printf("-h : Display this help message.\n\n");
    printf("-s : Use serial CPU only version of bfgsb instead of GPU (default is to use GPU).\n\n");
    printf("-p <num_cpu_work_threads> : Number of cpu work threads to use with gpu version (default is 1).\n\n");
+   printf("-k <num_cohorts> : Split the pixels into <num_cohorts> cohorts and let the gpu evaluate one cohort while the\n");
+   printf("                   cpu work threads step the next one (default is 1, no overlap).\n\n");
    printf("-m <hessian_approx_factor> : Hessian approximation factor to use for bfgsb (default is 6).\n");
-   printf("                            (higher is better but more compute intensive)\n\n");
+   printf("                            (higher is better but more compute intensive, the native engine is compiled\n");
+   printf("                            for 3 to 10, 20 and 30, other values use the Fortran routine)\n\n");
+   printf("-f : Use the Fortran L-BFGS-B routine instead of the native C++ engine (to compare results).\n\n");
+   printf("-H : Use the dense BFGS-B engine instead of L-BFGS-B: it keeps the full inverse Hessian of the 5 parameters,\n");
+   printf("     so an iteration does not get slower with -m (-m is ignored, -L does not apply).\n\n");
+   printf("-J : Solve with a bounded Levenberg-Marquardt engine instead of L-BFGS-B (gpu version only): the gpu returns\n");
+   printf("     the 5x5 Gauss-Newton matrix J'J of the band residuals with the analytic gradient and the cpu solves the\n");
+   printf("     damped normal equations (-m, -d, -F, -G, -H and -L do not apply).\n\n");
+   printf("-e : Allocate every solver on the heap instead of in per work thread arenas (gpu version only).\n\n");
+   printf("-W <num_pixels> : Solve at most <num_pixels> pixels at once, a new pixel is started in the place of every\n");
+   printf("                  pixel that converges (gpu version only, default is 0 = all pixels at once).\n\n");
+   printf("-d : Compute the gradient with finite differences instead of the analytic gradient (the original kernel\n");
+   printf("     on the gpu, central differences on the cpu).\n\n");
+   printf("-g : Check the analytic gradient against central finite differences at the start point and at a\n");
+   printf("     random point of every pixel and print the largest error.\n\n");
+   printf("-C <cache_dir> : Directory to keep the compiled OpenCL programs in, they are rebuilt only when the source,\n");
+   printf("                 the build options or the device driver change (default is %s, -C \"\" to always rebuild).\n\n", programCacheDir);
+   printf("-M <mode> : How the gpu gets the x, f and gradient buffers: zero (map them, the gpu shares the host memory),\n");
+   printf("            pinned (copy them from pinned host memory), copy (copy them from ordinary host memory) or\n");
+   printf("            auto (default, zero if the device reports unified host memory and pinned otherwise).\n\n");
+   printf("-Q : Use an out-of-order OpenCL command queue so the gpu can evaluate several cohorts (-k) at once.\n\n");
+   printf("-P <platform> : OpenCL platform to run on, by index or part of its name or vendor (default is all platforms).\n\n");
+   printf("-D <devices> : Comma separated list of the OpenCL devices to run on, each one a device type (gpu, cpu,\n");
+   printf("               accelerator or all), a device index or part of a device name (default is the gpus, or all\n");
+   printf("               devices if there is no gpu). With several devices, e.g. -D cpu,gpu, the pixels are split\n");
+   printf("               between them in proportion to their measured speed.\n\n");
+   printf("-N <num_devices> : Split the pixels over the first <num_devices> OpenCL devices in proportion to their\n");
+   printf("                   measured speed (default is 0 = all devices).\n\n");
+   printf("-S <compute_units> : Split every OpenCL device into sub-devices of <compute_units> compute units and use\n");
+   printf("                     them as separate devices (OpenCL 1.2, e.g. to run several devices on one cpu).\n\n");
+   printf("-T : Do not tune the launch shape (work-group size and pixels per work-item) of the OpenCL kernels,\n");
+   printf("     let the driver pick the work-group size. The tuned shapes are kept in the -C directory.\n\n");
+   printf("-K <variant> : Variant of the finite difference (-d) evaluation kernel: private (band values in registers),\n");
+   printf("               local (measured bands in local memory) or auto (default, time them on the first evaluation\n");
+   printf("               of each device and use the fastest). The analytic gradient kernel has no variants.\n\n");
+   printf("-F <precision> : Precision of the analytic gradient evaluations on the gpu: double (default), float (for\n");
+   printf("                 gpus with slow double arithmetic, the error sums stay in double) or mixed (converge in\n");
+   printf("                 float, then polish every pixel with -I more iterations in double).\n\n");
+   printf("-I <polish_iterations> : Double precision iterations after the float ones with -F mixed (default is 20).\n\n");
+   printf("-G <iterations> : Run the L-BFGS-B iterations on the gpu with the OpenCL engine instead of the cpu work-threads,\n");
+   printf("                  relaunching the solve kernel every <iterations> iterations until all pixels are done\n");
+   printf("                  (0 = solve on the cpu, the default). The evaluations are in double precision (-F is ignored)\n");
+   printf("                  and -f, -H and -e do not apply, -W bounds the pixels of each launch.\n\n");
+   printf("-L <points> : Evaluate <points> points with the first trial step of every line search on the gpu: the trial\n");
+   printf("              point and <points>-1 shorter steps (at most %d), a line search that would need another trial\n", LBFGSB_MAX_CANDIDATES);
+   printf("              takes the best of them that is good enough instead (default is 1, native engine only).\n\n");
    printf("-t <max_iterations>: Maximum number of iterations to use for bfgsb (default is 2000)\n");  
    printf("                     (higher is better but more compute intensive)\n\n");
    printf("-o <param_out_file> : Output hyperspectral parameters in binary format to this file (will be placed in the ./output directory).\n\n");
@@ -702,5 +1179,8 @@ static void display_usage()
    printf("-c <n> : Use coarse grained search with <n> points to find initial starting positions.\n\n");
    printf("-n <coarse_grain_init_file> : Use <coarse_grain_init_file> contents as initial starting positions for coarse grained search.\n");
    printf("                              (must be used with switch -c) (should be placed in the ./data directory)\n\n");
+   printf("-B : Score the pixels against the modelled bands of the coarse grained search points, computed once for every\n");
+   printf("     yexp bucket of %.2f, instead of evaluating the objective function at every point (much faster, with -y\n", yexp_bank_step);
+   printf("     pixels whose yexp is not on a bucket can start from a different point, so results can differ).\n\n");
    printf("\n");
 }
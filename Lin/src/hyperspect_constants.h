@@ -22,6 +22,11 @@
 //#define zenith 9.441	// for snythetic
 #define zenith 32.0		// for real
 #define view 0.0
+
+// 1/cos of the zenith and view angles the OpenCL kernels model (eval_kernel.cl),
+// the synthetic scene's zenith of 9.441
+#define cl_inv_cosz 1.01373094981255
+#define cl_inv_cosv 1.0
 #define PI 3.141592653589793
 
 // band ids 
@@ -34,6 +39,8 @@
 #define b490_id 9
 
 #define yexp_const_val 1.0  // constant value to set yexp when using synthetic images
+#define yexp_max 2.5        // yexp is clamped to [0, yexp_max] (yexp_calc.cl, hyperspect::yexp_calc())
+#define yexp_bank_step 0.05 // yexp buckets of the coarse-grain model bank (hyperspect::model_bank())
 
 #endif
 
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+//Windows
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf		// returns -1 (and may not terminate) if the string does not fit
+#endif
+
+#else
+//Linux
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <CL/cl.h>
+
+#include "launch_tuner.h"
+
+#define MAX_STR_SZ 512			// maximum string size
+
+// work-group sizes tried (if the kernel and device allow them) and functions per work-item
+static const size_t candidateLocalSizes[] = { 32, 64, 128, 256 };
+static const int candidateFuncsPerItem[] = { 1, 2, 4 };
+
+
+
+// size class of a launch of count functions: 2^(c-1) < count <= 2^c
+static int sizeClass(int count)
+{
+   int c = 0;
+   while(c < LAUNCH_SIZE_CLASSES - 1 && (1 << c) < count) c++;
+   return c;
+}
+
+static bool sameShape(launch_shape a, launch_shape b)
+{
+   return a.local_size == b.local_size && a.funcs_per_item == b.funcs_per_item;
+}
+
+
+LaunchTuner::LaunchTuner(const char *profileFileName)
+{
+   // a profile file name that does not fit is not used, the shapes are then tuned again in every run
+   int len = snprintf(this->profileFileName, sizeof(this->profileFileName), "%s", profileFileName != NULL ? profileFileName : "");
+   if(len < 0 || (size_t) len >= sizeof(this->profileFileName))
+   {
+      printf("Launch profile file name %s is too long, the launch shapes are not kept\n", profileFileName);
+      this->profileFileName[0] = '\0';
+   }
+   dirty = false;
+
+   kernels = NULL;
+   num_kernels = 0;
+
+   profiles = NULL;
+   num_profiles = 0;
+
+   loadProfiles();
+}
+
+LaunchTuner::~LaunchTuner()
+{
+   free(kernels);
+   free(profiles);
+}
+
+
+// read the tuned shapes, each line of the profile file is
+// <size class> <work-group size> <functions per work-item> <ns per function> <kernel|device|driver>
+void LaunchTuner::loadProfiles()
+{
+   if(profileFileName[0] == '\0') return;
+
+   FILE *fp = fopen(profileFileName, "r");
+   if(fp == NULL) return;
+
+   char line[2 * MAX_STR_SZ];
+   while(fgets(line, sizeof(line), fp) != NULL)
+   {
+      if(line[0] == '#') continue;
+
+      int size_class, funcs_per_item;
+      unsigned long local_size;
+      double ns;
+      char key[MAX_STR_SZ];
+
+      if(sscanf(line, "%d %lu %d %lf %511[^\n]", &size_class, &local_size, &funcs_per_item, &ns, key) != 5) continue;
+      if(size_class < 0 || size_class >= LAUNCH_SIZE_CLASSES || funcs_per_item < 1) continue;
+
+      launch_shape shape;
+      shape.local_size = local_size;
+      shape.funcs_per_item = funcs_per_item;
+      setProfile(key, size_class, shape, ns);
+   }
+
+   fclose(fp);
+   dirty = false;
+}
+
+
+// add or replace a tuned shape
+void LaunchTuner::setProfile(const char *key, int size_class, launch_shape shape, double ns)
+{
+   launch_profile *p = NULL;
+
+   for(int i = 0; i < num_profiles; i++)
+   {
+      if(profiles[i].size_class == size_class && !strcmp(profiles[i].key, key)) p = &profiles[i];
+   }
+
+   if(p == NULL)
+   {
+      profiles = (launch_profile *) realloc(profiles, (num_profiles + 1) * sizeof(launch_profile));
+      p = &profiles[num_profiles++];
+      snprintf(p->key, sizeof(p->key), "%s", key);
+      p->key[sizeof(p->key) - 1] = '\0';
+      p->size_class = size_class;
+   }
+
+   p->shape = shape;
+   p->ns = ns;
+   dirty = true;
+}
+
+
+int LaunchTuner::addKernel(cl_kernel kernel, cl_device_id device, const char *kernelName, bool tune)
+{
+   kernels = (tuned_kernel *) realloc(kernels, (num_kernels + 1) * sizeof(tuned_kernel));
+   tuned_kernel *tk = &kernels[num_kernels];
+   memset(tk, 0, sizeof(tuned_kernel));
+
+   char driver[100];
+   driver[0] = '\0';
+   if(clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(tk->deviceName), tk->deviceName, NULL) != CL_SUCCESS) tk->deviceName[0] = '\0';
+   if(clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL) != CL_SUCCESS) driver[0] = '\0';
+   tk->deviceName[sizeof(tk->deviceName) - 1] = '\0';
+   driver[sizeof(driver) - 1] = '\0';
+
+   // the kernel name is only printed, the key must be complete to be kept in the profile file
+   snprintf(tk->kernelName, sizeof(tk->kernelName), "%s", kernelName);
+   tk->kernelName[sizeof(tk->kernelName) - 1] = '\0';
+
+   int len = snprintf(tk->key, sizeof(tk->key), "%s|%s|%s", kernelName, tk->deviceName, driver);
+   if(len < 0 || (size_t) len >= sizeof(tk->key)) tk->key[0] = '\0';
+
+   tk->tune = tune;
+
+   // a kernel compiled for a fixed work-group size can not be launched with any other
+   size_t compileSize[3] = {0, 0, 0};
+   if(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+            sizeof(compileSize), compileSize, NULL) != CL_SUCCESS) compileSize[0] = 0;
+
+   tk->defaultShape.local_size = compileSize[0];
+   tk->defaultShape.funcs_per_item = 1;
+
+   // the work-group sizes the kernel can be launched with on this device, in
+   // multiples of the size the device prefers (the warp or wavefront size)
+   size_t maxLocal = 0;
+   size_t multiple = 1;
+   clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxLocal, NULL);
+#ifdef CL_VERSION_1_1
+   if(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+            sizeof(size_t), &multiple, NULL) != CL_SUCCESS || multiple == 0) multiple = 1;
+#endif
+
+   for(int f = 0; f < (int) (sizeof(candidateFuncsPerItem) / sizeof(int)); f++)
+   {
+      launch_shape shape;
+      shape.funcs_per_item = candidateFuncsPerItem[f];
+
+      if(compileSize[0] > 0)
+      {
+         if(tk->num_candidates == MAX_LAUNCH_CANDIDATES) break;
+         shape.local_size = compileSize[0];
+         tk->candidates[tk->num_candidates++] = shape;
+         continue;
+      }
+
+      if(tk->num_candidates == MAX_LAUNCH_CANDIDATES) break;
+      shape.local_size = 0;
+      tk->candidates[tk->num_candidates++] = shape;
+
+      for(int l = 0; l < (int) (sizeof(candidateLocalSizes) / sizeof(size_t)); l++)
+      {
+         size_t local = candidateLocalSizes[l];
+         if(local > maxLocal || (multiple <= local && local % multiple != 0)) continue;
+         if(tk->num_candidates == MAX_LAUNCH_CANDIDATES) break;
+
+         shape.local_size = local;
+         tk->candidates[tk->num_candidates++] = shape;
+      }
+   }
+
+   // start with the shapes tuned in earlier runs
+   for(int i = 0; i < num_profiles && tk->key[0] != '\0'; i++)
+   {
+      if(strcmp(profiles[i].key, tk->key) != 0) continue;
+
+      int c = profiles[i].size_class;
+      tk->tuned[c] = true;
+      tk->best[c] = profiles[i].shape;
+      tk->best_ns[c] = profiles[i].ns;
+   }
+
+   return num_kernels++;
+}
+
+
+launch_shape LaunchTuner::getShape(int k, int count, bool *trial)
+{
+   tuned_kernel *tk = &kernels[k];
+   int c = sizeClass(count);
+
+   *trial = false;
+
+   if(tk->tuned[c]) return tk->best[c];
+
+   if(trialsLeft(k, count) > 0)
+   {
+      *trial = true;
+      return tk->candidates[tk->started[c]++ % tk->num_candidates];
+   }
+
+   // also while the last trials are still running
+   return tk->defaultShape;
+}
+
+
+int LaunchTuner::trialsLeft(int k, int count)
+{
+   tuned_kernel *tk = &kernels[k];
+   int c = sizeClass(count);
+
+   if(!tk->tune || tk->tuned[c] || count < LAUNCH_TUNE_MIN_COUNT) return 0;
+
+   return tk->num_candidates * LAUNCH_TUNE_TRIALS - tk->started[c];
+}
+
+
+void LaunchTuner::report(int k, int count, launch_shape shape, int funcs, double ms)
+{
+   tuned_kernel *tk = &kernels[k];
+   int c = sizeClass(count);
+
+   if(tk->tuned[c]) return;
+
+   for(int i = 0; i < tk->num_candidates; i++)
+   {
+      if(!sameShape(tk->candidates[i], shape)) continue;
+
+      tk->trial_ms[c][i] += ms;
+      tk->trial_funcs[c][i] += funcs;
+      tk->reported[c]++;
+      break;
+   }
+
+   if(tk->reported[c] < tk->num_candidates * LAUNCH_TUNE_TRIALS) return;
+
+   // all candidates are timed, keep the one with the shortest time per function
+   int best = 0;
+   double best_ns = 0;
+   for(int i = 0; i < tk->num_candidates; i++)
+   {
+      double ns = 1000000.0 * tk->trial_ms[c][i] / (tk->trial_funcs[c][i] > 0 ? tk->trial_funcs[c][i] : 1);
+      if(i == 0 || ns < best_ns)
+      {
+         best = i;
+         best_ns = ns;
+      }
+   }
+
+   tk->tuned[c] = true;
+   tk->best[c] = tk->candidates[best];
+   tk->best_ns[c] = best_ns;
+   if(tk->key[0] != '\0') setProfile(tk->key, c, tk->best[c], best_ns);
+
+   char local[32];
+   if(tk->best[c].local_size > 0) sprintf(local, "%lu", (unsigned long) tk->best[c].local_size);
+   else sprintf(local, "picked by the driver");
+
+   printf("Tuned %s on %s for %d-%d functions: work-group size %s, %d function%s per work-item (%.1f ns per function)\n",
+         tk->kernelName, tk->deviceName, (c > 0) ? (1 << (c - 1)) + 1 : 1, 1 << c, local,
+         tk->best[c].funcs_per_item, tk->best[c].funcs_per_item > 1 ? "s" : "", best_ns);
+}
+
+
+// write all profiles through a temporary file, so concurrent runs never see a partly written one
+void LaunchTuner::save()
+{
+   if(!dirty || profileFileName[0] == '\0') return;
+
+   // create the directory of the profile file if it is not there yet
+   char dirName[sizeof(profileFileName)];
+   snprintf(dirName, sizeof(dirName), "%s", profileFileName);
+   dirName[sizeof(dirName) - 1] = '\0';
+   char *slash = strrchr(dirName, '/');
+   if(slash != NULL && slash != dirName)
+   {
+      *slash = '\0';
+#ifdef _WIN32
+      _mkdir(dirName);
+#else
+      mkdir(dirName, 0777);
+#endif
+   }
+
+   char tmpFileName[2 * MAX_STR_SZ];
+   int len = snprintf(tmpFileName, sizeof(tmpFileName), "%s.%d.tmp", profileFileName, (int) getpid());
+
+   FILE *fp = NULL;
+   if(len >= 0 && (size_t) len < sizeof(tmpFileName)) fp = fopen(tmpFileName, "w");
+   bool ok = (fp != NULL);
+
+   if(ok)
+   {
+      fprintf(fp, "# launch shapes tuned by bfgsb_cl:\n");
+      fprintf(fp, "# <size class> <work-group size (0 = driver)> <functions per work-item> <ns per function> <kernel|device|driver>\n");
+
+      for(int i = 0; i < num_profiles; i++)
+      {
+         fprintf(fp, "%d %lu %d %.3f %s\n", profiles[i].size_class, (unsigned long) profiles[i].shape.local_size,
+               profiles[i].shape.funcs_per_item, profiles[i].ns, profiles[i].key);
+      }
+
+      if(fclose(fp) != 0) ok = false;
+
+#ifdef _WIN32
+      // rename() does not replace an existing file on Windows
+      if(ok) remove(profileFileName);
+#endif
+      if(ok) ok = (rename(tmpFileName, profileFileName) == 0);
+      if(!ok) remove(tmpFileName);
+   }
+
+   if(ok) dirty = false;
+   else printf("Could not store the launch profiles %s\n", profileFileName);
+}
+
+
+size_t LaunchTuner::globalSize(launch_shape shape, int funcs)
+{
+   size_t items = (funcs + shape.funcs_per_item - 1) / shape.funcs_per_item;
+
+   if(shape.local_size > 0) items = ((items + shape.local_size - 1) / shape.local_size) * shape.local_size;
+
+   return items;
+}
@@ -0,0 +1,116 @@
+#ifndef LAUNCH_TUNER_H
+#define LAUNCH_TUNER_H
+
+#include <CL/cl.h>
+
+// Launch shapes of the 1D kernels that evaluate one function (pixel) per slot.
+//
+// A kernel that takes the end of its slot range as its last argument and
+// visits its slots with
+//    for(int slot = get_global_id(0); slot < slot_end; slot += get_global_size(0))
+// can be launched with any work-group size and any number of functions per
+// work-item: the global work size is padded up to a multiple of the work-group
+// size and the extra work-items do nothing.
+//
+// The LaunchTuner picks the shape for each device, kernel and size class
+// (launches of 2^(c-1) < count <= 2^c functions): the first launches of a size
+// class try each candidate shape LAUNCH_TUNE_TRIALS times and the one with the
+// shortest profiled kernel time per function is used from then on. The tuned
+// shapes are kept in a profile file, so later runs on the same device and
+// driver use them right away.
+//
+// A kernel compiled for a fixed work-group size (reqd_work_group_size) is only
+// tried and launched with that size.
+
+#define LAUNCH_SIZE_CLASSES 32			// size classes of launches (2^31 functions at most)
+#define MAX_LAUNCH_CANDIDATES 16		// candidate shapes of a kernel
+#define LAUNCH_TUNE_TRIALS 2			// launches with each candidate before picking one
+#define LAUNCH_TUNE_MIN_COUNT 256		// smaller launches are not tuned (they use the default shape)
+#define LAUNCH_TUNE_MIN_CHUNK 64		// smallest trial chunk when one large launch is split up to try the shapes
+
+typedef struct s_launch_shape {
+   size_t local_size;			// work-group size (0 = chosen by the driver)
+   int funcs_per_item;			// functions each work-item evaluates
+} launch_shape;
+
+// a kernel of a device being tuned
+typedef struct s_tuned_kernel {
+   char key[512];				// "kernel|device name|driver version", names the kernel in the profile file
+   char kernelName[100];
+   char deviceName[100];
+   bool tune;					// try candidate shapes (false = always the default shape)
+   launch_shape defaultShape;	// shape of the launches that are not tuned (the driver's work-group size 
+								// or the kernel's fixed one)
+   int num_candidates;
+   launch_shape candidates[MAX_LAUNCH_CANDIDATES];
+
+   // for each size class
+   bool tuned[LAUNCH_SIZE_CLASSES];
+   launch_shape best[LAUNCH_SIZE_CLASSES];
+   double best_ns[LAUNCH_SIZE_CLASSES];		// kernel time per function of the best shape
+   int started[LAUNCH_SIZE_CLASSES];		// trial launches started
+   int reported[LAUNCH_SIZE_CLASSES];		// trial launches timed
+   double trial_ms[LAUNCH_SIZE_CLASSES][MAX_LAUNCH_CANDIDATES];
+   double trial_funcs[LAUNCH_SIZE_CLASSES][MAX_LAUNCH_CANDIDATES];
+} tuned_kernel;
+
+// a tuned shape read from or written to the profile file
+typedef struct s_launch_profile {
+   char key[512];
+   int size_class;
+   launch_shape shape;
+   double ns;					// kernel time per function
+} launch_profile;
+
+
+class LaunchTuner {
+
+   public:
+
+   LaunchTuner(const char *profileFileName);		// NULL or "" to not keep the tuned shapes
+   ~LaunchTuner();
+
+   // add a kernel of a device, returns its number for the other calls
+   int addKernel(cl_kernel kernel, cl_device_id device, const char *kernelName, bool tune);
+
+   // shape to launch count functions with, *trial is set if it is a candidate
+   // being tried (report its kernel time with report())
+   launch_shape getShape(int k, int count, bool *trial);
+
+   // shape of the launches that are not tuned
+   launch_shape getDefaultShape(int k) { return kernels[k].defaultShape; }
+
+   // number of trial launches still to start for launches of count functions
+   int trialsLeft(int k, int count);
+
+   // report the profiled kernel time of a trial launch of funcs functions made with
+   // the shape getShape(k, count) returned
+   void report(int k, int count, launch_shape shape, int funcs, double ms);
+
+   // write the tuned shapes to the profile file if any were added
+   void save();
+
+   // global work size of a launch of funcs functions with shape
+   static size_t globalSize(launch_shape shape, int funcs);
+
+   private:
+
+   // The copy constructor and copy assignment operator are kept
+   // private so that they are not used.
+   LaunchTuner            (const LaunchTuner& source) { };
+   LaunchTuner& operator= (const LaunchTuner& source) { return *this; };
+
+   char profileFileName[512];
+   bool dirty;					// tuned shapes not saved yet
+
+   tuned_kernel *kernels;
+   int num_kernels;
+
+   launch_profile *profiles;	// contents of the profile file (also of other devices)
+   int num_profiles;
+
+   void loadProfiles();
+   void setProfile(const char *key, int size_class, launch_shape shape, double ns);
+};
+
+#endif
@@ -0,0 +1,2104 @@
+#include "lbfgsb_cl.h"
+
+#pragma OPENCL EXTENSION cl_khr_fp64: enable
+
+
+// OpenCL version of the native L-BFGS-B engine (lbfgsb_engine.h), for solving
+// one problem per work-item completely on the device.
+//
+// The algorithm is the one of lbfgsb_engine.h (and so of setulb in lbfgsb.f),
+// operation for operation. The differences are in the mechanics: n and m are
+// run time values, the work arrays of a problem are in global memory (see
+// lbfgsb_cl.h for their layout) and the saved state is a struct that a kernel
+// copies to private memory at the start of a launch and back at the end, so a
+// solve can be spread over any number of launches.
+//
+// A solve kernel of an OpenCL program (see eval_kernel_analytic_solve() in
+// eval_kernel.cl) runs each of its problems like this:
+//
+//    lbfgsb_engine e;
+//    lbfgsb_init(&e, n, m, factr, pgtol, x, f, g, l, u, nbd, work, iwork);
+//    if(start) lbfgsb_start(&e); else e.s = state[slot];
+//
+//    int iterations_left = launch_iterations;
+//    while(lbfgsb_run(&e, max_iterations, &iterations_left))
+//    {
+//       *f = f(x) and g = gradient of f at x
+//       lbfgsb_step(&e);
+//    }
+//
+//    state[slot] = e.s;
+//    if(e.s.task == LBFGSB_CL_NEW_X) atomic_inc(active);	// not finished yet
+
+
+// where lbfgsb_step() picks up again
+#define LBFGSB_RESUME_FG_START 0		// f and g at the starting point are ready
+#define LBFGSB_RESUME_LINE_SEARCH 1		// f and g at a line search trial point are ready
+#define LBFGSB_RESUME_NEW_X 2			// the caller has seen the new iterate
+
+// line search (dcsrch) task
+#define LBFGSB_LS_START 0
+#define LBFGSB_LS_FG 1
+#define LBFGSB_LS_CONVERGED 2
+#define LBFGSB_LS_WARNING 3
+#define LBFGSB_LS_ERROR 4
+
+
+// state of a problem kept between launches
+// (lsave, isave and dsave of mainlb and dcsrch in lbfgsb.f)
+typedef struct s_lbfgsb_state {
+   double theta, fold, tol, dnorm, epsmch, gd, stpmx, sbgnrm, stp, gdold, dtd, xstep;
+   double ginit, gtest, gx, gy, finit, fx, fy, stx, sty, stmin, stmax, width, width1;
+
+   int task;				// LBFGSB_CL_FG, LBFGSB_CL_NEW_X, ... (see lbfgsb_cl.h)
+   int resume;				// LBFGSB_RESUME_...
+   int lsTask;				// LBFGSB_LS_...
+   int prjctd, cnstnd, boxed, updatd, brackt, stage;
+   int nintol, iback, nskip, head, col, itail, iter, iupdat, nint, nfgv, info, ifun, iword, nfree, nact, ileave, nenter;
+} lbfgsb_state;
+
+// the host allocates LBFGSB_CL_STATE_SIZE bytes for each state
+typedef char lbfgsb_state_size_check[(sizeof(lbfgsb_state) <= LBFGSB_CL_STATE_SIZE) ? 1 : -1];
+
+
+// a problem being solved: its state and where its data is
+typedef struct s_lbfgsb_engine {
+   lbfgsb_state s;
+
+   int n;
+   int m;
+   double factr;
+   double pgtol;
+
+   // problem (owned by the caller)
+   __global double *x;
+   __global double *f;
+   __global double *g;
+   __global const double *l;
+   __global const double *u;
+   __global const int *nbd;
+
+   // limited memory matrices, stored column major like in lbfgsb.f
+   __global double *ws;			// ws(n, m): S matrix
+   __global double *wy;			// wy(n, m): Y matrix
+   __global double *sy;			// sy(m, m): S'Y
+   __global double *ss;			// ss(m, m): S'S
+   __global double *wt;			// wt(m, m): Cholesky factor of theta*S'S + L*D^(-1)*L'
+   __global double *wn;			// wn(2m, 2m): factorization of the middle matrix
+   __global double *snd;		// snd(2m, 2m): wn1 in formk
+
+   __global double *z;
+   __global double *r;
+   __global double *d;
+   __global double *t;
+   __global double *wa;
+
+   __global int *index;
+   __global int *iwhere;
+   __global int *indx2;
+} lbfgsb_engine;
+
+
+// ----------------------------------------------------------------------------
+// Linpack / BLAS helpers (column major, leading dimension lda)
+// ----------------------------------------------------------------------------
+
+double lbfgsb_ddot(int n, __global const double *dx, __global const double *dy)
+{
+   double dtemp = 0;
+   for(int i = 0; i < n; i++) dtemp = dtemp + dx[i]*dy[i];
+   return dtemp;
+}
+
+void lbfgsb_daxpy(int n, double da, __global const double *dx, __global double *dy)
+{
+   if(da == 0) return;
+   for(int i = 0; i < n; i++) dy[i] = dy[i] + da*dx[i];
+}
+
+// max and min as used by lbfgsb.f
+double lbfgsb_dmax(double a, double b) { return (a >= b) ? a : b; }
+double lbfgsb_dmin(double a, double b) { return (a <= b) ? a : b; }
+
+
+// sort out the least element of t and put it at t(n) using a heap
+// (positions are 1 based like in lbfgsb.f)
+void lbfgsb_hpsolb(int n, __global double *t, __global int *iorder, int iheap)
+{
+   if(iheap == 0)
+   {
+      // rearrange the elements t(1) to t(n) to form a heap
+      for(int k = 2; k <= n; k++)
+      {
+         double ddum = t[k-1];
+         int indxin = iorder[k-1];
+
+         // add ddum to the heap
+         int i = k;
+         while(i > 1)
+         {
+            int j = i/2;
+            if(!(ddum < t[j-1])) break;
+            t[i-1] = t[j-1];
+            iorder[i-1] = iorder[j-1];
+            i = j;
+         }
+
+         t[i-1] = ddum;
+         iorder[i-1] = indxin;
+      }
+   }
+
+   // assign to 'out' the value of t(1), the least member of the heap,
+   // and rearrange the remaining members to form a heap as
+   // elements 1 to n-1 of t
+   if(n > 1)
+   {
+      int i = 1;
+      double out = t[0];
+      int indxou = iorder[0];
+      double ddum = t[n-1];
+      int indxin = iorder[n-1];
+
+      // restore the heap
+      while(true)
+      {
+         int j = i + i;
+         if(j > n - 1) break;
+         if(t[j] < t[j-1]) j = j + 1;
+         if(!(t[j-1] < ddum)) break;
+         t[i-1] = t[j-1];
+         iorder[i-1] = iorder[j-1];
+         i = j;
+      }
+
+      t[i-1] = ddum;
+      iorder[i-1] = indxin;
+
+      // put the least member in t(n)
+      t[n-1] = out;
+      iorder[n-1] = indxou;
+   }
+}
+
+
+// Cholesky factor the n x n symmetric positive definite matrix a
+// (upper triangle), returns 0 or the order of the leading minor that is not
+// positive definite
+int lbfgsb_dpofa(__global double *a, int lda, int n)
+{
+   for(int j = 0; j < n; j++)
+   {
+      double s = 0;
+
+      for(int k = 0; k < j; k++)
+      {
+         double t = a[k + j*lda] - lbfgsb_ddot(k, a + k*lda, a + j*lda);
+         t = t/a[k + k*lda];
+         a[k + j*lda] = t;
+         s = s + t*t;
+      }
+
+      s = a[j + j*lda] - s;
+      if(s <= 0) return j + 1;
+      a[j + j*lda] = sqrt(s);
+   }
+
+   return 0;
+}
+
+
+// solve t*x=b (job 01) or trans(t)*x=b (job 11) for the upper triangular
+// n x n matrix t, overwriting b. Returns 0 or the (1 based) index of the
+// first zero diagonal element.
+int lbfgsb_dtrsl(__global double *t, int ldt, int n, __global double *b, int job)
+{
+   // check for zero diagonal elements
+   for(int j = 0; j < n; j++)
+   {
+      if(t[j + j*ldt] == 0) return j + 1;
+   }
+
+   if(job == 01)
+   {
+      // solve t*x=b, t upper triangular
+      b[n-1] = b[n-1]/t[(n-1) + (n-1)*ldt];
+
+      for(int j = n - 2; j >= 0; j--)
+      {
+         lbfgsb_daxpy(j + 1, -b[j+1], t + (j+1)*ldt, b);
+         b[j] = b[j]/t[j + j*ldt];
+      }
+   }
+   else
+   {
+      // solve trans(t)*x=b, t upper triangular
+      b[0] = b[0]/t[0];
+
+      for(int j = 1; j < n; j++)
+      {
+         b[j] = b[j] - lbfgsb_ddot(j, t + j*ldt, b);
+         b[j] = b[j]/t[j + j*ldt];
+      }
+   }
+
+   return 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// line search (Minpack-2 dcsrch and dcstep)
+// ----------------------------------------------------------------------------
+
+// compute a safeguarded step for a search procedure and update an interval
+// that contains a step that satisfies a sufficient decrease and a curvature condition
+void lbfgsb_dcstep(double *stx, double *fx, double *dx, double *sty, double *fy, double *dy,
+      double *stp, double fp, double dp, int *brackt, double stpmin, double stpmax)
+{
+   const double p66 = 0.66;
+   const double two = 2.0;
+   const double three = 3.0;
+
+   double gamma, p, q, r, s, stpc, stpf, stpq, theta;
+
+   double sgnd = dp*(*dx/fabs(*dx));
+
+   if(fp > *fx)
+   {
+      // first case: a higher function value. The minimum is bracketed.
+      theta = three*(*fx - fp)/(*stp - *stx) + *dx + dp;
+      s = lbfgsb_dmax(lbfgsb_dmax(fabs(theta), fabs(*dx)), fabs(dp));
+      gamma = s*sqrt((theta/s)*(theta/s) - (*dx/s)*(dp/s));
+      if(*stp < *stx) gamma = -gamma;
+      p = (gamma - *dx) + theta;
+      q = ((gamma - *dx) + gamma) + dp;
+      r = p/q;
+      stpc = *stx + r*(*stp - *stx);
+      stpq = *stx + ((*dx/((*fx - fp)/(*stp - *stx) + *dx))/two)*(*stp - *stx);
+      if(fabs(stpc - *stx) < fabs(stpq - *stx)) stpf = stpc;
+      else stpf = stpc + (stpq - stpc)/two;
+      *brackt = 1;
+   }
+   else if(sgnd < 0)
+   {
+      // second case: a lower function value and derivatives of opposite
+      // sign. The minimum is bracketed.
+      theta = three*(*fx - fp)/(*stp - *stx) + *dx + dp;
+      s = lbfgsb_dmax(lbfgsb_dmax(fabs(theta), fabs(*dx)), fabs(dp));
+      gamma = s*sqrt((theta/s)*(theta/s) - (*dx/s)*(dp/s));
+      if(*stp > *stx) gamma = -gamma;
+      p = (gamma - dp) + theta;
+      q = ((gamma - dp) + gamma) + *dx;
+      r = p/q;
+      stpc = *stp + r*(*stx - *stp);
+      stpq = *stp + (dp/(dp - *dx))*(*stx - *stp);
+      if(fabs(stpc - *stp) > fabs(stpq - *stp)) stpf = stpc;
+      else stpf = stpq;
+      *brackt = 1;
+   }
+   else if(fabs(dp) < fabs(*dx))
+   {
+      // third case: a lower function value, derivatives of the same sign,
+      // and the magnitude of the derivative decreases.
+      theta = three*(*fx - fp)/(*stp - *stx) + *dx + dp;
+      s = lbfgsb_dmax(lbfgsb_dmax(fabs(theta), fabs(*dx)), fabs(dp));
+
+      // the case gamma = 0 only arises if the cubic does not tend
+      // to infinity in the direction of the step
+      gamma = s*sqrt(lbfgsb_dmax(0.0, (theta/s)*(theta/s) - (*dx/s)*(dp/s)));
+      if(*stp > *stx) gamma = -gamma;
+      p = (gamma - dp) + theta;
+      q = (gamma + (*dx - dp)) + gamma;
+      r = p/q;
+      if(r < 0 && gamma != 0) stpc = *stp + r*(*stx - *stp);
+      else if(*stp > *stx) stpc = stpmax;
+      else stpc = stpmin;
+      stpq = *stp + (dp/(dp - *dx))*(*stx - *stp);
+
+      if(*brackt)
+      {
+         // a minimizer has been bracketed. If the cubic step is
+         // closer to stp than the secant step, the cubic step is
+         // taken, otherwise the secant step is taken.
+         if(fabs(stpc - *stp) < fabs(stpq - *stp)) stpf = stpc;
+         else stpf = stpq;
+
+         if(*stp > *stx) stpf = lbfgsb_dmin(*stp + p66*(*sty - *stp), stpf);
+         else stpf = lbfgsb_dmax(*stp + p66*(*sty - *stp), stpf);
+      }
+      else
+      {
+         // a minimizer has not been bracketed. If the cubic step is
+         // farther from stp than the secant step, the cubic step is
+         // taken, otherwise the secant step is taken.
+         if(fabs(stpc - *stp) > fabs(stpq - *stp)) stpf = stpc;
+         else stpf = stpq;
+
+         stpf = lbfgsb_dmin(stpmax, stpf);
+         stpf = lbfgsb_dmax(stpmin, stpf);
+      }
+   }
+   else
+   {
+      // fourth case: a lower function value, derivatives of the same sign,
+      // and the magnitude of the derivative does not decrease. If the
+      // minimum is not bracketed, the step is either stpmin or stpmax,
+      // otherwise the cubic step is taken.
+      if(*brackt)
+      {
+         theta = three*(fp - *fy)/(*sty - *stp) + *dy + dp;
+         s = lbfgsb_dmax(lbfgsb_dmax(fabs(theta), fabs(*dy)), fabs(dp));
+         gamma = s*sqrt((theta/s)*(theta/s) - (*dy/s)*(dp/s));
+         if(*stp > *sty) gamma = -gamma;
+         p = (gamma - dp) + theta;
+         q = ((gamma - dp) + gamma) + *dy;
+         r = p/q;
+         stpc = *stp + r*(*sty - *stp);
+         stpf = stpc;
+      }
+      else if(*stp > *stx) stpf = stpmax;
+      else stpf = stpmin;
+   }
+
+   // update the interval which contains a minimizer
+   if(fp > *fx)
+   {
+      *sty = *stp;
+      *fy = fp;
+      *dy = dp;
+   }
+   else
+   {
+      if(sgnd < 0)
+      {
+         *sty = *stx;
+         *fy = *fx;
+         *dy = *dx;
+      }
+
+      *stx = *stp;
+      *fx = fp;
+      *dx = dp;
+   }
+
+   // compute the new step
+   *stp = stpf;
+}
+
+
+// find a step stp that satisfies a sufficient decrease condition and a
+// curvature condition, using the function value f and derivative g at stp
+void lbfgsb_dcsrch(lbfgsb_state *s, double f, double g, double ftol, double gtol, double xtol, double stpmin, double stpmax)
+{
+   const double p5 = 0.5;
+   const double p66 = 0.66;
+   const double xtrapl = 1.1;
+   const double xtrapu = 4.0;
+
+   if(s->lsTask == LBFGSB_LS_START)
+   {
+      // check the input arguments for errors
+      if((s->stp < stpmin) || (s->stp > stpmax) || (g >= 0) || (ftol < 0) || (gtol < 0) ||
+            (xtol < 0) || (stpmin < 0) || (stpmax < stpmin))
+      {
+         s->lsTask = LBFGSB_LS_ERROR;
+         return;
+      }
+
+      // initialize local variables
+      s->brackt = 0;
+      s->stage = 1;
+      s->finit = f;
+      s->ginit = g;
+      s->gtest = ftol*s->ginit;
+      s->width = stpmax - stpmin;
+      s->width1 = s->width/p5;
+
+      s->stx = 0;
+      s->fx = s->finit;
+      s->gx = s->ginit;
+      s->sty = 0;
+      s->fy = s->finit;
+      s->gy = s->ginit;
+      s->stmin = 0;
+      s->stmax = s->stp + xtrapu*s->stp;
+      s->lsTask = LBFGSB_LS_FG;
+      return;
+   }
+
+   // if psi(stp) <= 0 and f'(stp) >= 0 for some step, then the
+   // algorithm enters the second stage
+   double ftest = s->finit + s->stp*s->gtest;
+   if(s->stage == 1 && f <= ftest && g >= 0) s->stage = 2;
+
+   // test for warnings
+   bool warning = false;
+   if(s->brackt && (s->stp <= s->stmin || s->stp >= s->stmax)) warning = true;
+   if(s->brackt && s->stmax - s->stmin <= xtol*s->stmax) warning = true;
+   if(s->stp == stpmax && f <= ftest && g <= s->gtest) warning = true;
+   if(s->stp == stpmin && (f > ftest || g >= s->gtest)) warning = true;
+   if(s->stp == s->stx) warning = true;
+
+   // test for convergence
+   if(f <= ftest && fabs(g) <= gtol*(-s->ginit))
+   {
+      s->lsTask = LBFGSB_LS_CONVERGED;
+      return;
+   }
+
+   if(warning)
+   {
+      s->lsTask = LBFGSB_LS_WARNING;
+      return;
+   }
+
+   // a modified function is used to predict the step during the
+   // first stage if a lower function value has been obtained but
+   // the decrease is not sufficient
+   if(s->stage == 1 && f <= s->fx && f > ftest)
+   {
+      // define the modified function and derivative values
+      double fm = f - s->stp*s->gtest;
+      double fxm = s->fx - s->stx*s->gtest;
+      double fym = s->fy - s->sty*s->gtest;
+      double gm = g - s->gtest;
+      double gxm = s->gx - s->gtest;
+      double gym = s->gy - s->gtest;
+
+      // call dcstep to update stx, sty, and to compute the new step
+      lbfgsb_dcstep(&s->stx, &fxm, &gxm, &s->sty, &fym, &gym, &s->stp, fm, gm, &s->brackt, s->stmin, s->stmax);
+
+      // reset the function and derivative values for f
+      s->fx = fxm + s->stx*s->gtest;
+      s->fy = fym + s->sty*s->gtest;
+      s->gx = gxm + s->gtest;
+      s->gy = gym + s->gtest;
+   }
+   else
+   {
+      // call dcstep to update stx, sty, and to compute the new step
+      lbfgsb_dcstep(&s->stx, &s->fx, &s->gx, &s->sty, &s->fy, &s->gy, &s->stp, f, g, &s->brackt, s->stmin, s->stmax);
+   }
+
+   // decide if a bisection step is needed
+   if(s->brackt)
+   {
+      if(fabs(s->sty - s->stx) >= p66*s->width1) s->stp = s->stx + p5*(s->sty - s->stx);
+      s->width1 = s->width;
+      s->width = fabs(s->sty - s->stx);
+   }
+
+   // set the minimum and maximum steps allowed for stp
+   if(s->brackt)
+   {
+      s->stmin = lbfgsb_dmin(s->stx, s->sty);
+      s->stmax = lbfgsb_dmax(s->stx, s->sty);
+   }
+   else
+   {
+      s->stmin = s->stp + xtrapl*(s->stp - s->stx);
+      s->stmax = s->stp + xtrapu*(s->stp - s->stx);
+   }
+
+   // force the step to be within the bounds stpmax and stpmin
+   s->stp = lbfgsb_dmax(s->stp, stpmin);
+   s->stp = lbfgsb_dmin(s->stp, stpmax);
+
+   // if further progress is not possible, let stp be the best
+   // point obtained during the search
+   if((s->brackt && (s->stp <= s->stmin || s->stp >= s->stmax)) ||
+         (s->brackt && s->stmax - s->stmin <= xtol*s->stmax)) s->stp = s->stx;
+
+   // obtain another function and derivative
+   s->lsTask = LBFGSB_LS_FG;
+}
+
+
+// ----------------------------------------------------------------------------
+// subroutines of mainlb
+// ----------------------------------------------------------------------------
+
+// initialize iwhere and project the initial x to the feasible set
+void lbfgsb_active(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+
+   s->prjctd = 0;
+   s->cnstnd = 0;
+   s->boxed = 1;
+
+   // project the initial x to the feasible set if necessary
+   for(int i = 0; i < n; i++)
+   {
+      if(e->nbd[i] > 0)
+      {
+         if(e->nbd[i] <= 2 && e->x[i] <= e->l[i])
+         {
+            if(e->x[i] < e->l[i])
+            {
+               s->prjctd = 1;
+               e->x[i] = e->l[i];
+            }
+         }
+         else if(e->nbd[i] >= 2 && e->x[i] >= e->u[i])
+         {
+            if(e->x[i] > e->u[i])
+            {
+               s->prjctd = 1;
+               e->x[i] = e->u[i];
+            }
+         }
+      }
+   }
+
+   // initialize iwhere and assign values to cnstnd and boxed
+   for(int i = 0; i < n; i++)
+   {
+      if(e->nbd[i] != 2) s->boxed = 0;
+
+      if(e->nbd[i] == 0)
+      {
+         // this variable is always free
+         e->iwhere[i] = -1;
+      }
+      else
+      {
+         s->cnstnd = 1;
+
+         if(e->nbd[i] == 2 && e->u[i] - e->l[i] <= 0)
+         {
+            // this variable is always fixed
+            e->iwhere[i] = 3;
+         }
+         else e->iwhere[i] = 0;
+      }
+   }
+}
+
+
+// product of the 2m x 2m middle matrix of the compact L-BFGS formula
+// with the 2col vector v, returns the product in p
+int lbfgsb_bmv(lbfgsb_engine *e, __global double *v, __global double *p)
+{
+   int m = e->m;
+   int col = e->s.col;
+   __global double *sy = e->sy;
+
+   if(col == 0) return 0;
+
+   // PART I: solve [  D^(1/2)      O ] [ p1 ] = [ v1 ]
+   //               [ -L*D^(-1/2)   J ] [ p2 ]   [ v2 ]
+
+   // solve Jp2=v2+LD^(-1)v1
+   p[col] = v[col];
+
+   for(int i = 1; i < col; i++)
+   {
+      int i2 = col + i;
+      double sum = 0;
+
+      for(int k = 0; k < i; k++)
+      {
+         sum = sum + sy[i + k*m]*v[k]/sy[k + k*m];
+      }
+
+      p[i2] = v[i2] + sum;
+   }
+
+   // solve the triangular system
+   int info = lbfgsb_dtrsl(e->wt, m, col, p + col, 11);
+   if(info != 0) return info;
+
+   // PART II: solve [ -D^(1/2)   D^(-1/2)*L'  ] [ p1 ] = [ p1 ]
+   //                [  0         J'           ] [ p2 ]   [ p2 ]
+
+   // solve J^Tp2=p2
+   info = lbfgsb_dtrsl(e->wt, m, col, p + col, 01);
+   if(info != 0) return info;
+
+   // compute p1=-D^(-1/2)(p1-D^(-1/2)L'p2)
+   //           =-D^(-1/2)p1+D^(-1)L'p2
+   for(int i = 0; i < col; i++)
+   {
+      p[i] = -v[i]/sy[i + i*m];
+   }
+
+   for(int i = 0; i < col; i++)
+   {
+      double sum = 0;
+
+      for(int k = i + 1; k < col; k++)
+      {
+         sum = sum + sy[k + i*m]*p[col + k]/sy[i + i*m];
+      }
+
+      p[i] = p[i] + sum;
+   }
+
+   return 0;
+}
+
+
+// compute the generalized Cauchy point z along the projected gradient direction
+int lbfgsb_cauchy(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   int m = e->m;
+   int col = s->col;
+   double theta = s->theta;
+
+   __global double *x = e->x;
+   __global double *g = e->g;
+   __global const double *l = e->l;
+   __global const double *u = e->u;
+   __global const int *nbd = e->nbd;
+   __global int *iwhere = e->iwhere;
+   __global double *d = e->d;
+   __global double *t = e->t;
+   __global double *xcp = e->z;
+   __global int *iorder = e->indx2;
+   __global double *p = e->wa;
+   __global double *c = e->wa + 2*m;
+   __global double *wbp = e->wa + 4*m;
+   __global double *v = e->wa + 6*m;
+
+   // check the status of the variables, reset iwhere(i) if necessary;
+   // compute the Cauchy direction d and the breakpoints t; initialize
+   // the derivative f1 and the vector p = W'd (for theta = 1)
+
+   if(s->sbgnrm <= 0)
+   {
+      // x is a GCP
+      for(int i = 0; i < n; i++) xcp[i] = x[i];
+      return 0;
+   }
+
+   bool bnded = true;
+   int nfree = n + 1;		// position (1 based) of the last free variable in iorder
+   int nbreak = 0;
+   int ibkmin = 0;
+   double bkmin = 0;
+   int col2 = 2*col;
+   double f1 = 0;
+   double tl = 0;
+   double tu = 0;
+
+   // we set p to zero and build it up as we determine d
+   for(int i = 0; i < col2; i++) p[i] = 0;
+
+   // in the following loop we determine for each variable its bound
+   // status and its breakpoint, and update p accordingly.
+   // Smallest breakpoint is identified.
+   for(int i = 0; i < n; i++)
+   {
+      double neggi = -g[i];
+
+      if(iwhere[i] != 3 && iwhere[i] != -1)
+      {
+         // if x(i) is not a constant and has bounds,
+         // compute the difference between x(i) and its bounds
+         if(nbd[i] <= 2) tl = x[i] - l[i];
+         if(nbd[i] >= 2) tu = u[i] - x[i];
+
+         // if a variable is close enough to a bound
+         // we treat it as at bound
+         bool xlower = nbd[i] <= 2 && tl <= 0;
+         bool xupper = nbd[i] >= 2 && tu <= 0;
+
+         // reset iwhere(i)
+         iwhere[i] = 0;
+         if(xlower)
+         {
+            if(neggi <= 0) iwhere[i] = 1;
+         }
+         else if(xupper)
+         {
+            if(neggi >= 0) iwhere[i] = 2;
+         }
+         else
+         {
+            if(fabs(neggi) <= 0) iwhere[i] = -3;
+         }
+      }
+
+      int pointr = s->head;
+
+      if(iwhere[i] != 0 && iwhere[i] != -1)
+      {
+         d[i] = 0;
+      }
+      else
+      {
+         d[i] = neggi;
+         f1 = f1 - neggi*neggi;
+
+         // calculate p := p - W'e_i* (g_i)
+         for(int j = 0; j < col; j++)
+         {
+            p[j] = p[j] + e->wy[i + pointr*n]*neggi;
+            p[col + j] = p[col + j] + e->ws[i + pointr*n]*neggi;
+            pointr = (pointr + 1) % m;
+         }
+
+         if(nbd[i] <= 2 && nbd[i] != 0 && neggi < 0)
+         {
+            // x(i) + d(i) is bounded; compute t(i)
+            nbreak++;
+            iorder[nbreak-1] = i;
+            t[nbreak-1] = tl/(-neggi);
+            if(nbreak == 1 || t[nbreak-1] < bkmin)
+            {
+               bkmin = t[nbreak-1];
+               ibkmin = nbreak;
+            }
+         }
+         else if(nbd[i] >= 2 && neggi > 0)
+         {
+            // x(i) + d(i) is bounded; compute t(i)
+            nbreak++;
+            iorder[nbreak-1] = i;
+            t[nbreak-1] = tu/neggi;
+            if(nbreak == 1 || t[nbreak-1] < bkmin)
+            {
+               bkmin = t[nbreak-1];
+               ibkmin = nbreak;
+            }
+         }
+         else
+         {
+            // x(i) + d(i) is not bounded
+            nfree--;
+            iorder[nfree-1] = i;
+            if(fabs(neggi) > 0) bnded = false;
+         }
+      }
+   }
+
+   // the indices of the nonzero components of d are now stored
+   // in iorder(1),...,iorder(nbreak) and iorder(nfree),...,iorder(n).
+   // The smallest of the nbreak breakpoints is in t(ibkmin)=bkmin.
+
+   if(theta != 1)
+   {
+      // complete the initialization of p for theta not= one
+      for(int j = 0; j < col; j++) p[col + j] = theta*p[col + j];
+   }
+
+   // initialize GCP xcp = x
+   for(int i = 0; i < n; i++) xcp[i] = x[i];
+
+   if(nbreak == 0 && nfree == n + 1)
+   {
+      // is a zero vector, return with the initial xcp as GCP
+      return 0;
+   }
+
+   // initialize c = W'(xcp - x) = 0
+   for(int j = 0; j < col2; j++) c[j] = 0;
+
+   // initialize derivative f2
+   double f2 = -theta*f1;
+   double f2_org = f2;
+
+   if(col > 0)
+   {
+      int info = lbfgsb_bmv(e, p, v);
+      if(info != 0) return info;
+      f2 = f2 - lbfgsb_ddot(col2, v, p);
+   }
+
+   double dtm = -f1/f2;
+   double tsum = 0;
+   s->nint = 1;
+
+   bool reachedLastBreakpoint = false;
+
+   if(nbreak > 0)
+   {
+      int nleft = nbreak;
+      int iter = 1;
+      double tj = 0;
+
+      // the beginning of the loop
+      while(true)
+      {
+         // find the next smallest breakpoint;
+         // compute dt = t(nleft) - t(nleft + 1)
+         double tj0 = tj;
+         int ibp;
+
+         if(iter == 1)
+         {
+            // since we already have the smallest breakpoint we need not do
+            // heapsort yet. Often only one breakpoint is used and the
+            // cost of heapsort is avoided
+            tj = bkmin;
+            ibp = iorder[ibkmin-1];
+         }
+         else
+         {
+            if(iter == 2)
+            {
+               // replace the already used smallest breakpoint with the
+               // breakpoint numbered nbreak > nlast, before heapsort call
+               if(ibkmin != nbreak)
+               {
+                  t[ibkmin-1] = t[nbreak-1];
+                  iorder[ibkmin-1] = iorder[nbreak-1];
+               }
+            }
+
+            // update heap structure of breakpoints
+            // (if iter=2, initialize heap)
+            lbfgsb_hpsolb(nleft, t, iorder, iter-2);
+            tj = t[nleft-1];
+            ibp = iorder[nleft-1];
+         }
+
+         double dt = tj - tj0;
+
+         // if a minimizer is within this interval, locate the GCP and return
+         if(dtm < dt) break;
+
+         // otherwise fix one variable and
+         // reset the corresponding component of d to zero
+         tsum = tsum + dt;
+         nleft--;
+         iter++;
+         double dibp = d[ibp];
+         d[ibp] = 0;
+         double zibp;
+
+         if(dibp > 0)
+         {
+            zibp = u[ibp] - x[ibp];
+            xcp[ibp] = u[ibp];
+            iwhere[ibp] = 2;
+         }
+         else
+         {
+            zibp = l[ibp] - x[ibp];
+            xcp[ibp] = l[ibp];
+            iwhere[ibp] = 1;
+         }
+
+         if(nleft == 0 && nbreak == n)
+         {
+            // all n variables are fixed, return with xcp as GCP
+            dtm = dt;
+            reachedLastBreakpoint = true;
+            break;
+         }
+
+         // update the derivative information
+         s->nint++;
+         double dibp2 = dibp*dibp;
+
+         // update f1 and f2
+         // temporarily set f1 and f2 for col=0
+         f1 = f1 + dt*f2 + dibp2 - theta*dibp*zibp;
+         f2 = f2 - theta*dibp2;
+
+         if(col > 0)
+         {
+            // update c = c + dt*p
+            lbfgsb_daxpy(col2, dt, p, c);
+
+            // choose wbp,
+            // the row of W corresponding to the breakpoint encountered
+            int pointr = s->head;
+            for(int j = 0; j < col; j++)
+            {
+               wbp[j] = e->wy[ibp + pointr*n];
+               wbp[col + j] = theta*e->ws[ibp + pointr*n];
+               pointr = (pointr + 1) % m;
+            }
+
+            // compute (wbp)Mc, (wbp)Mp, and (wbp)M(wbp)'
+            int info = lbfgsb_bmv(e, wbp, v);
+            if(info != 0) return info;
+
+            double wmc = lbfgsb_ddot(col2, c, v);
+            double wmp = lbfgsb_ddot(col2, p, v);
+            double wmw = lbfgsb_ddot(col2, wbp, v);
+
+            // update p = p - dibp*wbp
+            lbfgsb_daxpy(col2, -dibp, wbp, p);
+
+            // complete updating f1 and f2 while col > 0
+            f1 = f1 + dibp*wmc;
+            f2 = f2 + 2.0*dibp*wmp - dibp2*wmw;
+         }
+
+         f2 = lbfgsb_dmax(s->epsmch*f2_org, f2);
+
+         if(nleft > 0)
+         {
+            dtm = -f1/f2;
+            // to repeat the loop for unsearched intervals
+            continue;
+         }
+         else if(bnded)
+         {
+            f1 = 0;
+            f2 = 0;
+            dtm = 0;
+         }
+         else
+         {
+            dtm = -f1/f2;
+         }
+
+         break;
+      }
+   }
+
+   if(!reachedLastBreakpoint)
+   {
+      if(dtm <= 0) dtm = 0;
+      tsum = tsum + dtm;
+
+      // move free variables (i.e., the ones w/o breakpoints) and
+      // the variables whose breakpoints haven't been reached
+      lbfgsb_daxpy(n, tsum, d, xcp);
+   }
+
+   // update c = c + dtm*p = W'(x^c - x)
+   // which will be used in computing r = Z'(B(x^c - x) + g)
+   if(col > 0) lbfgsb_daxpy(col2, dtm, p, c);
+
+   return 0;
+}
+
+
+// compute r=-Z'B(xcp-xk)-Z'g by using wa(2m+1)=W'(xcp-x) from cauchy
+int lbfgsb_cmprlb(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   int m = e->m;
+   int col = s->col;
+
+   if(!s->cnstnd && col > 0)
+   {
+      for(int i = 0; i < n; i++) e->r[i] = -e->g[i];
+   }
+   else
+   {
+      for(int i = 0; i < s->nfree; i++)
+      {
+         int k = e->index[i];
+         e->r[i] = -s->theta*(e->z[k] - e->x[k]) - e->g[k];
+      }
+
+      if(lbfgsb_bmv(e, e->wa + 2*m, e->wa) != 0) return -8;
+
+      int pointr = s->head;
+
+      for(int j = 0; j < col; j++)
+      {
+         double a1 = e->wa[j];
+         double a2 = s->theta*e->wa[col + j];
+
+         for(int i = 0; i < s->nfree; i++)
+         {
+            int k = e->index[i];
+            e->r[i] = e->r[i] + e->wy[k + pointr*n]*a1 + e->ws[k + pointr*n]*a2;
+         }
+
+         pointr = (pointr + 1) % m;
+      }
+   }
+
+   return 0;
+}
+
+
+// form the LEL^T factorization of the indefinite matrix
+//    K = [-D -Y'ZZ'Y/theta     L_a'-R_z'  ]
+//        [L_a -R_z           theta*S'AA'S ]
+// in wn (wn1 = snd holds the inner products kept between calls)
+int lbfgsb_formk(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   int m = e->m;
+   int m2 = 2*m;
+   int col = s->col;
+   int head = s->head;
+   double theta = s->theta;
+
+   __global double *ws = e->ws;
+   __global double *wy = e->wy;
+   __global double *wn = e->wn;
+   __global double *wn1 = e->snd;
+   __global int *ind = e->index;
+   __global int *indx2 = e->indx2;
+   int nsub = s->nfree;
+   int upcl;
+
+   // Form the lower triangular part of
+   //    WN1 = [Y' ZZ'Y   L_a'+R_z']
+   //          [L_a+R_z   S'AA'S   ]
+   // where L_a is the strictly lower triangular part of S'AA'Y
+   //       R_z is the upper triangular part of S'ZZ'Y.
+
+   if(s->updatd)
+   {
+      if(s->iupdat > m)
+      {
+         // shift old part of WN1
+         for(int jy = 0; jy < m - 1; jy++)
+         {
+            int js = m + jy;
+
+            for(int i = 0; i < m - 1 - jy; i++)
+            {
+               wn1[(jy + i) + jy*m2] = wn1[(jy + 1 + i) + (jy + 1)*m2];
+            }
+
+            for(int i = 0; i < m - 1 - jy; i++)
+            {
+               wn1[(js + i) + js*m2] = wn1[(js + 1 + i) + (js + 1)*m2];
+            }
+
+            for(int i = 0; i < m - 1; i++)
+            {
+               wn1[(m + i) + jy*m2] = wn1[(m + 1 + i) + (jy + 1)*m2];
+            }
+         }
+      }
+
+      // put new rows in blocks (1,1), (2,1) and (2,2)
+      int pbegin = 0;
+      int pend = nsub;
+      int dbegin = nsub;
+      int dend = n;
+      int iy = col - 1;
+      int is = m + col - 1;
+      int ipntr = head + col - 1;
+      if(ipntr >= m) ipntr = ipntr - m;
+      int jpntr = head;
+
+      for(int jy = 0; jy < col; jy++)
+      {
+         int js = m + jy;
+         double temp1 = 0;
+         double temp2 = 0;
+         double temp3 = 0;
+
+         // compute element jy of row 'col' of Y'ZZ'Y
+         for(int k = pbegin; k < pend; k++)
+         {
+            int k1 = ind[k];
+            temp1 = temp1 + wy[k1 + ipntr*n]*wy[k1 + jpntr*n];
+         }
+
+         // compute elements jy of row 'col' of L_a and S'AA'S
+         for(int k = dbegin; k < dend; k++)
+         {
+            int k1 = ind[k];
+            temp2 = temp2 + ws[k1 + ipntr*n]*ws[k1 + jpntr*n];
+            temp3 = temp3 + ws[k1 + ipntr*n]*wy[k1 + jpntr*n];
+         }
+
+         wn1[iy + jy*m2] = temp1;
+         wn1[is + js*m2] = temp2;
+         wn1[is + jy*m2] = temp3;
+         jpntr = (jpntr + 1) % m;
+      }
+
+      // put new column in block (2,1)
+      int jy = col - 1;
+      jpntr = head + col - 1;
+      if(jpntr >= m) jpntr = jpntr - m;
+      ipntr = head;
+
+      for(int i = 0; i < col; i++)
+      {
+         int is = m + i;
+         double temp3 = 0;
+
+         // compute element i of column 'col' of R_z
+         for(int k = pbegin; k < pend; k++)
+         {
+            int k1 = ind[k];
+            temp3 = temp3 + ws[k1 + ipntr*n]*wy[k1 + jpntr*n];
+         }
+
+         ipntr = (ipntr + 1) % m;
+         wn1[is + jy*m2] = temp3;
+      }
+
+      upcl = col - 1;
+   }
+   else upcl = col;
+
+   // modify the old parts in blocks (1,1) and (2,2) due to changes
+   // in the set of free variables
+   int ipntr = head;
+
+   for(int iy = 0; iy < upcl; iy++)
+   {
+      int is = m + iy;
+      int jpntr = head;
+
+      for(int jy = 0; jy <= iy; jy++)
+      {
+         int js = m + jy;
+         double temp1 = 0;
+         double temp2 = 0;
+         double temp3 = 0;
+         double temp4 = 0;
+
+         for(int k = 0; k < s->nenter; k++)
+         {
+            int k1 = indx2[k];
+            temp1 = temp1 + wy[k1 + ipntr*n]*wy[k1 + jpntr*n];
+            temp2 = temp2 + ws[k1 + ipntr*n]*ws[k1 + jpntr*n];
+         }
+
+         for(int k = s->ileave; k < n; k++)
+         {
+            int k1 = indx2[k];
+            temp3 = temp3 + wy[k1 + ipntr*n]*wy[k1 + jpntr*n];
+            temp4 = temp4 + ws[k1 + ipntr*n]*ws[k1 + jpntr*n];
+         }
+
+         wn1[iy + jy*m2] = wn1[iy + jy*m2] + temp1 - temp3;
+         wn1[is + js*m2] = wn1[is + js*m2] - temp2 + temp4;
+         jpntr = (jpntr + 1) % m;
+      }
+
+      ipntr = (ipntr + 1) % m;
+   }
+
+   // modify the old parts in block (2,1)
+   ipntr = head;
+
+   for(int is = m; is < m + upcl; is++)
+   {
+      int jpntr = head;
+
+      for(int jy = 0; jy < upcl; jy++)
+      {
+         double temp1 = 0;
+         double temp3 = 0;
+
+         for(int k = 0; k < s->nenter; k++)
+         {
+            int k1 = indx2[k];
+            temp1 = temp1 + ws[k1 + ipntr*n]*wy[k1 + jpntr*n];
+         }
+
+         for(int k = s->ileave; k < n; k++)
+         {
+            int k1 = indx2[k];
+            temp3 = temp3 + ws[k1 + ipntr*n]*wy[k1 + jpntr*n];
+         }
+
+         if(is <= jy + m)
+         {
+            wn1[is + jy*m2] = wn1[is + jy*m2] + temp1 - temp3;
+         }
+         else
+         {
+            wn1[is + jy*m2] = wn1[is + jy*m2] - temp1 + temp3;
+         }
+
+         jpntr = (jpntr + 1) % m;
+      }
+
+      ipntr = (ipntr + 1) % m;
+   }
+
+   // Form the upper triangle of WN = [D+Y' ZZ'Y/theta   -L_a'+R_z' ]
+   //                                 [-L_a +R_z        S'AA'S*theta]
+   for(int iy = 0; iy < col; iy++)
+   {
+      int is = col + iy;
+      int is1 = m + iy;
+
+      for(int jy = 0; jy <= iy; jy++)
+      {
+         int js = col + jy;
+         int js1 = m + jy;
+         wn[jy + iy*m2] = wn1[iy + jy*m2]/theta;
+         wn[js + is*m2] = wn1[is1 + js1*m2]*theta;
+      }
+
+      for(int jy = 0; jy < iy; jy++)
+      {
+         wn[jy + is*m2] = -wn1[is1 + jy*m2];
+      }
+
+      for(int jy = iy; jy < col; jy++)
+      {
+         wn[jy + is*m2] = wn1[is1 + jy*m2];
+      }
+
+      wn[iy + iy*m2] = wn[iy + iy*m2] + e->sy[iy + iy*m];
+   }
+
+   // Form the upper triangle of WN= [  LL'            L^-1(-L_a'+R_z')]
+   //                                [(-L_a +R_z)L'^-1   S'AA'S*theta  ]
+
+   // first Cholesky factor (1,1) block of wn to get LL'
+   // with L' stored in the upper triangle of wn
+   if(lbfgsb_dpofa(wn, m2, col) != 0) return -1;
+
+   // then form L^-1(-L_a'+R_z') in the (1,2) block
+   int col2 = 2*col;
+
+   for(int js = col; js < col2; js++)
+   {
+      lbfgsb_dtrsl(wn, m2, col, wn + js*m2, 11);
+   }
+
+   // Form S'AA'S*theta + (L^-1(-L_a'+R_z'))'L^-1(-L_a'+R_z') in the
+   // upper triangle of (2,2) block of wn
+   for(int is = col; is < col2; is++)
+   {
+      for(int js = is; js < col2; js++)
+      {
+         wn[is + js*m2] = wn[is + js*m2] + lbfgsb_ddot(col, wn + is*m2, wn + js*m2);
+      }
+   }
+
+   // Cholesky factorization of (2,2) block of wn
+   if(lbfgsb_dpofa(wn + col + col*m2, m2, col) != 0) return -2;
+
+   return 0;
+}
+
+
+// form the upper half of T = theta*SS + L*D^(-1)*L' and Cholesky factorize it
+int lbfgsb_formt(lbfgsb_engine *e)
+{
+   int m = e->m;
+   int col = e->s.col;
+   double theta = e->s.theta;
+   __global double *wt = e->wt;
+   __global double *ss = e->ss;
+   __global double *sy = e->sy;
+
+   for(int j = 0; j < col; j++)
+   {
+      wt[0 + j*m] = theta*ss[0 + j*m];
+   }
+
+   for(int i = 1; i < col; i++)
+   {
+      for(int j = i; j < col; j++)
+      {
+         int k1 = (i < j) ? i : j;
+         double ddum = 0;
+
+         for(int k = 0; k < k1; k++)
+         {
+            ddum = ddum + sy[i + k*m]*sy[j + k*m]/sy[k + k*m];
+         }
+
+         wt[i + j*m] = ddum + theta*ss[i + j*m];
+      }
+   }
+
+   // Cholesky factorize T to J*J' with
+   // J' stored in the upper triangle of wt
+   if(lbfgsb_dpofa(wt, m, col) != 0) return -3;
+
+   return 0;
+}
+
+
+// count the entering and leaving variables and find the index set of free
+// and active variables at the GCP
+void lbfgsb_freev(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   __global int *index = e->index;
+   __global int *iwhere = e->iwhere;
+   __global int *indx2 = e->indx2;
+
+   s->nenter = 0;
+   s->ileave = n;
+
+   if(s->iter > 0 && s->cnstnd)
+   {
+      // count the entering and leaving variables
+      for(int i = 0; i < s->nfree; i++)
+      {
+         int k = index[i];
+         if(iwhere[k] > 0)
+         {
+            s->ileave--;
+            indx2[s->ileave] = k;
+         }
+      }
+
+      for(int i = s->nfree; i < n; i++)
+      {
+         int k = index[i];
+         if(iwhere[k] <= 0)
+         {
+            indx2[s->nenter] = k;
+            s->nenter++;
+         }
+      }
+   }
+
+   // find the index set of free and active variables at the GCP
+   s->nfree = 0;
+   int iact = n;
+
+   for(int i = 0; i < n; i++)
+   {
+      if(iwhere[i] <= 0)
+      {
+         index[s->nfree] = i;
+         s->nfree++;
+      }
+      else
+      {
+         iact--;
+         index[iact] = i;
+      }
+   }
+}
+
+
+// update the matrices WS and WY and form the middle matrix in B
+void lbfgsb_matupd(lbfgsb_engine *e, double rr, double dr)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   int m = e->m;
+   __global double *ss = e->ss;
+   __global double *sy = e->sy;
+
+   // set pointers for matrices WS and WY
+   if(s->iupdat <= m)
+   {
+      s->col = s->iupdat;
+      s->itail = (s->head + s->iupdat - 1) % m;
+   }
+   else
+   {
+      s->itail = (s->itail + 1) % m;
+      s->head = (s->head + 1) % m;
+   }
+
+   int col = s->col;
+
+   // update matrices WS and WY
+   for(int i = 0; i < n; i++)
+   {
+      e->ws[i + s->itail*n] = e->d[i];
+      e->wy[i + s->itail*n] = e->r[i];
+   }
+
+   // set theta=yy/ys
+   s->theta = rr/dr;
+
+   // form the middle matrix in B:
+   // update the upper triangle of SS, and the lower triangle of SY
+   if(s->iupdat > m)
+   {
+      // move old information
+      for(int j = 0; j < col - 1; j++)
+      {
+         for(int i = 0; i <= j; i++)
+         {
+            ss[i + j*m] = ss[(i + 1) + (j + 1)*m];
+         }
+
+         for(int i = 0; i < col - 1 - j; i++)
+         {
+            sy[(j + i) + j*m] = sy[(j + 1 + i) + (j + 1)*m];
+         }
+      }
+   }
+
+   // add new information: the last row of SY and the last column of SS
+   int pointr = s->head;
+
+   for(int j = 0; j < col - 1; j++)
+   {
+      sy[(col - 1) + j*m] = lbfgsb_ddot(n, e->d, e->wy + pointr*n);
+      ss[j + (col - 1)*m] = lbfgsb_ddot(n, e->ws + pointr*n, e->d);
+      pointr = (pointr + 1) % m;
+   }
+
+   if(s->stp == 1) ss[(col - 1) + (col - 1)*m] = s->dtd;
+   else ss[(col - 1) + (col - 1)*m] = s->stp*s->stp*s->dtd;
+
+   sy[(col - 1) + (col - 1)*m] = dr;
+}
+
+
+// compute the infinity norm of the projected gradient
+void lbfgsb_projgr(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+
+   s->sbgnrm = 0;
+
+   for(int i = 0; i < e->n; i++)
+   {
+      double gi = e->g[i];
+
+      if(e->nbd[i] != 0)
+      {
+         if(gi < 0)
+         {
+            if(e->nbd[i] >= 2) gi = lbfgsb_dmax(e->x[i] - e->u[i], gi);
+         }
+         else
+         {
+            if(e->nbd[i] <= 2) gi = lbfgsb_dmin(e->x[i] - e->l[i], gi);
+         }
+      }
+
+      s->sbgnrm = lbfgsb_dmax(s->sbgnrm, fabs(gi));
+   }
+}
+
+
+// subspace minimization over the free variables (direct primal method),
+// moves z towards the minimizer of the quadratic model on the subspace
+int lbfgsb_subsm(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   int m = e->m;
+   int m2 = 2*m;
+   int col = s->col;
+   double theta = s->theta;
+   int nsub = s->nfree;
+
+   __global int *ind = e->index;
+   __global double *wv = e->wa;
+   __global double *r = e->r;
+   __global double *z = e->z;
+   __global const double *l = e->l;
+   __global const double *u = e->u;
+   __global const int *nbd = e->nbd;
+
+   if(nsub <= 0) return 0;
+
+   // compute wv = W'Zd
+   int pointr = s->head;
+
+   for(int i = 0; i < col; i++)
+   {
+      double temp1 = 0;
+      double temp2 = 0;
+
+      for(int j = 0; j < nsub; j++)
+      {
+         int k = ind[j];
+         temp1 = temp1 + e->wy[k + pointr*n]*r[j];
+         temp2 = temp2 + e->ws[k + pointr*n]*r[j];
+      }
+
+      wv[i] = temp1;
+      wv[col + i] = theta*temp2;
+      pointr = (pointr + 1) % m;
+   }
+
+   // compute wv:=K^(-1)wv
+   int col2 = 2*col;
+
+   int info = lbfgsb_dtrsl(e->wn, m2, col2, wv, 11);
+   if(info != 0) return info;
+
+   for(int i = 0; i < col; i++) wv[i] = -wv[i];
+
+   info = lbfgsb_dtrsl(e->wn, m2, col2, wv, 01);
+   if(info != 0) return info;
+
+   // compute d = (1/theta)d + (1/theta**2)Z'W wv
+   pointr = s->head;
+
+   for(int jy = 0; jy < col; jy++)
+   {
+      int js = col + jy;
+
+      for(int i = 0; i < nsub; i++)
+      {
+         int k = ind[i];
+         r[i] = r[i] + e->wy[k + pointr*n]*wv[jy]/theta + e->ws[k + pointr*n]*wv[js];
+      }
+
+      pointr = (pointr + 1) % m;
+   }
+
+   for(int i = 0; i < nsub; i++) r[i] = r[i]/theta;
+
+   // backtrack to the feasible region
+   double alpha = 1;
+   double temp1 = alpha;
+   int ibd = 0;
+
+   for(int i = 0; i < nsub; i++)
+   {
+      int k = ind[i];
+      double dk = r[i];
+
+      if(nbd[k] != 0)
+      {
+         bool temp1_updated = false;
+
+         if(dk < 0 && nbd[k] <= 2)
+         {
+            double temp2 = l[k] - z[k];
+            if(temp2 >= 0)
+            {
+               temp1 = 0;
+               temp1_updated = true;
+            }
+            else if(dk*alpha < temp2)
+            {
+               temp1 = temp2/dk;
+               temp1_updated = true;
+            }
+         }
+         else if(dk > 0 && nbd[k] >= 2)
+         {
+            double temp2 = u[k] - z[k];
+            if(temp2 <= 0)
+            {
+               temp1 = 0;
+               temp1_updated = true;
+            }
+            else if(dk*alpha > temp2)
+            {
+               temp1 = temp2/dk;
+               temp1_updated = true;
+            }
+         }
+
+         if(temp1_updated && temp1 < alpha)
+         {
+            alpha = temp1;
+            ibd = i;
+         }
+      }
+   }
+
+   if(alpha < 1)
+   {
+      double dk = r[ibd];
+      int k = ind[ibd];
+
+      if(dk > 0)
+      {
+         z[k] = u[k];
+         r[ibd] = 0;
+      }
+      else if(dk < 0)
+      {
+         z[k] = l[k];
+         r[ibd] = 0;
+      }
+   }
+
+   for(int i = 0; i < nsub; i++)
+   {
+      int k = ind[i];
+      z[k] = z[k] + alpha*r[i];
+   }
+
+   if(alpha < 1) s->iword = 1;
+   else s->iword = 0;
+
+   return 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// mainlb
+// ----------------------------------------------------------------------------
+
+// refresh the lbfgs memory and restart the iteration
+void lbfgsb_reset_memory(lbfgsb_state *s)
+{
+   s->info = 0;
+   s->col = 0;
+   s->head = 0;
+   s->theta = 1;
+   s->iupdat = 0;
+   s->updatd = 0;
+}
+
+
+// compute the search direction d = z - x: generalized Cauchy point and
+// subspace minimization (labels 222 to 555 in mainlb)
+void lbfgsb_search_direction(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+
+   while(true)
+   {
+      bool wrk = false;
+
+      s->iword = -1;
+
+      if(!s->cnstnd && s->col > 0)
+      {
+         // skip the search for the GCP
+         for(int i = 0; i < n; i++) e->z[i] = e->x[i];
+         wrk = s->updatd;
+         s->nint = 0;
+      }
+      else
+      {
+         // compute the Generalized Cauchy Point (GCP)
+         s->info = lbfgsb_cauchy(e);
+         if(s->info != 0)
+         {
+            // singular triangular system detected
+            lbfgsb_reset_memory(s);
+            continue;
+         }
+
+         s->nintol += s->nint;
+
+         // count the entering and leaving variables for iter > 0,
+         // find the index set of free and active variables at the GCP
+         lbfgsb_freev(e);
+         wrk = (s->ileave < n) || (s->nenter > 0) || s->updatd;
+
+         s->nact = n - s->nfree;
+      }
+
+      // subspace minimization
+      if(s->nfree != 0 && s->col != 0)
+      {
+         if(wrk) s->info = lbfgsb_formk(e);
+
+         if(s->info == 0) s->info = lbfgsb_cmprlb(e);
+         if(s->info == 0) s->info = lbfgsb_subsm(e);
+
+         if(s->info != 0)
+         {
+            // nonpositive definiteness in Cholesky factorization or
+            // singular triangular system
+            lbfgsb_reset_memory(s);
+            continue;
+         }
+      }
+
+      break;
+   }
+
+   for(int i = 0; i < n; i++)
+   {
+      e->d[i] = e->z[i] - e->x[i];
+   }
+}
+
+
+// start a line search along d (first part of lnsrlb)
+void lbfgsb_line_search_start(lbfgsb_engine *e)
+{
+   const double big = 1.0e10;
+
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   __global double *d = e->d;
+
+   s->dtd = lbfgsb_ddot(n, d, d);
+   s->dnorm = sqrt(s->dtd);
+
+   // determine the maximum step length
+   s->stpmx = big;
+
+   if(s->cnstnd)
+   {
+      if(s->iter == 0)
+      {
+         s->stpmx = 1;
+      }
+      else
+      {
+         for(int i = 0; i < n; i++)
+         {
+            double a1 = d[i];
+
+            if(e->nbd[i] != 0)
+            {
+               if(a1 < 0 && e->nbd[i] <= 2)
+               {
+                  double a2 = e->l[i] - e->x[i];
+                  if(a2 >= 0) s->stpmx = 0;
+                  else if(a1*s->stpmx < a2) s->stpmx = a2/a1;
+               }
+               else if(a1 > 0 && e->nbd[i] >= 2)
+               {
+                  double a2 = e->u[i] - e->x[i];
+                  if(a2 <= 0) s->stpmx = 0;
+                  else if(a1*s->stpmx > a2) s->stpmx = a2/a1;
+               }
+            }
+         }
+      }
+   }
+
+   if(s->iter == 0 && !s->boxed) s->stp = lbfgsb_dmin(1/s->dnorm, s->stpmx);
+   else s->stp = 1;
+
+   for(int i = 0; i < n; i++)
+   {
+      e->t[i] = e->x[i];
+      e->r[i] = e->g[i];
+   }
+
+   s->fold = *e->f;
+   s->ifun = 0;
+   s->iback = 0;
+   s->lsTask = LBFGSB_LS_START;
+}
+
+
+// run the line search with the current f and g (second part of lnsrlb and
+// the code after it in mainlb). Returns true if the line search failed and the
+// iteration must be restarted, else returns false with the task set for the caller.
+bool lbfgsb_line_search(lbfgsb_engine *e)
+{
+   const double ftol = 1.0e-3;
+   const double gtol = 0.9;
+   const double xtol = 0.1;
+
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+   __global double *x = e->x;
+   __global double *g = e->g;
+
+   bool evaluate = false;
+
+   s->gd = lbfgsb_ddot(n, g, e->d);
+
+   if(s->ifun == 0)
+   {
+      s->gdold = s->gd;
+      if(s->gd >= 0)
+      {
+         // the directional derivative >=0, line search is impossible
+         s->info = -4;
+      }
+   }
+
+   if(s->info == 0)
+   {
+      lbfgsb_dcsrch(s, *e->f, s->gd, ftol, gtol, xtol, 0, s->stpmx);
+
+      s->xstep = s->stp*s->dnorm;
+
+      if(s->lsTask != LBFGSB_LS_CONVERGED && s->lsTask != LBFGSB_LS_WARNING)
+      {
+         evaluate = true;
+         s->ifun++;
+         s->nfgv++;
+         s->iback = s->ifun - 1;
+
+         if(s->stp == 1)
+         {
+            for(int i = 0; i < n; i++) x[i] = e->z[i];
+         }
+         else
+         {
+            for(int i = 0; i < n; i++) x[i] = s->stp*e->d[i] + e->t[i];
+         }
+      }
+   }
+
+   if(s->info != 0 || s->iback >= 20)
+   {
+      // restore the previous iterate
+      for(int i = 0; i < n; i++)
+      {
+         x[i] = e->t[i];
+         g[i] = e->r[i];
+      }
+
+      *e->f = s->fold;
+
+      if(s->col == 0)
+      {
+         // abnormal termination
+         if(s->info == 0)
+         {
+            s->info = -9;
+
+            // restore the actual number of f and g evaluations etc.
+            s->nfgv--;
+            s->ifun--;
+            s->iback--;
+         }
+
+         s->iter++;
+         s->task = LBFGSB_CL_ABNORMAL;
+         return false;
+      }
+
+      // refresh the lbfgs memory and restart the iteration
+      if(s->info == 0) s->nfgv--;
+      lbfgsb_reset_memory(s);
+      return true;
+   }
+
+   if(evaluate)
+   {
+      // return to the driver for calculating f and g
+      s->resume = LBFGSB_RESUME_LINE_SEARCH;
+      s->task = LBFGSB_CL_FG;
+      return false;
+   }
+
+   // calculate and print out the quantities related to the new X
+   s->iter++;
+
+   // compute the infinity norm of the projected (-)gradient
+   lbfgsb_projgr(e);
+
+   s->resume = LBFGSB_RESUME_NEW_X;
+   s->task = LBFGSB_CL_NEW_X;
+   return false;
+}
+
+
+// ----------------------------------------------------------------------------
+// interface
+// ----------------------------------------------------------------------------
+
+// point the engine at the problem with n variables and m corrections whose x, f
+// and gradient are at x, f and g and whose workspaces are work (LBFGSB_CL_WORK_SIZE(n, m)
+// doubles) and iwork (LBFGSB_CL_IWORK_SIZE(n) ints). l, u and nbd are the bounds
+// and bound types, like for setulb. The state e->s is not touched, call
+// lbfgsb_start() or copy a saved state into it.
+void lbfgsb_init(lbfgsb_engine *e, int n, int m, double factr, double pgtol,
+      __global double *x, __global double *f, __global double *g,
+      __global const double *l, __global const double *u, __global const int *nbd,
+      __global double *work, __global int *iwork)
+{
+   e->n = n;
+   e->m = m;
+   e->factr = factr;
+   e->pgtol = pgtol;
+
+   e->x = x;
+   e->f = f;
+   e->g = g;
+   e->l = l;
+   e->u = u;
+   e->nbd = nbd;
+
+   e->ws = work;
+   e->wy = e->ws + n*m;
+   e->sy = e->wy + n*m;
+   e->ss = e->sy + m*m;
+   e->wt = e->ss + m*m;
+   e->wn = e->wt + m*m;
+   e->snd = e->wn + 4*m*m;
+   e->z = e->snd + 4*m*m;
+   e->r = e->z + n;
+   e->d = e->r + n;
+   e->t = e->d + n;
+   e->wa = e->t + n;
+
+   e->index = iwork;
+   e->iwhere = e->index + n;
+   e->indx2 = e->iwhere + n;
+}
+
+
+// start a new optimization from x (task 'START'), sets the task to
+// LBFGSB_CL_FG (evaluate at the projected starting point) or LBFGSB_CL_ERROR
+void lbfgsb_start(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+
+   // the work arrays start out zeroed like those of the native engine
+   for(int i = 0; i < LBFGSB_CL_WORK_SIZE(n, e->m); i++) e->ws[i] = 0;
+   for(int i = 0; i < LBFGSB_CL_IWORK_SIZE(n); i++) e->index[i] = 0;
+
+   s->epsmch = 2.220446049250313e-16;	// dpmeps() for IEEE double precision
+
+   s->fold = 0;
+   s->dnorm = 0;
+   s->gd = 0;
+   s->sbgnrm = 0;
+   s->stp = 0;
+   s->stpmx = 0;
+   s->gdold = 0;
+   s->dtd = 0;
+   s->xstep = 0;
+
+   s->col = 0;
+   s->head = 0;
+   s->theta = 1;
+   s->iupdat = 0;
+   s->updatd = 0;
+   s->iback = 0;
+   s->itail = 0;
+   s->ifun = 0;
+   s->iword = 0;
+   s->nact = 0;
+   s->ileave = 0;
+   s->nenter = 0;
+
+   s->iter = 0;
+   s->nfgv = 0;
+   s->nint = 0;
+   s->nintol = 0;
+   s->nskip = 0;
+   s->nfree = n;
+
+   s->tol = e->factr*s->epsmch;
+   s->info = 0;
+
+   s->resume = LBFGSB_RESUME_FG_START;
+   s->lsTask = LBFGSB_LS_START;
+   s->task = LBFGSB_CL_ERROR;
+
+   // check the input arguments for errors (errclb)
+   if(e->factr < 0) return;
+
+   for(int i = 0; i < n; i++)
+   {
+      if((e->nbd[i] < 0) || (e->nbd[i] > 3)) return;
+      if((e->nbd[i] == 2) && (e->l[i] > e->u[i])) return;
+   }
+
+   // initialize iwhere and project x onto the feasible set
+   lbfgsb_active(e);
+
+   s->task = LBFGSB_CL_FG;
+}
+
+
+// continue the optimization after the caller evaluated f and g (LBFGSB_CL_FG)
+// or saw the new iterate (LBFGSB_CL_NEW_X), sets the next task
+void lbfgsb_step(lbfgsb_engine *e)
+{
+   lbfgsb_state *s = &e->s;
+   int n = e->n;
+
+   if(s->resume == LBFGSB_RESUME_FG_START)
+   {
+      s->nfgv = 1;
+
+      // the infinity norm of the projected (-)gradient
+      lbfgsb_projgr(e);
+
+      if(s->sbgnrm <= e->pgtol)
+      {
+         s->task = LBFGSB_CL_CONVERGED;
+         return;
+      }
+   }
+   else if(s->resume == LBFGSB_RESUME_LINE_SEARCH)
+   {
+      if(!lbfgsb_line_search(e)) return;
+   }
+   else
+   {
+      // test for termination
+      if(s->sbgnrm <= e->pgtol)
+      {
+         s->task = LBFGSB_CL_CONVERGED;
+         return;
+      }
+
+      double ddum = lbfgsb_dmax(lbfgsb_dmax(fabs(s->fold), fabs(*e->f)), 1.0);
+      if((s->fold - *e->f) <= s->tol*ddum)
+      {
+         if(s->iback >= 10) s->info = -5;
+         s->task = LBFGSB_CL_CONVERGED;
+         return;
+      }
+
+      // compute d = newx - oldx, r = newg - oldg, rr = y'y and dr = y's
+      for(int i = 0; i < n; i++)
+      {
+         e->r[i] = e->g[i] - e->r[i];
+      }
+
+      double rr = lbfgsb_ddot(n, e->r, e->r);
+      double dr;
+
+      if(s->stp == 1)
+      {
+         dr = s->gd - s->gdold;
+         ddum = -s->gdold;
+      }
+      else
+      {
+         dr = (s->gd - s->gdold)*s->stp;
+         for(int i = 0; i < n; i++) e->d[i] = s->stp*e->d[i];
+         ddum = -s->gdold*s->stp;
+      }
+
+      if(dr <= s->epsmch*ddum)
+      {
+         // skip the L-BFGS update
+         s->nskip++;
+         s->updatd = 0;
+      }
+      else
+      {
+         // update the L-BFGS matrix
+         s->updatd = 1;
+         s->iupdat++;
+
+         lbfgsb_matupd(e, rr, dr);
+
+         // form the upper half of T = theta*SS + L*D^(-1)*L' and
+         // factorize it
+         if(lbfgsb_formt(e) != 0) lbfgsb_reset_memory(s);
+      }
+   }
+
+   // compute the next search direction and start the line search along it,
+   // until the line search does not need a restart
+   while(true)
+   {
+      lbfgsb_search_direction(e);
+      lbfgsb_line_search_start(e);
+
+      if(!lbfgsb_line_search(e)) return;
+   }
+}
+
+
+// step through the new iterates until the engine wants f and g at x (returns
+// true) or is finished (returns false). Like SolverExtEval, the solve is stopped
+// (LBFGSB_CL_STOP) at the new iterate of iteration max_iterations. It also
+// returns false, leaving the task at LBFGSB_CL_NEW_X, when *iterations_left
+// new iterates have been passed in this launch.
+bool lbfgsb_run(lbfgsb_engine *e, int max_iterations, int *iterations_left)
+{
+   lbfgsb_state *s = &e->s;
+
+   while(s->task == LBFGSB_CL_NEW_X)
+   {
+      if(s->iter == max_iterations)
+      {
+         s->task = LBFGSB_CL_STOP;
+         return false;
+      }
+
+      if(*iterations_left <= 0) return false;
+      (*iterations_left)--;
+
+      lbfgsb_step(e);
+   }
+
+   return s->task == LBFGSB_CL_FG;
+}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <new>
+
+#include "lbfgsb_engine.h"
+
+// The native engine is instantiated for these problem dimensions and numbers
+// of corrections. Other sizes return NULL from createLbfgsbEngine() and the
+// solver falls back to the Fortran routine.
+//
+// Every instantiation is large, so only the sizes that are used are compiled
+// in: the 5 parameters of the hyperspectral model, with 3 to 10 corrections
+// (the default -m is 6) and the 20 and 30 of the test scripts and bench_lbfgsb.
+
+// the numbers of corrections compiled in for each n, CASE(N, M) is expanded for each of them
+#define LBFGSB_ENGINE_M_LIST(N, CASE) \
+   CASE(N, 3) CASE(N, 4) CASE(N, 5) CASE(N, 6) CASE(N, 7) CASE(N, 8) CASE(N, 9) \
+   CASE(N, 10) CASE(N, 20) CASE(N, 30)
+
+#define LBFGSB_ENGINE_N_LIST(CASE) \
+   CASE(5)
+
+#define LBFGSB_ENGINE_CASE_M(N, M) \
+   case M: \
+      if(mem != NULL) return new (mem) LbfgsbEngine<N, M>(x, f, g, l, u, nbd, factr, pgtol); \
+      return new LbfgsbEngine<N, M>(x, f, g, l, u, nbd, factr, pgtol);
+
+#define LBFGSB_ENGINE_CASE_N(N) \
+   case N: \
+      switch(m) \
+      { \
+      LBFGSB_ENGINE_M_LIST(N, LBFGSB_ENGINE_CASE_M) \
+      default: return NULL; \
+      }
+
+#define LBFGSB_ENGINE_SIZE_M(N, M) \
+   case M: return sizeof(LbfgsbEngine<N, M>);
+
+#define LBFGSB_ENGINE_SIZE_N(N) \
+   case N: \
+      switch(m) \
+      { \
+      LBFGSB_ENGINE_M_LIST(N, LBFGSB_ENGINE_SIZE_M) \
+      default: return 0; \
+      }
+
+
+// returns true if createLbfgsbEngine() supports n variables with m corrections
+bool lbfgsbEngineSupported(int n, int m)
+{
+   return lbfgsbEngineSize(n, m) > 0;
+}
+
+
+// returns the size in bytes of the engine for n variables with m corrections
+// (0 if that size is not compiled in)
+size_t lbfgsbEngineSize(int n, int m)
+{
+   switch(n)
+   {
+   LBFGSB_ENGINE_N_LIST(LBFGSB_ENGINE_SIZE_N)
+   default: return 0;
+   }
+}
+
+
+// create the native engine for an n variable problem using m corrections
+// (in mem if it is not NULL), returns NULL if that size is not compiled in
+LbfgsbEngineBase *createLbfgsbEngine(
+      int n,
+      int m,
+      double *x,
+      double *f,
+      double *g,
+      double *l,
+      double *u,
+      int *nbd,
+      double factr,
+      double pgtol,
+      void *mem)
+{
+   switch(n)
+   {
+   LBFGSB_ENGINE_N_LIST(LBFGSB_ENGINE_CASE_N)
+   default: return NULL;
+   }
+}
@@ -0,0 +1,2149 @@
+#ifndef LBFGSB_ENGINE_H
+#define LBFGSB_ENGINE_H
+
+#include <stddef.h>
+#include <math.h>
+#include <float.h>
+
+// Native C++ version of the L-BFGS-B (version 2.4) routine setulb in lbfgsb.f.
+//
+// The algorithm is the same as the Fortran one, operation for operation, so
+// both give the same iterates. The differences are in the mechanics:
+// the problem dimension N and the number of corrections M are template
+// parameters so all work arrays are fixed size members (no heap work arrays,
+// loops over n and m have compile time bounds), the reverse communication
+// state is an enum instead of 60 character task strings and the CPU timers
+// and print routines are left out.
+
+// Reverse communication tasks. The engine returns lbfgsbFG or lbfgsbNewX when
+// it wants to be called again, any other task means the optimization is over.
+enum LbfgsbTask {
+   lbfgsbFG,				// evaluate f and g at x, then call step()
+   lbfgsbNewX,				// x is a new iterate, call step() to go on (or stop())
+   lbfgsbConverged,			// converged (projected gradient or relative reduction of f)
+   lbfgsbAbnormal,			// the line search could not find a better point
+   lbfgsbError,				// error in the input (n, m, factr, bound types or bounds)
+   lbfgsbStop				// stopped by the caller
+};
+
+// most speculative line search candidates an engine takes (see setCandidates())
+#define LBFGSB_MAX_CANDIDATES 7
+
+
+// Interface to a native L-BFGS-B engine for one problem.
+// x, f and g are owned by the caller and are read and written in place,
+// exactly like the arguments of setulb.
+class LbfgsbEngineBase {
+
+   public:
+
+   virtual ~LbfgsbEngineBase() { }
+
+   virtual LbfgsbTask start() = 0;		// start a new optimization from x (task 'START')
+   virtual LbfgsbTask step() = 0;		// continue after lbfgsbFG or lbfgsbNewX
+   virtual LbfgsbTask stop() = 0;		// stop the optimization (task 'STOP')
+
+   // speculative line search: with the first trial point of every line search the
+   // engine also proposes count (at most LBFGSB_MAX_CANDIDATES) shorter steps along
+   // the search direction and writes them to xc (n values each). The caller evaluates 
+   // them together with the trial point into fc and gc (one value and n values each).
+   // If the trial point does not end the line search, the candidate with the lowest f
+   // that satisfies the same conditions as the line search is taken as the new iterate
+   // instead of evaluating another trial point. Off until it is called.
+   virtual void setCandidates(double *, double *, double *, int) { }
+
+   // number of candidates to evaluate with the current lbfgsbFG (0 if none)
+   virtual int candidates() { return 0; }
+};
+
+
+// Creates the native engine for an n variable problem using m corrections.
+// Returns NULL if that (n, m) combination is not compiled in (see lbfgsb_engine.cpp).
+// If mem is not NULL the engine is constructed in mem (at least
+// lbfgsbEngineSize(n, m) bytes, 16 byte aligned) instead of being allocated
+// with new, destroy it by calling its destructor instead of delete.
+LbfgsbEngineBase *createLbfgsbEngine(
+      int n,
+      int m,
+      double *x,				// array of size n, the current x
+      double *f,				// f(x)
+      double *g,				// array of size n, the gradient of f at x
+      double *l,				// array of size n of lower bounds
+      double *u,				// array of size n of upper bounds
+      int *nbd,					// array of size n of bound types
+      double factr,
+      double pgtol,
+      void *mem = NULL);
+
+// returns true if createLbfgsbEngine() supports n variables with m corrections
+bool lbfgsbEngineSupported(int n, int m);
+
+// returns the size in bytes of the engine for n variables with m corrections
+// (0 if that size is not compiled in)
+size_t lbfgsbEngineSize(int n, int m);
+
+
+template <int N, int M>
+class LbfgsbEngine : public LbfgsbEngineBase {
+
+   public:
+
+   LbfgsbEngine(double *x, double *f, double *g, double *l, double *u, int *nbd, double factr, double pgtol)
+   {
+      this->x = x;
+      this->f = f;
+      this->g = g;
+      this->l = l;
+      this->u = u;
+      this->nbd = nbd;
+      this->factr = factr;
+      this->pgtol = pgtol;
+
+      for(int i = 0; i < N*M; i++) { ws[i] = 0; wy[i] = 0; }
+      for(int i = 0; i < M*M; i++) { sy[i] = 0; ss[i] = 0; wt[i] = 0; }
+      for(int i = 0; i < 4*M*M; i++) { wn[i] = 0; snd[i] = 0; }
+      for(int i = 0; i < 8*M; i++) wa[i] = 0;
+      for(int i = 0; i < N; i++) { z[i] = 0; r[i] = 0; d[i] = 0; t[i] = 0; index[i] = 0; iwhere[i] = 0; indx2[i] = 0; }
+
+      resume = resumeFGStart;
+      lsTask = lsStart;
+
+      xc = NULL;
+      fc = NULL;
+      gc = NULL;
+      candCount = 0;
+      candPending = 0;
+   }
+
+   LbfgsbTask start();
+   LbfgsbTask step();
+   LbfgsbTask stop() { return lbfgsbStop; }
+
+   void setCandidates(double *xc, double *fc, double *gc, int count)
+   {
+      this->xc = xc;
+      this->fc = fc;
+      this->gc = gc;
+      candCount = (count < LBFGSB_MAX_CANDIDATES) ? count : LBFGSB_MAX_CANDIDATES;
+      if(candCount < 0) candCount = 0;
+   }
+
+   int candidates() { return candPending; }
+
+   private:
+
+   // where step() picks up again
+   enum LbfgsbResume {
+      resumeFGStart,		// f and g at the starting point are ready
+      resumeLineSearch,		// f and g at a line search trial point are ready
+      resumeNewX			// the caller has seen the new iterate
+   };
+
+   // line search (dcsrch) task
+   enum LbfgsbLineSearchTask {
+      lsStart,
+      lsFG,
+      lsConverged,
+      lsWarning,
+      lsError
+   };
+
+   // problem (owned by the caller)
+   double *x;
+   double *f;
+   double *g;
+   double *l;
+   double *u;
+   int *nbd;
+   double factr;
+   double pgtol;
+
+   // limited memory matrices, stored column major like in lbfgsb.f
+   double ws[N*M];			// ws(n, m): S matrix
+   double wy[N*M];			// wy(n, m): Y matrix
+   double sy[M*M];			// sy(m, m): S'Y
+   double ss[M*M];			// ss(m, m): S'S
+   double wt[M*M];			// wt(m, m): Cholesky factor of theta*S'S + L*D^(-1)*L'
+   double wn[4*M*M];		// wn(2m, 2m): factorization of the middle matrix
+   double snd[4*M*M];		// snd(2m, 2m): wn1 in formk
+
+   double z[N];
+   double r[N];
+   double d[N];
+   double t[N];
+   double wa[8*M];
+
+   int index[N];
+   int iwhere[N];
+   int indx2[N];
+
+   // mainlb saved state (lsave, isave and dsave in lbfgsb.f)
+   LbfgsbResume resume;
+   bool prjctd, cnstnd, boxed, updatd;
+   int nintol, iback, nskip, head, col, itail, iter, iupdat, nint, nfgv, info, ifun, iword, nfree, nact, ileave, nenter;
+   double theta, fold, tol, dnorm, epsmch, gd, stpmx, sbgnrm, stp, gdold, dtd, xstep;
+
+   // dcsrch saved state
+   LbfgsbLineSearchTask lsTask;
+   bool brackt;
+   int stage;
+   double ginit, gtest, gx, gy, finit, fx, fy, stx, sty, stmin, stmax, width, width1;
+
+   // speculative line search candidates (owned by the caller, see setCandidates())
+   double *xc;
+   double *fc;
+   double *gc;
+   int candCount;							// candidates to propose with each line search
+   int candPending;							// candidates proposed with the current trial point
+   double candStp[LBFGSB_MAX_CANDIDATES];	// and their steps
+
+   void resetMemory();
+   void searchDirection();
+   void lineSearchStart();
+   bool lineSearch(LbfgsbTask *task);
+   void proposeCandidates();
+   bool takeCandidate(int count, double ftol, double gtol);
+   void active();
+   int bmv(double *v, double *p);
+   int cauchy();
+   int cmprlb();
+   int formk();
+   int formt();
+   void freev();
+   void matupd(double rr, double dr);
+   void projgr();
+   int subsm();
+   void dcsrch(double f, double g, double ftol, double gtol, double xtol, double stpmin, double stpmax);
+
+   static void hpsolb(int n, double *t, int *iorder, int iheap);
+   static void dcstep(double &stx, double &fx, double &dx, double &sty, double &fy, double &dy,
+         double &stp, double fp, double dp, bool &brackt, double stpmin, double stpmax);
+   static int dpofa(double *a, int lda, int n);
+   static int dtrsl(double *t, int ldt, int n, double *b, int job);
+
+   static double ddot(int n, const double *dx, const double *dy)
+   {
+      double dtemp = 0;
+      for(int i = 0; i < n; i++) dtemp = dtemp + dx[i]*dy[i];
+      return dtemp;
+   }
+
+   static void daxpy(int n, double da, const double *dx, double *dy)
+   {
+      if(da == 0) return;
+      for(int i = 0; i < n; i++) dy[i] = dy[i] + da*dx[i];
+   }
+
+   // max and min as used by lbfgsb.f
+   static double dmax(double a, double b) { return (a >= b) ? a : b; }
+   static double dmin(double a, double b) { return (a <= b) ? a : b; }
+};
+
+
+// ----------------------------------------------------------------------------
+// mainlb
+// ----------------------------------------------------------------------------
+
+// initialize the solver for a new problem, returns lbfgsbFG (evaluate at the
+// projected starting point) or lbfgsbError
+template <int N, int M>
+LbfgsbTask LbfgsbEngine<N,M>::start()
+{
+   epsmch = DBL_EPSILON;	// dpmeps() for IEEE double precision
+
+   fold = 0;
+   dnorm = 0;
+   gd = 0;
+   sbgnrm = 0;
+   stp = 0;
+   stpmx = 0;
+   gdold = 0;
+   dtd = 0;
+   xstep = 0;
+
+   col = 0;
+   head = 0;
+   theta = 1;
+   iupdat = 0;
+   updatd = false;
+   iback = 0;
+   itail = 0;
+   ifun = 0;
+   iword = 0;
+   nact = 0;
+   ileave = 0;
+   nenter = 0;
+
+   iter = 0;
+   nfgv = 0;
+   nint = 0;
+   nintol = 0;
+   nskip = 0;
+   nfree = N;
+
+   tol = factr*epsmch;
+   info = 0;
+
+   // check the input arguments for errors (errclb)
+   if(factr < 0) return lbfgsbError;
+
+   for(int i = 0; i < N; i++)
+   {
+      if((nbd[i] < 0) || (nbd[i] > 3)) return lbfgsbError;
+      if((nbd[i] == 2) && (l[i] > u[i])) return lbfgsbError;
+   }
+
+   // initialize iwhere and project x onto the feasible set
+   active();
+
+   resume = resumeFGStart;
+   return lbfgsbFG;
+}
+
+
+// continue the optimization after the caller evaluated f and g (lbfgsbFG)
+// or saw the new iterate (lbfgsbNewX)
+template <int N, int M>
+LbfgsbTask LbfgsbEngine<N,M>::step()
+{
+   LbfgsbTask task;
+
+   switch(resume)
+   {
+   case resumeFGStart:
+      nfgv = 1;
+
+      // the infinity norm of the projected (-)gradient
+      projgr();
+
+      if(sbgnrm <= pgtol) return lbfgsbConverged;
+      break;
+
+   case resumeLineSearch:
+      if(!lineSearch(&task)) return task;
+      break;
+
+   case resumeNewX:
+      {
+         // test for termination
+         if(sbgnrm <= pgtol) return lbfgsbConverged;
+
+         double ddum = dmax(dmax(fabs(fold), fabs(*f)), 1.0);
+         if((fold - *f) <= tol*ddum)
+         {
+            if(iback >= 10) info = -5;
+            return lbfgsbConverged;
+         }
+
+         // compute d = newx - oldx, r = newg - oldg, rr = y'y and dr = y's
+         for(int i = 0; i < N; i++)
+         {
+            r[i] = g[i] - r[i];
+         }
+
+         double rr = ddot(N, r, r);
+         double dr;
+
+         if(stp == 1)
+         {
+            dr = gd - gdold;
+            ddum = -gdold;
+         }
+         else
+         {
+            dr = (gd - gdold)*stp;
+            for(int i = 0; i < N; i++) d[i] = stp*d[i];
+            ddum = -gdold*stp;
+         }
+
+         if(dr <= epsmch*ddum)
+         {
+            // skip the L-BFGS update
+            nskip++;
+            updatd = false;
+         }
+         else
+         {
+            // update the L-BFGS matrix
+            updatd = true;
+            iupdat++;
+
+            matupd(rr, dr);
+
+            // form the upper half of T = theta*SS + L*D^(-1)*L' and
+            // factorize it
+            if(formt() != 0) resetMemory();
+         }
+      }
+      break;
+   }
+
+   // compute the next search direction and start the line search along it,
+   // until the line search does not need a restart
+   while(true)
+   {
+      searchDirection();
+      lineSearchStart();
+
+      if(!lineSearch(&task)) return task;
+   }
+}
+
+
+// refresh the lbfgs memory and restart the iteration
+template <int N, int M>
+void LbfgsbEngine<N,M>::resetMemory()
+{
+   info = 0;
+   col = 0;
+   head = 0;
+   theta = 1;
+   iupdat = 0;
+   updatd = false;
+}
+
+
+// compute the search direction d = z - x: generalized Cauchy point and
+// subspace minimization (labels 222 to 555 in mainlb)
+template <int N, int M>
+void LbfgsbEngine<N,M>::searchDirection()
+{
+   while(true)
+   {
+      bool wrk = false;
+
+      iword = -1;
+
+      if(!cnstnd && col > 0)
+      {
+         // skip the search for the GCP
+         for(int i = 0; i < N; i++) z[i] = x[i];
+         wrk = updatd;
+         nint = 0;
+      }
+      else
+      {
+         // compute the Generalized Cauchy Point (GCP)
+         info = cauchy();
+         if(info != 0)
+         {
+            // singular triangular system detected
+            resetMemory();
+            continue;
+         }
+
+         nintol += nint;
+
+         // count the entering and leaving variables for iter > 0,
+         // find the index set of free and active variables at the GCP
+         freev();
+         wrk = (ileave < N) || (nenter > 0) || updatd;
+
+         nact = N - nfree;
+      }
+
+      // subspace minimization
+      if(nfree != 0 && col != 0)
+      {
+         if(wrk) info = formk();
+
+         if(info == 0) info = cmprlb();
+         if(info == 0) info = subsm();
+
+         if(info != 0)
+         {
+            // nonpositive definiteness in Cholesky factorization or
+            // singular triangular system
+            resetMemory();
+            continue;
+         }
+      }
+
+      break;
+   }
+
+   for(int i = 0; i < N; i++)
+   {
+      d[i] = z[i] - x[i];
+   }
+}
+
+
+// start a line search along d (first part of lnsrlb)
+template <int N, int M>
+void LbfgsbEngine<N,M>::lineSearchStart()
+{
+   const double big = 1.0e10;
+
+   dtd = ddot(N, d, d);
+   dnorm = sqrt(dtd);
+
+   // determine the maximum step length
+   stpmx = big;
+
+   if(cnstnd)
+   {
+      if(iter == 0)
+      {
+         stpmx = 1;
+      }
+      else
+      {
+         for(int i = 0; i < N; i++)
+         {
+            double a1 = d[i];
+
+            if(nbd[i] != 0)
+            {
+               if(a1 < 0 && nbd[i] <= 2)
+               {
+                  double a2 = l[i] - x[i];
+                  if(a2 >= 0) stpmx = 0;
+                  else if(a1*stpmx < a2) stpmx = a2/a1;
+               }
+               else if(a1 > 0 && nbd[i] >= 2)
+               {
+                  double a2 = u[i] - x[i];
+                  if(a2 <= 0) stpmx = 0;
+                  else if(a1*stpmx > a2) stpmx = a2/a1;
+               }
+            }
+         }
+      }
+   }
+
+   if(iter == 0 && !boxed) stp = dmin(1/dnorm, stpmx);
+   else stp = 1;
+
+   for(int i = 0; i < N; i++)
+   {
+      t[i] = x[i];
+      r[i] = g[i];
+   }
+
+   fold = *f;
+   ifun = 0;
+   iback = 0;
+   lsTask = lsStart;
+}
+
+
+// run the line search with the current f and g (second part of lnsrlb and
+// the code after it in mainlb). Returns true if the line search failed and the
+// iteration must be restarted, else returns false with the task for the caller.
+template <int N, int M>
+bool LbfgsbEngine<N,M>::lineSearch(LbfgsbTask *task)
+{
+   const double ftol = 1.0e-3;
+   const double gtol = 0.9;
+   const double xtol = 0.1;
+
+   bool evaluate = false;
+
+   // candidates evaluated with the trial point, they are only looked at once
+   int cands = candPending;
+   candPending = 0;
+
+   gd = ddot(N, g, d);
+
+   if(ifun == 0)
+   {
+      gdold = gd;
+      if(gd >= 0)
+      {
+         // the directional derivative >=0, line search is impossible
+         info = -4;
+      }
+   }
+
+   if(info == 0)
+   {
+      dcsrch(*f, gd, ftol, gtol, xtol, 0, stpmx);
+
+      // a candidate that satisfies the conditions ends the line search
+      // instead of the next trial step
+      if(lsTask == lsFG && cands > 0 && takeCandidate(cands, ftol, gtol)) lsTask = lsConverged;
+
+      xstep = stp*dnorm;
+
+      if(lsTask != lsConverged && lsTask != lsWarning)
+      {
+         evaluate = true;
+         ifun++;
+         nfgv++;
+         iback = ifun - 1;
+
+         if(stp == 1)
+         {
+            for(int i = 0; i < N; i++) x[i] = z[i];
+         }
+         else
+         {
+            for(int i = 0; i < N; i++) x[i] = stp*d[i] + t[i];
+         }
+
+         if(ifun == 1 && candCount > 0) proposeCandidates();
+      }
+   }
+
+   if(info != 0 || iback >= 20)
+   {
+      // restore the previous iterate
+      for(int i = 0; i < N; i++)
+      {
+         x[i] = t[i];
+         g[i] = r[i];
+      }
+
+      *f = fold;
+
+      if(col == 0)
+      {
+         // abnormal termination
+         if(info == 0)
+         {
+            info = -9;
+
+            // restore the actual number of f and g evaluations etc.
+            nfgv--;
+            ifun--;
+            iback--;
+         }
+
+         iter++;
+         *task = lbfgsbAbnormal;
+         return false;
+      }
+
+      // refresh the lbfgs memory and restart the iteration
+      if(info == 0) nfgv--;
+      resetMemory();
+      return true;
+   }
+
+   if(evaluate)
+   {
+      // return to the driver for calculating f and g
+      resume = resumeLineSearch;
+      *task = lbfgsbFG;
+      return false;
+   }
+
+   // calculate and print out the quantities related to the new X
+   iter++;
+
+   // compute the infinity norm of the projected (-)gradient
+   projgr();
+
+   resume = resumeNewX;
+   *task = lbfgsbNewX;
+   return false;
+}
+
+
+// propose the speculative candidates of the first trial step stp of a line search:
+// the steps a backtracking search would try next, halving stp each time
+// (x stays feasible as the trial point is and the steps are shorter)
+template <int N, int M>
+void LbfgsbEngine<N,M>::proposeCandidates()
+{
+   double step = stp;
+
+   for(int k = 0; k < candCount; k++)
+   {
+      step = 0.5*step;
+      candStp[k] = step;
+
+      double *xk = xc + k*N;
+      for(int i = 0; i < N; i++) xk[i] = step*d[i] + t[i];
+   }
+
+   candPending = candCount;
+}
+
+
+// take the candidate with the lowest f that satisfies the sufficient decrease and
+// curvature conditions dcsrch tests, as if the line search had converged there.
+// Returns false if none of the count candidates does.
+template <int N, int M>
+bool LbfgsbEngine<N,M>::takeCandidate(int count, double ftol, double gtol)
+{
+   int best = -1;
+
+   for(int k = 0; k < count; k++)
+   {
+      double gdk = ddot(N, gc + k*N, d);
+
+      if(fc[k] <= finit + candStp[k]*ftol*ginit && fabs(gdk) <= gtol*(-ginit))
+      {
+         if(best < 0 || fc[k] < fc[best]) best = k;
+      }
+   }
+
+   if(best < 0) return false;
+
+   stp = candStp[best];
+   *f = fc[best];
+
+   for(int i = 0; i < N; i++)
+   {
+      x[i] = xc[best*N + i];
+      g[i] = gc[best*N + i];
+   }
+
+   gd = ddot(N, g, d);
+
+   // it counts as one more trial of the line search
+   ifun++;
+   nfgv++;
+   iback = ifun - 1;
+
+   return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// subroutines of mainlb
+// ----------------------------------------------------------------------------
+
+// initialize iwhere and project the initial x to the feasible set
+template <int N, int M>
+void LbfgsbEngine<N,M>::active()
+{
+   prjctd = false;
+   cnstnd = false;
+   boxed = true;
+
+   // project the initial x to the feasible set if necessary
+   for(int i = 0; i < N; i++)
+   {
+      if(nbd[i] > 0)
+      {
+         if(nbd[i] <= 2 && x[i] <= l[i])
+         {
+            if(x[i] < l[i])
+            {
+               prjctd = true;
+               x[i] = l[i];
+            }
+         }
+         else if(nbd[i] >= 2 && x[i] >= u[i])
+         {
+            if(x[i] > u[i])
+            {
+               prjctd = true;
+               x[i] = u[i];
+            }
+         }
+      }
+   }
+
+   // initialize iwhere and assign values to cnstnd and boxed
+   for(int i = 0; i < N; i++)
+   {
+      if(nbd[i] != 2) boxed = false;
+
+      if(nbd[i] == 0)
+      {
+         // this variable is always free
+         iwhere[i] = -1;
+      }
+      else
+      {
+         cnstnd = true;
+
+         if(nbd[i] == 2 && u[i] - l[i] <= 0)
+         {
+            // this variable is always fixed
+            iwhere[i] = 3;
+         }
+         else iwhere[i] = 0;
+      }
+   }
+}
+
+
+// product of the 2m x 2m middle matrix of the compact L-BFGS formula
+// with the 2col vector v, returns the product in p
+template <int N, int M>
+int LbfgsbEngine<N,M>::bmv(double *v, double *p)
+{
+   if(col == 0) return 0;
+
+   // PART I: solve [  D^(1/2)      O ] [ p1 ] = [ v1 ]
+   //               [ -L*D^(-1/2)   J ] [ p2 ]   [ v2 ]
+
+   // solve Jp2=v2+LD^(-1)v1
+   p[col] = v[col];
+
+   for(int i = 1; i < col; i++)
+   {
+      int i2 = col + i;
+      double sum = 0;
+
+      for(int k = 0; k < i; k++)
+      {
+         sum = sum + sy[i + k*M]*v[k]/sy[k + k*M];
+      }
+
+      p[i2] = v[i2] + sum;
+   }
+
+   // solve the triangular system
+   int info = dtrsl(wt, M, col, p + col, 11);
+   if(info != 0) return info;
+
+   // PART II: solve [ -D^(1/2)   D^(-1/2)*L'  ] [ p1 ] = [ p1 ]
+   //                [  0         J'           ] [ p2 ]   [ p2 ]
+
+   // solve J^Tp2=p2
+   info = dtrsl(wt, M, col, p + col, 01);
+   if(info != 0) return info;
+
+   // compute p1=-D^(-1/2)(p1-D^(-1/2)L'p2)
+   //           =-D^(-1/2)p1+D^(-1)L'p2
+   for(int i = 0; i < col; i++)
+   {
+      p[i] = -v[i]/sy[i + i*M];
+   }
+
+   for(int i = 0; i < col; i++)
+   {
+      double sum = 0;
+
+      for(int k = i + 1; k < col; k++)
+      {
+         sum = sum + sy[k + i*M]*p[col + k]/sy[i + i*M];
+      }
+
+      p[i] = p[i] + sum;
+   }
+
+   return 0;
+}
+
+
+// compute the generalized Cauchy point z along the projected gradient direction
+template <int N, int M>
+int LbfgsbEngine<N,M>::cauchy()
+{
+   double *xcp = z;
+   int *iorder = indx2;
+   double *p = wa;
+   double *c = wa + 2*M;
+   double *wbp = wa + 4*M;
+   double *v = wa + 6*M;
+
+   // check the status of the variables, reset iwhere(i) if necessary;
+   // compute the Cauchy direction d and the breakpoints t; initialize
+   // the derivative f1 and the vector p = W'd (for theta = 1)
+
+   if(sbgnrm <= 0)
+   {
+      // x is a GCP
+      for(int i = 0; i < N; i++) xcp[i] = x[i];
+      return 0;
+   }
+
+   bool bnded = true;
+   int nfree = N + 1;		// position (1 based) of the last free variable in iorder
+   int nbreak = 0;
+   int ibkmin = 0;
+   double bkmin = 0;
+   int col2 = 2*col;
+   double f1 = 0;
+   double tl = 0;
+   double tu = 0;
+
+   // we set p to zero and build it up as we determine d
+   for(int i = 0; i < col2; i++) p[i] = 0;
+
+   // in the following loop we determine for each variable its bound
+   // status and its breakpoint, and update p accordingly.
+   // Smallest breakpoint is identified.
+   for(int i = 0; i < N; i++)
+   {
+      double neggi = -g[i];
+
+      if(iwhere[i] != 3 && iwhere[i] != -1)
+      {
+         // if x(i) is not a constant and has bounds,
+         // compute the difference between x(i) and its bounds
+         if(nbd[i] <= 2) tl = x[i] - l[i];
+         if(nbd[i] >= 2) tu = u[i] - x[i];
+
+         // if a variable is close enough to a bound
+         // we treat it as at bound
+         bool xlower = nbd[i] <= 2 && tl <= 0;
+         bool xupper = nbd[i] >= 2 && tu <= 0;
+
+         // reset iwhere(i)
+         iwhere[i] = 0;
+         if(xlower)
+         {
+            if(neggi <= 0) iwhere[i] = 1;
+         }
+         else if(xupper)
+         {
+            if(neggi >= 0) iwhere[i] = 2;
+         }
+         else
+         {
+            if(fabs(neggi) <= 0) iwhere[i] = -3;
+         }
+      }
+
+      int pointr = head;
+
+      if(iwhere[i] != 0 && iwhere[i] != -1)
+      {
+         d[i] = 0;
+      }
+      else
+      {
+         d[i] = neggi;
+         f1 = f1 - neggi*neggi;
+
+         // calculate p := p - W'e_i* (g_i)
+         for(int j = 0; j < col; j++)
+         {
+            p[j] = p[j] + wy[i + pointr*N]*neggi;
+            p[col + j] = p[col + j] + ws[i + pointr*N]*neggi;
+            pointr = (pointr + 1) % M;
+         }
+
+         if(nbd[i] <= 2 && nbd[i] != 0 && neggi < 0)
+         {
+            // x(i) + d(i) is bounded; compute t(i)
+            nbreak++;
+            iorder[nbreak-1] = i;
+            t[nbreak-1] = tl/(-neggi);
+            if(nbreak == 1 || t[nbreak-1] < bkmin)
+            {
+               bkmin = t[nbreak-1];
+               ibkmin = nbreak;
+            }
+         }
+         else if(nbd[i] >= 2 && neggi > 0)
+         {
+            // x(i) + d(i) is bounded; compute t(i)
+            nbreak++;
+            iorder[nbreak-1] = i;
+            t[nbreak-1] = tu/neggi;
+            if(nbreak == 1 || t[nbreak-1] < bkmin)
+            {
+               bkmin = t[nbreak-1];
+               ibkmin = nbreak;
+            }
+         }
+         else
+         {
+            // x(i) + d(i) is not bounded
+            nfree--;
+            iorder[nfree-1] = i;
+            if(fabs(neggi) > 0) bnded = false;
+         }
+      }
+   }
+
+   // the indices of the nonzero components of d are now stored
+   // in iorder(1),...,iorder(nbreak) and iorder(nfree),...,iorder(n).
+   // The smallest of the nbreak breakpoints is in t(ibkmin)=bkmin.
+
+   if(theta != 1)
+   {
+      // complete the initialization of p for theta not= one
+      for(int j = 0; j < col; j++) p[col + j] = theta*p[col + j];
+   }
+
+   // initialize GCP xcp = x
+   for(int i = 0; i < N; i++) xcp[i] = x[i];
+
+   if(nbreak == 0 && nfree == N + 1)
+   {
+      // is a zero vector, return with the initial xcp as GCP
+      return 0;
+   }
+
+   // initialize c = W'(xcp - x) = 0
+   for(int j = 0; j < col2; j++) c[j] = 0;
+
+   // initialize derivative f2
+   double f2 = -theta*f1;
+   double f2_org = f2;
+
+   if(col > 0)
+   {
+      int info = bmv(p, v);
+      if(info != 0) return info;
+      f2 = f2 - ddot(col2, v, p);
+   }
+
+   double dtm = -f1/f2;
+   double tsum = 0;
+   nint = 1;
+
+   bool reachedLastBreakpoint = false;
+
+   if(nbreak > 0)
+   {
+      int nleft = nbreak;
+      int iter = 1;
+      double tj = 0;
+
+      // the beginning of the loop
+      while(true)
+      {
+         // find the next smallest breakpoint;
+         // compute dt = t(nleft) - t(nleft + 1)
+         double tj0 = tj;
+         int ibp;
+
+         if(iter == 1)
+         {
+            // since we already have the smallest breakpoint we need not do
+            // heapsort yet. Often only one breakpoint is used and the
+            // cost of heapsort is avoided
+            tj = bkmin;
+            ibp = iorder[ibkmin-1];
+         }
+         else
+         {
+            if(iter == 2)
+            {
+               // replace the already used smallest breakpoint with the
+               // breakpoint numbered nbreak > nlast, before heapsort call
+               if(ibkmin != nbreak)
+               {
+                  t[ibkmin-1] = t[nbreak-1];
+                  iorder[ibkmin-1] = iorder[nbreak-1];
+               }
+            }
+
+            // update heap structure of breakpoints
+            // (if iter=2, initialize heap)
+            hpsolb(nleft, t, iorder, iter-2);
+            tj = t[nleft-1];
+            ibp = iorder[nleft-1];
+         }
+
+         double dt = tj - tj0;
+
+         // if a minimizer is within this interval, locate the GCP and return
+         if(dtm < dt) break;
+
+         // otherwise fix one variable and
+         // reset the corresponding component of d to zero
+         tsum = tsum + dt;
+         nleft--;
+         iter++;
+         double dibp = d[ibp];
+         d[ibp] = 0;
+         double zibp;
+
+         if(dibp > 0)
+         {
+            zibp = u[ibp] - x[ibp];
+            xcp[ibp] = u[ibp];
+            iwhere[ibp] = 2;
+         }
+         else
+         {
+            zibp = l[ibp] - x[ibp];
+            xcp[ibp] = l[ibp];
+            iwhere[ibp] = 1;
+         }
+
+         if(nleft == 0 && nbreak == N)
+         {
+            // all n variables are fixed, return with xcp as GCP
+            dtm = dt;
+            reachedLastBreakpoint = true;
+            break;
+         }
+
+         // update the derivative information
+         nint++;
+         double dibp2 = dibp*dibp;
+
+         // update f1 and f2
+         // temporarily set f1 and f2 for col=0
+         f1 = f1 + dt*f2 + dibp2 - theta*dibp*zibp;
+         f2 = f2 - theta*dibp2;
+
+         if(col > 0)
+         {
+            // update c = c + dt*p
+            daxpy(col2, dt, p, c);
+
+            // choose wbp,
+            // the row of W corresponding to the breakpoint encountered
+            int pointr = head;
+            for(int j = 0; j < col; j++)
+            {
+               wbp[j] = wy[ibp + pointr*N];
+               wbp[col + j] = theta*ws[ibp + pointr*N];
+               pointr = (pointr + 1) % M;
+            }
+
+            // compute (wbp)Mc, (wbp)Mp, and (wbp)M(wbp)'
+            int info = bmv(wbp, v);
+            if(info != 0) return info;
+
+            double wmc = ddot(col2, c, v);
+            double wmp = ddot(col2, p, v);
+            double wmw = ddot(col2, wbp, v);
+
+            // update p = p - dibp*wbp
+            daxpy(col2, -dibp, wbp, p);
+
+            // complete updating f1 and f2 while col > 0
+            f1 = f1 + dibp*wmc;
+            f2 = f2 + 2.0*dibp*wmp - dibp2*wmw;
+         }
+
+         f2 = dmax(epsmch*f2_org, f2);
+
+         if(nleft > 0)
+         {
+            dtm = -f1/f2;
+            // to repeat the loop for unsearched intervals
+            continue;
+         }
+         else if(bnded)
+         {
+            f1 = 0;
+            f2 = 0;
+            dtm = 0;
+         }
+         else
+         {
+            dtm = -f1/f2;
+         }
+
+         break;
+      }
+   }
+
+   if(!reachedLastBreakpoint)
+   {
+      if(dtm <= 0) dtm = 0;
+      tsum = tsum + dtm;
+
+      // move free variables (i.e., the ones w/o breakpoints) and
+      // the variables whose breakpoints haven't been reached
+      daxpy(N, tsum, d, xcp);
+   }
+
+   // update c = c + dtm*p = W'(x^c - x)
+   // which will be used in computing r = Z'(B(x^c - x) + g)
+   if(col > 0) daxpy(col2, dtm, p, c);
+
+   return 0;
+}
+
+
+// compute r=-Z'B(xcp-xk)-Z'g by using wa(2m+1)=W'(xcp-x) from cauchy
+template <int N, int M>
+int LbfgsbEngine<N,M>::cmprlb()
+{
+   if(!cnstnd && col > 0)
+   {
+      for(int i = 0; i < N; i++) r[i] = -g[i];
+   }
+   else
+   {
+      for(int i = 0; i < nfree; i++)
+      {
+         int k = index[i];
+         r[i] = -theta*(z[k] - x[k]) - g[k];
+      }
+
+      if(bmv(wa + 2*M, wa) != 0) return -8;
+
+      int pointr = head;
+
+      for(int j = 0; j < col; j++)
+      {
+         double a1 = wa[j];
+         double a2 = theta*wa[col + j];
+
+         for(int i = 0; i < nfree; i++)
+         {
+            int k = index[i];
+            r[i] = r[i] + wy[k + pointr*N]*a1 + ws[k + pointr*N]*a2;
+         }
+
+         pointr = (pointr + 1) % M;
+      }
+   }
+
+   return 0;
+}
+
+
+// form the LEL^T factorization of the indefinite matrix
+//    K = [-D -Y'ZZ'Y/theta     L_a'-R_z'  ]
+//        [L_a -R_z           theta*S'AA'S ]
+// in wn (wn1 = snd holds the inner products kept between calls)
+template <int N, int M>
+int LbfgsbEngine<N,M>::formk()
+{
+   const int m2 = 2*M;
+   double *wn1 = snd;
+   int *ind = index;
+   int nsub = nfree;
+   int upcl;
+
+   // Form the lower triangular part of
+   //    WN1 = [Y' ZZ'Y   L_a'+R_z']
+   //          [L_a+R_z   S'AA'S   ]
+   // where L_a is the strictly lower triangular part of S'AA'Y
+   //       R_z is the upper triangular part of S'ZZ'Y.
+
+   if(updatd)
+   {
+      if(iupdat > M)
+      {
+         // shift old part of WN1
+         for(int jy = 0; jy < M - 1; jy++)
+         {
+            int js = M + jy;
+
+            for(int i = 0; i < M - 1 - jy; i++)
+            {
+               wn1[(jy + i) + jy*m2] = wn1[(jy + 1 + i) + (jy + 1)*m2];
+            }
+
+            for(int i = 0; i < M - 1 - jy; i++)
+            {
+               wn1[(js + i) + js*m2] = wn1[(js + 1 + i) + (js + 1)*m2];
+            }
+
+            for(int i = 0; i < M - 1; i++)
+            {
+               wn1[(M + i) + jy*m2] = wn1[(M + 1 + i) + (jy + 1)*m2];
+            }
+         }
+      }
+
+      // put new rows in blocks (1,1), (2,1) and (2,2)
+      int pbegin = 0;
+      int pend = nsub;
+      int dbegin = nsub;
+      int dend = N;
+      int iy = col - 1;
+      int is = M + col - 1;
+      int ipntr = head + col - 1;
+      if(ipntr >= M) ipntr = ipntr - M;
+      int jpntr = head;
+
+      for(int jy = 0; jy < col; jy++)
+      {
+         int js = M + jy;
+         double temp1 = 0;
+         double temp2 = 0;
+         double temp3 = 0;
+
+         // compute element jy of row 'col' of Y'ZZ'Y
+         for(int k = pbegin; k < pend; k++)
+         {
+            int k1 = ind[k];
+            temp1 = temp1 + wy[k1 + ipntr*N]*wy[k1 + jpntr*N];
+         }
+
+         // compute elements jy of row 'col' of L_a and S'AA'S
+         for(int k = dbegin; k < dend; k++)
+         {
+            int k1 = ind[k];
+            temp2 = temp2 + ws[k1 + ipntr*N]*ws[k1 + jpntr*N];
+            temp3 = temp3 + ws[k1 + ipntr*N]*wy[k1 + jpntr*N];
+         }
+
+         wn1[iy + jy*m2] = temp1;
+         wn1[is + js*m2] = temp2;
+         wn1[is + jy*m2] = temp3;
+         jpntr = (jpntr + 1) % M;
+      }
+
+      // put new column in block (2,1)
+      int jy = col - 1;
+      jpntr = head + col - 1;
+      if(jpntr >= M) jpntr = jpntr - M;
+      ipntr = head;
+
+      for(int i = 0; i < col; i++)
+      {
+         int is = M + i;
+         double temp3 = 0;
+
+         // compute element i of column 'col' of R_z
+         for(int k = pbegin; k < pend; k++)
+         {
+            int k1 = ind[k];
+            temp3 = temp3 + ws[k1 + ipntr*N]*wy[k1 + jpntr*N];
+         }
+
+         ipntr = (ipntr + 1) % M;
+         wn1[is + jy*m2] = temp3;
+      }
+
+      upcl = col - 1;
+   }
+   else upcl = col;
+
+   // modify the old parts in blocks (1,1) and (2,2) due to changes
+   // in the set of free variables
+   int ipntr = head;
+
+   for(int iy = 0; iy < upcl; iy++)
+   {
+      int is = M + iy;
+      int jpntr = head;
+
+      for(int jy = 0; jy <= iy; jy++)
+      {
+         int js = M + jy;
+         double temp1 = 0;
+         double temp2 = 0;
+         double temp3 = 0;
+         double temp4 = 0;
+
+         for(int k = 0; k < nenter; k++)
+         {
+            int k1 = indx2[k];
+            temp1 = temp1 + wy[k1 + ipntr*N]*wy[k1 + jpntr*N];
+            temp2 = temp2 + ws[k1 + ipntr*N]*ws[k1 + jpntr*N];
+         }
+
+         for(int k = ileave; k < N; k++)
+         {
+            int k1 = indx2[k];
+            temp3 = temp3 + wy[k1 + ipntr*N]*wy[k1 + jpntr*N];
+            temp4 = temp4 + ws[k1 + ipntr*N]*ws[k1 + jpntr*N];
+         }
+
+         wn1[iy + jy*m2] = wn1[iy + jy*m2] + temp1 - temp3;
+         wn1[is + js*m2] = wn1[is + js*m2] - temp2 + temp4;
+         jpntr = (jpntr + 1) % M;
+      }
+
+      ipntr = (ipntr + 1) % M;
+   }
+
+   // modify the old parts in block (2,1)
+   ipntr = head;
+
+   for(int is = M; is < M + upcl; is++)
+   {
+      int jpntr = head;
+
+      for(int jy = 0; jy < upcl; jy++)
+      {
+         double temp1 = 0;
+         double temp3 = 0;
+
+         for(int k = 0; k < nenter; k++)
+         {
+            int k1 = indx2[k];
+            temp1 = temp1 + ws[k1 + ipntr*N]*wy[k1 + jpntr*N];
+         }
+
+         for(int k = ileave; k < N; k++)
+         {
+            int k1 = indx2[k];
+            temp3 = temp3 + ws[k1 + ipntr*N]*wy[k1 + jpntr*N];
+         }
+
+         if(is <= jy + M)
+         {
+            wn1[is + jy*m2] = wn1[is + jy*m2] + temp1 - temp3;
+         }
+         else
+         {
+            wn1[is + jy*m2] = wn1[is + jy*m2] - temp1 + temp3;
+         }
+
+         jpntr = (jpntr + 1) % M;
+      }
+
+      ipntr = (ipntr + 1) % M;
+   }
+
+   // Form the upper triangle of WN = [D+Y' ZZ'Y/theta   -L_a'+R_z' ]
+   //                                 [-L_a +R_z        S'AA'S*theta]
+   for(int iy = 0; iy < col; iy++)
+   {
+      int is = col + iy;
+      int is1 = M + iy;
+
+      for(int jy = 0; jy <= iy; jy++)
+      {
+         int js = col + jy;
+         int js1 = M + jy;
+         wn[jy + iy*m2] = wn1[iy + jy*m2]/theta;
+         wn[js + is*m2] = wn1[is1 + js1*m2]*theta;
+      }
+
+      for(int jy = 0; jy < iy; jy++)
+      {
+         wn[jy + is*m2] = -wn1[is1 + jy*m2];
+      }
+
+      for(int jy = iy; jy < col; jy++)
+      {
+         wn[jy + is*m2] = wn1[is1 + jy*m2];
+      }
+
+      wn[iy + iy*m2] = wn[iy + iy*m2] + sy[iy + iy*M];
+   }
+
+   // Form the upper triangle of WN= [  LL'            L^-1(-L_a'+R_z')]
+   //                                [(-L_a +R_z)L'^-1   S'AA'S*theta  ]
+
+   // first Cholesky factor (1,1) block of wn to get LL'
+   // with L' stored in the upper triangle of wn
+   if(dpofa(wn, m2, col) != 0) return -1;
+
+   // then form L^-1(-L_a'+R_z') in the (1,2) block
+   int col2 = 2*col;
+
+   for(int js = col; js < col2; js++)
+   {
+      dtrsl(wn, m2, col, wn + js*m2, 11);
+   }
+
+   // Form S'AA'S*theta + (L^-1(-L_a'+R_z'))'L^-1(-L_a'+R_z') in the
+   // upper triangle of (2,2) block of wn
+   for(int is = col; is < col2; is++)
+   {
+      for(int js = is; js < col2; js++)
+      {
+         wn[is + js*m2] = wn[is + js*m2] + ddot(col, wn + is*m2, wn + js*m2);
+      }
+   }
+
+   // Cholesky factorization of (2,2) block of wn
+   if(dpofa(wn + col + col*m2, m2, col) != 0) return -2;
+
+   return 0;
+}
+
+
+// form the upper half of T = theta*SS + L*D^(-1)*L' and Cholesky factorize it
+template <int N, int M>
+int LbfgsbEngine<N,M>::formt()
+{
+   for(int j = 0; j < col; j++)
+   {
+      wt[0 + j*M] = theta*ss[0 + j*M];
+   }
+
+   for(int i = 1; i < col; i++)
+   {
+      for(int j = i; j < col; j++)
+      {
+         int k1 = (i < j) ? i : j;
+         double ddum = 0;
+
+         for(int k = 0; k < k1; k++)
+         {
+            ddum = ddum + sy[i + k*M]*sy[j + k*M]/sy[k + k*M];
+         }
+
+         wt[i + j*M] = ddum + theta*ss[i + j*M];
+      }
+   }
+
+   // Cholesky factorize T to J*J' with
+   // J' stored in the upper triangle of wt
+   if(dpofa(wt, M, col) != 0) return -3;
+
+   return 0;
+}
+
+
+// count the entering and leaving variables and find the index set of free
+// and active variables at the GCP
+template <int N, int M>
+void LbfgsbEngine<N,M>::freev()
+{
+   nenter = 0;
+   ileave = N;
+
+   if(iter > 0 && cnstnd)
+   {
+      // count the entering and leaving variables
+      for(int i = 0; i < nfree; i++)
+      {
+         int k = index[i];
+         if(iwhere[k] > 0)
+         {
+            ileave--;
+            indx2[ileave] = k;
+         }
+      }
+
+      for(int i = nfree; i < N; i++)
+      {
+         int k = index[i];
+         if(iwhere[k] <= 0)
+         {
+            indx2[nenter] = k;
+            nenter++;
+         }
+      }
+   }
+
+   // find the index set of free and active variables at the GCP
+   nfree = 0;
+   int iact = N;
+
+   for(int i = 0; i < N; i++)
+   {
+      if(iwhere[i] <= 0)
+      {
+         index[nfree] = i;
+         nfree++;
+      }
+      else
+      {
+         iact--;
+         index[iact] = i;
+      }
+   }
+}
+
+
+// update the matrices WS and WY and form the middle matrix in B
+template <int N, int M>
+void LbfgsbEngine<N,M>::matupd(double rr, double dr)
+{
+   // set pointers for matrices WS and WY
+   if(iupdat <= M)
+   {
+      col = iupdat;
+      itail = (head + iupdat - 1) % M;
+   }
+   else
+   {
+      itail = (itail + 1) % M;
+      head = (head + 1) % M;
+   }
+
+   // update matrices WS and WY
+   for(int i = 0; i < N; i++)
+   {
+      ws[i + itail*N] = d[i];
+      wy[i + itail*N] = r[i];
+   }
+
+   // set theta=yy/ys
+   theta = rr/dr;
+
+   // form the middle matrix in B:
+   // update the upper triangle of SS, and the lower triangle of SY
+   if(iupdat > M)
+   {
+      // move old information
+      for(int j = 0; j < col - 1; j++)
+      {
+         for(int i = 0; i <= j; i++)
+         {
+            ss[i + j*M] = ss[(i + 1) + (j + 1)*M];
+         }
+
+         for(int i = 0; i < col - 1 - j; i++)
+         {
+            sy[(j + i) + j*M] = sy[(j + 1 + i) + (j + 1)*M];
+         }
+      }
+   }
+
+   // add new information: the last row of SY and the last column of SS
+   int pointr = head;
+
+   for(int j = 0; j < col - 1; j++)
+   {
+      sy[(col - 1) + j*M] = ddot(N, d, wy + pointr*N);
+      ss[j + (col - 1)*M] = ddot(N, ws + pointr*N, d);
+      pointr = (pointr + 1) % M;
+   }
+
+   if(stp == 1) ss[(col - 1) + (col - 1)*M] = dtd;
+   else ss[(col - 1) + (col - 1)*M] = stp*stp*dtd;
+
+   sy[(col - 1) + (col - 1)*M] = dr;
+}
+
+
+// compute the infinity norm of the projected gradient
+template <int N, int M>
+void LbfgsbEngine<N,M>::projgr()
+{
+   sbgnrm = 0;
+
+   for(int i = 0; i < N; i++)
+   {
+      double gi = g[i];
+
+      if(nbd[i] != 0)
+      {
+         if(gi < 0)
+         {
+            if(nbd[i] >= 2) gi = dmax(x[i] - u[i], gi);
+         }
+         else
+         {
+            if(nbd[i] <= 2) gi = dmin(x[i] - l[i], gi);
+         }
+      }
+
+      sbgnrm = dmax(sbgnrm, fabs(gi));
+   }
+}
+
+
+// subspace minimization over the free variables (direct primal method),
+// moves z towards the minimizer of the quadratic model on the subspace
+template <int N, int M>
+int LbfgsbEngine<N,M>::subsm()
+{
+   const int m2 = 2*M;
+   int nsub = nfree;
+   int *ind = index;
+   double *wv = wa;
+
+   if(nsub <= 0) return 0;
+
+   // compute wv = W'Zd
+   int pointr = head;
+
+   for(int i = 0; i < col; i++)
+   {
+      double temp1 = 0;
+      double temp2 = 0;
+
+      for(int j = 0; j < nsub; j++)
+      {
+         int k = ind[j];
+         temp1 = temp1 + wy[k + pointr*N]*r[j];
+         temp2 = temp2 + ws[k + pointr*N]*r[j];
+      }
+
+      wv[i] = temp1;
+      wv[col + i] = theta*temp2;
+      pointr = (pointr + 1) % M;
+   }
+
+   // compute wv:=K^(-1)wv
+   int col2 = 2*col;
+
+   int info = dtrsl(wn, m2, col2, wv, 11);
+   if(info != 0) return info;
+
+   for(int i = 0; i < col; i++) wv[i] = -wv[i];
+
+   info = dtrsl(wn, m2, col2, wv, 01);
+   if(info != 0) return info;
+
+   // compute d = (1/theta)d + (1/theta**2)Z'W wv
+   pointr = head;
+
+   for(int jy = 0; jy < col; jy++)
+   {
+      int js = col + jy;
+
+      for(int i = 0; i < nsub; i++)
+      {
+         int k = ind[i];
+         r[i] = r[i] + wy[k + pointr*N]*wv[jy]/theta + ws[k + pointr*N]*wv[js];
+      }
+
+      pointr = (pointr + 1) % M;
+   }
+
+   for(int i = 0; i < nsub; i++) r[i] = r[i]/theta;
+
+   // backtrack to the feasible region
+   double alpha = 1;
+   double temp1 = alpha;
+   int ibd = 0;
+
+   for(int i = 0; i < nsub; i++)
+   {
+      int k = ind[i];
+      double dk = r[i];
+
+      if(nbd[k] != 0)
+      {
+         bool temp1_updated = false;
+
+         if(dk < 0 && nbd[k] <= 2)
+         {
+            double temp2 = l[k] - z[k];
+            if(temp2 >= 0)
+            {
+               temp1 = 0;
+               temp1_updated = true;
+            }
+            else if(dk*alpha < temp2)
+            {
+               temp1 = temp2/dk;
+               temp1_updated = true;
+            }
+         }
+         else if(dk > 0 && nbd[k] >= 2)
+         {
+            double temp2 = u[k] - z[k];
+            if(temp2 <= 0)
+            {
+               temp1 = 0;
+               temp1_updated = true;
+            }
+            else if(dk*alpha > temp2)
+            {
+               temp1 = temp2/dk;
+               temp1_updated = true;
+            }
+         }
+
+         if(temp1_updated && temp1 < alpha)
+         {
+            alpha = temp1;
+            ibd = i;
+         }
+      }
+   }
+
+   if(alpha < 1)
+   {
+      double dk = r[ibd];
+      int k = ind[ibd];
+
+      if(dk > 0)
+      {
+         z[k] = u[k];
+         r[ibd] = 0;
+      }
+      else if(dk < 0)
+      {
+         z[k] = l[k];
+         r[ibd] = 0;
+      }
+   }
+
+   for(int i = 0; i < nsub; i++)
+   {
+      int k = ind[i];
+      z[k] = z[k] + alpha*r[i];
+   }
+
+   if(alpha < 1) iword = 1;
+   else iword = 0;
+
+   return 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// line search (Minpack-2 dcsrch and dcstep)
+// ----------------------------------------------------------------------------
+
+// find a step stp that satisfies a sufficient decrease condition and a
+// curvature condition, using the function value f and derivative g at stp
+template <int N, int M>
+void LbfgsbEngine<N,M>::dcsrch(double f, double g, double ftol, double gtol, double xtol, double stpmin, double stpmax)
+{
+   const double p5 = 0.5;
+   const double p66 = 0.66;
+   const double xtrapl = 1.1;
+   const double xtrapu = 4.0;
+
+   if(lsTask == lsStart)
+   {
+      // check the input arguments for errors
+      if((stp < stpmin) || (stp > stpmax) || (g >= 0) || (ftol < 0) || (gtol < 0) ||
+            (xtol < 0) || (stpmin < 0) || (stpmax < stpmin))
+      {
+         lsTask = lsError;
+         return;
+      }
+
+      // initialize local variables
+      brackt = false;
+      stage = 1;
+      finit = f;
+      ginit = g;
+      gtest = ftol*ginit;
+      width = stpmax - stpmin;
+      width1 = width/p5;
+
+      stx = 0;
+      fx = finit;
+      gx = ginit;
+      sty = 0;
+      fy = finit;
+      gy = ginit;
+      stmin = 0;
+      stmax = stp + xtrapu*stp;
+      lsTask = lsFG;
+      return;
+   }
+
+   // if psi(stp) <= 0 and f'(stp) >= 0 for some step, then the
+   // algorithm enters the second stage
+   double ftest = finit + stp*gtest;
+   if(stage == 1 && f <= ftest && g >= 0) stage = 2;
+
+   // test for warnings
+   bool warning = false;
+   if(brackt && (stp <= stmin || stp >= stmax)) warning = true;
+   if(brackt && stmax - stmin <= xtol*stmax) warning = true;
+   if(stp == stpmax && f <= ftest && g <= gtest) warning = true;
+   if(stp == stpmin && (f > ftest || g >= gtest)) warning = true;
+   if(stp == stx) warning = true;
+
+   // test for convergence
+   if(f <= ftest && fabs(g) <= gtol*(-ginit))
+   {
+      lsTask = lsConverged;
+      return;
+   }
+
+   if(warning)
+   {
+      lsTask = lsWarning;
+      return;
+   }
+
+   // a modified function is used to predict the step during the
+   // first stage if a lower function value has been obtained but
+   // the decrease is not sufficient
+   if(stage == 1 && f <= fx && f > ftest)
+   {
+      // define the modified function and derivative values
+      double fm = f - stp*gtest;
+      double fxm = fx - stx*gtest;
+      double fym = fy - sty*gtest;
+      double gm = g - gtest;
+      double gxm = gx - gtest;
+      double gym = gy - gtest;
+
+      // call dcstep to update stx, sty, and to compute the new step
+      dcstep(stx, fxm, gxm, sty, fym, gym, stp, fm, gm, brackt, stmin, stmax);
+
+      // reset the function and derivative values for f
+      fx = fxm + stx*gtest;
+      fy = fym + sty*gtest;
+      gx = gxm + gtest;
+      gy = gym + gtest;
+   }
+   else
+   {
+      // call dcstep to update stx, sty, and to compute the new step
+      dcstep(stx, fx, gx, sty, fy, gy, stp, f, g, brackt, stmin, stmax);
+   }
+
+   // decide if a bisection step is needed
+   if(brackt)
+   {
+      if(fabs(sty - stx) >= p66*width1) stp = stx + p5*(sty - stx);
+      width1 = width;
+      width = fabs(sty - stx);
+   }
+
+   // set the minimum and maximum steps allowed for stp
+   if(brackt)
+   {
+      stmin = dmin(stx, sty);
+      stmax = dmax(stx, sty);
+   }
+   else
+   {
+      stmin = stp + xtrapl*(stp - stx);
+      stmax = stp + xtrapu*(stp - stx);
+   }
+
+   // force the step to be within the bounds stpmax and stpmin
+   stp = dmax(stp, stpmin);
+   stp = dmin(stp, stpmax);
+
+   // if further progress is not possible, let stp be the best
+   // point obtained during the search
+   if((brackt && (stp <= stmin || stp >= stmax)) || (brackt && stmax - stmin <= xtol*stmax)) stp = stx;
+
+   // obtain another function and derivative
+   lsTask = lsFG;
+}
+
+
+// compute a safeguarded step for a search procedure and update an interval
+// that contains a step that satisfies a sufficient decrease and a curvature condition
+template <int N, int M>
+void LbfgsbEngine<N,M>::dcstep(double &stx, double &fx, double &dx, double &sty, double &fy, double &dy,
+      double &stp, double fp, double dp, bool &brackt, double stpmin, double stpmax)
+{
+   const double p66 = 0.66;
+   const double two = 2.0;
+   const double three = 3.0;
+
+   double gamma, p, q, r, s, stpc, stpf, stpq, theta;
+
+   double sgnd = dp*(dx/fabs(dx));
+
+   if(fp > fx)
+   {
+      // first case: a higher function value. The minimum is bracketed.
+      theta = three*(fx - fp)/(stp - stx) + dx + dp;
+      s = dmax(dmax(fabs(theta), fabs(dx)), fabs(dp));
+      gamma = s*sqrt((theta/s)*(theta/s) - (dx/s)*(dp/s));
+      if(stp < stx) gamma = -gamma;
+      p = (gamma - dx) + theta;
+      q = ((gamma - dx) + gamma) + dp;
+      r = p/q;
+      stpc = stx + r*(stp - stx);
+      stpq = stx + ((dx/((fx - fp)/(stp - stx) + dx))/two)*(stp - stx);
+      if(fabs(stpc - stx) < fabs(stpq - stx)) stpf = stpc;
+      else stpf = stpc + (stpq - stpc)/two;
+      brackt = true;
+   }
+   else if(sgnd < 0)
+   {
+      // second case: a lower function value and derivatives of opposite
+      // sign. The minimum is bracketed.
+      theta = three*(fx - fp)/(stp - stx) + dx + dp;
+      s = dmax(dmax(fabs(theta), fabs(dx)), fabs(dp));
+      gamma = s*sqrt((theta/s)*(theta/s) - (dx/s)*(dp/s));
+      if(stp > stx) gamma = -gamma;
+      p = (gamma - dp) + theta;
+      q = ((gamma - dp) + gamma) + dx;
+      r = p/q;
+      stpc = stp + r*(stx - stp);
+      stpq = stp + (dp/(dp - dx))*(stx - stp);
+      if(fabs(stpc - stp) > fabs(stpq - stp)) stpf = stpc;
+      else stpf = stpq;
+      brackt = true;
+   }
+   else if(fabs(dp) < fabs(dx))
+   {
+      // third case: a lower function value, derivatives of the same sign,
+      // and the magnitude of the derivative decreases.
+      theta = three*(fx - fp)/(stp - stx) + dx + dp;
+      s = dmax(dmax(fabs(theta), fabs(dx)), fabs(dp));
+
+      // the case gamma = 0 only arises if the cubic does not tend
+      // to infinity in the direction of the step
+      gamma = s*sqrt(dmax(0.0, (theta/s)*(theta/s) - (dx/s)*(dp/s)));
+      if(stp > stx) gamma = -gamma;
+      p = (gamma - dp) + theta;
+      q = (gamma + (dx - dp)) + gamma;
+      r = p/q;
+      if(r < 0 && gamma != 0) stpc = stp + r*(stx - stp);
+      else if(stp > stx) stpc = stpmax;
+      else stpc = stpmin;
+      stpq = stp + (dp/(dp - dx))*(stx - stp);
+
+      if(brackt)
+      {
+         // a minimizer has been bracketed. If the cubic step is
+         // closer to stp than the secant step, the cubic step is
+         // taken, otherwise the secant step is taken.
+         if(fabs(stpc - stp) < fabs(stpq - stp)) stpf = stpc;
+         else stpf = stpq;
+
+         if(stp > stx) stpf = dmin(stp + p66*(sty - stp), stpf);
+         else stpf = dmax(stp + p66*(sty - stp), stpf);
+      }
+      else
+      {
+         // a minimizer has not been bracketed. If the cubic step is
+         // farther from stp than the secant step, the cubic step is
+         // taken, otherwise the secant step is taken.
+         if(fabs(stpc - stp) > fabs(stpq - stp)) stpf = stpc;
+         else stpf = stpq;
+
+         stpf = dmin(stpmax, stpf);
+         stpf = dmax(stpmin, stpf);
+      }
+   }
+   else
+   {
+      // fourth case: a lower function value, derivatives of the same sign,
+      // and the magnitude of the derivative does not decrease. If the
+      // minimum is not bracketed, the step is either stpmin or stpmax,
+      // otherwise the cubic step is taken.
+      if(brackt)
+      {
+         theta = three*(fp - fy)/(sty - stp) + dy + dp;
+         s = dmax(dmax(fabs(theta), fabs(dy)), fabs(dp));
+         gamma = s*sqrt((theta/s)*(theta/s) - (dy/s)*(dp/s));
+         if(stp > sty) gamma = -gamma;
+         p = (gamma - dp) + theta;
+         q = ((gamma - dp) + gamma) + dy;
+         r = p/q;
+         stpc = stp + r*(sty - stp);
+         stpf = stpc;
+      }
+      else if(stp > stx) stpf = stpmax;
+      else stpf = stpmin;
+   }
+
+   // update the interval which contains a minimizer
+   if(fp > fx)
+   {
+      sty = stp;
+      fy = fp;
+      dy = dp;
+   }
+   else
+   {
+      if(sgnd < 0)
+      {
+         sty = stx;
+         fy = fx;
+         dy = dx;
+      }
+
+      stx = stp;
+      fx = fp;
+      dx = dp;
+   }
+
+   // compute the new step
+   stp = stpf;
+}
+
+
+// ----------------------------------------------------------------------------
+// Linpack / BLAS helpers (column major, leading dimension lda)
+// ----------------------------------------------------------------------------
+
+// sort out the least element of t and put it at t(n) using a heap
+// (positions are 1 based like in lbfgsb.f)
+template <int N, int M>
+void LbfgsbEngine<N,M>::hpsolb(int n, double *t, int *iorder, int iheap)
+{
+   if(iheap == 0)
+   {
+      // rearrange the elements t(1) to t(n) to form a heap
+      for(int k = 2; k <= n; k++)
+      {
+         double ddum = t[k-1];
+         int indxin = iorder[k-1];
+
+         // add ddum to the heap
+         int i = k;
+         while(i > 1)
+         {
+            int j = i/2;
+            if(!(ddum < t[j-1])) break;
+            t[i-1] = t[j-1];
+            iorder[i-1] = iorder[j-1];
+            i = j;
+         }
+
+         t[i-1] = ddum;
+         iorder[i-1] = indxin;
+      }
+   }
+
+   // assign to 'out' the value of t(1), the least member of the heap,
+   // and rearrange the remaining members to form a heap as
+   // elements 1 to n-1 of t
+   if(n > 1)
+   {
+      int i = 1;
+      double out = t[0];
+      int indxou = iorder[0];
+      double ddum = t[n-1];
+      int indxin = iorder[n-1];
+
+      // restore the heap
+      while(true)
+      {
+         int j = i + i;
+         if(j > n - 1) break;
+         if(t[j] < t[j-1]) j = j + 1;
+         if(!(t[j-1] < ddum)) break;
+         t[i-1] = t[j-1];
+         iorder[i-1] = iorder[j-1];
+         i = j;
+      }
+
+      t[i-1] = ddum;
+      iorder[i-1] = indxin;
+
+      // put the least member in t(n)
+      t[n-1] = out;
+      iorder[n-1] = indxou;
+   }
+}
+
+
+// Cholesky factor the n x n symmetric positive definite matrix a
+// (upper triangle), returns 0 or the order of the leading minor that is not
+// positive definite
+template <int N, int M>
+int LbfgsbEngine<N,M>::dpofa(double *a, int lda, int n)
+{
+   for(int j = 0; j < n; j++)
+   {
+      double s = 0;
+
+      for(int k = 0; k < j; k++)
+      {
+         double t = a[k + j*lda] - ddot(k, a + k*lda, a + j*lda);
+         t = t/a[k + k*lda];
+         a[k + j*lda] = t;
+         s = s + t*t;
+      }
+
+      s = a[j + j*lda] - s;
+      if(s <= 0) return j + 1;
+      a[j + j*lda] = sqrt(s);
+   }
+
+   return 0;
+}
+
+
+// solve t*x=b (job 01) or trans(t)*x=b (job 11) for the upper triangular
+// n x n matrix t, overwriting b. Returns 0 or the (1 based) index of the
+// first zero diagonal element.
+template <int N, int M>
+int LbfgsbEngine<N,M>::dtrsl(double *t, int ldt, int n, double *b, int job)
+{
+   // check for zero diagonal elements
+   for(int j = 0; j < n; j++)
+   {
+      if(t[j + j*ldt] == 0) return j + 1;
+   }
+
+   if(job == 01)
+   {
+      // solve t*x=b, t upper triangular
+      b[n-1] = b[n-1]/t[(n-1) + (n-1)*ldt];
+
+      for(int j = n - 2; j >= 0; j--)
+      {
+         daxpy(j + 1, -b[j+1], t + (j+1)*ldt, b);
+         b[j] = b[j]/t[j + j*ldt];
+      }
+   }
+   else
+   {
+      // solve trans(t)*x=b, t upper triangular
+      b[0] = b[0]/t[0];
+
+      for(int j = 1; j < n; j++)
+      {
+         b[j] = b[j] - ddot(j, t + j*ldt, b);
+         b[j] = b[j]/t[j + j*ldt];
+      }
+   }
+
+   return 0;
+}
+
+#endif
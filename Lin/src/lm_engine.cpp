@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <new>
+
+#include "lm_engine.h"
+
+// The Levenberg-Marquardt engine is instantiated for these problem dimensions
+// (the same as the native engine). Other sizes return NULL from createLmEngine()
+// and the solver uses the native engine instead.
+
+#define LM_ENGINE_N_LIST(CASE) \
+   CASE(1) CASE(2) CASE(3) CASE(4) CASE(5) CASE(6) CASE(7) CASE(8)
+
+#define LM_ENGINE_CASE_N(N) \
+   case N: \
+      if(mem != NULL) return new (mem) LmEngine<N>(x, f, g, l, u, nbd, factr, pgtol); \
+      return new LmEngine<N>(x, f, g, l, u, nbd, factr, pgtol);
+
+#define LM_ENGINE_SIZE_N(N) \
+   case N: return sizeof(LmEngine<N>);
+
+
+// returns true if createLmEngine() supports n variables
+bool lmEngineSupported(int n)
+{
+   return lmEngineSize(n) > 0;
+}
+
+
+// returns the size in bytes of the Levenberg-Marquardt engine for n variables
+// (0 if that size is not compiled in)
+size_t lmEngineSize(int n)
+{
+   switch(n)
+   {
+   LM_ENGINE_N_LIST(LM_ENGINE_SIZE_N)
+   default: return 0;
+   }
+}
+
+
+// create the Levenberg-Marquardt engine for an n variable problem (in mem if it is not
+// NULL), returns NULL if that size is not compiled in
+LbfgsbEngineBase *createLmEngine(
+      int n,
+      double *x,
+      double *f,
+      double *g,
+      double *l,
+      double *u,
+      int *nbd,
+      double factr,
+      double pgtol,
+      void *mem)
+{
+   switch(n)
+   {
+   LM_ENGINE_N_LIST(LM_ENGINE_CASE_N)
+   default: return NULL;
+   }
+}
@@ -0,0 +1,413 @@
+#ifndef LM_ENGINE_H
+#define LM_ENGINE_H
+
+#include <stddef.h>
+#include <math.h>
+#include <float.h>
+
+#include "lbfgsb_engine.h"
+
+// Bounded Levenberg-Marquardt engine for least squares objectives.
+//
+// LmEngine<N> minimizes f(x) = sqrt(r(x)'r(x)) over a box, r(x) being a
+// vector of residuals, through the reverse communication interface of the
+// L-BFGS-B engines (LbfgsbEngineBase). Together with f and its gradient g the
+// caller returns the Gauss-Newton matrix A = J'J of the residuals at x after
+// the gradient (g[N] onwards, the upper triangle row by row, LM_ENGINE_JTJ_SIZE(N)
+// values). Then J'r = f*g and the Gauss-Newton model of phi = f^2 = r'r is
+//    phi(x + s) ~ phi + 2*s'J'r + s'As
+// so a step only needs the solution of an N x N system.
+//
+// An iteration:
+// - fixes the variables that are at a bound with the gradient pointing out
+//   of the box,
+// - solves (A + lambda*D) s = -J'r on the free variables (D is the diagonal
+//   of A, Marquardt's scaling) with a Cholesky factorization,
+// - evaluates the projection of x + s onto the box and takes it if phi
+//   decreased by a fraction of the decrease the model predicts, adapting
+//   lambda to the ratio of the two (Nielsen's rule),
+// - otherwise raises lambda and solves again from x (the evaluation counts,
+//   the iteration does not).
+// The termination tests (projected gradient and relative reduction of f,
+// pgtol and factr) are those of L-BFGS-B. LM_ENGINE_MAX_REJECTS rejected
+// steps in a row end the solve as abnormal (x is the last iterate).
+
+// number of values of the Gauss-Newton matrix after the gradient of an n variable problem
+#define LM_ENGINE_JTJ_SIZE(n) ((n)*((n) + 1)/2)
+
+// rejected steps in a row before the solve is abandoned
+#define LM_ENGINE_MAX_REJECTS 30
+
+
+// Creates the Levenberg-Marquardt engine for an n variable problem, g must have
+// room for n + LM_ENGINE_JTJ_SIZE(n) values. Returns NULL if that n is not
+// compiled in (see lm_engine.cpp). If mem is not NULL the engine is constructed
+// in mem (at least lmEngineSize(n) bytes, 16 byte aligned) instead of being
+// allocated with new, destroy it by calling its destructor instead of delete.
+LbfgsbEngineBase *createLmEngine(
+      int n,
+      double *x,				// array of size n, the current x
+      double *f,				// f(x)
+      double *g,				// array of size n + LM_ENGINE_JTJ_SIZE(n), the gradient of f at x and J'J
+      double *l,				// array of size n of lower bounds
+      double *u,				// array of size n of upper bounds
+      int *nbd,					// array of size n of bound types
+      double factr,
+      double pgtol,
+      void *mem = NULL);
+
+// returns true if createLmEngine() supports n variables
+bool lmEngineSupported(int n);
+
+// returns the size in bytes of the Levenberg-Marquardt engine for n variables
+// (0 if that size is not compiled in)
+size_t lmEngineSize(int n);
+
+
+template <int N>
+class LmEngine : public LbfgsbEngineBase {
+
+   public:
+
+   LmEngine(double *x, double *f, double *g, double *l, double *u, int *nbd, double factr, double pgtol)
+   {
+      this->x = x;
+      this->f = f;
+      this->g = g;
+      this->l = l;
+      this->u = u;
+      this->nbd = nbd;
+      this->factr = factr;
+      this->pgtol = pgtol;
+
+      for(int i = 0; i < N; i++) { xs[i] = 0; s[i] = 0; freeVar[i] = true; }
+      for(int i = 0; i < G; i++) gs[i] = 0;
+
+      resume = resumeFGStart;
+   }
+
+   LbfgsbTask start();
+   LbfgsbTask step();
+   LbfgsbTask stop() { return lbfgsbStop; }
+
+   private:
+
+   // gradient and Gauss-Newton matrix values of a point
+   enum { G = N + LM_ENGINE_JTJ_SIZE(N) };
+
+   // where step() picks up again
+   enum LmResume {
+      resumeFGStart,		// f, g and J'J at the starting point are ready
+      resumeTrial,			// f, g and J'J at a trial point are ready
+      resumeNewX			// the caller has seen the new iterate
+   };
+
+   // problem (owned by the caller)
+   double *x;
+   double *f;
+   double *g;
+   double *l;
+   double *u;
+   int *nbd;
+   double factr;
+   double pgtol;
+
+   // the iterate (the caller's x, f and g hold the trial point while it is evaluated)
+   double xs[N];
+   double fs;
+   double gs[G];
+
+   double s[N];				// step to the trial point
+   bool freeVar[N];			// the variable moves in the step
+
+   // saved state
+   LmResume resume;
+   int iter, nfgv, nreject;
+   double lambda, nu, pred, fold, tol, epsmch, sbgnrm;
+
+   LbfgsbTask trialStep();
+   void saveIterate();
+   void restoreIterate();
+   void projgr();
+
+   // bound types with a lower / an upper bound
+   bool hasLower(int i) const { return nbd[i] == 1 || nbd[i] == 2; }
+   bool hasUpper(int i) const { return nbd[i] == 2 || nbd[i] == 3; }
+
+   // element (i, j) of the Gauss-Newton matrix of the iterate
+   double jtj(int i, int j) const
+   {
+      if(i > j) { int k = i; i = j; j = k; }
+      return gs[N + i*N - i*(i - 1)/2 + (j - i)];
+   }
+
+   static double dmax(double a, double b) { return (a >= b) ? a : b; }
+   static double dmin(double a, double b) { return (a <= b) ? a : b; }
+};
+
+
+// initialize the solver for a new problem, returns lbfgsbFG (evaluate at the
+// projected starting point) or lbfgsbError
+template <int N>
+LbfgsbTask LmEngine<N>::start()
+{
+   epsmch = DBL_EPSILON;
+
+   iter = 0;
+   nfgv = 0;
+   nreject = 0;
+   // start damped, an undamped Gauss-Newton step from a poor start point
+   // can land in the basin of another local minimum
+   lambda = 1.0e-1;
+   nu = 2;
+   pred = 0;
+   fold = 0;
+   sbgnrm = 0;
+
+   tol = factr*epsmch;
+
+   // check the input arguments for errors
+   if(factr < 0) return lbfgsbError;
+
+   for(int i = 0; i < N; i++)
+   {
+      if((nbd[i] < 0) || (nbd[i] > 3)) return lbfgsbError;
+      if((nbd[i] == 2) && (l[i] > u[i])) return lbfgsbError;
+   }
+
+   // project x onto the feasible set
+   for(int i = 0; i < N; i++)
+   {
+      if(hasLower(i) && x[i] < l[i]) x[i] = l[i];
+      if(hasUpper(i) && x[i] > u[i]) x[i] = u[i];
+   }
+
+   resume = resumeFGStart;
+   return lbfgsbFG;
+}
+
+
+// continue the optimization after the caller evaluated f, g and J'J (lbfgsbFG)
+// or saw the new iterate (lbfgsbNewX)
+template <int N>
+LbfgsbTask LmEngine<N>::step()
+{
+   switch(resume)
+   {
+   case resumeFGStart:
+      nfgv = 1;
+
+      saveIterate();
+      projgr();
+
+      if(sbgnrm <= pgtol) return lbfgsbConverged;
+      break;
+
+   case resumeTrial:
+      {
+         // ratio of the actual to the predicted decrease of phi = f^2
+         double rho = (fs*fs - (*f)*(*f))/pred;
+
+         if(rho > 1.0e-4)
+         {
+            // take the trial point, trust the model more the better it predicted
+            double a = 2*rho - 1;
+            lambda *= dmax(1.0/3.0, 1 - a*a*a);
+            nu = 2;
+            nreject = 0;
+
+            fold = fs;
+            saveIterate();
+
+            iter++;
+            projgr();
+
+            resume = resumeNewX;
+            return lbfgsbNewX;
+         }
+
+         // (this also rejects a trial point where f is not a number)
+         restoreIterate();
+
+         lambda *= nu;
+         nu *= 2;
+
+         if(++nreject >= LM_ENGINE_MAX_REJECTS) return lbfgsbAbnormal;
+      }
+      break;
+
+   case resumeNewX:
+      {
+         // test for termination
+         if(sbgnrm <= pgtol) return lbfgsbConverged;
+
+         double ddum = dmax(dmax(fabs(fold), fabs(*f)), 1.0);
+         if((fold - *f) <= tol*ddum) return lbfgsbConverged;
+      }
+      break;
+   }
+
+   return trialStep();
+}
+
+
+// compute the step s from the iterate and ask for f, g and J'J at the projection
+// of xs + s onto the box. Raises lambda until the step is expected to lower f,
+// returns lbfgsbAbnormal if it does not get there.
+template <int N>
+LbfgsbTask LmEngine<N>::trialStep()
+{
+   double b[N];				// J'r = f*g
+   double a[N*N];			// A + lambda*D on the free variables, then its Cholesky factor
+   double dmaxdiag = 0;
+
+   for(int i = 0; i < N; i++)
+   {
+      b[i] = fs*gs[i];
+      dmaxdiag = dmax(dmaxdiag, jtj(i, i));
+
+      bool atLower = hasLower(i) && xs[i] <= l[i];
+      bool atUpper = hasUpper(i) && xs[i] >= u[i];
+
+      freeVar[i] = !((atLower && gs[i] >= 0) || (atUpper && gs[i] <= 0));
+   }
+
+   // a variable the residuals do not depend on is damped like the others
+   double dfloor = (dmaxdiag > 0) ? epsmch*dmaxdiag : 1;
+
+   while(lambda < 1.0e20)
+   {
+      // factor A + lambda*D over the free variables (the fixed ones get the identity)
+      bool factored = true;
+
+      for(int i = 0; i < N && factored; i++)
+      {
+         for(int j = 0; j <= i; j++)
+         {
+            double aij;
+
+            if(!freeVar[i] || !freeVar[j]) aij = (i == j) ? 1 : 0;
+            else
+            {
+               aij = jtj(i, j);
+               if(i == j) aij += lambda*dmax(jtj(i, i), dfloor);
+            }
+
+            for(int k = 0; k < j; k++) aij -= a[i*N + k]*a[j*N + k];
+
+            if(i == j)
+            {
+               if(aij <= 0)
+               {
+                  factored = false;
+                  break;
+               }
+               a[i*N + i] = sqrt(aij);
+            }
+            else a[i*N + j] = aij/a[j*N + j];
+         }
+      }
+
+      if(factored)
+      {
+         // solve L L' s = -b, the fixed variables do not move
+         for(int i = 0; i < N; i++)
+         {
+            double si = freeVar[i] ? -b[i] : 0;
+            for(int k = 0; k < i; k++) si -= a[i*N + k]*s[k];
+            s[i] = si/a[i*N + i];
+         }
+
+         for(int i = N - 1; i >= 0; i--)
+         {
+            double si = s[i];
+            for(int k = i + 1; k < N; k++) si -= a[k*N + i]*s[k];
+            s[i] = si/a[i*N + i];
+         }
+
+         // project the trial point onto the box, the model is evaluated for the step taken
+         for(int i = 0; i < N; i++)
+         {
+            double xi = xs[i] + s[i];
+            if(hasLower(i) && xi < l[i]) xi = l[i];
+            if(hasUpper(i) && xi > u[i]) xi = u[i];
+            x[i] = xi;
+            s[i] = xi - xs[i];
+         }
+
+         double sAs = 0;
+         double sb = 0;
+
+         for(int i = 0; i < N; i++)
+         {
+            sb += s[i]*b[i];
+            for(int j = 0; j < N; j++) sAs += s[i]*jtj(i, j)*s[j];
+         }
+
+         pred = -(2*sb + sAs);
+
+         if(pred > 0)
+         {
+            nfgv++;
+            resume = resumeTrial;
+            return lbfgsbFG;
+         }
+      }
+
+      // the projection (or rounding) spoiled the step, shorten it
+      lambda *= nu;
+      nu *= 2;
+   }
+
+   restoreIterate();
+   return lbfgsbAbnormal;
+}
+
+
+// keep the caller's x, f and g as the iterate
+template <int N>
+void LmEngine<N>::saveIterate()
+{
+   for(int i = 0; i < N; i++) xs[i] = x[i];
+   for(int i = 0; i < G; i++) gs[i] = g[i];
+   fs = *f;
+}
+
+
+// put the iterate back into the caller's x, f and g
+template <int N>
+void LmEngine<N>::restoreIterate()
+{
+   for(int i = 0; i < N; i++) x[i] = xs[i];
+   for(int i = 0; i < G; i++) g[i] = gs[i];
+   *f = fs;
+}
+
+
+// the infinity norm of the projected gradient of the iterate
+template <int N>
+void LmEngine<N>::projgr()
+{
+   sbgnrm = 0;
+
+   for(int i = 0; i < N; i++)
+   {
+      double gi = gs[i];
+
+      if(nbd[i] != 0)
+      {
+         if(gi < 0)
+         {
+            if(nbd[i] >= 2) gi = dmax(xs[i] - u[i], gi);
+         }
+         else
+         {
+            if(nbd[i] <= 2) gi = dmin(xs[i] - l[i], gi);
+         }
+      }
+
+      sbgnrm = dmax(sbgnrm, fabs(gi));
+   }
+}
+
+#endif
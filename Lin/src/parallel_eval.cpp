@@ -1,6 +1,21 @@
 #include <stdio.h>
 #include <string.h>
 
+// for timing functions
+#ifdef _WIN32
+//Windows
+#include <Winsock2.h>
+#include "gettimeofday.h"
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf		// returns -1 (and may not terminate) if the string does not fit
+#endif
+
+#else
+//Linux
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
 #include <CL/cl.h>
 
 #include <iostream>
@@ -10,6 +25,11 @@ using namespace std;
 
 #include "parallel_eval.h"
 #include "bfgsb_cl.h"
+#include "program_cache.h"
+#include "device_select.h"
+#include "launch_tuner.h"
+#include "time_util.h"
+#include "lbfgsb_cl.h"
 
 // comment out to NOT use OpenCL compiler optimizations
 // the optimization slightly improves performance at a slight cost to mathematical
@@ -17,11 +37,22 @@ using namespace std;
 //#define USE_OPENCL_RELAXED_MATH_OPTS
 
 
-static char* readSource(const char *sourceFilename); 
 
 // kernel names to look for in user provided OpenCL file
+// (the evaluation kernel name can be changed with the pEval constructor)
 static const char* evalKernel_name = "eval_kernel";
 static const char* coarseGrainKernel_name = "coarse_grained_search";
+static const char* coarseGrainBankKernel_suffix = "_bank";	// appended to the coarse grain kernel name
+static const char* solveKernel_suffix = "_solve";		// appended to the evaluation kernel name
+
+// evaluation kernel variants, the first one is the evaluation kernel itself.
+// A variant must take the same arguments as the evaluation kernel, variants the
+// program does not have (or a device can not run) are not used.
+static const pEval_variant evalVariants[EVAL_VARIANTS] = {
+   { "private", "", "band values in registers", false },
+   { "local", "_local", "measured bands in local memory", false },
+   { "float", "_float", "single precision", true }
+};
 
 #ifdef USE_OPENCL_RELAXED_MATH_OPTS
 static const char* OpenCL_optSwitches = "-cl-mad-enable -cl-fast-relaxed-math";
@@ -29,62 +60,151 @@ static const char* OpenCL_optSwitches = "-cl-mad-enable -cl-fast-relaxed-math";
 static const char* OpenCL_optSwitches = "";
 #endif
 
+static bool growBuffer(cl_context context, cl_mem *buf, size_t *capacity, cl_mem_flags *buf_flags,
+      cl_mem_flags mem_flags, size_t size, void *host_ptr);
+static void uploadConstBuffer(cl_context context, cl_command_queue cmdQueue, cl_mem *buf, size_t *capacity,
+      size_t size, void *data);
 
 
 pEval::pEval(
       int num_vars, 
-      int num_funcs, 
       const char *evalSrcFileNameFull, 
       const char *OpenCL_incDir,
-      int num_user_args,
-      bfgsb_cl_user_data_arg *user_args,
-      bool use_coarse_grain_search,
-      unsigned int coarse_grain_n,
-      double *coarse_grain_points
+      const bfgsb_cl_options *options
       )
 {
+   bfgsb_cl_options opts;
+   if(options != NULL) opts = *options;
+   else bfgsb_cl_set_default_options(&opts);
+
    this->num_vars = num_vars;
-   this->num_funcs = num_funcs;
+   this->g_stride = num_vars + (opts.lm_solver ? num_vars*(num_vars + 1)/2 : 0);
    sprintf(this->evalSrcFileNameFull, "%s", evalSrcFileNameFull);
    sprintf(this->OpenCL_incDir, "%s", OpenCL_incDir);
-   this->num_user_args = num_user_args;
-
-   this->use_coarse_grain_search = use_coarse_grain_search;
-   this->coarse_grain_n = coarse_grain_n;
-
-   if((use_coarse_grain_search) && (coarse_grain_n > 0))
-   {
-      this->coarse_grain_points = (double *) malloc(coarse_grain_n * num_vars * sizeof(double));
-      memcpy(this->coarse_grain_points, coarse_grain_points, coarse_grain_n * num_vars * sizeof(double));
+   int len = snprintf(this->evalKernelName, sizeof(this->evalKernelName), "%s", 
+         opts.eval_kernel != NULL ? opts.eval_kernel : evalKernel_name);
+   if(len < 0 || (size_t) len >= sizeof(this->evalKernelName)) {
+      printf("OpenCL evaluation kernel name %s is too long\n", opts.eval_kernel);
+      exit(-1);
    }
 
-   if(num_user_args > 0)
-   {
-     user_buffs = (pEval_user_buff *) malloc(num_user_args * sizeof(pEval_user_buff));
+   // a cache directory that does not fit is not used
+   len = snprintf(this->programCacheDir, sizeof(this->programCacheDir), "%s", 
+         opts.program_cache_dir != NULL ? opts.program_cache_dir : "");
+   if(len < 0 || (size_t) len >= sizeof(this->programCacheDir)) {
+      printf("OpenCL program cache directory %s is too long, not caching\n", opts.program_cache_dir);
+      this->programCacheDir[0] = '\0';
+   }
 
-     for(int i = 0; i < num_user_args; i++)
-      {
-         user_buffs[i].data_dev = NULL;
-         memcpy(&user_buffs[i].arg, &user_args[i], sizeof(bfgsb_cl_user_data_arg));
-      }
+   len = snprintf(this->platformSelect, sizeof(this->platformSelect), "%s", 
+         opts.platform_select != NULL ? opts.platform_select : "");
+   if(len < 0 || (size_t) len >= sizeof(this->platformSelect)) {
+      printf("OpenCL platform selection %s is too long\n", opts.platform_select);
+      exit(-1);
    }
 
-    context = NULL;
-    cmdQueue = NULL;
-    evalKernel = NULL;
-    coarseGrainedSearchKernel = NULL;
+   len = snprintf(this->deviceSelect, sizeof(this->deviceSelect), "%s", 
+         opts.device_select != NULL ? opts.device_select : "");
+   if(len < 0 || (size_t) len >= sizeof(this->deviceSelect)) {
+      printf("OpenCL device selection %s is too long\n", opts.device_select);
+      exit(-1);
+   }
 
-    active_mask_dev = NULL;
-    F_dev = NULL;
-    x_dev = NULL;
-    g_dev = NULL;
-    coarse_grain_points_dev = NULL;
-    init_ret_dev = NULL;
+   num_funcs = 0;
+   num_user_args = 0;
+   use_coarse_grain_search = false;
+   coarse_grain_n = 0;
+
+   capacity_funcs = 0;
+   capacity_user_args = 0;
+   capacity_coarse_grain_points = 0;
+   capacity_init_ret = 0;
+   capacity_coarse_grain_bank = 0;
+   capacity_coarse_grain_norm2 = 0;
+   capacity_coarse_grain_bank_ids = 0;
+   user_buffs = NULL;
+
+    num_contexts = 0;
+    contexts = NULL;
+    programs = NULL;
+    num_devices = 0;
+    devs = NULL;
+    sliceCount = NULL;
+    subDevices = NULL;
+    num_subDevices = 0;
 
     F_host = NULL;
     x_host = NULL;
     g_host = NULL;
-    active_mask_host = NULL;
+    Fc_host = NULL;
+    xc_host = NULL;
+    gc_host = NULL;
+    point_ids_host = NULL;
+    F_packed_host = NULL;
+    x_packed_host = NULL;
+    g_packed_host = NULL;
+    func_ids_host = NULL;
+    all_ids = NULL;
+    F_pinned = NULL;
+    x_pinned = NULL;
+    g_pinned = NULL;
+    func_ids_pinned = NULL;
+
+    hostMemory = opts.host_memory;
+    outOfOrderQueue = opts.out_of_order_queue;
+    maxDevices = opts.num_devices;
+    subDeviceUnits = opts.sub_device_units;
+    tuneLaunch = opts.tune_launch;
+    launchTuner = NULL;
+
+    singlePrecision = false;
+    evalPoints = (opts.line_search_points > 1) ? opts.line_search_points : 1;
+    evalVariant = EVAL_VARIANT_AUTO;
+    if(opts.eval_variant != NULL && strcmp(opts.eval_variant, "auto") != 0)
+    {
+       evalVariant = -2;
+       for(int v = 0; v < EVAL_VARIANTS; v++)
+       {
+          if(!evalVariants[v].single_precision && !strcmp(opts.eval_variant, evalVariants[v].name)) evalVariant = v;
+       }
+
+       if(evalVariant == -2)
+       {
+          printf("Unknown evaluation kernel variant %s (use auto", opts.eval_variant);
+          for(int v = 0; v < EVAL_VARIANTS; v++) {
+             if(!evalVariants[v].single_precision) printf(", %s", evalVariants[v].name);
+          }
+          printf(")\n");
+          exit(-1);
+       }
+    }
+
+    doneCallback = NULL;
+    doneCallbackArg = NULL;
+    pthread_mutex_init(&callbackMutex, NULL);
+
+    num_cohorts = opts.num_cohorts;
+    if(num_cohorts < 1) num_cohorts = 1;
+    cohortFirstSlot = (int *) malloc(num_cohorts * sizeof(int));
+    cohortCount = (int *) malloc(num_cohorts * sizeof(int));
+    cohortRefs = (pEval_cohort_ref *) malloc(num_cohorts * sizeof(pEval_cohort_ref));
+    cohortPending = (int *) malloc(num_cohorts * sizeof(int));
+
+    for(int c = 0; c < num_cohorts; c++)
+    {
+       cohortFirstSlot[c] = 0;
+       cohortCount[c] = 0;
+       cohortRefs[c].pe = this;
+       cohortRefs[c].cohort = c;
+       cohortPending[c] = 0;
+    }
+
+    deviceBusy_ms = 0;
+    hostWait_ms = 0;
+
+    solveLaunches = 0;
+    solveFuncs = 0;
+    solve_ms = 0;
 }
 
 
@@ -93,60 +213,185 @@ pEval::~pEval()
 {
    OpenCL_cleanup();
    
-   if(num_user_args > 0)
-   {
-      free(user_buffs);
-   }
-
-   if((use_coarse_grain_search) && (coarse_grain_n > 0))
-   {
-      free(coarse_grain_points);
-   }
+   free(user_buffs);
 
    free(F_host);
    free(x_host);
    free(g_host);
-   free(active_mask_host);
+   free(Fc_host);
+   free(xc_host);
+   free(gc_host);
+   free(point_ids_host);
+   free(all_ids);
+
+   free(cohortFirstSlot);
+   free(cohortCount);
+   free(cohortRefs);
+   free(cohortPending);
+   pthread_mutex_destroy(&callbackMutex);
 }
 
 
 // cleanup and release OpenCL resources
 void pEval::OpenCL_cleanup()
 {
-   clReleaseMemObject(active_mask_dev);
-   clReleaseMemObject(F_dev);
-   clReleaseMemObject(x_dev);
-   clReleaseMemObject(g_dev);
+   for(int c = 0; c < num_cohorts; c++)
+   {
+      evalWait(c);
+   }
 
-   for(int i = 0; i < num_user_args; i++)
+   if(launchTuner != NULL)
    {
-      clReleaseMemObject(user_buffs[i].data_dev);
+      launchTuner->save();
+      delete launchTuner;
+      launchTuner = NULL;
    }
 
-   if((use_coarse_grain_search) && (coarse_grain_n > 0))
+   for(int d = 0; d < num_devices; d++)
    {
-      clReleaseMemObject(init_ret_dev);
-      clReleaseMemObject(coarse_grain_points_dev);
+      for(int c = 0; c < num_cohorts; c++)
+      {
+         if(devs[d].cohortUnmapFEvent[c] != NULL) clReleaseEvent(devs[d].cohortUnmapFEvent[c]);
+         if(devs[d].cohortUnmapgEvent[c] != NULL) clReleaseEvent(devs[d].cohortUnmapgEvent[c]);
+         devs[d].cohortUnmapFEvent[c] = NULL;
+         devs[d].cohortUnmapgEvent[c] = NULL;
+      }
+      clFinish(devs[d].cmdQueue);
    }
 
+   // the pinned staging buffers are unmapped with the queue
+   freeStagingBuffers();
 
-   clReleaseKernel(evalKernel);
+   for(int i = 0; i < capacity_user_args; i++)
+   {
+      for(int d = 0; d < num_devices; d++)
+      {
+         if(user_buffs[i].data_dev[d] != NULL) clReleaseMemObject(user_buffs[i].data_dev[d]);
+      }
+      free(user_buffs[i].data_dev);
+   }
 
-   if((use_coarse_grain_search) && (coarse_grain_n > 0))
+   for(int d = 0; d < num_devices; d++)
    {
-      
-      clReleaseKernel(coarseGrainedSearchKernel);
+      pEval_device *dev = &devs[d];
+
+      if(dev->func_ids_dev != NULL) clReleaseMemObject(dev->func_ids_dev);
+      if(dev->F_dev != NULL) clReleaseMemObject(dev->F_dev);
+      if(dev->x_dev != NULL) clReleaseMemObject(dev->x_dev);
+      if(dev->g_dev != NULL) clReleaseMemObject(dev->g_dev);
+      if(dev->init_ret_dev != NULL) clReleaseMemObject(dev->init_ret_dev);
+      if(dev->coarse_grain_points_dev != NULL) clReleaseMemObject(dev->coarse_grain_points_dev);
+      if(dev->coarse_grain_bank_dev != NULL) clReleaseMemObject(dev->coarse_grain_bank_dev);
+      if(dev->coarse_grain_norm2_dev != NULL) clReleaseMemObject(dev->coarse_grain_norm2_dev);
+      if(dev->coarse_grain_bank_ids_dev != NULL) clReleaseMemObject(dev->coarse_grain_bank_ids_dev);
+      if(dev->solve_state_dev != NULL) clReleaseMemObject(dev->solve_state_dev);
+      if(dev->solve_work_dev != NULL) clReleaseMemObject(dev->solve_work_dev);
+      if(dev->solve_iwork_dev != NULL) clReleaseMemObject(dev->solve_iwork_dev);
+      if(dev->solve_bounds_dev != NULL) clReleaseMemObject(dev->solve_bounds_dev);
+      if(dev->solve_nbd_dev != NULL) clReleaseMemObject(dev->solve_nbd_dev);
+      if(dev->solve_active_dev != NULL) clReleaseMemObject(dev->solve_active_dev);
+
+      for(int v = 0; v < EVAL_VARIANTS; v++)
+      {
+         if(dev->variantKernels[v] != NULL) clReleaseKernel(dev->variantKernels[v]);
+      }
+      if(dev->coarsePointsKernel != NULL) clReleaseKernel(dev->coarsePointsKernel);
+      if(dev->coarseBankKernel != NULL) clReleaseKernel(dev->coarseBankKernel);
+      if(dev->solveKernel != NULL) clReleaseKernel(dev->solveKernel);
+      if(dev->cmdQueue != NULL) clReleaseCommandQueue(dev->cmdQueue);
+
+      free(dev->func_ids_sent);
+      free(dev->cohortFirstSlot);
+      free(dev->cohortCount);
+      free(dev->cohortStartEvent);
+      free(dev->cohortDoneEvent);
+      free(dev->cohortFMapped);
+      free(dev->cohortgMapped);
+      free(dev->cohortUnmapFEvent);
+      free(dev->cohortUnmapgEvent);
+      free(dev->cohortKernelEvent);
+      free(dev->cohortShape);
    }
 
-   clReleaseCommandQueue(cmdQueue);
-   clReleaseContext(context);
+   free(devs);
+   free(sliceCount);
+   devs = NULL;
+   sliceCount = NULL;
+   num_devices = 0;
+
+   for(int i = 0; i < num_contexts; i++)
+   {
+      if(programs[i] != NULL) clReleaseProgram(programs[i]);
+      if(contexts[i] != NULL) clReleaseContext(contexts[i]);
+   }
+   free(programs);
+   free(contexts);
+   programs = NULL;
+   contexts = NULL;
+   num_contexts = 0;
+
+#ifdef CL_VERSION_1_2
+   for(cl_uint i = 0; i < num_subDevices; i++)
+   {
+      clReleaseDevice(subDevices[i]);
+   }
+#endif
+   free(subDevices);
+   subDevices = NULL;
+   num_subDevices = 0;
 }
 
-// setup OpenCL subsystem and initalize OpenCL kernel inputs
+// setup OpenCL subsystem: device, context, command queue and the compiled
+// evaluation program. Problem inputs are set up by setProblem().
 void pEval::OpenCL_setup()
 {
    OpenCL_mainSetup();
-   OpenCL_initInputs();
+}
+
+
+// set up the inputs of a new batch of num_funcs functions
+// the OpenCL buffers are kept from the previous batch and only grown
+// if this batch needs more room than any batch before it
+void pEval::setProblem(
+      int num_funcs,
+      int num_user_args,
+      bfgsb_cl_user_data_arg *user_args,
+      bool use_coarse_grain_search,
+      unsigned int coarse_grain_n,
+      double *coarse_grain_points,
+      const bfgsb_cl_coarse_grain_bank *coarse_grain_bank)
+{
+   // nothing of the previous batch may still be in flight
+   for(int c = 0; c < num_cohorts; c++)
+   {
+      evalWait(c);
+   }
+
+   this->num_funcs = num_funcs;
+   this->num_user_args = num_user_args;
+   this->use_coarse_grain_search = use_coarse_grain_search;
+   this->coarse_grain_n = coarse_grain_n;
+
+   if(num_user_args > capacity_user_args)
+   {
+      user_buffs = (pEval_user_buff *) realloc(user_buffs, num_user_args * sizeof(pEval_user_buff));
+
+      for(int i = capacity_user_args; i < num_user_args; i++)
+      {
+         user_buffs[i].data_dev = (cl_mem *) calloc(num_devices, sizeof(cl_mem));
+         user_buffs[i].capacity = 0;
+         user_buffs[i].mem_flags = 0;
+      }
+
+      capacity_user_args = num_user_args;
+   }
+
+   for(int i = 0; i < num_user_args; i++)
+   {
+      memcpy(&user_buffs[i].arg, &user_args[i], sizeof(bfgsb_cl_user_data_arg));
+   }
+
+   OpenCL_initInputs(coarse_grain_points, coarse_grain_bank);
 }
 
 
@@ -161,156 +406,214 @@ void pEval::OpenCL_mainSetup()
 
    cl_int status;  // use as return value for most OpenCL functions
 
-   cl_uint numPlatforms = 0;
-   cl_platform_id *platforms;
-                
-   // Query for the number of recongnized platforms
-   status = clGetPlatformIDs(0, NULL, &numPlatforms);
-   if(status != CL_SUCCESS) {
-      printf("clGetPlatformIDs failed\n");
-      exit(-1);
-   }
+   cl_device_id *devices;
+   cl_platform_id *devicePlatforms;		// platform of each device
 
-   // Make sure some platforms were found 
-   if(numPlatforms == 0) {
-      printf("No platforms detected.\n");
-      exit(-1);
-   }
+   // pick the platforms and devices given by the options (the GPUs by default)
+   cl_uint numDevices = selectDevices(platformSelect, deviceSelect, &devices, &devicePlatforms);
 
-   // Allocate enough space for each platform
-   platforms = (cl_platform_id*)malloc(numPlatforms*sizeof(cl_platform_id));
-   if(platforms == NULL) {
-      perror("malloc");
-      exit(-1);
+
+   // use the first maxDevices devices only
+   if((maxDevices > 0) && (numDevices > (cl_uint) maxDevices)) numDevices = maxDevices;
+
+#ifdef CL_VERSION_1_2
+   // split the devices into sub-devices of subDeviceUnits compute units each
+   // (a CPU device can be split like this to run the multi-device path on one CPU)
+   if(subDeviceUnits > 0)
+   {
+      cl_device_partition_property partition[3] = {CL_DEVICE_PARTITION_EQUALLY, subDeviceUnits, 0};
+      cl_device_id *split = NULL;
+      cl_platform_id *splitPlatforms = NULL;
+      cl_uint numSplit = 0;
+
+      for(unsigned int i = 0; i < numDevices; i++) {
+         cl_uint numSub = 0;
+         status = clCreateSubDevices(devices[i], partition, 0, NULL, &numSub);
+
+         if(status != CL_SUCCESS || numSub == 0) {
+            printf("Device %u can not be split into sub-devices of %d compute units, it is used whole\n", i, subDeviceUnits);
+            split = (cl_device_id *) realloc(split, (numSplit + 1) * sizeof(cl_device_id));
+            splitPlatforms = (cl_platform_id *) realloc(splitPlatforms, (numSplit + 1) * sizeof(cl_platform_id));
+            split[numSplit] = devices[i];
+            splitPlatforms[numSplit++] = devicePlatforms[i];
+            continue;
+         }
+
+         split = (cl_device_id *) realloc(split, (numSplit + numSub) * sizeof(cl_device_id));
+         splitPlatforms = (cl_platform_id *) realloc(splitPlatforms, (numSplit + numSub) * sizeof(cl_platform_id));
+         subDevices = (cl_device_id *) realloc(subDevices, (num_subDevices + numSub) * sizeof(cl_device_id));
+
+         status = clCreateSubDevices(devices[i], partition, numSub, split + numSplit, NULL);
+         if(status != CL_SUCCESS) {
+            printf("clCreateSubDevices failed\n");
+            exit(-1);
+         }
+
+         memcpy(subDevices + num_subDevices, split + numSplit, numSub * sizeof(cl_device_id));
+         for(cl_uint j = 0; j < numSub; j++) splitPlatforms[numSplit + j] = devicePlatforms[i];
+         num_subDevices += numSub;
+         numSplit += numSub;
+      }
+
+      free(devices);
+      free(devicePlatforms);
+      devices = split;
+      devicePlatforms = splitPlatforms;
+      numDevices = numSplit;
    }
+#else
+   if(subDeviceUnits > 0) printf("Sub-devices need OpenCL 1.2, the devices are used whole\n");
+#endif
 
-   // Fill in platforms
-   clGetPlatformIDs(numPlatforms, platforms, NULL);
-   if(status != CL_SUCCESS) {
-      printf("clGetPlatformIDs failed\n");
-      exit(-1);
+
+   // Create a context for the devices of each platform (a context can not span platforms,
+   // selectDevices() returns the devices grouped by platform).
+   // The devices [groupFirst[c], groupFirst[c+1]) share context c
+   cl_uint *groupFirst = (cl_uint *) malloc((numDevices + 1) * sizeof(cl_uint));
+   num_contexts = 0;
+   for(cl_uint i = 0; i < numDevices; i++) {
+      if(i == 0 || devicePlatforms[i] != devicePlatforms[i - 1]) groupFirst[num_contexts++] = i;
    }
+   groupFirst[num_contexts] = numDevices;
 
-   // Print out some basic information about each platform
-   printf("%u platforms detected\n", numPlatforms);
-   for(unsigned int i = 0; i < numPlatforms; i++) {
-      char buf[100];
-      printf("Platform %u: \n", i);
-      status = clGetPlatformInfo(platforms[i], CL_PLATFORM_VENDOR,
-                       sizeof(buf), buf, NULL);
-      printf("\tVendor: %s\n", buf);
-      status |= clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME,
-                       sizeof(buf), buf, NULL);
-      printf("\tName: %s\n", buf);
+   contexts = (cl_context *) calloc(num_contexts, sizeof(cl_context));
+   programs = (cl_program *) calloc(num_contexts, sizeof(cl_program));
 
-      if(status != CL_SUCCESS) {
-         printf("clGetPlatformInfo failed\n");
+   for(int c = 0; c < num_contexts; c++) {
+      cl_context_properties contextProps[3] = {
+         CL_CONTEXT_PLATFORM, (cl_context_properties) devicePlatforms[groupFirst[c]], 0 };
+
+      contexts[c] = clCreateContext(contextProps, groupFirst[c + 1] - groupFirst[c], devices + groupFirst[c], 
+            NULL, NULL, &status);
+      if(status != CL_SUCCESS || contexts[c] == NULL) {
+         printf("clCreateContext failed\n");
          exit(-1);
       }
    }
-   printf("\n");
 
-   cl_uint numDevices = 0;
-   cl_device_id *devices;
+   if(num_contexts > 1) printf("The devices are on %d platforms, each one gets its own context\n", num_contexts);
 
-   // Retrive the number of devices present
-   status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, NULL, 
-                           &numDevices);
-   if(status != CL_SUCCESS) {
-      printf("clGetDeviceIDs failed\n");
-      exit(-1);
+   // Create a command queue for each device, the evaluations are split over all of them
+   // profile commands when pipelining so the achieved overlap can be reported,
+   // with several devices to measure their evaluation rates and to time the launch shapes
+   // and kernel variants
+   cl_command_queue_properties queueProps = 0;
+   if(num_cohorts > 1 || numDevices > 1 || tuneLaunch || evalVariant == EVAL_VARIANT_AUTO) {
+      queueProps = CL_QUEUE_PROFILING_ENABLE;
    }
 
-   // Make sure some devices were found
-   if(numDevices == 0) {
-      printf("No devices detected.\n");
-      exit(-1);
-   }
+   // with an out-of-order queue the device may run the evaluations of 
+   // different cohorts at the same time (see evalAsync() for the ordering)
+   if(outOfOrderQueue)
+   {
+      for(unsigned int i = 0; i < numDevices; i++) {
+         cl_command_queue_properties deviceQueueProps = 0;
+         status = clGetDeviceInfo(devices[i], CL_DEVICE_QUEUE_PROPERTIES,
+                          sizeof(deviceQueueProps), &deviceQueueProps, NULL);
 
-   // Allocate enough space for each device
-   devices = (cl_device_id*)malloc(numDevices*sizeof(cl_device_id));
-   if(devices == NULL) {
-      perror("malloc");
-      exit(-1);
+         if(status != CL_SUCCESS || !(deviceQueueProps & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+         {
+            printf("Device %u does not support out-of-order execution, using in-order command queues\n\n", i);
+            outOfOrderQueue = false;
+            break;
+         }
+      }
+
+      if(outOfOrderQueue) queueProps |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
    }
 
-   // Fill in devices
-   status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, numDevices,
-                     devices, NULL);
-   if(status != CL_SUCCESS) {
-      printf("clGetDeviceIDs failed\n");
-      exit(-1);
-   }   
-
-   // Print out some basic information about each device
-   printf("%u devices detected\n", numDevices);
-   for(unsigned int i = 0; i < numDevices; i++) {
-      char buf[100];
-      printf("Device %u: \n", i);
-      status = clGetDeviceInfo(devices[i], CL_DEVICE_VENDOR,
-                       sizeof(buf), buf, NULL);
-      printf("\tDevice: %s\n", buf);
-      status |= clGetDeviceInfo(devices[i], CL_DEVICE_NAME,
-                       sizeof(buf), buf, NULL);
-      printf("\tName: %s\n", buf);
+   // with devices that share the host memory (integrated GPUs and CPUs) the
+   // evaluation buffers are mapped by the host instead of copied, other devices
+   // copy them from pinned host memory which transfers faster than pageable memory
+   cl_bool unifiedMemory = CL_TRUE;
 
-      if(status != CL_SUCCESS) {
-         printf("clGetDeviceInfo failed\n");
+   num_devices = numDevices;
+   devs = (pEval_device *) calloc(num_devices, sizeof(pEval_device));
+   sliceCount = (int *) calloc(num_devices, sizeof(int));
+
+   for(int d = 0, c = 0; d < num_devices; d++) {
+      pEval_device *dev = &devs[d];
+
+      while((cl_uint) d >= groupFirst[c + 1]) c++;
+
+      dev->device = devices[d];
+      dev->context = contexts[c];
+      clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(dev->name), dev->name, NULL);
+
+      dev->cmdQueue = clCreateCommandQueue(dev->context, devices[d], queueProps, &status);
+      if(status != CL_SUCCESS || dev->cmdQueue == NULL) {
+         printf("clCreateCommandQueue failed\n");
          exit(-1);
       }
+
+      cl_bool deviceUnified = CL_FALSE;
+      status = clGetDeviceInfo(devices[d], CL_DEVICE_HOST_UNIFIED_MEMORY,
+                       sizeof(cl_bool), &deviceUnified, NULL);
+      if(status != CL_SUCCESS || !deviceUnified) unifiedMemory = CL_FALSE;
+
+      // until it is measured the evaluation rate is taken to be proportional to the compute units
+      cl_uint computeUnits = 1;
+      clGetDeviceInfo(devices[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, NULL);
+      dev->computeUnits = (computeUnits > 0) ? computeUnits : 1;
+      dev->rate = 0;
+      dev->rateMeasured = false;
+      dev->evaluated = 0;
+      dev->busy_ms = 0;
+
+      dev->cohortFirstSlot = (int *) calloc(num_cohorts, sizeof(int));
+      dev->cohortCount = (int *) calloc(num_cohorts, sizeof(int));
+      dev->cohortStartEvent = (cl_event *) calloc(num_cohorts, sizeof(cl_event));
+      dev->cohortDoneEvent = (cl_event *) calloc(num_cohorts, sizeof(cl_event));
+      dev->cohortFMapped = (double **) calloc(num_cohorts, sizeof(double *));
+      dev->cohortgMapped = (double **) calloc(num_cohorts, sizeof(double *));
+      dev->cohortUnmapFEvent = (cl_event *) calloc(num_cohorts, sizeof(cl_event));
+      dev->cohortUnmapgEvent = (cl_event *) calloc(num_cohorts, sizeof(cl_event));
+      dev->cohortKernelEvent = (cl_event *) calloc(num_cohorts, sizeof(cl_event));
+      dev->cohortShape = (launch_shape *) calloc(num_cohorts, sizeof(launch_shape));
    }
-   printf("\n");
 
+   if(num_devices > 1) printf("Evaluations are split over %d devices\n", num_devices);
 
-   // Create a context and associate it with the devices
-   context = clCreateContext(NULL, numDevices, devices, NULL, NULL, &status);
-   if(status != CL_SUCCESS || context == NULL) {
-      printf("clCreateContext failed\n");
-      exit(-1);
+   if(hostMemory == BFGSB_CL_HOST_MEMORY_AUTO)
+   {
+      hostMemory = unifiedMemory ? BFGSB_CL_HOST_MEMORY_ZERO_COPY : BFGSB_CL_HOST_MEMORY_PINNED;
    }
 
-   // Create a command queue and associate it with the device you 
-   // want to execute on
-   cmdQueue = clCreateCommandQueue(context, devices[0], 0, &status);
-   if(status != CL_SUCCESS || cmdQueue == NULL) {
-      printf("clCreateCommandQueue failed\n");
-      exit(-1);
-   }
+   printf("Host memory is %sshared with the device%s, evaluation buffers are %s\n\n", unifiedMemory ? "" : "not ", 
+         num_devices > 1 ? "s" : "",
+         hostMemory == BFGSB_CL_HOST_MEMORY_ZERO_COPY ? "mapped (zero-copy)" :
+         hostMemory == BFGSB_CL_HOST_MEMORY_PINNED ? "copied from pinned memory" : "copied");
 
-   cl_program program;
-   
    char *source;
 
    //const char *sourceFile = "eval_kernel.cl";
    // This function reads in the source code of the program
-   source = readSource(evalSrcFileNameFull);
+   // (with the files it includes inlined)
+   source = readProgramSource(evalSrcFileNameFull, OpenCL_incDir);
 
    //printf("Program source is:\n%s\n", source);
 
-   // Create a program. The 'source' string is the code from the 
-   program = clCreateProgramWithSource(context, 1, (const char**)&source, 
-                              NULL, &status);
-   if(status != CL_SUCCESS) {
-      printf("clCreateProgramWithSource failed\n");
-      exit(-1);
-   }
-
    cl_int buildErr;
-   // Build (compile & link) the program for the devices.
+   // Create and build (compile & link) the program for the devices, or load
+   // it from the program cache.
    // Save the return value in 'buildErr' (the following 
    // code will print any compilation errors to the screen)a
   
    char OpenCL_buildLine[MAX_STR_SZ];
    sprintf(OpenCL_buildLine, "-I %s %s", OpenCL_incDir, OpenCL_optSwitches);
-   buildErr = clBuildProgram(program, numDevices, devices, OpenCL_buildLine, NULL, NULL);
-   //buildErr = clBuildProgram(program, numDevices, devices, NULL, NULL, NULL);
+   for(int c = 0; c < num_contexts; c++) {
+      programs[c] = buildProgramCached(contexts[c], groupFirst[c + 1] - groupFirst[c], devices + groupFirst[c], 
+            source, OpenCL_buildLine, programCacheDir, &buildErr);
+   }
 
    // If there are build errors, print them to the screen
    if(1) {
       //printf("Program failed to build.\n");
       cl_build_status buildStatus;
-      for(unsigned int i = 0; i < numDevices; i++) {
-         clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_STATUS,
+      for(unsigned int i = 0, c = 0; i < numDevices; i++) {
+         while(i >= groupFirst[c + 1]) c++;
+
+         clGetProgramBuildInfo(programs[c], devices[i], CL_PROGRAM_BUILD_STATUS,
                           sizeof(cl_build_status), &buildStatus, NULL);
         
         /* 
@@ -321,14 +624,14 @@ void pEval::OpenCL_mainSetup()
 
          char *buildLog;
          size_t buildLogSize;
-         clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG,
+         clGetProgramBuildInfo(programs[c], devices[i], CL_PROGRAM_BUILD_LOG,
                           0, NULL, &buildLogSize);
          buildLog = (char*)malloc(buildLogSize);
          if(buildLog == NULL) {
             perror("malloc");
             exit(-1);
          }
-         clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG,
+         clGetProgramBuildInfo(programs[c], devices[i], CL_PROGRAM_BUILD_LOG,
                           buildLogSize, buildLog, NULL);
          buildLog[buildLogSize-1] = '\0';
          printf("Device %u Build Log:\n%s\n", i, buildLog);   
@@ -341,149 +644,502 @@ void pEval::OpenCL_mainSetup()
    }
 
 
-   evalKernel = clCreateKernel(program, evalKernel_name, &status);
-   if(status != CL_SUCCESS) {
-      printf("clCreateKernel failed\n");
-      exit(-1);
-   }
+   // each device needs its own kernel objects as the buffer arguments differ
+   // (one for each variant of the evaluation kernel the program has)
+   bool variantFound[EVAL_VARIANTS] = { false };
 
-   if((use_coarse_grain_search) && (coarse_grain_n > 0))
-   {
+   for(int d = 0, c = 0; d < num_devices; d++) {
+      pEval_device *dev = &devs[d];
 
-      coarseGrainedSearchKernel = clCreateKernel(program, coarseGrainKernel_name, &status);
-      if(status != CL_SUCCESS) {
-         printf("clCreateKernel failed\n");
+      while((cl_uint) d >= groupFirst[c + 1]) c++;
+
+      dev->program = programs[c];
+
+      cl_ulong deviceLocalMem = 0;
+      clGetDeviceInfo(dev->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &deviceLocalMem, NULL);
+
+      for(int v = 0; v < EVAL_VARIANTS; v++) {
+         char kernelName[MAX_STR_SZ];
+         int len = snprintf(kernelName, sizeof(kernelName), "%s%s", evalKernelName, evalVariants[v].suffix);
+         if(len < 0 || (size_t) len >= sizeof(kernelName)) {
+            printf("OpenCL kernel name %s%s is too long\n", evalKernelName, evalVariants[v].suffix);
+            exit(-1);
+         }
+
+         dev->variantKernels[v] = clCreateKernel(dev->program, kernelName, &status);
+         if(status != CL_SUCCESS) {
+            dev->variantKernels[v] = NULL;
+
+            if(v == 0) {
+               printf("clCreateKernel failed (kernel %s)\n", evalKernelName);
+               exit(-1);
+            }
+            continue;
+         }
+
+         // the variant must fit the device's local memory and work-group size
+         cl_ulong localMem = 0;
+         size_t maxLocal = 0;
+         size_t compileSize[3] = {0, 0, 0};
+         clGetKernelWorkGroupInfo(dev->variantKernels[v], dev->device, CL_KERNEL_LOCAL_MEM_SIZE, 
+               sizeof(cl_ulong), &localMem, NULL);
+         clGetKernelWorkGroupInfo(dev->variantKernels[v], dev->device, CL_KERNEL_WORK_GROUP_SIZE, 
+               sizeof(size_t), &maxLocal, NULL);
+         clGetKernelWorkGroupInfo(dev->variantKernels[v], dev->device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE, 
+               sizeof(compileSize), compileSize, NULL);
+
+         if(v > 0 && (localMem > deviceLocalMem || compileSize[0] > maxLocal)) {
+            printf("Device %d (%s) can not run %s (%lu bytes of local memory, work-group size %lu)\n", 
+                  d, dev->name, kernelName, (unsigned long) localMem, (unsigned long) compileSize[0]);
+            clReleaseKernel(dev->variantKernels[v]);
+            dev->variantKernels[v] = NULL;
+            continue;
+         }
+
+         variantFound[v] = true;
+      }
+
+      // the device solver is optional, its bounds, bound types and count of running
+      // functions are small and kept for the session
+      char solveKernelName[MAX_STR_SZ];
+      int len = snprintf(solveKernelName, sizeof(solveKernelName), "%s%s", evalKernelName, solveKernel_suffix);
+      if(len < 0 || (size_t) len >= sizeof(solveKernelName)) {
+         printf("OpenCL solve kernel name %s%s is too long\n", evalKernelName, solveKernel_suffix);
          exit(-1);
       }
+
+      dev->solveKernel = clCreateKernel(dev->program, solveKernelName, &status);
+      if(status != CL_SUCCESS) dev->solveKernel = NULL;
+
+      if(dev->solveKernel != NULL)
+      {
+         size_t capacity;
+         cl_mem_flags flags;
+
+         capacity = 0;
+         growBuffer(dev->context, &dev->solve_bounds_dev, &capacity, &flags, CL_MEM_READ_ONLY, 2 * num_vars * sizeof(double), NULL);
+         capacity = 0;
+         growBuffer(dev->context, &dev->solve_nbd_dev, &capacity, &flags, CL_MEM_READ_ONLY, num_vars * sizeof(cl_int), NULL);
+         capacity = 0;
+         growBuffer(dev->context, &dev->solve_active_dev, &capacity, &flags, CL_MEM_READ_WRITE, sizeof(cl_int), NULL);
+      }
+   }
+
+   int numFound = 0;
+   for(int v = 0; v < EVAL_VARIANTS; v++) {
+      if(variantFound[v]) numFound++;
+   }
+
+   if(numFound > 1) {
+      printf("Evaluation kernel variants:");
+      for(int v = 0; v < EVAL_VARIANTS; v++) {
+         if(variantFound[v]) printf(" %s (%s%s, %s)", evalVariants[v].name, evalKernelName, 
+               evalVariants[v].suffix, evalVariants[v].description);
+      }
+      printf("\n");
+   }
+
+   // the tuned launch shapes are kept with the compiled programs
+   char launchProfileFileName[MAX_STR_SZ];
+   launchProfileFileName[0] = '\0';
+   if(programCacheDir[0] != '\0') {
+      int len = snprintf(launchProfileFileName, sizeof(launchProfileFileName), "%s/launch_profiles.txt", programCacheDir);
+      if(len < 0 || (size_t) len >= sizeof(launchProfileFileName)) {
+         printf("OpenCL program cache directory %s is too long, the launch shapes are not kept\n", programCacheDir);
+         launchProfileFileName[0] = '\0';
+      }
+   }
+
+   launchTuner = new LaunchTuner(launchProfileFileName);
+
+   for(int d = 0; d < num_devices; d++) {
+      pEval_device *dev = &devs[d];
+
+      for(int v = 0; v < EVAL_VARIANTS; v++) {
+         char kernelName[MAX_STR_SZ];
+         snprintf(kernelName, sizeof(kernelName), "%s%s", evalKernelName, evalVariants[v].suffix);	// fits, checked when the kernels were created
+
+         dev->variantTuneIds[v] = -1;
+         if(dev->variantKernels[v] != NULL) {
+            dev->variantTuneIds[v] = launchTuner->addKernel(dev->variantKernels[v], dev->device, kernelName, tuneLaunch);
+         }
+      }
+
+      dev->coarseTuneId = -1;
+      dev->coarsePointsTuneId = -1;
+      dev->coarseBankTuneId = -1;
+      dev->evalSlotEndArg = -1;
+      dev->coarseSlotEndArg = -1;
+
+      // the variant asked for, or the evaluation kernel if the device does not have it.
+      // With more than one variant to choose from auto picks one on the first evaluation
+      int available = 0;
+      for(int v = 0; v < EVAL_VARIANTS; v++) {
+         if(dev->variantKernels[v] != NULL && !evalVariants[v].single_precision) available++;
+      }
+
+      if(evalVariant == EVAL_VARIANT_AUTO) {
+         useVariant(d, (available > 1) ? EVAL_VARIANT_AUTO : 0);
+      }
+      else if(dev->variantKernels[evalVariant] == NULL) {
+         printf("Device %d (%s) has no %s variant of %s, using %s\n", d, dev->name, 
+               evalVariants[evalVariant].name, evalKernelName, evalKernelName);
+         useVariant(d, 0);
+      }
+      else useVariant(d, evalVariant);
    }
 
+   if(evalVariant == EVAL_VARIANT_AUTO && num_devices > 0 && devs[0].variant == EVAL_VARIANT_AUTO) {
+      printf("The fastest variant is picked on the first evaluation of each device\n");
+   }
+   printf("\n");
 
-   free(platforms);
+   free(devicePlatforms);
+   free(groupFirst);
    free(devices);
    free(source);
 
 }
 
 
-// initialize inputs to OpenCL kernel
-void pEval::OpenCL_initInputs()
+// make sure *buf holds at least size bytes, (re)creating it with mem_flags if 
+// it is smaller or was created with different flags (host_ptr is only used when
+// mem_flags contains CL_MEM_COPY_HOST_PTR). Returns true if a new buffer was created.
+static bool growBuffer(cl_context context, cl_mem *buf, size_t *capacity, cl_mem_flags *buf_flags,
+      cl_mem_flags mem_flags, size_t size, void *host_ptr)
 {
    cl_int status;
 
-   active_mask_host = (int *) malloc(num_funcs*sizeof(int));
-   F_host = (double *) malloc(num_funcs * sizeof(double));
-   x_host = (double *) malloc(num_vars * num_funcs * sizeof(double));
-   g_host = (double *) malloc(num_vars * num_funcs * sizeof(double));
-  
-   for(int i = 0; i < num_funcs; i++)
-   {
-      active_mask_host[i] = 1;
-   }
+   if((*buf != NULL) && (size <= *capacity) && (mem_flags == *buf_flags)) return false;
 
-   active_mask_dev = clCreateBuffer(context, CL_MEM_READ_WRITE,
-         num_funcs * sizeof(int), NULL, &status);
-   if(status != CL_SUCCESS || active_mask_dev == NULL) {
-      printf("clCreateBuffer failed\n");
-      exit(-1);
-   }
+   if(*buf != NULL) clReleaseMemObject(*buf);
 
-   F_dev = clCreateBuffer(context, CL_MEM_READ_WRITE,
-        num_funcs * sizeof(double), NULL, &status);
-   if(status != CL_SUCCESS || F_dev == NULL) {
+   *buf = clCreateBuffer(context, mem_flags, size, host_ptr, &status);
+   if(status != CL_SUCCESS || *buf == NULL) {
       printf("clCreateBuffer failed\n");
       exit(-1);
    }
 
-   x_dev = clCreateBuffer(context, CL_MEM_READ_WRITE,
-        num_vars * num_funcs * sizeof(double), NULL, &status);
-   if(status != CL_SUCCESS || x_dev == NULL) {
-      printf("clCreateBuffer failed\n");
-      exit(-1);
-   }
+   *capacity = size;
+   *buf_flags = mem_flags;
 
-   g_dev = clCreateBuffer(context, CL_MEM_READ_WRITE,
-        num_vars * num_funcs * sizeof(double), NULL, &status);
-   if(status != CL_SUCCESS || g_dev == NULL) {
-      printf("clCreateBuffer failed\n");
-      exit(-1);
-   }
+   return true;
+}
 
 
-   // set up problem specific inputs
-   for(int i = 0; i < num_user_args; i++)
+// copy size bytes of data to a read-only device buffer, growing it if needed
+static void uploadConstBuffer(cl_context context, cl_command_queue cmdQueue, cl_mem *buf, size_t *capacity,
+      size_t size, void *data)
+{
+   cl_mem_flags flags = CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR;
+
+   if(!growBuffer(context, buf, capacity, &flags, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, size, data))
    {
+      cl_int status = clEnqueueWriteBuffer(cmdQueue, *buf, CL_TRUE, 0, size, data, 0, NULL, NULL);
+      if(status != CL_SUCCESS) {
+         printf("clEnqueueWriteBuffer failed\n");
+         exit(-1);
+      }
+   }
+}
 
-      if(user_buffs[i].arg.buffer == true)
-      {
-         cl_int status;
-         void *host_ptr;
-         cl_mem_flags mem_flags;
 
-         if(user_buffs[i].arg.small_const == true)
-         {
-            mem_flags = CL_MEM_READ_ONLY;
-         }
+// create a buffer of size bytes in pinned host memory and map it for the host,
+// it stays mapped until unmapPinned()
+static void *mapPinned(cl_context context, cl_command_queue cmdQueue, cl_mem *buf, size_t size)
+{
+   cl_int status;
 
-         else mem_flags = CL_MEM_READ_WRITE;
+   *buf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &status);
+   if(status != CL_SUCCESS || *buf == NULL) {
+      printf("clCreateBuffer failed\n");
+      exit(-1);
+   }
 
-         if(user_buffs[i].arg.init == true)
-         {
-            mem_flags |= CL_MEM_COPY_HOST_PTR;
-            host_ptr = user_buffs[i].arg.data;
-         }
+   void *ptr = clEnqueueMapBuffer(cmdQueue, *buf, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 
+         0, NULL, NULL, &status);
+   if(status != CL_SUCCESS || ptr == NULL) {
+      printf("clEnqueueMapBuffer failed\n");
+      exit(-1);
+   }
 
-         else host_ptr = NULL;
+   return ptr;
+}
 
-         size_t size = user_buffs[i].arg.size;
 
-         user_buffs[i].data_dev = clCreateBuffer(context, mem_flags,
-             size, host_ptr, &status);
+// unmap and release a buffer created by mapPinned()
+static void unmapPinned(cl_command_queue cmdQueue, cl_mem *buf, void *ptr)
+{
+   if(*buf == NULL) return;
 
-         if(status != CL_SUCCESS || user_buffs[i].data_dev == NULL) {
-            printf("clCreateBuffer failed\n");
-            exit(-1);
-         }
+   clEnqueueUnmapMemObject(cmdQueue, *buf, ptr, 0, NULL, NULL);
+   clFinish(cmdQueue);
+   clReleaseMemObject(*buf);
+   *buf = NULL;
+}
 
-      }
 
+// allocate the packed host staging buffers for the evaluation points of capacity_funcs functions
+void pEval::allocStagingBuffers()
+{
+   size_t slots = (size_t) capacity_funcs * evalPoints;
 
+   // the pinned buffers are mapped through the first device's queue, the other
+   // devices (also the ones in other contexts) copy from them as ordinary host memory
+   cl_context context = devs[0].context;
+   cl_command_queue cmdQueue = devs[0].cmdQueue;
 
+   switch(hostMemory)
+   {
+   case BFGSB_CL_HOST_MEMORY_PINNED:
+      F_packed_host = (double *) mapPinned(context, cmdQueue, &F_pinned, slots * sizeof(double));
+      x_packed_host = (double *) mapPinned(context, cmdQueue, &x_pinned, num_vars * slots * sizeof(double));
+      g_packed_host = (double *) mapPinned(context, cmdQueue, &g_pinned, g_stride * slots * sizeof(double));
+      func_ids_host = (int *) mapPinned(context, cmdQueue, &func_ids_pinned, slots * sizeof(int));
+      break;
+   case BFGSB_CL_HOST_MEMORY_ZERO_COPY:
+      // the slots are mapped from the device buffers, only the ids are kept on the host
+      func_ids_host = (int *) malloc(slots * sizeof(int));
+      break;
+   default:
+      F_packed_host = (double *) malloc(slots * sizeof(double));
+      x_packed_host = (double *) malloc(num_vars * slots * sizeof(double));
+      g_packed_host = (double *) malloc(g_stride * slots * sizeof(double));
+      func_ids_host = (int *) malloc(slots * sizeof(int));
+      break;
    }
+}
 
 
-   // set up eval kernel parameters
-   status  = clSetKernelArg(evalKernel, 0, sizeof(cl_mem), &active_mask_dev);
-   status |= clSetKernelArg(evalKernel, 1, sizeof(cl_mem), &F_dev);
-   status |= clSetKernelArg(evalKernel, 2, sizeof(cl_mem), &x_dev);
-   status |= clSetKernelArg(evalKernel, 3, sizeof(cl_mem), &g_dev);
+// free the packed host staging buffers
+void pEval::freeStagingBuffers()
+{
+   if(hostMemory == BFGSB_CL_HOST_MEMORY_PINNED)
+   {
+      cl_command_queue cmdQueue = (num_devices > 0) ? devs[0].cmdQueue : NULL;
 
-   if(status != CL_SUCCESS)
+      unmapPinned(cmdQueue, &F_pinned, F_packed_host);
+      unmapPinned(cmdQueue, &x_pinned, x_packed_host);
+      unmapPinned(cmdQueue, &g_pinned, g_packed_host);
+      unmapPinned(cmdQueue, &func_ids_pinned, func_ids_host);
+   }
+   else
    {
-      printf("clSetKernelArg error 1\n");
-      exit(-1);
+      free(F_packed_host);
+      free(x_packed_host);
+      free(g_packed_host);
+      free(func_ids_host);
    }
 
+   F_packed_host = NULL;
+   x_packed_host = NULL;
+   g_packed_host = NULL;
+   func_ids_host = NULL;
+}
 
-   for(int i = 0; i < num_user_args; i++)
+
+// initialize inputs to OpenCL kernel for the current problem
+// buffers are only reallocated when they grow past their high-water mark
+void pEval::OpenCL_initInputs(double *coarse_grain_points, const bfgsb_cl_coarse_grain_bank *coarse_grain_bank)
+{
+   cl_int status;
+
+   if(num_funcs > capacity_funcs)
    {
-      if(user_buffs[i].arg.buffer == true)
+      // nothing needs to be kept from the previous batch
+      free(F_host);
+      free(x_host);
+      free(g_host);
+      free(Fc_host);
+      free(xc_host);
+      free(gc_host);
+      free(point_ids_host);
+      free(all_ids);
+      freeStagingBuffers();
+
+      F_host = (double *) malloc(num_funcs * sizeof(double));
+      x_host = (double *) malloc(num_vars * num_funcs * sizeof(double));
+      g_host = (double *) malloc(g_stride * num_funcs * sizeof(double));
+      all_ids = (int *) malloc(num_funcs * sizeof(int));
+
+      if(evalPoints > 1)
       {
-         status |= clSetKernelArg(evalKernel, 4+i, sizeof(cl_mem), &user_buffs[i].data_dev);
+         Fc_host = (double *) malloc((evalPoints - 1) * num_funcs * sizeof(double));
+         xc_host = (double *) malloc((evalPoints - 1) * num_vars * num_funcs * sizeof(double));
+         gc_host = (double *) malloc((evalPoints - 1) * g_stride * num_funcs * sizeof(double));
       }
 
-      else
-      {
-         status |= clSetKernelArg(evalKernel, 4+i, user_buffs[i].arg.size, user_buffs[i].arg.data);
-      }
+      // every evaluation point of every function can have a slot
+      size_t slots = (size_t) num_funcs * evalPoints;
+      point_ids_host = (int *) malloc(slots * sizeof(int));
 
-      if(status != CL_SUCCESS)
+      capacity_funcs = num_funcs;
+      allocStagingBuffers();
+
+      // zero-copy device buffers live in host memory
+      cl_mem_flags hostFlags = 0;
+      if(hostMemory == BFGSB_CL_HOST_MEMORY_ZERO_COPY) hostFlags = CL_MEM_ALLOC_HOST_PTR;
+
+      for(int d = 0; d < num_devices; d++)
       {
-         printf("%d\n", status);
-         printf("clSetKernelArg error\n");
-         exit(-1);
+         pEval_device *dev = &devs[d];
+
+         // capacity 0 makes growBuffer() release the old device buffer and create a new one
+         size_t capacity;
+         cl_mem_flags flags;
+
+         capacity = 0;
+         growBuffer(dev->context, &dev->func_ids_dev, &capacity, &flags, CL_MEM_READ_ONLY | hostFlags, slots * sizeof(int), NULL);
+         capacity = 0;
+         growBuffer(dev->context, &dev->F_dev, &capacity, &flags, CL_MEM_READ_WRITE | hostFlags, slots * sizeof(double), NULL);
+         capacity = 0;
+         growBuffer(dev->context, &dev->x_dev, &capacity, &flags, CL_MEM_READ_WRITE | hostFlags, num_vars * slots * sizeof(double), NULL);
+         capacity = 0;
+         growBuffer(dev->context, &dev->g_dev, &capacity, &flags, CL_MEM_READ_WRITE | hostFlags, g_stride * slots * sizeof(double), NULL);
+
+         free(dev->func_ids_sent);
+         dev->func_ids_sent = (int *) malloc(slots * sizeof(int));
       }
+   }
+  
+   int num_slots = num_funcs * evalPoints;
+
+   for(int i = 0; i < num_funcs; i++)
+   {
+      all_ids[i] = i;
+   }
+
+   for(int i = 0; i < num_slots; i++)
+   {
+      func_ids_host[i] = -1;	// nothing on the device yet
+   }
+
+   for(int d = 0; d < num_devices; d++)
+   {
+      for(int i = 0; i < num_slots; i++) devs[d].func_ids_sent[i] = -1;
+   }
+
+
+   // set up problem specific inputs
+   // (every device gets its own copy of the user buffers)
+   for(int i = 0; i < num_user_args; i++)
+   {
+
+      if(user_buffs[i].arg.buffer == true)
+      {
+         void *host_ptr;
+         cl_mem_flags mem_flags;
+
+         if(user_buffs[i].arg.small_const == true)
+         {
+            mem_flags = CL_MEM_READ_ONLY;
+         }
+
+         else mem_flags = CL_MEM_READ_WRITE;
+
+         if(user_buffs[i].arg.init == true)
+         {
+            host_ptr = user_buffs[i].arg.data;
+         }
+
+         else host_ptr = NULL;
+
+         size_t size = user_buffs[i].arg.size;
+         size_t capacity = user_buffs[i].capacity;
+         cl_mem_flags buf_flags = user_buffs[i].mem_flags;
+
+         for(int d = 0; d < num_devices; d++)
+         {
+            // growBuffer() updates them for each device in the same way
+            user_buffs[i].capacity = capacity;
+            user_buffs[i].mem_flags = buf_flags;
+
+            // a new buffer is initialized at creation, an old one is overwritten
+            bool created = growBuffer(devs[d].context, &user_buffs[i].data_dev[d], &user_buffs[i].capacity, &user_buffs[i].mem_flags,
+                  mem_flags | ((host_ptr != NULL) ? CL_MEM_COPY_HOST_PTR : 0), size, host_ptr);
+
+            if(!created && (host_ptr != NULL))
+            {
+               status = clEnqueueWriteBuffer(devs[d].cmdQueue, user_buffs[i].data_dev[d], CL_TRUE, 0,
+                     size, host_ptr, 0, NULL, NULL);
+               if(status != CL_SUCCESS) {
+                  printf("clEnqueueWriteBuffer failed\n");
+                  exit(-1);
+               }
+            }
+         }
+      }
+
+
+
+   }
+
+
+   // set up eval kernel parameters (of every variant)
+   for(int d = 0; d < num_devices; d++)
+   {
+      pEval_device *dev = &devs[d];
+
+      // a kernel with one more argument takes the end of its slots there (set at each launch)
+      cl_uint numArgs = 0;
+      clGetKernelInfo(dev->variantKernels[0], CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &numArgs, NULL);
+      dev->evalSlotEndArg = (numArgs == (cl_uint) (4 + num_user_args + 1)) ? 4 + num_user_args : -1;
+
+      for(int v = 0; v < EVAL_VARIANTS; v++)
+      {
+         cl_kernel kernel = dev->variantKernels[v];
+         if(kernel == NULL) continue;
+
+         // a variant with other arguments than the evaluation kernel, or one that needs a fixed
+         // work-group size but can not be launched padded to it, is not used
+         cl_uint variantArgs = 0;
+         size_t compileSize[3] = {0, 0, 0};
+         clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &variantArgs, NULL);
+         clGetKernelWorkGroupInfo(kernel, dev->device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE, 
+               sizeof(compileSize), compileSize, NULL);
+
+         if(v > 0 && (variantArgs != numArgs || (compileSize[0] > 0 && dev->evalSlotEndArg < 0)))
+         {
+            printf("The %s variant of %s does not take the same arguments, it is not used\n",
+                  evalVariants[v].name, evalKernelName);
+            clReleaseKernel(kernel);
+            dev->variantKernels[v] = NULL;
+            useVariant(d, (dev->variant == v) ? 0 : dev->variant);
+            continue;
+         }
 
+         status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &dev->func_ids_dev);
+         status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &dev->F_dev);
+         status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &dev->x_dev);
+         status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &dev->g_dev);
 
+         if(status != CL_SUCCESS)
+         {
+            printf("clSetKernelArg error 1\n");
+            exit(-1);
+         }
+
+
+         for(int i = 0; i < num_user_args; i++)
+         {
+            if(user_buffs[i].arg.buffer == true)
+            {
+               status |= clSetKernelArg(kernel, 4+i, sizeof(cl_mem), &user_buffs[i].data_dev[d]);
+            }
+
+            else
+            {
+               status |= clSetKernelArg(kernel, 4+i, user_buffs[i].arg.size, user_buffs[i].arg.data);
+            }
+
+            if(status != CL_SUCCESS)
+            {
+               printf("%d\n", status);
+               printf("clSetKernelArg error\n");
+               exit(-1);
+            }
+         }
+      }
    }
 
    //********************************************************************
@@ -492,50 +1148,167 @@ void pEval::OpenCL_initInputs()
 
    if((use_coarse_grain_search) && (coarse_grain_n > 0))
    {
+      size_t points_size = coarse_grain_n * num_vars * sizeof(double);
+      size_t points_capacity = capacity_coarse_grain_points;
+      size_t init_ret_capacity = capacity_init_ret;
 
-      coarse_grain_points_dev = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
-            coarse_grain_n * num_vars * sizeof(double) , coarse_grain_points, &status);
-      if(status != CL_SUCCESS || coarse_grain_points_dev == NULL) {
-         printf("clCreateBuffer failed\n");
-         exit(-1);
-      }
+      printf("coarse grain n = %d\n", coarse_grain_n);
 
-      init_ret_dev = clCreateBuffer(context, CL_MEM_READ_WRITE,
-            num_vars * num_funcs * sizeof(double), NULL, &status);
-      if(status != CL_SUCCESS || init_ret_dev == NULL) {
-         printf("clCreateBuffer failed\n");
-         exit(-1);
-      }
+      // with a model bank the bank kernel scores the functions against it, the squared
+      // norms of the models are the same for every function and computed here once
+      char bankKernelName[MAX_STR_SZ];
+      sprintf(bankKernelName, "%s%s", coarseGrainKernel_name, coarseGrainBankKernel_suffix);
+
+      double *bank_norm2 = NULL;
+      int *bank_ids = NULL;
+      size_t bank_size = 0;
+      size_t norm2_size = 0;
+      size_t bank_ids_size = num_funcs * sizeof(cl_int);
+      size_t bank_capacity = capacity_coarse_grain_bank;
+      size_t norm2_capacity = capacity_coarse_grain_norm2;
+      size_t bank_ids_capacity = capacity_coarse_grain_bank_ids;
+
+      if(coarse_grain_bank != NULL)
+      {
+         int num_models = coarse_grain_bank->num_banks * coarse_grain_n;
+         int dim = coarse_grain_bank->dim;
 
-      printf("coarse grain n = %d\n", coarse_grain_n);
+         bank_size = (size_t) num_models * dim * sizeof(double);
+         norm2_size = num_models * sizeof(double);
 
-      status  = clSetKernelArg(coarseGrainedSearchKernel, 0, sizeof(cl_int), &coarse_grain_n);
-      status |= clSetKernelArg(coarseGrainedSearchKernel, 1, sizeof(cl_mem), &coarse_grain_points_dev);
-      status |= clSetKernelArg(coarseGrainedSearchKernel, 2, sizeof(cl_mem), &init_ret_dev);
+         bank_norm2 = (double *) malloc(norm2_size);
+         for(int i = 0; i < num_models; i++)
+         {
+            double *m = coarse_grain_bank->models + (size_t) i * dim;
+            double sum = 0;
+            for(int j = 0; j < dim; j++) sum += m[j] * m[j];
+            bank_norm2[i] = sum;
+         }
 
+         bank_ids = coarse_grain_bank->bank_ids;
+         if(bank_ids == NULL) bank_ids = (int *) calloc(num_funcs, sizeof(int));
+      }
 
-      for(int i = 0; i < num_user_args; i++)
+      for(int d = 0; d < num_devices; d++)
       {
-         if(user_buffs[i].arg.buffer == true)
+         pEval_device *dev = &devs[d];
+
+         // the coarse grain kernels are only created once a batch needs them,
+         // a program without the bank kernel evaluates f at every point
+         if(coarse_grain_bank != NULL && dev->coarseBankKernel == NULL && dev->coarseBankTuneId == -1)
          {
-            status |= clSetKernelArg(coarseGrainedSearchKernel, 3+i, sizeof(cl_mem), &user_buffs[i].data_dev);
+            dev->coarseBankKernel = clCreateKernel(dev->program, bankKernelName, &status);
+            if(status != CL_SUCCESS)
+            {
+               dev->coarseBankKernel = NULL;
+               dev->coarseBankTuneId = -2;
+               printf("Device %d (%s) has no %s kernel, evaluating f at every coarse grain point\n", d, dev->name, bankKernelName);
+            }
+            else dev->coarseBankTuneId = launchTuner->addKernel(dev->coarseBankKernel, dev->device, bankKernelName, tuneLaunch);
          }
 
+         if(coarse_grain_bank == NULL || dev->coarseBankKernel == NULL)
+         {
+            if(dev->coarsePointsKernel == NULL)
+            {
+               dev->coarsePointsKernel = clCreateKernel(dev->program, coarseGrainKernel_name, &status);
+               if(status != CL_SUCCESS) {
+                  printf("clCreateKernel failed\n");
+                  exit(-1);
+               }
+
+               dev->coarsePointsTuneId = launchTuner->addKernel(dev->coarsePointsKernel, dev->device, coarseGrainKernel_name, tuneLaunch);
+            }
+
+            dev->coarseGrainedSearchKernel = dev->coarsePointsKernel;
+            dev->coarseTuneId = dev->coarsePointsTuneId;
+         }
          else
          {
-            status |= clSetKernelArg(coarseGrainedSearchKernel, 3+i, user_buffs[i].arg.size, user_buffs[i].arg.data);
+            dev->coarseGrainedSearchKernel = dev->coarseBankKernel;
+            dev->coarseTuneId = dev->coarseBankTuneId;
          }
 
-         if(status != CL_SUCCESS)
+         bool useBank = (dev->coarseGrainedSearchKernel == dev->coarseBankKernel);
+
+         cl_mem_flags flags = CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR;		// these buffers always use the same flags
+
+         capacity_coarse_grain_points = points_capacity;
+         if(!growBuffer(dev->context, &dev->coarse_grain_points_dev, &capacity_coarse_grain_points, &flags, 
+                  CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, points_size, coarse_grain_points))
          {
-            printf("%d\n", status);
-            printf("clSetKernelArg error\n");
-            exit(-1);
+            status = clEnqueueWriteBuffer(dev->cmdQueue, dev->coarse_grain_points_dev, CL_TRUE, 0,
+                  points_size, coarse_grain_points, 0, NULL, NULL);
+            if(status != CL_SUCCESS) {
+               printf("clEnqueueWriteBuffer failed\n");
+               exit(-1);
+            }
          }
 
+         flags = CL_MEM_READ_WRITE;
+         capacity_init_ret = init_ret_capacity;
+         growBuffer(dev->context, &dev->init_ret_dev, &capacity_init_ret, &flags, 
+               CL_MEM_READ_WRITE, num_vars * num_funcs * sizeof(double), NULL);
+
+         status  = clSetKernelArg(dev->coarseGrainedSearchKernel, 0, sizeof(cl_int), &coarse_grain_n);
+         status |= clSetKernelArg(dev->coarseGrainedSearchKernel, 1, sizeof(cl_mem), &dev->coarse_grain_points_dev);
+         status |= clSetKernelArg(dev->coarseGrainedSearchKernel, 2, sizeof(cl_mem), &dev->init_ret_dev);
+
+         // the bank kernel takes the bank after the standard arguments
+         // (dimension, models, their squared norms and the bank of every function)
+         int firstUserArg = 3;
 
+         if(useBank)
+         {
+            capacity_coarse_grain_bank = bank_capacity;
+            uploadConstBuffer(dev->context, dev->cmdQueue, &dev->coarse_grain_bank_dev, &capacity_coarse_grain_bank,
+                  bank_size, coarse_grain_bank->models);
+            capacity_coarse_grain_norm2 = norm2_capacity;
+            uploadConstBuffer(dev->context, dev->cmdQueue, &dev->coarse_grain_norm2_dev, &capacity_coarse_grain_norm2,
+                  norm2_size, bank_norm2);
+            capacity_coarse_grain_bank_ids = bank_ids_capacity;
+            uploadConstBuffer(dev->context, dev->cmdQueue, &dev->coarse_grain_bank_ids_dev, &capacity_coarse_grain_bank_ids,
+                  bank_ids_size, bank_ids);
+
+            cl_int dim = coarse_grain_bank->dim;
+            status |= clSetKernelArg(dev->coarseGrainedSearchKernel, 3, sizeof(cl_int), &dim);
+            status |= clSetKernelArg(dev->coarseGrainedSearchKernel, 4, sizeof(cl_mem), &dev->coarse_grain_bank_dev);
+            status |= clSetKernelArg(dev->coarseGrainedSearchKernel, 5, sizeof(cl_mem), &dev->coarse_grain_norm2_dev);
+            status |= clSetKernelArg(dev->coarseGrainedSearchKernel, 6, sizeof(cl_mem), &dev->coarse_grain_bank_ids_dev);
+            firstUserArg = 7;
+         }
+
+
+         for(int i = 0; i < num_user_args; i++)
+         {
+            if(user_buffs[i].arg.buffer == true)
+            {
+               status |= clSetKernelArg(dev->coarseGrainedSearchKernel, firstUserArg+i, sizeof(cl_mem), &user_buffs[i].data_dev[d]);
+            }
+
+            else
+            {
+               status |= clSetKernelArg(dev->coarseGrainedSearchKernel, firstUserArg+i, user_buffs[i].arg.size, user_buffs[i].arg.data);
+            }
+
+            if(status != CL_SUCCESS)
+            {
+               printf("%d\n", status);
+               printf("clSetKernelArg error\n");
+               exit(-1);
+            }
+
+
+         }
+
+         cl_uint numArgs = 0;
+         clGetKernelInfo(dev->coarseGrainedSearchKernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &numArgs, NULL);
+         dev->coarseSlotEndArg = (numArgs == (cl_uint) (firstUserArg + num_user_args + 1)) ? firstUserArg + num_user_args : -1;
       }
 
+      free(bank_norm2);
+      if(coarse_grain_bank != NULL && coarse_grain_bank->bank_ids == NULL) free(bank_ids);
+
    }
 
 
@@ -543,148 +1316,1029 @@ void pEval::OpenCL_initInputs()
 
 
 
-// do parallel evaluation on the GPU
+// do parallel evaluation of all functions on the GPU
 void pEval::eval()
 {
+   evalAsync(0, 0, all_ids, num_funcs);
+   evalWait(0);
+}
+
+
+// split count slots over the devices in proportion to their evaluation rates
+// (in proportion to their compute units until all rates have been measured)
+void pEval::splitSlots(int count, int *dev_count)
+{
+   bool measured = true;
+   for(int d = 0; d < num_devices; d++)
+   {
+      if(!devs[d].rateMeasured) measured = false;
+   }
+
+   double total_weight = 0;
+   for(int d = 0; d < num_devices; d++)
+   {
+      total_weight += measured ? devs[d].rate : devs[d].computeUnits;
+   }
+
+   // each device gets its share of the slots left, the last one the rest
+   int left = count;
+   for(int d = 0; d < num_devices; d++)
+   {
+      double weight = measured ? devs[d].rate : devs[d].computeUnits;
+      int n = left;
+
+      if(d < num_devices - 1) n = (int) (left * (weight / total_weight) + 0.5);
+      if(n > left) n = left;
+
+      dev_count[d] = n;
+      left -= n;
+      total_weight -= weight;
+   }
+}
+
+
+// start parallel evaluation of the functions in func_ids on the GPU
+// only these functions are transferred and launched: their x is gathered into
+// slots [first_slot, first_slot+count) of the packed buffers, the kernel maps
+// each slot back to its function number through the func_ids buffer and 
+// evalWait() scatters the packed F and gradient back.
+// With several devices each one gets a contiguous slice of the slots.
+// The host x of these functions must not be changed until evalWait(cohort) 
+// returns, and their host F and g are not valid until then.
+void pEval::evalAsync(int cohort, int first_slot, const int *func_ids, int count)
+{
+   // time spent enqueueing also counts as host time lost to the GPU
+   // (some OpenCL implementations do the work inside the enqueue calls)
+   struct timeval start, end;
+   gettimeofday(&start, NULL); 
+
+   cohortFirstSlot[cohort] = first_slot;
+   cohortCount[cohort] = count;
+
+   // the evaluation points of the slots are kept on the host for evalWait(),
+   // the device gets their function ids
+   memcpy(point_ids_host + first_slot, func_ids, count * sizeof(int));
+
+   for(int i = 0; i < count; i++)
+   {
+      func_ids_host[first_slot + i] = pointFunc(func_ids[i]);
+   }
+
+   splitSlots(count, sliceCount);
+
+   int slices = 0;
+   for(int d = 0; d < num_devices; d++)
+   {
+      if(sliceCount[d] > 0) slices++;
+   }
+
+   // the done callback is called when the last slice is finished
+   pthread_mutex_lock(&callbackMutex);
+   cohortPending[cohort] = slices;
+   pthread_mutex_unlock(&callbackMutex);
+
+   int slot = first_slot;
+   for(int d = 0; d < num_devices; d++)
+   {
+      devs[d].cohortFirstSlot[cohort] = slot;
+      devs[d].cohortCount[cohort] = sliceCount[d];
+
+      if(sliceCount[d] > 0) evalSliceAsync(d, cohort, slot, sliceCount[d]);
+      slot += sliceCount[d];
+   }
+
+   gettimeofday(&end, NULL); 
+   hostWait_ms += calc_time(&start, &end) - 0.5;  // calc_time() rounds up by 0.5 ms
+}
+
+
+// start the evaluation of slots [first_slot, first_slot+count) of cohort on device d
+void pEval::evalSliceAsync(int d, int cohort, int first_slot, int count)
+{
+   pEval_device *dev = &devs[d];
+   cl_command_queue cmdQueue = dev->cmdQueue;
+   const int *func_ids = func_ids_host + first_slot;
 
    cl_int status;
 
-   // transfer x and active mask data to the GPU
+   bool zeroCopy = (hostMemory == BFGSB_CL_HOST_MEMORY_ZERO_COPY);
 
-   status = clEnqueueWriteBuffer(cmdQueue, active_mask_dev, CL_TRUE, 0,
-         num_funcs * sizeof(int), active_mask_host, 
-         0, NULL, NULL);         
-   if(status != CL_SUCCESS) {
-      printf("clEnqueueWriteBuffer failed\n");
-      exit(-1);
+   // transfer the function ids only if they changed since the last time these slots were used
+   // on this device (they only change when solvers finish or the split moves), then transfer x.
+   // Zero-copy maps the slots of the device buffers, writes them and unmaps them
+   // again instead (with an in-order queue mapping waits for the commands before it,
+   // the previous evaluation of these slots is always finished)
+
+   cl_event idsWritten = NULL;
+
+   if(memcmp(dev->func_ids_sent + first_slot, func_ids, count * sizeof(int)) != 0)
+   {
+      memcpy(dev->func_ids_sent + first_slot, func_ids, count * sizeof(int));
+
+      if(zeroCopy)
+      {
+         int *ids_mapped = (int *) clEnqueueMapBuffer(cmdQueue, dev->func_ids_dev, CL_TRUE, CL_MAP_WRITE, 
+               first_slot * sizeof(int), count * sizeof(int), 0, NULL, NULL, &status);
+         if(status != CL_SUCCESS) {
+            printf("clEnqueueMapBuffer failed\n");
+            exit(-1);
+         }
+
+         memcpy(ids_mapped, func_ids, count * sizeof(int));
+         status = clEnqueueUnmapMemObject(cmdQueue, dev->func_ids_dev, ids_mapped, 0, NULL, &idsWritten);
+      }
+      else
+      {
+         status = clEnqueueWriteBuffer(cmdQueue, dev->func_ids_dev, CL_FALSE, first_slot * sizeof(int),
+               count * sizeof(int), func_ids, 
+               0, NULL, &idsWritten);         
+      }
+      if(status != CL_SUCCESS) {
+         printf("transfer of function ids failed\n");
+         exit(-1);
+      }
+   }
+
+   double *x_packed;
+   if(zeroCopy)
+   {
+      x_packed = (double *) clEnqueueMapBuffer(cmdQueue, dev->x_dev, CL_TRUE, CL_MAP_WRITE, 
+            first_slot * num_vars * sizeof(double), count * num_vars * sizeof(double), 0, NULL, NULL, &status);
+      if(status != CL_SUCCESS) {
+         printf("clEnqueueMapBuffer failed\n");
+         exit(-1);
+      }
+   }
+   else
+   {
+      x_packed = x_packed_host + (first_slot * num_vars);
+   }
+
+   // gather x into the packed buffer
+   const int *point_ids = point_ids_host + first_slot;
+
+   for(int i = 0; i < count; i++)
+   {
+      memcpy(x_packed + (i * num_vars), pointx(point_ids[i]), num_vars * sizeof(double));
    }
 
-   status = clEnqueueWriteBuffer(cmdQueue, x_dev, CL_TRUE, 0,
-         num_vars * num_funcs * sizeof(double), x_host, 
-         0, NULL, NULL);         
+   cl_event xWritten = NULL;
+
+   if(zeroCopy)
+   {
+      status = clEnqueueUnmapMemObject(cmdQueue, dev->x_dev, x_packed, 0, NULL, &xWritten);
+   }
+   else
+   {
+      status = clEnqueueWriteBuffer(cmdQueue, dev->x_dev, CL_FALSE, first_slot * num_vars * sizeof(double),
+            count * num_vars * sizeof(double), x_packed, 
+            0, NULL, &xWritten);         
+   }
    if(status != CL_SUCCESS) {
-      printf("clEnqueueWriteBuffer failed\n");
+      printf("transfer of x failed\n");
       exit(-1);
    }
 
-   size_t globalWorkSize[1] = {num_funcs};
-   size_t localWorkSize[1] = {64};
+   // the commands are chained with events so they also run in order on an 
+   // out-of-order queue: the kernel waits for the transfers (and for zero-copy 
+   // for the unmapping of the F and gradient slots of the last evaluation), 
+   // the F transfer waits for the kernel and the gradient transfer for the F transfer
+   cl_event waitList[4];
+   cl_uint numWait = 0;
+
+   if(idsWritten != NULL) waitList[numWait++] = idsWritten;
+   waitList[numWait++] = xWritten;
+   if(dev->cohortUnmapFEvent[cohort] != NULL) waitList[numWait++] = dev->cohortUnmapFEvent[cohort];
+   if(dev->cohortUnmapgEvent[cohort] != NULL) waitList[numWait++] = dev->cohortUnmapgEvent[cohort];
+
+   // the first evaluation large enough to time picks the kernel variant
+   // (in double precision, the single precision variant is not one of the choices)
+   if(dev->variant == EVAL_VARIANT_AUTO && !dev->singlePrecision && count >= LAUNCH_TUNE_MIN_COUNT)
+   {
+      pickVariant(d, first_slot, count, numWait, waitList);
+   }
+
+   // a kernel that checks the end of its slots is launched with the tuned shape
+   // (padded to whole work-groups), others with one work-item per slot
+   launch_shape shape = {0, 1};
+   bool trial = false;
+
+   if(dev->evalSlotEndArg >= 0)
+   {
+      cl_int slot_end = first_slot + count;
+      status = clSetKernelArg(dev->evalKernel, dev->evalSlotEndArg, sizeof(cl_int), &slot_end);
+      if(status != CL_SUCCESS) {
+         printf("clSetKernelArg error\n");
+         exit(-1);
+      }
+
+      shape = launchTuner->getShape(dev->evalTuneId, count, &trial);
+   }
+
+   size_t globalWorkOffset[1] = {(size_t) first_slot};
+   size_t globalWorkSize[1] = {LaunchTuner::globalSize(shape, count)};
+   size_t localWorkSize[1] = {shape.local_size};
+
+   cl_event kernelDone = NULL;
 
    // Execute the kernel.
    // 'globalWorkSize' is the 1D dimension of the work-items
-   status = clEnqueueNDRangeKernel(cmdQueue, evalKernel, 1, NULL, globalWorkSize, 
-                           NULL, 0, NULL, NULL);
+   // (the offset makes get_global_id() return the packed slot number)
+   status = clEnqueueNDRangeKernel(cmdQueue, dev->evalKernel, 1, globalWorkOffset, globalWorkSize, 
+                           (shape.local_size > 0) ? localWorkSize : NULL, numWait, waitList, &kernelDone);
    if(status != CL_SUCCESS) {
       printf("clEnqueueNDRangeKernel failed\n");
       exit(-1);
    }
 
-   clFinish(cmdQueue);
+   // the evaluation starts with the ids write if there is one
+   if(idsWritten != NULL)
+   {
+      clReleaseEvent(xWritten);
+      dev->cohortStartEvent[cohort] = idsWritten;
+   }
+   else dev->cohortStartEvent[cohort] = xWritten;
 
-	// copy F(x) and gradient back to the host
+   if(dev->cohortUnmapFEvent[cohort] != NULL) clReleaseEvent(dev->cohortUnmapFEvent[cohort]);
+   if(dev->cohortUnmapgEvent[cohort] != NULL) clReleaseEvent(dev->cohortUnmapgEvent[cohort]);
+   dev->cohortUnmapFEvent[cohort] = NULL;
+   dev->cohortUnmapgEvent[cohort] = NULL;
 
-   status = clEnqueueReadBuffer(cmdQueue, F_dev, CL_TRUE, 0,
-         num_funcs * sizeof(double), F_host, 
-         0, NULL, NULL);
+   cl_event FRead = NULL;
+
+	// copy packed F(x) and gradient back to the host
+	// (zero-copy maps them for reading until evalWait() is done with them)
+
+   if(zeroCopy)
+   {
+      dev->cohortFMapped[cohort] = (double *) clEnqueueMapBuffer(cmdQueue, dev->F_dev, CL_FALSE, CL_MAP_READ, 
+            first_slot * sizeof(double), count * sizeof(double), 1, &kernelDone, &FRead, &status);
+   }
+   else
+   {
+      status = clEnqueueReadBuffer(cmdQueue, dev->F_dev, CL_FALSE, first_slot * sizeof(double),
+            count * sizeof(double), F_packed_host + first_slot, 
+            1, &kernelDone, &FRead);
+   }
 
    if(status != CL_SUCCESS) {
-      printf("clEnqueueReadBuffer failed\n");
+      printf("transfer of F failed\n");
       exit(-1);
    }
 
-
-   status = clEnqueueReadBuffer(cmdQueue, g_dev, CL_TRUE, 0,
-         num_vars * num_funcs * sizeof(double), g_host, 
-         0, NULL, NULL);
+   if(zeroCopy)
+   {
+      dev->cohortgMapped[cohort] = (double *) clEnqueueMapBuffer(cmdQueue, dev->g_dev, CL_FALSE, CL_MAP_READ, 
+            first_slot * g_stride * sizeof(double), count * g_stride * sizeof(double), 
+            1, &FRead, &dev->cohortDoneEvent[cohort], &status);
+   }
+   else
+   {
+      status = clEnqueueReadBuffer(cmdQueue, dev->g_dev, CL_FALSE, first_slot * g_stride * sizeof(double),
+            count * g_stride * sizeof(double), g_packed_host + (first_slot * g_stride), 
+            1, &FRead, &dev->cohortDoneEvent[cohort]);
+   }
 
    if(status != CL_SUCCESS) {
-      printf("clEnqueueReadBuffer failed\n");
+      printf("transfer of gradient failed\n");
       exit(-1);
    }
 
+   // a kernel trying a candidate shape is timed by evalWait()
+   if(trial)
+   {
+      dev->cohortKernelEvent[cohort] = kernelDone;
+      dev->cohortShape[cohort] = shape;
+   }
+   else clReleaseEvent(kernelDone);
+
+   clReleaseEvent(FRead);
+
+   // tell the owner when the devices are done with this cohort
+   if(doneCallback != NULL)
+   {
+      status = clSetEventCallback(dev->cohortDoneEvent[cohort], CL_COMPLETE, evalDoneNotify, &cohortRefs[cohort]);
+      if(status != CL_SUCCESS) {
+         printf("clSetEventCallback failed\n");
+         exit(-1);
+      }
+   }
+
+   // make sure the device starts working while the host goes on
+   clFlush(cmdQueue);
+}
+
+
+// evaluate with variant v of the evaluation kernel on device d (EVAL_VARIANT_AUTO evaluates
+// with the evaluation kernel until a variant is picked), or with the device's single 
+// precision variant while single precision is on
+void pEval::useVariant(int d, int v)
+{
+   pEval_device *dev = &devs[d];
+
+   int k = (v == EVAL_VARIANT_AUTO) ? 0 : v;
+
+   dev->singlePrecision = false;
+   for(int s = 0; s < EVAL_VARIANTS && singlePrecision; s++)
+   {
+      if(evalVariants[s].single_precision && dev->variantKernels[s] != NULL)
+      {
+         k = s;
+         dev->singlePrecision = true;
+      }
+   }
+
+   dev->variant = v;
+   dev->evalKernel = dev->variantKernels[k];
+   dev->evalTuneId = dev->variantTuneIds[k];
+}
+
+
+bool pEval::setSinglePrecision(bool single)
+{
+   singlePrecision = single;
+
+   bool any = false;
+   for(int d = 0; d < num_devices; d++)
+   {
+      pEval_device *dev = &devs[d];
+
+      useVariant(d, dev->variant);
+
+      if(dev->singlePrecision) any = true;
+      else if(single)
+      {
+         printf("Device %d (%s) has no single precision variant of %s, it evaluates in double precision\n",
+               d, dev->name, evalKernelName);
+      }
+   }
+
+   return any;
 }
 
+
+// startup micro-benchmark of the kernel variants: evaluate slots [first_slot, first_slot+count)
+// (once the commands in waitList are done) with every variant device d has and use the fastest.
+// Each variant is launched EVAL_VARIANT_TRIALS times with its default shape and its fastest
+// launch counts (the first launches also warm up the caches). The variants compute the same 
+// F and gradient, the evaluation that follows overwrites them with the ones of the picked variant.
+void pEval::pickVariant(int d, int first_slot, int count, cl_uint numWait, const cl_event *waitList)
+{
+   pEval_device *dev = &devs[d];
+   cl_int status;
+
+   cl_event trialDone[EVAL_VARIANTS][EVAL_VARIANT_TRIALS];
+   double trial_ms[EVAL_VARIANTS];
+
+   for(int v = 0; v < EVAL_VARIANTS; v++)
+   {
+      cl_kernel kernel = dev->variantKernels[v];
+      if(kernel == NULL || evalVariants[v].single_precision) continue;
+
+      if(dev->evalSlotEndArg >= 0)
+      {
+         cl_int slot_end = first_slot + count;
+         status = clSetKernelArg(kernel, dev->evalSlotEndArg, sizeof(cl_int), &slot_end);
+         if(status != CL_SUCCESS) {
+            printf("clSetKernelArg error\n");
+            exit(-1);
+         }
+      }
+
+      launch_shape shape = launchTuner->getDefaultShape(dev->variantTuneIds[v]);
+
+      size_t globalWorkOffset[1] = {(size_t) first_slot};
+      size_t globalWorkSize[1] = {LaunchTuner::globalSize(shape, count)};
+      size_t localWorkSize[1] = {shape.local_size};
+
+      for(int t = 0; t < EVAL_VARIANT_TRIALS; t++)
+      {
+         status = clEnqueueNDRangeKernel(dev->cmdQueue, kernel, 1, globalWorkOffset, globalWorkSize, 
+               (shape.local_size > 0) ? localWorkSize : NULL, numWait, waitList, &trialDone[v][t]);
+         if(status != CL_SUCCESS) {
+            printf("clEnqueueNDRangeKernel failed\n");
+            exit(-1);
+         }
+
+         // with an out-of-order queue the trials must not run at the same time
+         status = clWaitForEvents(1, &trialDone[v][t]);
+         if(status != CL_SUCCESS) {
+            printf("clWaitForEvents failed\n");
+            exit(-1);
+         }
+      }
+   }
+
+   int best = 0;
+   printf("Device %d (%s), evaluation of %d functions with", d, dev->name, count);
+
+   for(int v = 0; v < EVAL_VARIANTS; v++)
+   {
+      if(dev->variantKernels[v] == NULL || evalVariants[v].single_precision) continue;
+
+      trial_ms[v] = 0;
+      for(int t = 0; t < EVAL_VARIANT_TRIALS; t++)
+      {
+         cl_ulong t_start, t_end;
+         clGetEventProfilingInfo(trialDone[v][t], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t_start, NULL);
+         clGetEventProfilingInfo(trialDone[v][t], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t_end, NULL);
+         clReleaseEvent(trialDone[v][t]);
+
+         double ms = (t_end - t_start) / 1000000.0;
+         if(t == 0 || ms < trial_ms[v]) trial_ms[v] = ms;
+      }
+
+      printf("%s the %s variant %.3f ms", (v > 0) ? "," : "", evalVariants[v].name, trial_ms[v]);
+      if(trial_ms[v] < trial_ms[best]) best = v;
+   }
+
+   printf(": using the %s variant\n", evalVariants[best].name);
+
+   useVariant(d, best);
+}
+
+
+// set the function called when the devices have finished an evaluation
+void pEval::setEvalDoneCallback(pEvalDoneCallback callback, void *arg)
+{
+   doneCallback = callback;
+   doneCallbackArg = arg;
+}
+
+
+// OpenCL event callback of the last command of a device's slice of a cohort's
+// evaluation, the owner is called once all slices are done
+void CL_CALLBACK pEval::evalDoneNotify(cl_event, cl_int, void *ref)
+{
+   pEval_cohort_ref *cohortRef = (pEval_cohort_ref *) ref;
+   pEval *pe = cohortRef->pe;
+
+   pthread_mutex_lock(&pe->callbackMutex);
+   int pending = --pe->cohortPending[cohortRef->cohort];
+   pthread_mutex_unlock(&pe->callbackMutex);
+
+   if(pending == 0) pe->doneCallback(cohortRef->cohort, pe->doneCallbackArg);
+}
+
+
+// wait for the evaluation in flight for cohort to finish
+void pEval::evalWait(int cohort)
+{
+   bool inFlight = false;
+   for(int d = 0; d < num_devices; d++)
+   {
+      if(devs[d].cohortDoneEvent[cohort] != NULL) inFlight = true;
+   }
+
+   if(!inFlight) return;
+
+   struct timeval start, end;
+   gettimeofday(&start, NULL); 
+
+   for(int d = 0; d < num_devices; d++)
+   {
+      if(devs[d].cohortDoneEvent[cohort] == NULL) continue;
+
+      cl_int status = clWaitForEvents(1, &devs[d].cohortDoneEvent[cohort]);
+      if(status != CL_SUCCESS) {
+         printf("clWaitForEvents failed\n");
+         exit(-1);
+      }
+   }
+
+   gettimeofday(&end, NULL); 
+   hostWait_ms += calc_time(&start, &end) - 0.5;  // calc_time() rounds up by 0.5 ms
+
+   // the queues are profiled when pipelining or with several devices,
+   // the cohort kept the devices busy as long as its longest slice took
+   bool profiled = (num_cohorts > 1) || (num_devices > 1);
+   double cohortBusy_ms = 0;
+
+   for(int d = 0; d < num_devices; d++)
+   {
+      pEval_device *dev = &devs[d];
+
+      if(dev->cohortDoneEvent[cohort] == NULL) continue;
+
+      int count = dev->cohortCount[cohort];
+      dev->evaluated += count;
+
+      if(profiled)
+      {
+         cl_ulong t_start, t_end;
+         clGetEventProfilingInfo(dev->cohortStartEvent[cohort], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t_start, NULL);
+         clGetEventProfilingInfo(dev->cohortDoneEvent[cohort], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t_end, NULL);
+
+         double busy = (t_end - t_start) / 1000000.0;
+         dev->busy_ms += busy;
+         if(busy > cohortBusy_ms) cohortBusy_ms = busy;
+
+         // rebalance: the split follows the evaluation rates, smoothed over the
+         // last evaluations as the number of functions shrinks
+         if(busy > 0)
+         {
+            double rate = count / busy;
+
+            if(dev->rateMeasured) dev->rate = 0.7 * dev->rate + 0.3 * rate;
+            else dev->rate = rate;
+            dev->rateMeasured = true;
+         }
+      }
+
+      // launch tuning only times the kernel
+      if(dev->cohortKernelEvent[cohort] != NULL)
+      {
+         cl_ulong t_start, t_end;
+         clGetEventProfilingInfo(dev->cohortKernelEvent[cohort], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t_start, NULL);
+         clGetEventProfilingInfo(dev->cohortKernelEvent[cohort], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t_end, NULL);
+
+         launchTuner->report(dev->evalTuneId, count, dev->cohortShape[cohort], count, (t_end - t_start) / 1000000.0);
+
+         clReleaseEvent(dev->cohortKernelEvent[cohort]);
+         dev->cohortKernelEvent[cohort] = NULL;
+      }
+
+      clReleaseEvent(dev->cohortStartEvent[cohort]);
+      clReleaseEvent(dev->cohortDoneEvent[cohort]);
+      dev->cohortStartEvent[cohort] = NULL;
+      dev->cohortDoneEvent[cohort] = NULL;
+   }
+
+   if(num_cohorts > 1) deviceBusy_ms += cohortBusy_ms;
+
+   // scatter packed F(x) and gradient back to the function order
+   for(int d = 0; d < num_devices; d++)
+   {
+      pEval_device *dev = &devs[d];
+
+      if(dev->cohortCount[cohort] == 0) continue;
+
+      int first_slot = dev->cohortFirstSlot[cohort];
+      int *point_ids = point_ids_host + first_slot;
+      double *F_packed;
+      double *g_packed;
+
+      if(hostMemory == BFGSB_CL_HOST_MEMORY_ZERO_COPY)
+      {
+         F_packed = dev->cohortFMapped[cohort];
+         g_packed = dev->cohortgMapped[cohort];
+      }
+      else
+      {
+         F_packed = F_packed_host + first_slot;
+         g_packed = g_packed_host + (first_slot * g_stride);
+      }
+
+      for(int i = 0; i < dev->cohortCount[cohort]; i++)
+      {
+         *pointF(point_ids[i]) = F_packed[i];
+         memcpy(pointg(point_ids[i]), g_packed + (i * g_stride), g_stride * sizeof(double));
+      }
+
+      // the slots must be unmapped before the kernel writes them again
+      // (the next evaluation of the cohort waits for the unmaps)
+      if(hostMemory == BFGSB_CL_HOST_MEMORY_ZERO_COPY)
+      {
+         clEnqueueUnmapMemObject(dev->cmdQueue, dev->F_dev, dev->cohortFMapped[cohort], 0, NULL, &dev->cohortUnmapFEvent[cohort]);
+         clEnqueueUnmapMemObject(dev->cmdQueue, dev->g_dev, dev->cohortgMapped[cohort], 0, NULL, &dev->cohortUnmapgEvent[cohort]);
+         dev->cohortFMapped[cohort] = NULL;
+         dev->cohortgMapped[cohort] = NULL;
+      }
+
+      dev->cohortCount[cohort] = 0;
+   }
+}
+
+
+// print each device's share of the evaluations
+void pEval::printDeviceStats()
+{
+   long total = 0;
+   for(int d = 0; d < num_devices; d++)
+   {
+      total += devs[d].evaluated;
+   }
+
+   if(total == 0) total = 1;
+
+   for(int d = 0; d < num_devices; d++)
+   {
+      printf("DEVICE %d (%s): %.1f%% of the evaluations, busy %f (ms), %.1f evaluations/ms\n", d, devs[d].name,
+            100.0 * devs[d].evaluated / total, devs[d].busy_ms, devs[d].rateMeasured ? devs[d].rate : 0.0);
+   }
+}
+
+
 // perform coarse grain search in parallel on the GPU
+// (split over the devices like the evaluations). While the launch shape of the
+// coarse grain kernel is tuned, the first part of each device's pixels is 
+// searched in chunks with the candidate shapes and the rest with the fastest one.
 void pEval::coarse_grain_search(double *init_ret)
 {
    cl_int status;
 
-   size_t globalWorkSize[1] = {num_funcs};
-   size_t localWorkSize[1] = {64};
+   splitSlots(num_funcs, sliceCount);
 
-   // Execute the kernel.
-   // 'globalWorkSize' is the 1D dimension of the work-items
-   status = clEnqueueNDRangeKernel(cmdQueue, coarseGrainedSearchKernel, 1, NULL, globalWorkSize, 
-                           NULL, 0, NULL, NULL);
-   if(status != CL_SUCCESS) {
-      printf("clEnqueueNDRangeKernel failed\n");
-      exit(-1);
+   int *first = (int *) malloc(num_devices * sizeof(int));
+   int *done = (int *) calloc(num_devices, sizeof(int));		// pixels searched in trial chunks
+
+   for(int d = 0, slot = 0; d < num_devices; d++)
+   {
+      first[d] = slot;
+      slot += sliceCount[d];
    }
 
-   clFinish(cmdQueue);
+   // trial chunks
+   cl_event *trialEvents = NULL;
+   launch_shape *trialShapes = NULL;
+   int *trialDevices = NULL;
+   int *trialFuncs = NULL;
+   int num_trials = 0;
 
-   status = clEnqueueReadBuffer(cmdQueue, init_ret_dev, CL_TRUE, 0,
-         num_vars * num_funcs * sizeof(double), init_ret, 
-         0, NULL, NULL);
+   for(int d = 0; d < num_devices; d++)
+   {
+      pEval_device *dev = &devs[d];
+      int count = sliceCount[d];
 
-   if(status != CL_SUCCESS) {
-      printf("clEnqueueReadBuffer failed\n");
-      exit(-1);
+      if(dev->coarseSlotEndArg < 0 || count == 0) continue;
+
+      // the trials use at most half of the pixels
+      int trials = launchTuner->trialsLeft(dev->coarseTuneId, count);
+      if(trials == 0) continue;
+
+      int chunk = count / (2 * trials);
+      if(chunk < LAUNCH_TUNE_MIN_CHUNK) continue;
+
+      trialEvents = (cl_event *) realloc(trialEvents, (num_trials + trials) * sizeof(cl_event));
+      trialShapes = (launch_shape *) realloc(trialShapes, (num_trials + trials) * sizeof(launch_shape));
+      trialDevices = (int *) realloc(trialDevices, (num_trials + trials) * sizeof(int));
+      trialFuncs = (int *) realloc(trialFuncs, (num_trials + trials) * sizeof(int));
+
+      for(int t = 0; t < trials; t++)
+      {
+         bool trial;
+         trialShapes[num_trials] = launchTuner->getShape(dev->coarseTuneId, count, &trial);
+         trialDevices[num_trials] = d;
+         trialFuncs[num_trials] = chunk;
+
+         coarseGrainLaunch(d, first[d] + done[d], chunk, trialShapes[num_trials], 0, NULL, &trialEvents[num_trials]);
+         done[d] += chunk;
+         num_trials++;
+      }
+
+      clFlush(dev->cmdQueue);
    }
 
+   for(int d = 0; d < num_devices; d++)
+   {
+      if(done[d] > 0) clFinish(devs[d].cmdQueue);
+   }
 
-}
+   for(int t = 0; t < num_trials; t++)
+   {
+      cl_ulong t_start, t_end;
+      clGetEventProfilingInfo(trialEvents[t], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t_start, NULL);
+      clGetEventProfilingInfo(trialEvents[t], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t_end, NULL);
 
+      int d = trialDevices[t];
+      launchTuner->report(devs[d].coarseTuneId, sliceCount[d], trialShapes[t], trialFuncs[t], (t_end - t_start) / 1000000.0);
+      clReleaseEvent(trialEvents[t]);
+   }
 
-// read OpenCL source from file
-char* readSource(const char *sourceFilename) {
+   // the rest of the pixels with the tuned shape
+   for(int d = 0; d < num_devices; d++)
+   {
+      pEval_device *dev = &devs[d];
+      int count = sliceCount[d];
 
-   FILE *fp;
-   int err;
-   int size;
+      if(count == 0) continue;
 
-   char *source;
+      cl_event kernelDone = NULL;
 
-   fp = fopen(sourceFilename, "rb");
-   if(fp == NULL) {
-      printf("Could not open kernel file: %s\n", sourceFilename);
-      exit(-1);
+      if(count > done[d])
+      {
+         launch_shape shape = {0, 1};
+         bool trial;
+         if(dev->coarseSlotEndArg >= 0) shape = launchTuner->getShape(dev->coarseTuneId, count, &trial);
+
+         coarseGrainLaunch(d, first[d] + done[d], count - done[d], shape, 0, NULL, &kernelDone);
+      }
+
+      status = clEnqueueReadBuffer(dev->cmdQueue, dev->init_ret_dev, CL_FALSE, first[d] * num_vars * sizeof(double),
+            count * num_vars * sizeof(double), init_ret + (first[d] * num_vars), 
+            (kernelDone != NULL) ? 1 : 0, (kernelDone != NULL) ? &kernelDone : NULL, NULL);
+
+      if(status != CL_SUCCESS) {
+         printf("clEnqueueReadBuffer failed\n");
+         exit(-1);
+      }
+
+      if(kernelDone != NULL) clReleaseEvent(kernelDone);
+      clFlush(dev->cmdQueue);
    }
-   
-   err = fseek(fp, 0, SEEK_END);
-   if(err != 0) {
-      printf("Error seeking to end of file\n");
-      exit(-1);
+
+   for(int d = 0; d < num_devices; d++)
+   {
+      clFinish(devs[d].cmdQueue);
    }
 
-   size = ftell(fp);
-   if(size < 0) {
-      printf("Error getting file position\n");
-      exit(-1);
+   free(trialEvents);
+   free(trialShapes);
+   free(trialDevices);
+   free(trialFuncs);
+   free(first);
+   free(done);
+}
+
+
+// launch the coarse grain kernel on device d for the pixels [first, first+count)
+void pEval::coarseGrainLaunch(int d, int first, int count, launch_shape shape, 
+      cl_uint numWait, const cl_event *waitList, cl_event *kernelDone)
+{
+   pEval_device *dev = &devs[d];
+   cl_int status;
+
+   if(dev->coarseSlotEndArg >= 0)
+   {
+      cl_int slot_end = first + count;
+      status = clSetKernelArg(dev->coarseGrainedSearchKernel, dev->coarseSlotEndArg, sizeof(cl_int), &slot_end);
+      if(status != CL_SUCCESS) {
+         printf("clSetKernelArg error\n");
+         exit(-1);
+      }
    }
 
-   err = fseek(fp, 0, SEEK_SET);
-   if(err != 0) {
-      printf("Error seeking to start of file\n");
+   size_t globalWorkOffset[1] = {(size_t) first};
+   size_t globalWorkSize[1] = {LaunchTuner::globalSize(shape, count)};
+   size_t localWorkSize[1] = {shape.local_size};
+
+   // Execute the kernel.
+   // 'globalWorkSize' is the 1D dimension of the work-items
+   status = clEnqueueNDRangeKernel(dev->cmdQueue, dev->coarseGrainedSearchKernel, 1, globalWorkOffset, globalWorkSize, 
+                           (shape.local_size > 0) ? localWorkSize : NULL, numWait, waitList, kernelDone);
+   if(status != CL_SUCCESS) {
+      printf("clEnqueueNDRangeKernel failed\n");
       exit(-1);
    }
+}
 
-   source = (char*)malloc(size+1);
-   if(source == NULL) {
-      printf("Error allocating %d bytes for the program source\n", size+1);
-      exit(-1);
+
+// true if every device has the solve kernel
+bool pEval::hasSolveKernel()
+{
+   if(num_devices == 0) return false;
+
+   for(int d = 0; d < num_devices; d++)
+   {
+      if(devs[d].solveKernel == NULL) return false;
    }
 
-   err = fread(source, 1, size, fp);
-   if(err != size) {
-      printf("only read %d bytes\n", err);
-      exit(0);
+   return true;
+}
+
+
+// solve the functions of the current problem with the solve kernel (see parallel_eval.h).
+// The functions are split over the devices like the evaluations and each device solves
+// its share one chunk after the other. Every round launches all devices before the host
+// waits for them, a device whose chunk has no running functions left reads back its
+// solutions and starts on its next chunk in the following round.
+void pEval::deviceSolve(double *x_inits, int *b, double *L, double *U, int m, double factr, double pgtol,
+      int max_iterations, int launch_iterations, int window, bool verbosePrint)
+{
+   cl_int status;
+
+   struct timeval start, end;
+   gettimeofday(&start, NULL); 
+
+   if(launch_iterations < 1) launch_iterations = 1;
+
+   size_t workSize = LBFGSB_CL_WORK_SIZE(num_vars, m) * sizeof(double);
+   size_t iworkSize = LBFGSB_CL_IWORK_SIZE(num_vars) * sizeof(cl_int);
+
+   double *bounds = (double *) malloc(2 * num_vars * sizeof(double));
+   memcpy(bounds, L, num_vars * sizeof(double));
+   memcpy(bounds + num_vars, U, num_vars * sizeof(double));
+
+   splitSlots(num_funcs, sliceCount);
+
+   int *next = (int *) malloc(num_devices * sizeof(int));			// first function of the next chunk
+   int *sliceEnd = (int *) malloc(num_devices * sizeof(int));
+   int *chunkSize = (int *) malloc(num_devices * sizeof(int));
+   int *chunkFirst = (int *) malloc(num_devices * sizeof(int));
+   int *chunkCount = (int *) calloc(num_devices, sizeof(int));		// 0 = no chunk being solved
+   int *chunkLaunches = (int *) calloc(num_devices, sizeof(int));
+   cl_int *running = (cl_int *) malloc(num_devices * sizeof(cl_int));	// functions still running after a launch
+   cl_event *readDone = (cl_event *) malloc(num_devices * sizeof(cl_event));
+   const cl_int zero = 0;
+
+   for(int d = 0, slot = 0; d < num_devices; d++)
+   {
+      pEval_device *dev = &devs[d];
+
+      next[d] = slot;
+      slot += sliceCount[d];
+      sliceEnd[d] = slot;
+
+      if(sliceCount[d] == 0) continue;
+
+      // a chunk's workspaces go in one buffer, which the device must be able to allocate
+      cl_ulong maxAlloc = 0;
+      clGetDeviceInfo(dev->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAlloc, NULL);
+
+      long size = (long) (maxAlloc / workSize);
+      if(window > 0 && window < size) size = window;
+      if(size > sliceCount[d]) size = sliceCount[d];
+      if(size < 1) size = 1;
+      chunkSize[d] = (int) size;
+
+      cl_mem_flags flags = CL_MEM_READ_WRITE;		// these buffers always use the same flags
+      growBuffer(dev->context, &dev->solve_state_dev, &dev->solveStateCapacity, &flags, 
+            CL_MEM_READ_WRITE, size * LBFGSB_CL_STATE_SIZE, NULL);
+      growBuffer(dev->context, &dev->solve_work_dev, &dev->solveWorkCapacity, &flags, 
+            CL_MEM_READ_WRITE, size * workSize, NULL);
+      growBuffer(dev->context, &dev->solve_iwork_dev, &dev->solveIworkCapacity, &flags, 
+            CL_MEM_READ_WRITE, size * iworkSize, NULL);
+
+      status  = clEnqueueWriteBuffer(dev->cmdQueue, dev->solve_bounds_dev, CL_TRUE, 0,
+            2 * num_vars * sizeof(double), bounds, 0, NULL, NULL);
+      status |= clEnqueueWriteBuffer(dev->cmdQueue, dev->solve_nbd_dev, CL_TRUE, 0,
+            num_vars * sizeof(cl_int), b, 0, NULL, NULL);
+      if(status != CL_SUCCESS) {
+         printf("clEnqueueWriteBuffer failed\n");
+         exit(-1);
+      }
+
+      // the solve kernel takes the solver arguments, the user arguments of the evaluation
+      // kernel and the end of its slots
+      cl_uint numArgs = 0;
+      clGetKernelInfo(dev->solveKernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &numArgs, NULL);
+      if(numArgs != (cl_uint) (16 + num_user_args + 1)) {
+         printf("The solve kernel of %s does not take %d user arguments\n", evalKernelName, num_user_args);
+         exit(-1);
+      }
+
+      cl_kernel kernel = dev->solveKernel;
+      cl_int launch_its = launch_iterations;
+      cl_int max_its = max_iterations;
+      cl_int hessian_m = m;
+
+      status  = clSetKernelArg(kernel, 2, sizeof(cl_int), &launch_its);
+      status |= clSetKernelArg(kernel, 3, sizeof(cl_int), &max_its);
+      status |= clSetKernelArg(kernel, 4, sizeof(cl_int), &hessian_m);
+      status |= clSetKernelArg(kernel, 5, sizeof(double), &factr);
+      status |= clSetKernelArg(kernel, 6, sizeof(double), &pgtol);
+      status |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &dev->solve_bounds_dev);
+      status |= clSetKernelArg(kernel, 8, sizeof(cl_mem), &dev->solve_nbd_dev);
+      status |= clSetKernelArg(kernel, 9, sizeof(cl_mem), &dev->F_dev);
+      status |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &dev->x_dev);
+      status |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &dev->g_dev);
+      status |= clSetKernelArg(kernel, 12, sizeof(cl_mem), &dev->solve_state_dev);
+      status |= clSetKernelArg(kernel, 13, sizeof(cl_mem), &dev->solve_work_dev);
+      status |= clSetKernelArg(kernel, 14, sizeof(cl_mem), &dev->solve_iwork_dev);
+      status |= clSetKernelArg(kernel, 15, sizeof(cl_mem), &dev->solve_active_dev);
+
+      for(int i = 0; i < num_user_args; i++)
+      {
+         if(user_buffs[i].arg.buffer == true)
+         {
+            status |= clSetKernelArg(kernel, 16+i, sizeof(cl_mem), &user_buffs[i].data_dev[d]);
+         }
+
+         else
+         {
+            status |= clSetKernelArg(kernel, 16+i, user_buffs[i].arg.size, user_buffs[i].arg.data);
+         }
+      }
+
+      if(status != CL_SUCCESS)
+      {
+         printf("%d\n", status);
+         printf("clSetKernelArg error\n");
+         exit(-1);
+      }
    }
 
-   source[size] = '\0';
+   free(bounds);
 
-   return source;
-}
+   for(int round = 0; ; round++)
+   {
+      int launched = 0;
+
+      for(int d = 0; d < num_devices; d++)
+      {
+         pEval_device *dev = &devs[d];
+         cl_event ready[2];
+         cl_uint numReady = 0;
+
+         // start on the next chunk of the device's share
+         if(chunkCount[d] == 0)
+         {
+            if(next[d] == sliceEnd[d]) continue;
+
+            chunkFirst[d] = next[d];
+            chunkCount[d] = sliceEnd[d] - next[d];
+            if(chunkCount[d] > chunkSize[d]) chunkCount[d] = chunkSize[d];
+            chunkLaunches[d] = 0;
+            next[d] += chunkCount[d];
+
+            status = clEnqueueWriteBuffer(dev->cmdQueue, dev->x_dev, CL_FALSE, chunkFirst[d] * num_vars * sizeof(double),
+                  chunkCount[d] * num_vars * sizeof(double), x_inits + (chunkFirst[d] * num_vars), 0, NULL, &ready[numReady++]);
+            if(status != CL_SUCCESS) {
+               printf("clEnqueueWriteBuffer failed\n");
+               exit(-1);
+            }
+         }
+
+         // the queue may be out of order, the launch waits for its inputs and
+         // the count is read after it
+         status = clEnqueueWriteBuffer(dev->cmdQueue, dev->solve_active_dev, CL_FALSE, 0, sizeof(cl_int), &zero, 
+               0, NULL, &ready[numReady++]);
+         if(status != CL_SUCCESS) {
+            printf("clEnqueueWriteBuffer failed\n");
+            exit(-1);
+         }
+
+         cl_int first = chunkFirst[d];
+         cl_int startChunk = (chunkLaunches[d] == 0) ? 1 : 0;
+         cl_int slot_end = chunkCount[d];
+
+         status  = clSetKernelArg(dev->solveKernel, 0, sizeof(cl_int), &first);
+         status |= clSetKernelArg(dev->solveKernel, 1, sizeof(cl_int), &startChunk);
+         status |= clSetKernelArg(dev->solveKernel, 16 + num_user_args, sizeof(cl_int), &slot_end);
+         if(status != CL_SUCCESS) {
+            printf("clSetKernelArg error\n");
+            exit(-1);
+         }
+
+         size_t globalWorkSize[1] = {(size_t) chunkCount[d]};
+         cl_event kernelDone;
+
+         status = clEnqueueNDRangeKernel(dev->cmdQueue, dev->solveKernel, 1, NULL, globalWorkSize, NULL, 
+               numReady, ready, &kernelDone);
+         if(status != CL_SUCCESS) {
+            printf("clEnqueueNDRangeKernel failed\n");
+            exit(-1);
+         }
+
+         status = clEnqueueReadBuffer(dev->cmdQueue, dev->solve_active_dev, CL_FALSE, 0, sizeof(cl_int), &running[d],
+               1, &kernelDone, &readDone[d]);
+         if(status != CL_SUCCESS) {
+            printf("clEnqueueReadBuffer failed\n");
+            exit(-1);
+         }
+
+         for(cl_uint i = 0; i < numReady; i++) clReleaseEvent(ready[i]);
+         clReleaseEvent(kernelDone);
+         clFlush(dev->cmdQueue);
+         launched++;
+      }
+
+      if(launched == 0) break;
+
+      int total_running = 0;
+
+      for(int d = 0; d < num_devices; d++)
+      {
+         pEval_device *dev = &devs[d];
+
+         if(chunkCount[d] == 0) continue;
 
+         clWaitForEvents(1, &readDone[d]);
+         clReleaseEvent(readDone[d]);
 
+         chunkLaunches[d]++;
+         solveLaunches++;
+         total_running += running[d];
 
+         if(running[d] > 0) continue;
+
+         // the chunk is solved
+         status  = clEnqueueReadBuffer(dev->cmdQueue, dev->F_dev, CL_TRUE, chunkFirst[d] * sizeof(double),
+               chunkCount[d] * sizeof(double), F_host + chunkFirst[d], 0, NULL, NULL);
+         status |= clEnqueueReadBuffer(dev->cmdQueue, dev->x_dev, CL_TRUE, chunkFirst[d] * num_vars * sizeof(double),
+               chunkCount[d] * num_vars * sizeof(double), x_host + (chunkFirst[d] * num_vars), 0, NULL, NULL);
+         if(status != CL_SUCCESS) {
+            printf("clEnqueueReadBuffer failed\n");
+            exit(-1);
+         }
+
+         solveFuncs += chunkCount[d];
+         chunkCount[d] = 0;
+      }
+
+      if(verbosePrint) printf("device solver round %d: %d launches, %d functions still running\n", 
+            round, launched, total_running);
+   }
+
+   free(next);
+   free(sliceEnd);
+   free(chunkSize);
+   free(chunkFirst);
+   free(chunkCount);
+   free(chunkLaunches);
+   free(running);
+   free(readDone);
+
+   gettimeofday(&end, NULL); 
+   solve_ms += calc_time(&start, &end) - 0.5;  // calc_time() rounds up by 0.5 ms
+}
@@ -2,19 +2,128 @@
 #define PARALLEL_EVAL_H
 
 
+#include <pthread.h>
 #include <CL/cl.h>
 
 #include "bfgsb_cl.h"
+#include "launch_tuner.h"
 
 
 #define MAX_STR_SZ 512		// maximum string size
 
+// evaluation kernel variants: the same evaluation with the per-function data in
+// different memories, or in single precision. The kernel of a variant is the evaluation
+// kernel with the variant's suffix (e.g. eval_kernel_local), see evalVariants in parallel_eval.cpp
+#define EVAL_VARIANTS 3				// private, local and float
+#define EVAL_VARIANT_AUTO -1		// pick the fastest variant of each device on its first evaluation
+#define EVAL_VARIANT_TRIALS 2		// launches with each variant when picking one (the fastest counts)
+
+typedef struct s_pEval_variant {
+   const char *name;				// name to select the variant with (bfgsb_cl_options.eval_variant)
+   const char *suffix;				// appended to the evaluation kernel name
+   const char *description;
+   bool single_precision;			// only used while single precision is on (see setSinglePrecision()),
+									// never picked or selected by name
+} pEval_variant;
+
 typedef struct s_pEval_user_buff {
-   cl_mem data_dev;						// if user needs a buffer  
+   cl_mem *data_dev;					// if user needs a buffer (one copy on each device)
+   size_t capacity;						// size of data_dev in bytes
+   cl_mem_flags mem_flags;				// flags data_dev was created with
    bfgsb_cl_user_data_arg arg;
 } pEval_user_buff;
 
 
+// one of the OpenCL devices the evaluations are split over
+typedef struct s_pEval_device {
+   cl_device_id device;
+   char name[100];
+   cl_context context;					// context and program of the device's platform
+   cl_program program;
+   cl_command_queue cmdQueue;
+   cl_kernel evalKernel;				// kernel of the variant in use
+   cl_kernel variantKernels[EVAL_VARIANTS];	// kernel of each variant (NULL if the program does not have 
+											// it or the device can not run it)
+   int variantTuneIds[EVAL_VARIANTS];	// their kernel numbers in the launch tuner
+   int variant;							// variant in use, EVAL_VARIANT_AUTO until it is picked
+   bool singlePrecision;				// evaluating with the single precision variant instead
+   cl_kernel coarseGrainedSearchKernel;	// coarse grain kernel of the current batch, one of
+   cl_kernel coarsePointsKernel;		// coarse_grained_search (evaluates f at every point) and
+   cl_kernel coarseBankKernel;			// coarse_grained_search_bank (scores the model bank), created when needed
+   cl_kernel solveKernel;				// <evaluation kernel>_solve (NULL if the program does not have it)
+
+   // device memory handles (packed, slot i holds function func_ids[i]),
+   // every device has room for all slots and evaluates a slice of each cohort's slots
+   cl_mem F_dev;
+   cl_mem x_dev;
+   cl_mem g_dev;
+   cl_mem func_ids_dev;
+   int *func_ids_sent;					// function ids last transferred to func_ids_dev (indexed by slot)
+
+   cl_mem coarse_grain_points_dev;
+   cl_mem init_ret_dev;
+   cl_mem coarse_grain_bank_dev;		// model bank (see bfgsb_cl_coarse_grain_bank), the squared norm
+   cl_mem coarse_grain_norm2_dev;		// of every model and the bank of every function
+   cl_mem coarse_grain_bank_ids_dev;
+
+   // device solver (see deviceSolve()): saved engine state and workspaces of each
+   // function of the chunk being solved, bounds (lower then upper), bound types
+   // and the count of functions still running after a launch
+   cl_mem solve_state_dev;
+   cl_mem solve_work_dev;
+   cl_mem solve_iwork_dev;
+   cl_mem solve_bounds_dev;
+   cl_mem solve_nbd_dev;
+   cl_mem solve_active_dev;
+   size_t solveStateCapacity;
+   size_t solveWorkCapacity;
+   size_t solveIworkCapacity;
+
+   // the device's slice of the evaluation in flight for each cohort (count 0 = none)
+   int *cohortFirstSlot;
+   int *cohortCount;
+   cl_event *cohortStartEvent;			// first and last command of the slice
+   cl_event *cohortDoneEvent;
+
+   // zero-copy: F and gradient slots of the slice mapped for reading until evalWait()
+   double **cohortFMapped;
+   double **cohortgMapped;
+
+   // zero-copy: unmapping of the F and gradient slots, the next evaluation of the cohort waits for it
+   cl_event *cohortUnmapFEvent;
+   cl_event *cohortUnmapgEvent;
+
+   // launch shapes (see launch_tuner.h): a kernel with one more argument than the
+   // standard ones takes the end of its slots there and is launched with the tuned shape,
+   // -1 if it does not (it is launched with one work-item per slot)
+   int evalSlotEndArg;
+   int coarseSlotEndArg;
+   int evalTuneId;						// kernel numbers in the launch tuner (coarseTuneId is -1 until 
+   int coarseTuneId;					// the coarse grain kernel is created)
+   int coarsePointsTuneId;				// of the two coarse grain kernels (-1 until they are created,
+   int coarseBankTuneId;				// -2 if the program has no bank kernel)
+   cl_event *cohortKernelEvent;			// kernel of the slice if it tries a candidate shape (NULL if not)
+   launch_shape *cohortShape;			// and the shape it tries
+
+   // load balance
+   double rate;							// functions evaluated per ms (smoothed over the evaluations)
+   bool rateMeasured;
+   cl_uint computeUnits;				// the split follows these until all rates are measured
+   long evaluated;						// functions evaluated so far
+   double busy_ms;						// time spent evaluating them
+} pEval_device;
+
+
+class pEval;
+
+// called when the device has finished the evaluation of a cohort
+typedef void (*pEvalDoneCallback)(int cohort, void *arg);
+
+typedef struct s_pEval_cohort_ref {
+   pEval *pe;
+   int cohort;
+} pEval_cohort_ref;
+
 
 class pEval {
   
@@ -23,69 +132,215 @@ class pEval {
 
     pEval(
       int num_vars,							// number of variables in each function
-      int num_funcs,						// number of functions in evaluation
       const char *evalSrcFileNameFull,		// name of the source code that contains the evaluation kernel
       const char *OpenCL_incDir,			// directory to search for OpenCL "include" files. Use "" if none.
+      const bfgsb_cl_options *options = NULL	// solver settings (number of cohorts, kernel name, program cache, 
+											// buffer sharing, queue and device selection), NULL for the defaults
+      );
+
+    ~pEval();
+
+	// init OpenCL subsystem (device, context, queue and compiled program), done once
+    void OpenCL_setup();
+
+	// set up the inputs of a batch of functions to evaluate, can be called again
+	// for every new batch (buffers are reused and only grow when needed)
+    void setProblem(
+      int num_funcs,						// number of functions in evaluation
       int num_user_args,					// number of additional user arguments to evaluation kernel
       bfgsb_cl_user_data_arg *user_args,	// user arg structs
       bool use_coarse_grain_search,			// set to true if also using coarse-grain search
       unsigned int coarse_grain_n,			// number of points used in coarse-grain search
-      double *coarse_grain_points			// array of size num_vars*coarse_grain_n points for coarse-grain search
+      double *coarse_grain_points,			// array of size num_vars*coarse_grain_n points for coarse-grain search
+      const bfgsb_cl_coarse_grain_bank *coarse_grain_bank = NULL	// model bank of the points (NULL = none, 
+																	// the search evaluates f at every point)
       );
 
-    ~pEval();
+	// execute parallel evaluation of all functions on OpenCL device
+    void eval();
 
-	// init OpenCL subsystem
-    void OpenCL_setup();
+	// start evaluating the count functions listed in func_ids on the OpenCL devices
+	// for cohort number cohort, returns without waiting for the devices.
+	// The x of these functions is packed into slots [first_slot, first_slot+count)
+	// of the device buffers, so cohorts in flight at the same time must use
+	// disjoint slot ranges. The slots are split over the devices in proportion
+	// to their measured evaluation rates. func_ids may also list candidate points
+	// (see candidateId()), there are num_funcs * getEvalPoints() slots.
+    void evalAsync(int cohort, int first_slot, const int *func_ids, int count);
 
-	// execute parallel evaluation on OpenCL device
-    void eval();
+	// wait for the last evaluation started for cohort to finish and scatter
+	// its F and gradient back to the host arrays (returns immediately if there 
+	// is none in flight)
+    void evalWait(int cohort);
+
+	// call callback(cohort, arg) whenever the device has finished the evaluation 
+	// started for a cohort by evalAsync() (NULL for none). It is called from a 
+	// thread of the OpenCL runtime and must only hand the cohort over to the 
+	// thread that calls evalWait(), which still has to be called to get the results.
+    void setEvalDoneCallback(pEvalDoneCallback callback, void *arg);
+
+	// pipelining statistics: time the device spent evaluating and
+	// time the host spent blocked in evalAsync() and evalWait()
+    double getDeviceBusyTime() { return deviceBusy_ms; }
+    double getHostWaitTime() { return hostWait_ms; }
+
+	// number of devices the evaluations are split over, and their share of the work so far
+    int getNumDevices() { return num_devices; }
+    void printDeviceStats();
+
+	// evaluate with the single precision variant of the evaluation kernel on the devices
+	// that have one (the others keep evaluating in double precision), or go back to
+	// double precision. Call it after setProblem() when no evaluation is in flight.
+	// Returns true if any device evaluates in single precision.
+    bool setSinglePrecision(bool single);
     
 	void coarse_grain_search(double *init_ret);
 
-	// functions to return F, x, gradient, and active mask
+	// true if every device has the solve kernel (<evaluation kernel>_solve)
+    bool hasSolveKernel();
+
+	// solve all functions of the current problem on the devices from x_inits
+	// (num_vars values for each function) with the solve kernel, which runs the
+	// L-BFGS-B iterations in device memory (lbfgsb.cl) and evaluates the functions
+	// itself. Each launch runs at most launch_iterations iterations of the functions
+	// of a chunk that are still running, the chunk is relaunched until all of them
+	// have finished. A chunk has at most window functions (0 = no limit) and is also
+	// bounded by the largest buffer the device can allocate. The solutions are left
+	// in getx() and getF().
+    void deviceSolve(double *x_inits, int *b, double *L, double *U, int m, double factr, double pgtol,
+          int max_iterations, int launch_iterations, int window, bool verbosePrint);
+
+	// device solver statistics: kernel launches, functions solved and time taken
+    long getSolveLaunches() { return solveLaunches; }
+    long getSolveFuncs() { return solveFuncs; }
+    double getSolveTime() { return solve_ms; }
+
+	// functions to return F, x and gradient (indexed by function number)
     double *getF() { return F_host; }
     double *getx() { return x_host; }
     double *getg() { return g_host; }
-    int *getActive() {return active_mask_host; }
+
+	// values in g of every function: the gradient, followed by J'J with
+	// bfgsb_cl_options.lm_solver (getg() + func * getGradientStride())
+    int getGradientStride() { return g_stride; }
+
+	// evaluation points of every function: its x and getEvalPoints()-1 candidate points 
+	// (speculative line search steps, see bfgsb_cl_options.line_search_points) that are
+	// evaluated in the same launch when their ids are given to evalAsync().
+	// The candidates of a function are stored one after the other (indexed by
+	// function number * (getEvalPoints()-1) + candidate number)
+    int getEvalPoints() { return evalPoints; }
+    int candidateId(int func, int k) { return num_funcs + func * (evalPoints - 1) + k; }
+    double *getFCandidates() { return Fc_host; }
+    double *getxCandidates() { return xc_host; }
+    double *getgCandidates() { return gc_host; }
 
    private:
 
     int num_vars;
+    int g_stride;						// values per function in the g buffers
     int num_funcs;
     char evalSrcFileNameFull[MAX_STR_SZ];
     char OpenCL_incDir[MAX_STR_SZ];
+    char evalKernelName[MAX_STR_SZ];
+    char programCacheDir[MAX_STR_SZ];
+    char platformSelect[MAX_STR_SZ];	// platform and devices to run on (see device_select.h)
+    char deviceSelect[MAX_STR_SZ];
     int num_user_args;
     pEval_user_buff *user_buffs;
     bool use_coarse_grain_search;
     unsigned int coarse_grain_n;
-    double *coarse_grain_points;
+    int num_cohorts;
+    bfgsb_cl_host_memory hostMemory;	// resolved from AUTO by OpenCL_mainSetup()
+    bool outOfOrderQueue;				// cleared by OpenCL_mainSetup() if a device does not support it
+    int maxDevices;						// use at most this many devices (0 = all)
+    int subDeviceUnits;					// split the devices into sub-devices of this many compute units (0 = don't)
+    bool tuneLaunch;					// tune the launch shapes of the kernels
+    int evalVariant;					// evaluation kernel variant to use (or EVAL_VARIANT_AUTO)
+    bool singlePrecision;				// evaluate with the single precision variant (setSinglePrecision())
+    int evalPoints;						// evaluation points of each function (1 + candidates)
+    LaunchTuner *launchTuner;			// tuned shapes are kept in the program cache directory
+
+	// high-water marks of the buffers, kept across batches
+    int capacity_funcs;
+    int capacity_user_args;
+    size_t capacity_coarse_grain_points;
+    size_t capacity_init_ret;
+    size_t capacity_coarse_grain_bank;
+    size_t capacity_coarse_grain_norm2;
+    size_t capacity_coarse_grain_bank_ids;
 
 	// OpenCL data structures
-    cl_context context;
-    cl_command_queue cmdQueue;
-    cl_kernel evalKernel;
-    cl_kernel coarseGrainedSearchKernel;
+    int num_contexts;					// one context and program for each platform the devices are on
+    cl_context *contexts;
+    cl_program *programs;
+    int num_devices;
+    pEval_device *devs;
+    cl_device_id *subDevices;			// sub-devices created by OpenCL_mainSetup() (NULL if none)
+    cl_uint num_subDevices;
+    int *sliceCount;					// number of slots for each device, filled in by splitSlots()
 
-	// device memory handles
-    cl_mem F_dev;
-    cl_mem x_dev;
-    cl_mem g_dev;
-    cl_mem active_mask_dev;
+	// packed slot range of the evaluation in flight for each cohort
+    int *cohortFirstSlot;
+    int *cohortCount;
 
-    cl_mem coarse_grain_points_dev;
-    cl_mem init_ret_dev;
+	// evaluation done callback
+    pEvalDoneCallback doneCallback;
+    void *doneCallbackArg;
+    pEval_cohort_ref *cohortRefs;		// event callback argument for each cohort
+    int *cohortPending;					// slices of the cohort's evaluation the devices have not finished
+    pthread_mutex_t callbackMutex;		// protects cohortPending
+    static void CL_CALLBACK evalDoneNotify(cl_event event, cl_int status, void *ref);
+
+    double deviceBusy_ms;
+    double hostWait_ms;
+
+    long solveLaunches;
+    long solveFuncs;
+    double solve_ms;
 
 	// OpenCL subsystem functions
     void OpenCL_mainSetup();
-    void OpenCL_initInputs();
+    void OpenCL_initInputs(double *coarse_grain_points, const bfgsb_cl_coarse_grain_bank *coarse_grain_bank);
     void OpenCL_cleanup();
+    void allocStagingBuffers();
+    void freeStagingBuffers();
+    void evalSliceAsync(int d, int cohort, int first_slot, int count);
+    void splitSlots(int count, int *dev_count);
+    void coarseGrainLaunch(int d, int first, int count, launch_shape shape, 
+          cl_uint numWait, const cl_event *waitList, cl_event *kernelDone);
+    void useVariant(int d, int v);
+    void pickVariant(int d, int first_slot, int count, cl_uint numWait, const cl_event *waitList);
 
-	// host memory pointers
+	// host memory pointers (indexed by function number)
     double *F_host;
     double *x_host;
     double *g_host;
-    int *active_mask_host;
+
+	// candidate points (evalPoints-1 for each function)
+    double *Fc_host;
+    double *xc_host;
+    double *gc_host;
+
+	// F, x and gradient of evaluation point p (a function number or a candidateId())
+    double *pointF(int p) { return (p < num_funcs) ? F_host + p : Fc_host + (p - num_funcs); }
+    double *pointx(int p) { return (p < num_funcs) ? x_host + p * num_vars : xc_host + (p - num_funcs) * num_vars; }
+    double *pointg(int p) { return (p < num_funcs) ? g_host + p * g_stride : gc_host + (p - num_funcs) * g_stride; }
+    int pointFunc(int p) { return (p < num_funcs) ? p : (p - num_funcs) / (evalPoints - 1); }
+
+	// packed host staging buffers (indexed by slot), mapped from the pinned
+	// buffers below with BFGSB_CL_HOST_MEMORY_PINNED and not used with 
+	// BFGSB_CL_HOST_MEMORY_ZERO_COPY (except func_ids_host)
+    double *F_packed_host;
+    double *x_packed_host;
+    double *g_packed_host;
+    int *func_ids_host;
+    int *point_ids_host;		// evaluation point of each slot (func_ids_host has its function)
+    cl_mem F_pinned;
+    cl_mem x_pinned;
+    cl_mem g_pinned;
+    cl_mem func_ids_pinned;
+    int *all_ids;				// 0 .. num_funcs-1, for eval()
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include <pthread.h>
+
+#include "phase_barrier.h"
+
+
+PhaseBarrier::PhaseBarrier(int num_workers)
+{
+   this->num_workers = num_workers;
+
+   // all workers count as arrived until the first phase is published
+   num_arrived = num_workers;
+   phase = 0;
+   stop = false;
+
+   pthread_mutex_init(&mutex, NULL);
+   pthread_cond_init(&phaseCond, NULL);
+   pthread_cond_init(&doneCond, NULL);
+}
+
+PhaseBarrier::~PhaseBarrier()
+{
+   pthread_cond_destroy(&doneCond);
+   pthread_cond_destroy(&phaseCond);
+   pthread_mutex_destroy(&mutex);
+}
+
+
+// start a new phase, all workers must have arrived for the previous one
+void PhaseBarrier::publish()
+{
+   pthread_mutex_lock(&mutex);
+   num_arrived = 0;
+   phase++;
+   pthread_cond_broadcast(&phaseCond);
+   pthread_mutex_unlock(&mutex);
+}
+
+// sleep until the last worker has arrived for the current phase
+void PhaseBarrier::waitForWorkers()
+{
+   pthread_mutex_lock(&mutex);
+   while(num_arrived < num_workers)
+   {
+      pthread_cond_wait(&doneCond, &mutex);
+   }
+   pthread_mutex_unlock(&mutex);
+}
+
+// tell all workers to exit
+void PhaseBarrier::shutdown()
+{
+   pthread_mutex_lock(&mutex);
+   stop = true;
+   pthread_cond_broadcast(&phaseCond);
+   pthread_mutex_unlock(&mutex);
+}
+
+
+// sleep until a new phase is published or the barrier is shut down
+bool PhaseBarrier::waitForPhase(unsigned int *seen_phase)
+{
+   bool newPhase;
+
+   pthread_mutex_lock(&mutex);
+   while((phase == *seen_phase) && !stop)
+   {
+      pthread_cond_wait(&phaseCond, &mutex);
+   }
+
+   newPhase = (phase != *seen_phase);
+   *seen_phase = phase;
+   pthread_mutex_unlock(&mutex);
+
+   return newPhase;
+}
+
+// worker is done with the current phase, wake up the master if it is the last one
+void PhaseBarrier::arrive()
+{
+   pthread_mutex_lock(&mutex);
+   num_arrived++;
+   if(num_arrived == num_workers) pthread_cond_signal(&doneCond);
+   pthread_mutex_unlock(&mutex);
+}
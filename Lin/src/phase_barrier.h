@@ -0,0 +1,50 @@
+#ifndef PHASE_BARRIER_H
+#define PHASE_BARRIER_H
+
+#include <pthread.h>
+
+// Reusable master/worker phase barrier.
+// The master publishes a phase (one solver iteration), every worker sleeps
+// until a new phase is published, does its share of the work and then arrives.
+// The master sleeps until the last worker has arrived.
+// All waiting is done on condition variables so idle threads do not burn CPU.
+class PhaseBarrier {
+
+   public:
+
+   PhaseBarrier(int num_workers);	// number of worker threads taking part in each phase
+   ~PhaseBarrier();
+
+   // master side
+
+   void publish();				// start a new phase and wake up all workers
+   void waitForWorkers();		// block until all workers have arrived for the current phase
+   void shutdown();				// release all workers for good (waitForPhase() returns false)
+
+   // worker side
+
+   // block until a phase newer than *seen_phase is published
+   // returns true and updates *seen_phase if there is work to do,
+   // returns false if the barrier has been shut down
+   bool waitForPhase(unsigned int *seen_phase);
+
+   void arrive();				// signal that this worker is done with the current phase
+
+   private:
+
+   // The copy constructor and copy assignment operator are kept
+   // private so that they are not used.
+   PhaseBarrier            (const PhaseBarrier& source) { };
+   PhaseBarrier& operator= (const PhaseBarrier& source) { return *this; };
+
+   pthread_mutex_t mutex;
+   pthread_cond_t phaseCond;	// signaled when a phase is published (or on shutdown)
+   pthread_cond_t doneCond;		// signaled when the last worker arrives
+
+   int num_workers;
+   int num_arrived;				// workers done with the current phase
+   unsigned int phase;			// current phase number
+   bool stop;					// true once shutdown() has been called
+};
+
+#endif
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+//Windows
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf		// returns -1 (and may not terminate) if the string does not fit
+#endif
+
+#else
+//Linux
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <CL/cl.h>
+
+#include "program_cache.h"
+
+#define MAX_STR_SZ 512			// maximum string size
+#define MAX_INCLUDE_DEPTH 16	// maximum nesting of #include "..." in the OpenCL sources
+
+// OpenCL file embedded in the executable
+typedef struct s_embeddedSource {
+   const char *name;			// file name (without directory)
+   const char *text;			// contents of the file
+} embeddedSource;
+
+#ifdef EMBED_CL_SOURCES
+// generated by the Makefile from the OpenCL files (make embed_cl=1)
+#include "embedded_cl_sources.inc"
+#else
+static const embeddedSource embeddedSources[] = { { NULL, NULL } };
+#endif
+
+// first bytes of a cache file, change the version when the layout changes
+static const char cacheMagic[8] = { 'B', 'F', 'G', 'S', 'B', 'C', 'L', '1' };
+
+static char *readFile(const char *fileName);
+static char *expandIncludes(const char *fileName, const char *incDir, int depth);
+static unsigned long long hashProgram(cl_uint numDevices, const cl_device_id *devices, const char *source, const char *buildLine);
+static cl_program loadProgram(cl_context context, cl_uint numDevices, const cl_device_id *devices, const char *cacheFileName, unsigned long long key);
+static void storeProgram(cl_program program, cl_uint numDevices, const char *cacheDir, const char *cacheFileName, unsigned long long key);
+
+
+// returns the source of the OpenCL file sourceFileName with its includes inlined
+char *readProgramSource(const char *sourceFileName, const char *incDir)
+{
+   return expandIncludes(sourceFileName, incDir, 0);
+}
+
+
+// create and build the program, from the binaries in cacheDir if they are there
+cl_program buildProgramCached(
+      cl_context context,
+      cl_uint numDevices,
+      const cl_device_id *devices,
+      const char *source,
+      const char *buildLine,
+      const char *cacheDir,
+      cl_int *buildErr)
+{
+   cl_int status;
+   cl_program program;
+   bool useCache = (cacheDir != NULL && cacheDir[0] != '\0');
+
+   unsigned long long key = 0;
+   char cacheFileName[MAX_STR_SZ];
+
+   if(useCache)
+   {
+      key = hashProgram(numDevices, devices, source, buildLine);
+
+      int len = snprintf(cacheFileName, sizeof(cacheFileName), "%s/%016llx.clbin", cacheDir, key);
+      if(len < 0 || (size_t) len >= sizeof(cacheFileName))
+      {
+         printf("OpenCL program cache directory %s is too long, not caching\n", cacheDir);
+         useCache = false;
+      }
+   }
+
+   if(useCache)
+   {
+      program = loadProgram(context, numDevices, devices, cacheFileName, key);
+
+      if(program != NULL)
+      {
+         *buildErr = clBuildProgram(program, numDevices, devices, buildLine, NULL, NULL);
+
+         if(*buildErr == CL_SUCCESS)
+         {
+            printf("Loaded OpenCL program binary %s\n", cacheFileName);
+            return program;
+         }
+
+         // the binary is stale (e.g. rejected by a new driver), build from source
+         printf("OpenCL program binary %s could not be built, rebuilding from source\n", cacheFileName);
+         clReleaseProgram(program);
+      }
+   }
+
+   program = clCreateProgramWithSource(context, 1, (const char**)&source,
+                              NULL, &status);
+   if(status != CL_SUCCESS) {
+      printf("clCreateProgramWithSource failed\n");
+      exit(-1);
+   }
+
+   *buildErr = clBuildProgram(program, numDevices, devices, buildLine, NULL, NULL);
+
+   if(useCache && *buildErr == CL_SUCCESS)
+   {
+      storeProgram(program, numDevices, cacheDir, cacheFileName, key);
+   }
+
+   return program;
+}
+
+
+// read the whole file fileName into a null terminated string (NULL if it can't be opened)
+static char *readFile(const char *fileName)
+{
+   FILE *fp = fopen(fileName, "rb");
+   if(fp == NULL) return NULL;
+
+   fseek(fp, 0, SEEK_END);
+   long size = ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+
+   if(size < 0) {
+      printf("Error getting the size of %s\n", fileName);
+      exit(-1);
+   }
+
+   char *text = (char *) malloc(size + 1);
+   if(text == NULL) {
+      printf("Error allocating %ld bytes for %s\n", size+1, fileName);
+      exit(-1);
+   }
+
+   if(fread(text, 1, size, fp) != (size_t) size) {
+      printf("Error reading %s\n", fileName);
+      exit(-1);
+   }
+
+   text[size] = '\0';
+   fclose(fp);
+
+   return text;
+}
+
+
+// returns the contents of fileName (embedded or from the disk) with every
+// #include "name" line replaced by the contents of incDir/name
+static char *expandIncludes(const char *fileName, const char *incDir, int depth)
+{
+   if(depth > MAX_INCLUDE_DEPTH) {
+      printf("OpenCL includes nested too deep in %s\n", fileName);
+      exit(-1);
+   }
+
+   // look for the file in the executable first
+   const char *baseName = fileName;
+   for(const char *c = fileName; *c != '\0'; c++)
+   {
+      if(*c == '/' || *c == '\\') baseName = c + 1;
+   }
+
+   const char *text = NULL;
+   char *fileText = NULL;
+
+   for(int i = 0; embeddedSources[i].name != NULL; i++)
+   {
+      if(strcmp(embeddedSources[i].name, baseName) == 0) text = embeddedSources[i].text;
+   }
+
+   if(text == NULL)
+   {
+      fileText = readFile(fileName);
+      if(fileText == NULL) {
+         printf("Could not open kernel file: %s\n", fileName);
+         exit(-1);
+      }
+      text = fileText;
+   }
+
+   // copy line by line, inlining the includes
+   size_t capacity = strlen(text) + 1;
+   size_t length = 0;
+   char *out = (char *) malloc(capacity);
+
+   const char *line = text;
+   while(*line != '\0')
+   {
+      const char *end = strchr(line, '\n');
+      size_t lineLength = (end != NULL) ? (size_t) (end - line + 1) : strlen(line);
+
+      const char *insert = line;
+      size_t insertLength = lineLength;
+      char *included = NULL;
+
+      // #include "name"
+      const char *c = line;
+      while(*c == ' ' || *c == '\t') c++;
+
+      if(*c == '#')
+      {
+         c++;
+         while(*c == ' ' || *c == '\t') c++;
+
+         if(strncmp(c, "include", 7) == 0)
+         {
+            c += 7;
+            while(*c == ' ' || *c == '\t') c++;
+
+            const char *close = (*c == '"') ? strchr(c + 1, '"') : NULL;
+
+            if(close != NULL && close < line + lineLength)
+            {
+               char includeName[MAX_STR_SZ];
+               int nameLength = (int) (close - c - 1);
+               int len;
+
+               if(incDir != NULL && incDir[0] != '\0') len = snprintf(includeName, sizeof(includeName), "%s/%.*s", incDir, nameLength, c + 1);
+               else len = snprintf(includeName, sizeof(includeName), "%.*s", nameLength, c + 1);
+
+               if(len < 0 || (size_t) len >= sizeof(includeName)) {
+                  printf("OpenCL include path too long in %s\n", fileName);
+                  exit(-1);
+               }
+
+               included = expandIncludes(includeName, incDir, depth + 1);
+               insert = included;
+               insertLength = strlen(included);
+            }
+         }
+      }
+
+      if(length + insertLength + 2 > capacity)
+      {
+         capacity = 2 * capacity + insertLength + 2;
+         out = (char *) realloc(out, capacity);
+      }
+
+      memcpy(out + length, insert, insertLength);
+      length += insertLength;
+
+      if(included != NULL)
+      {
+         if(insertLength > 0 && out[length-1] != '\n') out[length++] = '\n';
+         free(included);
+      }
+
+      line += lineLength;
+   }
+
+   out[length] = '\0';
+   free(fileText);
+
+   return out;
+}
+
+
+// 64 bit FNV-1a hash of size bytes
+static unsigned long long hashBytes(unsigned long long hash, const void *data, size_t size)
+{
+   const unsigned char *p = (const unsigned char *) data;
+
+   for(size_t i = 0; i < size; i++)
+   {
+      hash ^= p[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return hash;
+}
+
+
+// hash of everything the program binaries depend on
+static unsigned long long hashProgram(cl_uint numDevices, const cl_device_id *devices, const char *source, const char *buildLine)
+{
+   unsigned long long hash = 14695981039346656037ULL;
+
+   hash = hashBytes(hash, cacheMagic, sizeof(cacheMagic));
+   hash = hashBytes(hash, source, strlen(source) + 1);
+   hash = hashBytes(hash, buildLine, strlen(buildLine) + 1);
+
+   cl_device_info info[4] = { CL_DEVICE_NAME, CL_DEVICE_VENDOR, CL_DRIVER_VERSION, CL_DEVICE_VERSION };
+
+   for(cl_uint i = 0; i < numDevices; i++)
+   {
+      for(int k = 0; k < 4; k++)
+      {
+         char buf[MAX_STR_SZ];
+         buf[0] = '\0';
+         clGetDeviceInfo(devices[i], info[k], sizeof(buf), buf, NULL);
+         buf[MAX_STR_SZ-1] = '\0';
+         hash = hashBytes(hash, buf, strlen(buf) + 1);
+      }
+   }
+
+   return hash;
+}
+
+
+// create the program from the binaries in cacheFileName, returns NULL if there
+// are none for this key or the devices do not accept them
+static cl_program loadProgram(cl_context context, cl_uint numDevices, const cl_device_id *devices, const char *cacheFileName, unsigned long long key)
+{
+   FILE *fp = fopen(cacheFileName, "rb");
+   if(fp == NULL) return NULL;
+
+   // length of the file, the binaries must fit in what is left of it after their sizes
+   long fileLength = -1;
+   if(fseek(fp, 0, SEEK_END) == 0) fileLength = ftell(fp);
+   rewind(fp);
+
+   char magic[sizeof(cacheMagic)];
+   unsigned long long fileKey;
+   cl_uint fileDevices;
+
+   bool ok = fileLength > 0 &&
+      fread(magic, sizeof(magic), 1, fp) == 1 &&
+      fread(&fileKey, sizeof(fileKey), 1, fp) == 1 &&
+      fread(&fileDevices, sizeof(fileDevices), 1, fp) == 1 &&
+      memcmp(magic, cacheMagic, sizeof(magic)) == 0 &&
+      fileKey == key && fileDevices == numDevices;
+
+   size_t *sizes = (size_t *) calloc(numDevices, sizeof(size_t));
+   unsigned char **binaries = (unsigned char **) calloc(numDevices, sizeof(unsigned char *));
+
+   for(cl_uint i = 0; ok && i < numDevices; i++)
+   {
+      unsigned long long size;
+      ok = fread(&size, sizeof(size), 1, fp) == 1 && size > 0;
+      if(!ok) break;
+
+      // a truncated or corrupt file can claim any size, never allocate more than it holds
+      long pos = ftell(fp);
+      ok = pos >= 0 && pos <= fileLength && size <= (unsigned long long) (fileLength - pos);
+      if(!ok) break;
+
+      sizes[i] = (size_t) size;
+      binaries[i] = (unsigned char *) malloc(sizes[i]);
+      ok = binaries[i] != NULL && fread(binaries[i], 1, sizes[i], fp) == sizes[i];
+   }
+
+   fclose(fp);
+
+   cl_program program = NULL;
+
+   if(ok)
+   {
+      cl_int status;
+      cl_int *binaryStatus = (cl_int *) malloc(numDevices * sizeof(cl_int));
+
+      program = clCreateProgramWithBinary(context, numDevices, devices, sizes,
+            (const unsigned char **) binaries, binaryStatus, &status);
+
+      for(cl_uint i = 0; i < numDevices; i++)
+      {
+         if(status == CL_SUCCESS && binaryStatus[i] != CL_SUCCESS) status = binaryStatus[i];
+      }
+
+      if(status != CL_SUCCESS)
+      {
+         printf("OpenCL program binary %s was rejected, rebuilding from source\n", cacheFileName);
+         if(program != NULL) clReleaseProgram(program);
+         program = NULL;
+      }
+
+      free(binaryStatus);
+   }
+   else printf("OpenCL program binary %s is invalid, rebuilding from source\n", cacheFileName);
+
+   for(cl_uint i = 0; i < numDevices; i++) free(binaries[i]);
+   free(binaries);
+   free(sizes);
+
+   return program;
+}
+
+
+// write the binaries of the built program to cacheFileName (through a temporary
+// file, so concurrent runs never see a partly written one)
+static void storeProgram(cl_program program, cl_uint numDevices, const char *cacheDir, const char *cacheFileName, unsigned long long key)
+{
+   cl_int status;
+
+   size_t *sizes = (size_t *) calloc(numDevices, sizeof(size_t));
+   status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, numDevices * sizeof(size_t), sizes, NULL);
+   if(status != CL_SUCCESS) {
+      printf("clGetProgramInfo failed, OpenCL program binary not cached\n");
+      free(sizes);
+      return;
+   }
+
+   unsigned char **binaries = (unsigned char **) calloc(numDevices, sizeof(unsigned char *));
+   for(cl_uint i = 0; i < numDevices; i++) binaries[i] = (unsigned char *) malloc(sizes[i] > 0 ? sizes[i] : 1);
+
+   status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, numDevices * sizeof(unsigned char *), binaries, NULL);
+
+   bool ok = (status == CL_SUCCESS);
+   for(cl_uint i = 0; i < numDevices; i++) if(sizes[i] == 0) ok = false;
+
+   if(ok)
+   {
+#ifdef _WIN32
+      _mkdir(cacheDir);
+#else
+      mkdir(cacheDir, 0777);
+#endif
+
+      char tmpFileName[MAX_STR_SZ];
+      int len = snprintf(tmpFileName, sizeof(tmpFileName), "%s.%d.tmp", cacheFileName, (int) getpid());
+
+      FILE *fp = NULL;
+      if(len >= 0 && (size_t) len < sizeof(tmpFileName)) fp = fopen(tmpFileName, "wb");
+      ok = (fp != NULL);
+
+      if(ok)
+      {
+         ok = fwrite(cacheMagic, sizeof(cacheMagic), 1, fp) == 1 &&
+            fwrite(&key, sizeof(key), 1, fp) == 1 &&
+            fwrite(&numDevices, sizeof(numDevices), 1, fp) == 1;
+
+         for(cl_uint i = 0; ok && i < numDevices; i++)
+         {
+            unsigned long long size = sizes[i];
+            ok = fwrite(&size, sizeof(size), 1, fp) == 1 && fwrite(binaries[i], 1, sizes[i], fp) == sizes[i];
+         }
+
+         if(fclose(fp) != 0) ok = false;
+
+#ifdef _WIN32
+         // rename() does not replace an existing file on Windows
+         if(ok) remove(cacheFileName);
+#endif
+         if(ok) ok = (rename(tmpFileName, cacheFileName) == 0);
+         if(!ok) remove(tmpFileName);
+      }
+
+      if(ok) printf("Stored OpenCL program binary %s\n", cacheFileName);
+   }
+
+   if(!ok) printf("Could not store OpenCL program binary %s\n", cacheFileName);
+
+   for(cl_uint i = 0; i < numDevices; i++) free(binaries[i]);
+   free(binaries);
+   free(sizes);
+}
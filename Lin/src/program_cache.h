@@ -0,0 +1,37 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <CL/cl.h>
+
+// Loading and building of the OpenCL programs.
+//
+// readProgramSource() returns the source of a .cl file with the files it
+// includes with #include "..." inlined, so the source is complete in one
+// string. If the executable was built with the sources embedded
+// (make embed_cl=1) the files are taken from the executable instead of the disk.
+//
+// buildProgramCached() builds a program and stores its binaries in a cache
+// directory. The file name is a hash of the source, the build line and the
+// name, vendor, driver version and OpenCL version of the devices. Later builds
+// with the same key load the binaries with clCreateProgramWithBinary() instead
+// of compiling. If the stored binaries are rejected, the program is built from
+// the source again and the cache file is replaced.
+
+
+// returns the source of the OpenCL file sourceFileName with its includes inlined
+// (searched for in incDir), free() it when done
+char *readProgramSource(const char *sourceFileName, const char *incDir);
+
+// create and build the program from source for the devices, using the binaries in
+// cacheDir if there are any for this source, build line and devices (NULL or "" for no cache),
+// returns the program and the result of clBuildProgram() in buildErr
+cl_program buildProgramCached(
+      cl_context context,
+      cl_uint numDevices,
+      const cl_device_id *devices,
+      const char *source,
+      const char *buildLine,
+      const char *cacheDir,
+      cl_int *buildErr);
+
+#endif
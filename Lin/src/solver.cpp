@@ -5,33 +5,57 @@
 static void copyCStrToCharArray (const char* source, char* dest, int ndest);
 static bool strIsEqualToCStr (const char* str, const char* cstr); 
 
+// allocate count elements of type T from the arena, or from the heap if arena is NULL
+// (heap allocations are counted in heap_allocs)
+template <class T>
+static T *solverAlloc(SolverArena *arena, size_t count, long *heap_allocs)
+{
+   if(arena != NULL) return (T *) arena->alloc(count * sizeof(T));
+
+   (*heap_allocs)++;
+   return new T[count];
+}
+
 // initialize solver data structures
 SolverBase::SolverBase (int n, double *x_init, double* lb, double* ub, int* btype,
      double *x_ret, double *f_ret, double *g,
 	   int m, int maxiter,
-	   double factr, double pgtol)
+	   double factr, double pgtol,
+	   SolverEngine engine, SolverArena *arena)
 {
    
    this->n = n;
+   this->arena = arena;
+   heap_allocs = 0;
 
    this->x = x_ret;
    memcpy(this->x, x_init, n*sizeof(double));
 
-   this->lb = new double[n];
-   memcpy(this->lb, lb, n*sizeof(double));
-  
-   this->ub = new double[n];
-   memcpy(this->ub, ub, n*sizeof(double));
+   // the bounds are the same for all solvers in an arena, share them
+   if(arena != NULL)
+   {
+      this->lb = lb;
+      this->ub = ub;
+      this->btype = btype;
+   }
+   else
+   {
+      this->lb = solverAlloc<double>(NULL, n, &heap_allocs);
+      memcpy(this->lb, lb, n*sizeof(double));
 
-   this->btype = new int[n];
-   memcpy(this->btype, btype, n*sizeof(int));
+      this->ub = solverAlloc<double>(NULL, n, &heap_allocs);
+      memcpy(this->ub, ub, n*sizeof(double));
+
+      this->btype = solverAlloc<int>(NULL, n, &heap_allocs);
+      memcpy(this->btype, btype, n*sizeof(int));
+   }
 
    this->f = f_ret;
    *(this->f) = 0;
 
    if(g == NULL)
    {
-      this->g = new double[n];
+      this->g = solverAlloc<double>(arena, n, &heap_allocs);
       g_owner = true;
    }
    else
@@ -52,39 +76,160 @@ SolverBase::SolverBase (int n, double *x_init, double* lb, double* ub, int* btyp
    this->iprint = defaultprintlevel;
 
    iter = 0;
-   wa  = new double[(2*m + 4)*n + 12*m*(m + 1)];
-   iwa = new int[3*n];
+   task = lbfgsbStop;
+
+   // use the dense or the Levenberg-Marquardt engine if it was asked for and
+   // compiled for this n (LM needs the caller's g for J'J), else the native engine if it was compiled for this n and m,
+   // otherwise use the Fortran routine
+   this->engine = NULL;
+   wa = NULL;
+   iwa = NULL;
+
+   if(engine == denseEngine && denseBfgsbEngineSupported(n))
+   {
+      void *mem = NULL;
+      if(arena != NULL) mem = arena->alloc(denseBfgsbEngineSize(n));
+      else heap_allocs++;
+
+      this->engine = createDenseBfgsbEngine(n, this->x, this->f, this->g, this->lb, this->ub, this->btype, factr, pgtol, mem);
+      engineType = denseEngine;
+   }
+   else if(engine == lmEngine && !g_owner && lmEngineSupported(n))
+   {
+      void *mem = NULL;
+      if(arena != NULL) mem = arena->alloc(lmEngineSize(n));
+      else heap_allocs++;
+
+      this->engine = createLmEngine(n, this->x, this->f, this->g, this->lb, this->ub, this->btype, factr, pgtol, mem);
+      engineType = lmEngine;
+   }
+   else if(engine != fortranEngine && lbfgsbEngineSupported(n, m))
+   {
+      void *mem = NULL;
+      if(arena != NULL) mem = arena->alloc(lbfgsbEngineSize(n, m));
+      else heap_allocs++;
+
+      this->engine = createLbfgsbEngine(n, m, this->x, this->f, this->g, this->lb, this->ub, this->btype, factr, pgtol, mem);
+      engineType = nativeEngine;
+   }
+
+   if(this->engine == NULL)
+   {
+      engineType = fortranEngine;
+      wa  = solverAlloc<double>(arena, (2*m + 4)*n + 12*m*(m + 1), &heap_allocs);
+      iwa = solverAlloc<int>(arena, 3*n, &heap_allocs);
+   }
 }
 
 // release solver resources
+// (workspaces in an arena are released with the arena)
 SolverBase::~SolverBase() { 
 
+  if(arena != NULL)
+  {
+    if(engine) engine->~LbfgsbEngineBase();
+    return;
+  }
+
   delete[] lb;
   delete[] ub;
   delete[] btype;
   if(g_owner) delete[] g;
+  delete engine;
   delete[] wa;
   delete[] iwa;
 }
 
 
+// point the solver at a new problem, the native (dense or LM) engine is rebuilt in its
+// own memory if it is in an arena, the Fortran workspace is simply reused
+// (task 'START' initializes it)
+void SolverBase::resetProblem (double *x_init, double *x_ret, double *f_ret, double *g) {
+
+  x = x_ret;
+  memcpy(x, x_init, n*sizeof(double));
+
+  f = f_ret;
+  *f = 0;
+
+  if(!g_owner) this->g = g;
+
+  for(int i = 0; i < n; i++)
+  {
+    this->g[i] = 0;
+  }
+
+  iter = 0;
+  task = lbfgsbStop;
+
+  if(engine)
+  {
+    void *mem = NULL;
+
+    if(arena != NULL)
+    {
+      engine->~LbfgsbEngineBase();
+      mem = engine;
+    }
+    else
+    {
+      delete engine;
+      heap_allocs++;
+    }
+
+    if(engineType == denseEngine) engine = createDenseBfgsbEngine(n, x, f, this->g, lb, ub, btype, factr, pgtol, mem);
+    else if(engineType == lmEngine) engine = createLmEngine(n, x, f, this->g, lb, ub, btype, factr, pgtol, mem);
+    else engine = createLbfgsbEngine(n, m, x, f, this->g, lb, ub, btype, factr, pgtol, mem);
+  }
+}
+
+
 // run one iteration of the L-BFGS-B algorithm 
-void SolverBase::callLBFGS (const char* cmd) {
+void SolverBase::callLBFGS () {
+  if (engine) task = engine->step();
+  else callFortranLBFGS(0);
+}
+
+
+// start the L-BFGS-B algorithm at x
+void SolverBase::startLBFGS () {
+  if (engine) task = engine->start();
+  else callFortranLBFGS("START");
+}
+
+
+// stop the L-BFGS-B algorithm
+void SolverBase::stopLBFGS () {
+  if (engine) task = engine->stop();
+  else callFortranLBFGS("STOP");
+}
+
+
+// run one iteration of the Fortran L-BFGS-B routine 
+void SolverBase::callFortranLBFGS (const char* cmd) {
   if (cmd)
-    copyCStrToCharArray(cmd,task,60);
+    copyCStrToCharArray(cmd,ftask,60);
 
 // call appropiate fortran routine to the run the solver
 #ifdef _WIN32
 //Windows	
-  SETULB(&n,&m,x,lb,ub,btype,f,g,&factr,&pgtol,wa,iwa,task,&iprint,
+  SETULB(&n,&m,x,lb,ub,btype,f,g,&factr,&pgtol,wa,iwa,ftask,&iprint,
 	  csave,lsave,isave,dsave);
 #else
 //Linux
-  setulb_(&n,&m,x,lb,ub,btype,f,g,&factr,&pgtol,wa,iwa,task,&iprint,
+  setulb_(&n,&m,x,lb,ub,btype,f,g,&factr,&pgtol,wa,iwa,ftask,&iprint,
 	  csave,lsave,isave,dsave);
 
 #endif
 
+  // translate the task string
+  if (strIsEqualToCStr(ftask,"FG")) task = lbfgsbFG;
+  else if (strIsEqualToCStr(ftask,"NEW_X")) task = lbfgsbNewX;
+  else if (strIsEqualToCStr(ftask,"CONV")) task = lbfgsbConverged;
+  else if (strIsEqualToCStr(ftask,"ABNO")) task = lbfgsbAbnormal;
+  else if (strIsEqualToCStr(ftask,"STOP")) task = lbfgsbStop;
+  else task = lbfgsbError;
+
 }
 
 // Copy a C-style string (a null-terminated character array) to a
@@ -126,23 +271,30 @@ SolverExitStatus Solver::runSolver() {
   SolverExitStatus status = success;  // The return value.
 
   // This initial call sets up the structures for L-BFGS.
-  callLBFGS("START");
+  startLBFGS();
 
   // Repeat until we've reached the maximum number of iterations.
   while (true) {
 
     // Do something according to the "task" from the previous call to
     // L-BFGS.
-    if (strIsEqualToCStr(task,"FG")) {
+    if (task == lbfgsbFG) {
 
       // Evaluate the objective function and the gradient of the
       // objective at the current point x.
-      *f = computeObjective(x);
-      computeGradient(x);
+      if(obj_grad_func != NULL)
+      {
+         *f = obj_grad_func(x, g, aux_func_data);
+      }
+      else
+      {
+         *f = computeObjective(x);
+         computeGradient(x);
+      }
    //   printf("g = %f\n", g[0]);
     } 
     
-    else if (strIsEqualToCStr(task,"NEW_X")) {
+    else if (task == lbfgsbNewX) {
 
        // Go to the next iteration and call the iterative callback
        // routine.
@@ -152,21 +304,20 @@ SolverExitStatus Solver::runSolver() {
        // If we've reached the maximum number of iterations, terminate
        // the optimization.
        if (iter == maxiter) {
-          callLBFGS("STOP");
+          stopLBFGS();
           break;
        }
     } 
     
-    else if (strIsEqualToCStr(task,"CONV"))
-       break;
-    else if (strIsEqualToCStr(task,"ABNO")) {
+    else if (task == lbfgsbAbnormal) {
        status = abnormalTermination;
        break;
     } 
-    else if (strIsEqualToCStr(task,"ERROR")) {
+    else if (task == lbfgsbError) {
        status = errorOnInput;
        break;
     }
+    else break;		// converged or stopped
 
     // Call L-BFGS again.
     callLBFGS();
@@ -225,6 +376,17 @@ void Solver::computeGradient(double *x)
 }
 
 
+// reuse the solver for a new problem
+void SolverExtEval::restart(double *x_init, double *x_ret, double *f_ret, double *g, int id) {
+
+  resetProblem(x_init, x_ret, f_ret, g);
+
+  solverInit = false;
+  solverDone = false;
+  this->id = id;
+}
+
+
 // Run one iteration of the BFGS-B solver
 // if exit status == evalWait then f(x) and its gradient 
 // must be evaluated externally to this class
@@ -236,7 +398,7 @@ SolverExitStatus SolverExtEval::runSolver() {
   if(solverInit == false)
   {
      // This initial call sets up the structures for L-BFGS.
-     callLBFGS("START");
+     startLBFGS();
      solverInit = true;
   }
 
@@ -248,13 +410,13 @@ SolverExitStatus SolverExtEval::runSolver() {
 
     // Do something according to the "task" from the previous call to
     // L-BFGS.
-    if (strIsEqualToCStr(task,"FG")) {
+    if (task == lbfgsbFG) {
 
       status =  evalWait;
       break;
     } 
     
-    else if (strIsEqualToCStr(task,"NEW_X")) {
+    else if (task == lbfgsbNewX) {
 
        // Go to the next iteration and call the iterative callback
        // routine.
@@ -265,26 +427,26 @@ SolverExitStatus SolverExtEval::runSolver() {
        // If we've reached the maximum number of iterations, terminate
        // the optimization.
        if (iter == maxiter) {
-          callLBFGS("STOP");
+          stopLBFGS();
           solverDone = true;
           status = done;
           break;
        }
     } 
     
-    else if (strIsEqualToCStr(task,"CONV")) {
-       status = done;
-       solverDone = true;
-       break;
-    }
-    else if (strIsEqualToCStr(task,"ABNO")) {
+    else if (task == lbfgsbAbnormal) {
        status = abnormalTermination;
        solverDone = true;
        break;
-    } else if (strIsEqualToCStr(task,"ERROR")) {
+    } else if (task == lbfgsbError) {
        status = errorOnInput;
        solverDone = true;
        break;
+    } else {
+       // converged or stopped
+       status = done;
+       solverDone = true;
+       break;
     }
 
     // Call L-BFGS again.
@@ -5,6 +5,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "lbfgsb_engine.h"
+#include "dense_bfgsb_engine.h"
+#include "lm_engine.h"
+#include "solver_arena.h"
+
 // This defines the possible results of running the L-BFGS-B solver.
 enum SolverExitStatus { 
   success,              // The algorithm has converged to a stationary
@@ -26,6 +31,18 @@ enum SolverExitStatus {
     
 };
 
+// This defines the L-BFGS-B implementations that can run the solver.
+enum SolverEngine {
+  fortranEngine,		// setulb from lbfgsb.f
+  nativeEngine,			// templated C++ version in lbfgsb_engine.h (falls back to
+						// the Fortran one for sizes it was not compiled for)
+  denseEngine,			// dense BFGS-B in dense_bfgsb_engine.h, not limited memory
+						// (falls back to the native one for sizes it was not compiled for)
+  lmEngine				// bounded Levenberg-Marquardt in lm_engine.h, the caller's g holds
+						// J'J after the gradient (falls back to the native one for sizes it
+						// was not compiled for or if the solver owns its gradient)
+};
+
 // Default L-BFGS-B Solver Parameters
 // -----------------------------------------------------------------
 const int    defaultm          = 5;
@@ -33,6 +50,7 @@ const int    defaultmaxiter    = 100;
 const double defaultfactr      = 1e7;
 const double defaultpgtol      = 1e-5;
 const int    defaultprintlevel = -1;
+const SolverEngine defaultengine = nativeEngine;
 
 
 // Function declarations.
@@ -92,10 +110,15 @@ public:
   // lb and ub are the upper and lower bound constraints
   // bytype is the bound types
   // The solver output is stored in x_ret and f_ret
+  // engine selects the L-BFGS-B implementation
+  // If arena is not NULL all workspaces are taken from the arena and the
+  // bounds lb, ub and btype are shared instead of copied (they must not
+  // change until the solver is destroyed).
   SolverBase (int n, double *x_init, double* lb, double* ub, int* btype,
      double *x_ret, double *f_ret, double *g = NULL,
 	   int m = defaultm, int maxiter = defaultmaxiter,
-	   double factr = defaultfactr, double pgtol = defaultpgtol);
+	   double factr = defaultfactr, double pgtol = defaultpgtol,
+	   SolverEngine engine = defaultengine, SolverArena *arena = NULL);
 
   // The destructor.
   virtual ~SolverBase();
@@ -110,6 +133,9 @@ protected:
   SolverBase            (const SolverBase& source) { };
   SolverBase& operator= (const SolverBase& source) { return *this; };
 
+  SolverArena *arena;	// The arena the workspaces are in (NULL if on the heap).
+  long heap_allocs;		// Workspaces allocated on the heap (not counting the arena).
+
   int     n;			// The number of variables.
   double *f;			// The current value of the objective.
   double *x;			// The current x value
@@ -130,12 +156,28 @@ protected:
 						// limited-memory approximation to the Hessian.
 
   // Execute a single step the L-BFGS-B solver routine.
-  void callLBFGS (const char* cmd = 0);
+  void callLBFGS ();
+
+  // Start (task 'START') or stop (task 'STOP') the L-BFGS-B solver routine.
+  void startLBFGS ();
+  void stopLBFGS ();
 
-  // These are structures used by the L-BFGS-B solver routine.
+  // Point the solver at a new problem with the same n, m and bounds,
+  // reusing the workspaces (g is ignored if the solver owns its gradient).
+  void resetProblem (double *x_init, double *x_ret, double *f_ret, double *g);
+
+  SolverEngine engineType;		// The L-BFGS-B implementation in use.
+  LbfgsbEngineBase *engine;		// The native, dense or LM engine (NULL for Fortran).
+  LbfgsbTask task;				// The task returned by the last L-BFGS-B call.
+
+  // Run the Fortran routine with task string cmd (NULL to continue)
+  // and translate its task string to task.
+  void callFortranLBFGS (const char* cmd);
+
+  // These are structures used by the Fortran L-BFGS-B solver routine.
   double* wa;
   int*    iwa;
-  char    task[60];
+  char    ftask[60];
   char    csave[60];
   bool    lsave[4];
   int     isave[44];
@@ -160,14 +202,19 @@ class Solver : public SolverBase {
         double *x_ret,									// output: final x value upon solver run completion
         double *f_ret,									// output final f(x) value upon solver run completion
         int m,											// hessian approx factor
-        int maxiter)									// maximum iterations to run solver
-     : SolverBase(n, x_init, lb, ub, btype, x_ret, f_ret, NULL, m, maxiter)
+        int maxiter,									// maximum iterations to run solver
+        SolverEngine engine = defaultengine,			// L-BFGS-B implementation to use
+        double (*obj_grad_func)(double *, double *, void *) = NULL)	// optional function pointer that returns the objective
+														// function and its gradient (in its second argument) in
+														// one call, replaces obj_func and the finite differences
+     : SolverBase(n, x_init, lb, ub, btype, x_ret, f_ret, NULL, m, maxiter, defaultfactr, defaultpgtol, engine, NULL)
   {
 
       x_tmp1 =  (double *) malloc(n*sizeof(double));
       x_tmp2 =  (double *) malloc(n*sizeof(double));  
 
       this->obj_func = obj_func;
+      this->obj_grad_func = obj_grad_func;
       this->aux_data_size = aux_data_size;
 
       if(aux_data_size > 0)
@@ -199,6 +246,7 @@ class Solver : public SolverBase {
   void computeGradient(double *x);
  
   double (*obj_func)(double *, void *);
+  double (*obj_grad_func)(double *, double *, void *);
   unsigned int aux_data_size;
   void * aux_func_data;
   double *x_tmp1;
@@ -221,8 +269,10 @@ class SolverExtEval : public SolverBase {
         double *g,								// array of size n to store the gradient of f(x)
         int m,									// hessian approx factor
         int maxiter,							// maximum iterations to run solver
-        int id = 0)								// solver identifier
-     : SolverBase(n, x_init, lb, ub, btype, x_ret, f_ret, g, m, maxiter)
+        int id = 0,								// solver identifier
+        SolverEngine engine = defaultengine,	// L-BFGS-B implementation to use
+        SolverArena *arena = NULL)				// arena for the workspaces, shares the bounds (NULL to use the heap)
+     : SolverBase(n, x_init, lb, ub, btype, x_ret, f_ret, g, m, maxiter, defaultfactr, defaultpgtol, engine, arena)
   {
 
       solverInit = false;
@@ -237,8 +287,19 @@ class SolverExtEval : public SolverBase {
   // executes a single step of the solver
   SolverExitStatus runSolver();
 
+  // reuse this solver (and its workspaces) for a new problem with the same
+  // number of variables and bounds, the arguments are the same as for the constructor
+  void restart(double *x_init, double *x_ret, double *f_ret, double *g, int id);
+
   bool finished() { return solverDone; }   // returns true if solver is finished, false otherwise
   int getId() { return id; }			   // returns solver identifier
+  int getIterations() { return iter; }	   // returns the number of iterations run
+  long heapAllocations() { return heap_allocs; }   // returns the number of workspaces allocated on the heap
+
+  // speculative line search candidates (see LbfgsbEngineBase::setCandidates()),
+  // native engine only, set them again after restart()
+  void setCandidates(double *xc, double *fc, double *gc, int count) { if(engine) engine->setCandidates(xc, fc, gc, count); }
+  int candidates() { return engine ? engine->candidates() : 0; }   // candidates to evaluate with f and g
 
    protected:
   bool solverInit;							// true if solver has been initialized
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+//Windows
+#include <malloc.h>
+#endif
+
+#include "solver_arena.h"
+
+// round size up to a multiple of the alignment
+static size_t alignUp(size_t size)
+{
+   return (size + SOLVER_ARENA_ALIGN - 1) & ~((size_t) SOLVER_ARENA_ALIGN - 1);
+}
+
+
+SolverArena::SolverArena(size_t block_size)
+{
+   this->block_size = alignUp(block_size);
+   first = NULL;
+   current = NULL;
+   offset = 0;
+   bytes_used = 0;
+   num_blocks = 0;
+}
+
+
+SolverArena::~SolverArena()
+{
+   arenaBlock *b = first;
+
+   while(b != NULL)
+   {
+      arenaBlock *next = b->next;
+
+#ifdef _WIN32
+      _aligned_free(b);
+#else
+      free(b);
+#endif
+
+      b = next;
+   }
+}
+
+
+// get a block with size usable bytes from the heap
+SolverArena::arenaBlock *SolverArena::newBlock(size_t size)
+{
+   void *mem;
+   size_t header = alignUp(sizeof(arenaBlock));
+
+#ifdef _WIN32
+   mem = _aligned_malloc(header + size, SOLVER_ARENA_ALIGN);
+#else
+   if(posix_memalign(&mem, SOLVER_ARENA_ALIGN, header + size) != 0) mem = NULL;
+#endif
+
+   if(mem == NULL)
+   {
+      printf("SolverArena: out of memory\n");
+      exit(-1);
+   }
+
+   num_blocks++;
+
+   arenaBlock *b = (arenaBlock *) mem;
+   b->next = NULL;
+   b->size = size;
+
+   return b;
+}
+
+
+void *SolverArena::alloc(size_t size)
+{
+   size_t header = alignUp(sizeof(arenaBlock));
+   size = alignUp(size);
+
+   // move on to the next block (reusing blocks kept by reset()) until one has room
+   while(current == NULL || offset + size > current->size)
+   {
+      arenaBlock *next = (current != NULL) ? current->next : first;
+
+      if(next == NULL)
+      {
+         next = newBlock(size > block_size ? size : block_size);
+
+         if(current != NULL) current->next = next;
+         else first = next;
+      }
+      else if(next->size < size)
+      {
+         // too small for this allocation, put a new block in front of it
+         arenaBlock *b = newBlock(size > block_size ? size : block_size);
+         b->next = next;
+
+         if(current != NULL) current->next = b;
+         else first = b;
+
+         next = b;
+      }
+
+      current = next;
+      offset = 0;
+   }
+
+   void *p = (char *) current + header + offset;
+   offset += size;
+   bytes_used += size;
+
+   return p;
+}
+
+
+void SolverArena::reset()
+{
+   current = NULL;
+   offset = 0;
+   bytes_used = 0;
+}
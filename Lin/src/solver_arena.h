@@ -0,0 +1,59 @@
+#ifndef SOLVER_ARENA_H
+#define SOLVER_ARENA_H
+
+#include <stddef.h>
+
+// cache line size all arena allocations are aligned to
+#define SOLVER_ARENA_ALIGN 64
+
+// default size of the blocks an arena gets from the heap
+#define SOLVER_ARENA_BLOCK_SIZE (1 << 20)
+
+// Bump allocator for solver objects and their workspaces.
+// Memory is taken from large cache line aligned blocks, one allocation after
+// the other, so the solvers of one arena (and the state of each solver) are
+// contiguous in memory. Nothing is freed individually: reset() makes all
+// blocks available again (objects placed in the arena must be destroyed by
+// calling their destructor first), the destructor frees the blocks.
+// An arena is not thread safe, every thread must use its own.
+class SolverArena {
+
+   public:
+
+   SolverArena(size_t block_size = SOLVER_ARENA_BLOCK_SIZE);
+   ~SolverArena();
+
+   // returns size bytes aligned to SOLVER_ARENA_ALIGN
+   void *alloc(size_t size);
+
+   // forget all allocations, the blocks are kept for reuse
+   void reset();
+
+   size_t bytesUsed() { return bytes_used; }		// bytes handed out since the last reset()
+   int numBlocks() { return num_blocks; }			// number of blocks taken from the heap
+
+   private:
+
+   // The copy constructor and copy assignment operator are kept
+   // private so that they are not used.
+   SolverArena            (const SolverArena& source) { };
+   SolverArena& operator= (const SolverArena& source) { return *this; };
+
+   // header at the start of each block
+   struct s_arenaBlock {
+      struct s_arenaBlock *next;
+      size_t size;					// usable bytes after the header
+   };
+   typedef struct s_arenaBlock arenaBlock;
+
+   arenaBlock *newBlock(size_t size);
+
+   size_t block_size;
+   arenaBlock *first;				// all blocks in allocation order
+   arenaBlock *current;				// block allocations are taken from
+   size_t offset;					// bytes used in the current block
+   size_t bytes_used;
+   int num_blocks;
+};
+
+#endif
@@ -3,11 +3,14 @@
 #ifdef _WIN32
 //Windows
 #include <Winsock2.h>
+#include <psapi.h>
 #include "gettimeofday.h"
+#pragma comment(lib, "psapi.lib")
 
 #else
 //Linux
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #endif
 
@@ -31,4 +34,59 @@ double calc_time(struct timeval *t1, struct timeval *t2) {
 }
 
 
+/* get_cpu_time
+ *
+ * Returns the CPU time (user + system, summed over all threads) that the 
+ * process has used so far in milliseconds. Take the difference of two calls 
+ * to time a section of code.
+ */
+double get_cpu_time() {
+
+#ifdef _WIN32
+//Windows
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    ULARGE_INTEGER k, u;
+
+    GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+
+    k.LowPart = kernelTime.dwLowDateTime;
+    k.HighPart = kernelTime.dwHighDateTime;
+    u.LowPart = userTime.dwLowDateTime;
+    u.HighPart = userTime.dwHighDateTime;
+
+    // FILETIME is in 100 ns units
+    return (k.QuadPart + u.QuadPart) / 10000.0;
+#else
+//Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 + 
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+#endif
+}
 
+
+/* get_peak_rss
+ *
+ * Returns the largest amount of memory that has been resident (the peak
+ * working set on Windows) for the process so far in MB.
+ */
+double get_peak_rss() {
+
+#ifdef _WIN32
+//Windows
+    PROCESS_MEMORY_COUNTERS counters;
+
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+
+    return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+//Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // ru_maxrss is in KB
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
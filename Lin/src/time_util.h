@@ -15,5 +15,11 @@
 // calulate the time in ms between times t1 and t2
 double calc_time(struct timeval *t1, struct timeval *t2); 
 
+// returns the CPU time in ms (user + system, all threads) used by the process so far
+double get_cpu_time();
+
+// returns the peak resident set size (peak working set on Windows) of the process in MB
+double get_peak_rss();
+
 
 #endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "work_steal.h"
+#include "time_util.h"
+
+
+WorkStealScheduler::WorkStealScheduler(int num_workers)
+{
+   this->num_workers = num_workers;
+
+   ranges = (stealRange *) malloc(num_workers * sizeof(stealRange));
+   stats = (stealStats *) malloc(num_workers * sizeof(stealStats));
+   finishTime = (struct timeval *) malloc(num_workers * sizeof(struct timeval));
+
+   for(int w = 0; w < num_workers; w++)
+   {
+      ranges[w].begin = 0;
+      ranges[w].end = 0;
+      pthread_mutex_init(&ranges[w].lock, NULL);
+
+      stats[w].items = 0;
+      stats[w].steals = 0;
+      stats[w].stolen_items = 0;
+      stats[w].failed_steals = 0;
+      stats[w].idle_ms = 0;
+   }
+}
+
+WorkStealScheduler::~WorkStealScheduler()
+{
+   for(int w = 0; w < num_workers; w++)
+   {
+      pthread_mutex_destroy(&ranges[w].lock);
+   }
+
+   free(ranges);
+   free(stats);
+   free(finishTime);
+}
+
+
+// split [0, num_items) into num_workers contiguous chunks of (almost) equal size
+void WorkStealScheduler::assign(int num_items)
+{
+   int chunk = num_items / num_workers;
+   int extra = num_items % num_workers;
+   int begin = 0;
+
+   for(int w = 0; w < num_workers; w++)
+   {
+      int size = chunk + ((w < extra) ? 1 : 0);
+
+      ranges[w].begin = begin;
+      ranges[w].end = begin + size;
+      begin += size;
+   }
+}
+
+
+// take the next item from the front of the worker's own range, if that is
+// empty steal the back half of the first other worker range that still has work
+bool WorkStealScheduler::next(int worker, int *item)
+{
+   stealRange *own = &ranges[worker];
+
+   pthread_mutex_lock(&own->lock);
+   if(own->begin < own->end)
+   {
+      *item = own->begin++;
+      pthread_mutex_unlock(&own->lock);
+      stats[worker].items++;
+      return true;
+   }
+   pthread_mutex_unlock(&own->lock);
+
+   // own range is empty, look for a victim
+   for(int i = 1; i < num_workers; i++)
+   {
+      stealRange *victim = &ranges[(worker + i) % num_workers];
+      int begin, end;
+
+      pthread_mutex_lock(&victim->lock);
+      int remaining = victim->end - victim->begin;
+
+      if(remaining <= 0)
+      {
+         pthread_mutex_unlock(&victim->lock);
+         continue;
+      }
+
+      end = victim->end;
+      begin = end - (remaining + 1) / 2;
+      victim->end = begin;
+      pthread_mutex_unlock(&victim->lock);
+
+      // run the first stolen item, keep the rest as our own range
+      // (other thieves may steal from it in turn)
+      pthread_mutex_lock(&own->lock);
+      own->begin = begin + 1;
+      own->end = end;
+      pthread_mutex_unlock(&own->lock);
+
+      stats[worker].steals++;
+      stats[worker].stolen_items += end - begin;
+      stats[worker].items++;
+
+      *item = begin;
+      return true;
+   }
+
+   stats[worker].failed_steals++;
+   return false;
+}
+
+
+// record when the worker ran out of work
+void WorkStealScheduler::finish(int worker)
+{
+   gettimeofday(&finishTime[worker], NULL);
+}
+
+// add the time between each worker running out of work and the end of the iteration
+void WorkStealScheduler::iterationDone()
+{
+   struct timeval end;
+   gettimeofday(&end, NULL);
+
+   for(int w = 0; w < num_workers; w++)
+   {
+      stats[w].idle_ms += calc_time(&finishTime[w], &end) - 0.5;  // calc_time() rounds up by 0.5 ms
+   }
+}
+
+
+// print the load balance counters
+void WorkStealScheduler::printStats()
+{
+   for(int w = 0; w < num_workers; w++)
+   {
+      printf("work thread %d: %ld solver steps, %ld steals (%ld steps stolen), %ld failed steals, idle %f (ms)\n",
+            w,
+            stats[w].items,
+            stats[w].steals,
+            stats[w].stolen_items,
+            stats[w].failed_steals,
+            stats[w].idle_ms);
+   }
+}
@@ -0,0 +1,76 @@
+#ifndef WORK_STEAL_H
+#define WORK_STEAL_H
+
+#include <pthread.h>
+
+// for timing functions
+#ifdef _WIN32
+//Windows
+#include <Winsock2.h>
+#include "gettimeofday.h"
+
+#else
+//Linux
+#include <sys/time.h>
+#endif
+
+// work range owned by one worker thread, items [begin, end) are still to be done
+typedef struct s_stealRange {
+   int begin;
+   int end;
+   pthread_mutex_t lock;
+} stealRange;
+
+// per worker thread load balance counters
+typedef struct s_stealStats {
+   long items;					// number of work items run by the worker
+   long steals;					// number of successful steals
+   long stolen_items;			// number of work items taken in those steals
+   long failed_steals;			// number of times the worker found no work left to steal
+   double idle_ms;				// time spent waiting for the other workers to finish an iteration
+} stealStats;
+
+
+// Work-stealing scheduler for a set of work items numbered 0..num_items-1.
+// The master splits the items into one contiguous chunk per worker. A worker
+// runs its own chunk front to back and, once it is out of work, steals the
+// back half of the remaining chunk of another worker. This keeps the items of
+// one worker adjacent while still balancing uneven work item costs.
+class WorkStealScheduler {
+
+   public:
+
+   WorkStealScheduler(int num_workers);
+   ~WorkStealScheduler();
+
+   // master: hand out items [0, num_items) for a new iteration
+   // must only be called while the workers are not running
+   void assign(int num_items);
+
+   // worker: get the next item to work on, stealing if needed
+   // returns false when there is no work left for this iteration
+   bool next(int worker, int *item);
+
+   // worker: mark that this worker has run out of work for this iteration
+   void finish(int worker);
+
+   // master: all workers are done with the iteration, update idle times
+   void iterationDone();
+
+   // print the load balance counters of each worker
+   void printStats();
+
+   private:
+
+   // The copy constructor and copy assignment operator are kept
+   // private so that they are not used.
+   WorkStealScheduler            (const WorkStealScheduler& source) { };
+   WorkStealScheduler& operator= (const WorkStealScheduler& source) { return *this; };
+
+   int num_workers;
+   stealRange *ranges;
+   stealStats *stats;
+   struct timeval *finishTime;	// time each worker ran out of work in the current iteration
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include <CL/cl.h>
 
 #include "hyperspect.h"
+#include "program_cache.h"
+#include "device_select.h"
 
 
 #define MAX_STR_SZ 512			// maximum string size
@@ -22,10 +24,10 @@ static const char* OpenCL_optSwitches = "";
 
 static const char* yexpCalcKernel_name = "yexp_calc";
 
-static char* readSource(const char *sourceFilename); 
 
 
-void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, const char *OpenCL_incDir)
+void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, const char *OpenCL_incDir, const char *programCacheDir,
+      const char *platformSpec, const char *deviceSpec)
 {
 
     cl_context context;
@@ -41,109 +43,17 @@ void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, co
 
    cl_int status;  // use as return value for most OpenCL functions
 
-   cl_uint numPlatforms = 0;
-   cl_platform_id *platforms;
-                
-   // Query for the number of recongnized platforms
-   status = clGetPlatformIDs(0, NULL, &numPlatforms);
-   if(status != CL_SUCCESS) {
-      printf("clGetPlatformIDs failed\n");
-      exit(-1);
-   }
-
-   // Make sure some platforms were found 
-   if(numPlatforms == 0) {
-      printf("No platforms detected.\n");
-      exit(-1);
-   }
-
-   // Allocate enough space for each platform
-   platforms = (cl_platform_id*)malloc(numPlatforms*sizeof(cl_platform_id));
-   if(platforms == NULL) {
-      perror("malloc");
-      exit(-1);
-   }
-
-   // Fill in platforms
-   clGetPlatformIDs(numPlatforms, platforms, NULL);
-   if(status != CL_SUCCESS) {
-      printf("clGetPlatformIDs failed\n");
-      exit(-1);
-   }
-
-   // Print out some basic information about each platform
-   printf("%u platforms detected\n", numPlatforms);
-   for(unsigned int i = 0; i < numPlatforms; i++) {
-      char buf[100];
-      printf("Platform %u: \n", i);
-      status = clGetPlatformInfo(platforms[i], CL_PLATFORM_VENDOR,
-                       sizeof(buf), buf, NULL);
-      printf("\tVendor: %s\n", buf);
-      status |= clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME,
-                       sizeof(buf), buf, NULL);
-      printf("\tName: %s\n", buf);
-
-      if(status != CL_SUCCESS) {
-         printf("clGetPlatformInfo failed\n");
-         exit(-1);
-      }
-   }
-   printf("\n");
-
-   cl_uint numDevices = 0;
    cl_device_id *devices;
+   cl_platform_id *devicePlatforms;
 
-   // Retrive the number of devices present
-   status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, NULL, 
-                           &numDevices);
-   if(status != CL_SUCCESS) {
-      printf("clGetDeviceIDs failed\n");
-      exit(-1);
-   }
-
-   // Make sure some devices were found
-   if(numDevices == 0) {
-      printf("No devices detected.\n");
-      exit(-1);
-   }
-
-   // Allocate enough space for each device
-   devices = (cl_device_id*)malloc(numDevices*sizeof(cl_device_id));
-   if(devices == NULL) {
-      perror("malloc");
-      exit(-1);
-   }
+   // pick the platforms and devices given on the command line (the GPUs by default),
+   // yexp is a single small kernel so it runs on the first selected device only
+   selectDevices(platformSpec, deviceSpec, &devices, &devicePlatforms);
+   cl_uint numDevices = 1;
 
-   // Fill in devices
-   status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, numDevices,
-                     devices, NULL);
-   if(status != CL_SUCCESS) {
-      printf("clGetDeviceIDs failed\n");
-      exit(-1);
-   }   
-
-   // Print out some basic information about each device
-   printf("%u devices detected\n", numDevices);
-   for(unsigned int i = 0; i < numDevices; i++) {
-      char buf[100];
-      printf("Device %u: \n", i);
-      status = clGetDeviceInfo(devices[i], CL_DEVICE_VENDOR,
-                       sizeof(buf), buf, NULL);
-      printf("\tDevice: %s\n", buf);
-      status |= clGetDeviceInfo(devices[i], CL_DEVICE_NAME,
-                       sizeof(buf), buf, NULL);
-      printf("\tName: %s\n", buf);
-
-      if(status != CL_SUCCESS) {
-         printf("clGetDeviceInfo failed\n");
-         exit(-1);
-      }
-   }
-   printf("\n");
-
-
-   // Create a context and associate it with the devices
-   context = clCreateContext(NULL, numDevices, devices, NULL, NULL, &status);
+   // Create a context and associate it with the device
+   cl_context_properties contextProps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties) devicePlatforms[0], 0 };
+   context = clCreateContext(contextProps, numDevices, devices, NULL, NULL, &status);
    if(status != CL_SUCCESS || context == NULL) {
       printf("clCreateContext failed\n");
       exit(-1);
@@ -162,27 +72,20 @@ void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, co
    char *source;
 
    // This function reads in the source code of the program
-   source = readSource(yexpCalcSrcFileNameFull);
+   // (with the files it includes inlined)
+   source = readProgramSource(yexpCalcSrcFileNameFull, OpenCL_incDir);
 
    //printf("Program source is:\n%s\n", source);
 
-   // Create a program. The 'source' string is the code from the 
-   program = clCreateProgramWithSource(context, 1, (const char**)&source, 
-                              NULL, &status);
-   if(status != CL_SUCCESS) {
-      printf("clCreateProgramWithSource failed\n");
-      exit(-1);
-   }
-
    cl_int buildErr;
-   // Build (compile & link) the program for the devices.
+   // Create and build (compile & link) the program for the devices, or load
+   // it from the program cache.
    // Save the return value in 'buildErr' (the following 
    // code will print any compilation errors to the screen)a
   
    char OpenCL_buildLine[MAX_STR_SZ];
    sprintf(OpenCL_buildLine, "-I %s %s", OpenCL_incDir, OpenCL_optSwitches);
-   buildErr = clBuildProgram(program, numDevices, devices, OpenCL_buildLine, NULL, NULL);
-   //buildErr = clBuildProgram(program, numDevices, devices, NULL, NULL, NULL);
+   program = buildProgramCached(context, numDevices, devices, source, OpenCL_buildLine, programCacheDir, &buildErr);
 
    // If there are build errors, print them to the screen
    if(1) {
@@ -228,7 +131,7 @@ void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, co
 
 
 
-   free(platforms);
+   free(devicePlatforms);
    free(devices);
    free(source);
 
@@ -341,6 +244,9 @@ void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, co
 
    printf("yexp = %f\n", yexp_host[0]);
 
+   // the yexp power tables of the image depend on yexp
+   hyp_image->tables_calc();
+
    clReleaseMemObject(band440_dev); 
    clReleaseMemObject(band440p1_dev);
    clReleaseMemObject(band490_dev);
@@ -352,60 +258,3 @@ void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, co
    clReleaseCommandQueue(cmdQueue);
    clReleaseContext(context);
 }
-
-
-
-
-
-// read OpenCL source from a file
-char* readSource(const char *sourceFilename) {
-
-   FILE *fp;
-   int err;
-   int size;
-
-   char *source;
-
-   fp = fopen(sourceFilename, "rb");
-   if(fp == NULL) {
-      printf("Could not open kernel file: %s\n", sourceFilename);
-      exit(-1);
-   }
-   
-   err = fseek(fp, 0, SEEK_END);
-   if(err != 0) {
-      printf("Error seeking to end of file\n");
-      exit(-1);
-   }
-
-   size = ftell(fp);
-   if(size < 0) {
-      printf("Error getting file position\n");
-      exit(-1);
-   }
-
-   err = fseek(fp, 0, SEEK_SET);
-   if(err != 0) {
-      printf("Error seeking to start of file\n");
-      exit(-1);
-   }
-
-   source = (char*)malloc(size+1);
-   if(source == NULL) {
-      printf("Error allocating %d bytes for the program source\n", size+1);
-      exit(-1);
-   }
-
-   err = fread(source, 1, size, fp);
-   if(err != size) {
-      printf("only read %d bytes\n", err);
-      exit(0);
-   }
-
-   source[size] = '\0';
-
-   return source;
-}
-
-
-
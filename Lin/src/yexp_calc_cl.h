@@ -3,9 +3,12 @@
 
 #include "hyperspect.h"
 
-// calculate yexp on image hyp_image in OpenCL on the GPU
+// calculate yexp on image hyp_image in OpenCL on the GPU (and rebuild the image's tables with it)
 // the file yexpCalcSrcFileNameFull should conain the kernel to calculate yexp
 // any additional OpenCL include files should be placed in the diretory OpenCL_incDir
-void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, const char *OpenCL_incDir);
+// the compiled program is cached in programCacheDir (NULL for no cache)
+// it runs on the first device selected by platformSpec and deviceSpec (see device_select.h, NULL for the default)
+void yexp_calc_cl(hyperspect *hyp_image, const char *yexpCalcSrcFileNameFull, const char *OpenCL_incDir,
+      const char *programCacheDir = NULL, const char *platformSpec = NULL, const char *deviceSpec = NULL);
 
 #endif
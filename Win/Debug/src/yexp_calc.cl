@@ -1,3 +1,4 @@
+#include "hyperspect_constants.h"
 
 
 #pragma OPENCL EXTENSION cl_khr_fp64: enable
@@ -38,8 +39,8 @@ yexp_calc(__global double *band440,
    if (yexp_val < 0)  {
       yexp_val = 0.0;
    }
-   else if (yexp_val > 2.5) {
-      yexp_val = 2.5; 
+   else if (yexp_val > yexp_max) {
+      yexp_val = yexp_max; 
    }
  
    yexp[gid] = yexp_val;
@@ -2,177 +2,901 @@
 
 #pragma OPENCL EXTENSION cl_khr_fp64: enable
 
+#include "lbfgsb.cl"
 
-#define inv_cosz 1.01373094981255
-#define inv_cosv 1.0
+
+#define inv_cosz cl_inv_cosz
+#define inv_cosv cl_inv_cosv
 
 
 // hyperspectal objective function
+// (the modelled band values are summed up as they are computed, nothing goes to memory).
+// The terms that do not depend on the parameters come from tables built once by 
+// hyperspect::tables_calc(): exp_spectral holds exp(-0.015*(wavelength-440)) of each band,
+// pow_yexp the (400/wavelength)^yexp of each band of each pixel (laid out like the image)
+// and sum2_meas the measured energy (sum of the squared measured bands) of each pixel
 double
 obj_fun(double P, double G, double BP, double B, double H, int rss_offset_index,
-     __global double *rss_calc_device,
      __global double *image_device,
      __constant double *spectral_input,
      __constant double *powf_spectral_43,
-     __global double *yexp_device
+     __constant double *exp_spectral,
+     __global double *pow_yexp,
+     __global double *sum2_meas
      ) 
 {
-   double sum1 = 0; double sum2 = 0; 
- //  double sum3 = 0; double sum4 = 0;
+   double sum1 = 0;
    double lp = log(P);
- //  double inv_cosz = 1.0 / cos(zenith*PI/180.0);
- //  double inv_cosv = 1.0 / cos(view * PI/180.0);
- // double inv_cosz = 1.01373094981255;
- //  double inv_cosv = 1.0;
 
-   double yexp = yexp_device[rss_offset_index / total_bands];
+   for(int j = b400_id; j <= b800_id; j++) {
+      // the bands between b675 and b720 are not part of the error
+      if(j > b675_id && j < b720_id) continue;
 
-   for(int j = 0; j < total_bands; j++) {
-   double at, bb, u, karpa, duc, dub, rss_c, rss_b;
+      double at, bb, u, karpa, duc, dub, rss_c, rss_b, rss, meas;
       int spect_offset_index = j*6;
 
-      at = spectral_input[spect_offset_index + 3] + (P *            //correct
+      at = spectral_input[spect_offset_index + 3] + (P *
           (spectral_input[spect_offset_index + 1] + lp *
-           spectral_input[spect_offset_index + 2])) + (G * exp((-0.015) *
-          (spectral_input[spect_offset_index] - 440.0)));
+           spectral_input[spect_offset_index + 2])) + (G * exp_spectral[j]);
+
+      bb = 0.0038 * powf_spectral_43[j] + BP * pow_yexp[rss_offset_index + j];
+
+      u =  bb / (at + bb);
+      karpa = at + bb;
+      duc = 1.03 * sqrt(1 + 2.4 * u);
+      dub = 1.04 * sqrt(1 + 5.4 * u);
+
+      rss_c = (0.084+(0.17*u))*u*(1.0-exp(-karpa*H*((inv_cosz)+
+                 duc*inv_cosv)));
+
+      rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * exp((-karpa) *
+            H * ((inv_cosz) + dub*inv_cosv));
+
+      rss = (0.5*(rss_c+rss_b))/(1.0-1.5*(rss_c+rss_b));
+      meas = image_device[rss_offset_index + j];
+
+      sum1 += (rss - meas) * (rss - meas);           // (Meas-est)^2
+   }
+
+   return sqrt((sum1)/(sum2_meas[rss_offset_index / total_bands]));
+}
+
 
+// work-group size of the local memory kernels, their __local array holds the
+// measured bands of the pixels of this many work-items (64 x 42 doubles = 21 KB,
+// within the 32 KB of local memory every OpenCL 1.x device has)
+#define EVAL_LOCAL_GROUP_SIZE 64
+
+
+// obj_fun() with the measured bands of the pixel in local memory (image_local),
+// pow_yexp_pixel is the pixel's row of pow_yexp and sum2 its measured energy
+double
+obj_fun_local(double P, double G, double BP, double B, double H, double sum2,
+     __local double *image_local,
+     __global double *pow_yexp_pixel,
+     __constant double *spectral_input,
+     __constant double *powf_spectral_43,
+     __constant double *exp_spectral
+     ) 
+{
+   double sum1 = 0;
+   double lp = log(P);
+
+   for(int j = b400_id; j <= b800_id; j++) {
+      // the bands between b675 and b720 are not part of the error
+      if(j > b675_id && j < b720_id) continue;
+
+      double at, bb, u, karpa, duc, dub, rss_c, rss_b, rss;
+      int spect_offset_index = j*6;
+
+      at = spectral_input[spect_offset_index + 3] + (P *
+          (spectral_input[spect_offset_index + 1] + lp *
+           spectral_input[spect_offset_index + 2])) + (G * exp_spectral[j]);
 
-      bb = 0.0038 * powf_spectral_43[j] + BP *
-           pow((400.0f /spectral_input[spect_offset_index]), yexp); //correct
+      bb = 0.0038 * powf_spectral_43[j] + BP * pow_yexp_pixel[j];
 
-      u =  bb / (at + bb);             //correct
-      karpa = at + bb;                 //correct
-      duc = 1.03 * sqrt(1 + 2.4 * u);  //correct 
-      dub = 1.04 * sqrt(1 + 5.4 * u);  //correct
+      u =  bb / (at + bb);
+      karpa = at + bb;
+      duc = 1.03 * sqrt(1 + 2.4 * u);
+      dub = 1.04 * sqrt(1 + 5.4 * u);
 
-      rss_c = (0.084+(0.17*u))*u*(1.0-exp(-karpa*H*((inv_cosz)+  //correct
+      rss_c = (0.084+(0.17*u))*u*(1.0-exp(-karpa*H*((inv_cosz)+
                  duc*inv_cosv)));
 
-      rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * exp((-karpa) * //correct
+      rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * exp((-karpa) *
             H * ((inv_cosz) + dub*inv_cosv));
 
-      rss_calc_device[rss_offset_index + j] =
-                     (0.5*(rss_c+rss_b))/(1.0-1.5*(rss_c+rss_b)); //correct
+      rss = (0.5*(rss_c+rss_b))/(1.0-1.5*(rss_c+rss_b));
+
+      sum1 += (rss - image_local[j]) * (rss - image_local[j]);   // (Meas-est)^2
    }
 
-   //sum3 = 0;
-   //sum4 = 0;
-   for (int i= b400_id; i <= b675_id; ++i) {         // (Meas-est)^2
-		sum1 += (rss_calc_device[rss_offset_index + i] -
-			     image_device[rss_offset_index + i]) *
-                (rss_calc_device[rss_offset_index + i] -
-			     image_device[rss_offset_index + i]);
+   return sqrt((sum1)/(sum2));
+}
+
+
+// hyperspectal objective function and its analytic gradient (returned in g)
+// computed in one pass over the bands, f is the same as obj_fun()
+double
+obj_fun_grad(double P, double G, double BP, double B, double H, int rss_offset_index,
+     __global double *image_device,
+     __constant double *spectral_input,
+     __constant double *powf_spectral_43,
+     __constant double *exp_spectral,
+     __global double *pow_yexp,
+     __global double *sum2_meas,
+     __global double *g
+     ) 
+{
+   double sum1 = 0;
+   double g_P = 0; double g_G = 0; double g_BP = 0; double g_B = 0; double g_H = 0;
+   double lp = log(P);
+
+   for(int j = 0; j < total_bands; j++) {
+      // the bands between b675 and b720 are not part of the error
+      if(j > b675_id && j < b720_id) continue;
 
+      int spect_offset_index = j*6;
 
-        sum2 += image_device[rss_offset_index + i] * // Meas^2
-                image_device[rss_offset_index + i];
+      double eg = exp_spectral[j];
+      double pw = pow_yexp[rss_offset_index + j];
+
+      double at = spectral_input[spect_offset_index + 3] + (P *
+          (spectral_input[spect_offset_index + 1] + lp *
+           spectral_input[spect_offset_index + 2])) + (G * eg);
+
+      double bb = 0.0038 * powf_spectral_43[j] + BP * pw;
+
+      double u =  bb / (at + bb);
+      double karpa = at + bb;
+      double sc = sqrt(1 + 2.4 * u);
+      double sb = sqrt(1 + 5.4 * u);
+      double duc = 1.03 * sc;
+      double dub = 1.04 * sb;
+      double kc = (inv_cosz) + duc*inv_cosv;
+      double kb = (inv_cosz) + dub*inv_cosv;
+
+      double q = (0.084+(0.17*u))*u;
+      double ec = exp(-karpa*H*kc);
+      double eb = exp((-karpa) * H * kb);
+
+      double rss_c = q*(1.0-ec);
+      double rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * eb;
+
+      double d = 1.0-1.5*(rss_c+rss_b);
+      double rss = (0.5*(rss_c+rss_b))/d;
+      double diff = rss - image_device[rss_offset_index + j];
+
+      sum1 += diff * diff;                                 // (Meas-est)^2
+
+      // derivatives of rss_c+rss_b with respect to u, karpa and H
+      double dr_du = (0.084+(0.34*u))*(1.0-ec) + 
+         karpa*H*inv_cosv*(q*ec*(1.236/sc) - rss_b*(2.808/sb));
+      double dr_dk = H*(q*ec*kc - rss_b*kb);
+      double dr_dH = karpa*(q*ec*kc - rss_b*kb);
+
+      // chain rule through u = bb/(at+bb), karpa = at+bb and rss, diff * d(rss)/d(rss_c+rss_b)
+      double w = diff*0.5/(d*d);
+      double dr_dat = dr_dk - dr_du*u/karpa;
+      double dr_dbb = dr_dk + dr_du*(1.0-u)/karpa;
+
+      g_P += w*dr_dat*(spectral_input[spect_offset_index + 1] + 
+         (lp + 1.0)*spectral_input[spect_offset_index + 2]);
+      g_G += w*dr_dat*eg;
+      g_BP += w*dr_dbb*pw;
+      g_B += w*(1.0/PI)*spectral_input[spect_offset_index+4]*eb;
+      g_H += w*dr_dH;
    }
 
-  // 3 4
-   for (int i= b720_id; i <= b800_id; ++i) {         // (Meas-est)^2
-        sum1 += (image_device[rss_offset_index + i] -
-                rss_calc_device[rss_offset_index + i]) *
-                (image_device[rss_offset_index + i] -
-                rss_calc_device[rss_offset_index + i]);
+   double sum2 = sum2_meas[rss_offset_index / total_bands];
+   double err = sqrt((sum1)/(sum2));
+
+   // d(err) = d(sum1) / (2 * err * sum2), the 2 cancels with the one of d(sum1)
+   double scale = 0;
+   if(err > 0) scale = 1.0/(err*sum2);
+
+   g[0] = g_P*scale;
+   g[1] = g_G*scale;
+   g[2] = g_BP*scale;
+   g[3] = g_B*scale;
+   g[4] = g_H*scale;
+
+   return err;
+}
+
+
+// obj_fun_grad() with the band values computed in single precision, for devices
+// with slow double precision arithmetic. The squared differences and the
+// gradient terms are still summed up in double, so the sums lose nothing more
+// than the rounding of the float band values (the error of a converged pixel is
+// about 1e-6 higher than in double, see BFGSB_CL_PRECISION_MIXED to polish it).
+double
+obj_fun_grad_float(double P_d, double G_d, double BP_d, double B_d, double H_d, int rss_offset_index,
+     __global double *image_device,
+     __constant double *spectral_input,
+     __constant double *powf_spectral_43,
+     __constant double *exp_spectral,
+     __global double *pow_yexp,
+     __global double *sum2_meas,
+     __global double *g
+     ) 
+{
+   double sum1 = 0;
+   double g_P = 0; double g_G = 0; double g_BP = 0; double g_B = 0; double g_H = 0;
+
+   float P = (float) P_d; float G = (float) G_d; float BP = (float) BP_d;
+   float B = (float) B_d; float H = (float) H_d;
+   float lp = log(P);
+
+   for(int j = 0; j < total_bands; j++) {
+      // the bands between b675 and b720 are not part of the error
+      if(j > b675_id && j < b720_id) continue;
 
-        sum2 += image_device[rss_offset_index + i] *  // Meas^2
-                image_device[rss_offset_index + i];
+      int spect_offset_index = j*6;
+      float s1 = (float) spectral_input[spect_offset_index + 1];
+      float s2 = (float) spectral_input[spect_offset_index + 2];
+      float s4 = (float) spectral_input[spect_offset_index + 4];
+
+      float eg = (float) exp_spectral[j];
+      float pw = (float) pow_yexp[rss_offset_index + j];
+
+      float at = (float) spectral_input[spect_offset_index + 3] + (P * (s1 + lp * s2)) + (G * eg);
+
+      float bb = 0.0038f * (float) powf_spectral_43[j] + BP * pw;
+
+      float u =  bb / (at + bb);
+      float karpa = at + bb;
+      float sc = sqrt(1.0f + 2.4f * u);
+      float sb = sqrt(1.0f + 5.4f * u);
+      float kc = (float) inv_cosz + 1.03f*sc*(float) inv_cosv;
+      float kb = (float) inv_cosz + 1.04f*sb*(float) inv_cosv;
+
+      float q = (0.084f+(0.17f*u))*u;
+      float ec = exp(-karpa*H*kc);
+      float eb = exp((-karpa) * H * kb);
+
+      float rss_c = q*(1.0f-ec);
+      float rss_b = (float) (1.0/PI)*B*s4 * eb;
+
+      float d = 1.0f-1.5f*(rss_c+rss_b);
+      float rss = (0.5f*(rss_c+rss_b))/d;
+      double meas = image_device[rss_offset_index + j];
+      double diff = (double) rss - meas;
+
+      sum1 += diff * diff;                                 // (Meas-est)^2
+
+      // derivatives of rss_c+rss_b with respect to u, karpa and H
+      float dr_du = (0.084f+(0.34f*u))*(1.0f-ec) + 
+         karpa*H*(float) inv_cosv*(q*ec*(1.236f/sc) - rss_b*(2.808f/sb));
+      float dr_dk = H*(q*ec*kc - rss_b*kb);
+      float dr_dH = karpa*(q*ec*kc - rss_b*kb);
+
+      // chain rule through u = bb/(at+bb), karpa = at+bb and rss, diff * d(rss)/d(rss_c+rss_b)
+      float w = (float) diff*0.5f/(d*d);
+      float dr_dat = dr_dk - dr_du*u/karpa;
+      float dr_dbb = dr_dk + dr_du*(1.0f-u)/karpa;
+
+      g_P += w*dr_dat*(s1 + (lp + 1.0f)*s2);
+      g_G += w*dr_dat*eg;
+      g_BP += w*dr_dbb*pw;
+      g_B += w*(float) (1.0/PI)*s4*eb;
+      g_H += w*dr_dH;
    }
 
+   double sum2 = sum2_meas[rss_offset_index / total_bands];
+   double err = sqrt((sum1)/(sum2));
+
+   // d(err) = d(sum1) / (2 * err * sum2), the 2 cancels with the one of d(sum1)
+   double scale = 0;
+   if(err > 0) scale = 1.0/(err*sum2);
 
-   return sqrt((sum1)/(sum2));                 //correct
-  //return sqrt((sum1+sum3)/(sum2+sum4));                 //correct
-	//err = sqrt(sum1+sum3)/sqrt(sum2+sum4);                 //correct
+   g[0] = g_P*scale;
+   g[1] = g_G*scale;
+   g[2] = g_BP*scale;
+   g[3] = g_B*scale;
+   g[4] = g_H*scale;
 
+   return err;
 }
 
 
 #define h 1e-8
 
 
+// the kernels take the end of their slots (pixels) as last argument and visit the
+// slots from get_global_id(0) in steps of get_global_size(0), so the host can launch
+// them with any work-group size and number of slots per work-item (see launch_tuner.h)
+
 __kernel void
 coarse_grained_search(int num_inits,
                     __constant double *inits, 
                     __global double *ret,
-                    __global double *rss_calc_device,
                     __global double *image_device,
                     __constant double *spectral_input,
                     __constant double *powf_spectral_43,
-                    __global double *yexp_device
+                    __constant double *exp_spectral,
+                    __global double *pow_yexp,
+                    __global double *sum2_meas,
+                    int slot_end
                     )
 {
-   int thread_id = get_global_id(0);
-   int rss_offset_idx = thread_id * total_bands;
+   for(int thread_id = get_global_id(0); thread_id < slot_end; thread_id += get_global_size(0))
+   {
+      int rss_offset_idx = thread_id * total_bands;
 
-   double min_err = 10000;
-   int min_init_num;
+      double min_err = 10000;
+      int min_init_num;
 
-   for(int i = 0; i < num_inits; i++)
-   {
-     double P, G, BP, B, H;
-     int idx = i * 5;
+      for(int i = 0; i < num_inits; i++)
+      {
+        double P, G, BP, B, H;
+        int idx = i * 5;
+
+        P = inits[idx];
+        G = inits[idx+1];
+        BP = inits[idx+2];
+        B = inits[idx+3];
+        H = inits[idx+4];
+
+        double err = obj_fun(P, G, BP, B, H, rss_offset_idx, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas);
+
+         if(err < min_err)
+         {
+            min_err = err;
+            min_init_num = i;
+         }
+      }
 
-     P = inits[idx];
-     G = inits[idx+1];
-     BP = inits[idx+2];
-     B = inits[idx+3];
-     H = inits[idx+4];
+      int init_idx = thread_id * 5;
+      for(int i = 0; i < 5; i++)
+      { 
+        ret[init_idx+i] = inits[min_init_num*5+i];
+      }
+   }
+}
 
-     double err = obj_fun(P, G, BP, B, H, rss_offset_idx, rss_calc_device, image_device, spectral_input, powf_spectral_43, yexp_device);
 
-      if(err < min_err)
+// coarse_grained_search() with the modelled bands of every init point precomputed by
+// the host (see hyperspect::model_bank()). The models do not depend on the pixel, only on
+// its yexp, so there is one bank of num_inits models for every yexp bucket and bank_ids
+// holds the bank of every pixel. The pixel is scored against every model as 
+// |m|^2 - 2*meas.m, which is (Meas-est)^2 summed over the bands without the |meas|^2 all
+// models share (the bands between b675 and b720 are 0 in the models). The scores of
+// four models are computed in one pass over the pixel's bands.
+__kernel void
+coarse_grained_search_bank(int num_inits,
+                    __constant double *inits, 
+                    __global double *ret,
+                    int bank_dim,
+                    __global double *bank,
+                    __global double *bank_norm2,
+                    __global int *bank_ids,
+                    __global double *image_device,
+                    __constant double *spectral_input,
+                    __constant double *powf_spectral_43,
+                    __constant double *exp_spectral,
+                    __global double *pow_yexp,
+                    __global double *sum2_meas,
+                    int slot_end
+                    )
+{
+   for(int thread_id = get_global_id(0); thread_id < slot_end; thread_id += get_global_size(0))
+   {
+      __global double *meas = image_device + thread_id * total_bands;
+      __global double *models = bank + bank_ids[thread_id] * num_inits * bank_dim;
+      __global double *norm2 = bank_norm2 + bank_ids[thread_id] * num_inits;
+
+      double min_score = HUGE_VAL;
+      int min_init_num = 0;
+      int i = 0;
+
+      for(; i + 4 <= num_inits; i += 4)
       {
-         min_err = err;
-         min_init_num = i;
+         __global double *m = models + i * bank_dim;
+         double d0 = 0; double d1 = 0; double d2 = 0; double d3 = 0;
+
+         for(int j = 0; j < bank_dim; j++)
+         {
+            double r = meas[j];
+            d0 += r * m[j];
+            d1 += r * m[bank_dim + j];
+            d2 += r * m[2*bank_dim + j];
+            d3 += r * m[3*bank_dim + j];
+         }
+
+         double s0 = norm2[i] - 2.0 * d0;
+         double s1 = norm2[i+1] - 2.0 * d1;
+         double s2 = norm2[i+2] - 2.0 * d2;
+         double s3 = norm2[i+3] - 2.0 * d3;
+
+         if(s0 < min_score) { min_score = s0; min_init_num = i; }
+         if(s1 < min_score) { min_score = s1; min_init_num = i+1; }
+         if(s2 < min_score) { min_score = s2; min_init_num = i+2; }
+         if(s3 < min_score) { min_score = s3; min_init_num = i+3; }
       }
-   }
 
-   int init_idx = thread_id * 5;
-   for(int i = 0; i < 5; i++)
-   { 
-     ret[init_idx+i] = inits[min_init_num*5+i];
-   }
+      for(; i < num_inits; i++)
+      {
+         __global double *m = models + i * bank_dim;
+         double d0 = 0;
 
+         for(int j = 0; j < bank_dim; j++) d0 += meas[j] * m[j];
 
+         double s0 = norm2[i] - 2.0 * d0;
+         if(s0 < min_score) { min_score = s0; min_init_num = i; }
+      }
 
+      int init_idx = thread_id * 5;
+      for(int k = 0; k < 5; k++)
+      { 
+        ret[init_idx+k] = inits[min_init_num*5+k];
+      }
+   }
 }
 
 
 
 __kernel void
 eval_kernel(
-    __global int *active_mask,
+    __global int *func_ids,
     __global double *F,
     __global double *x,
     __global double *g,
-    __global double *rss_calc_device,
     __global double *image_device,
     __constant double *spectral_input,
     __constant double *powf_spectral_43,
-    __global double *yexp_device
+    __constant double *exp_spectral,
+    __global double *pow_yexp,
+    __global double *sum2_meas,
+    int slot_end
     )
 
 {
-  int thread_id = get_global_id(0);
-  if(active_mask[thread_id] == 0) return;
-  int xidx = thread_id * 5;  
-  double P, G, BP, B, H;
-  double f;
+  for(int thread_id = get_global_id(0); thread_id < slot_end; thread_id += get_global_size(0))
+  {
+    // x, F and g are packed: slot thread_id holds image element func_ids[thread_id]
+    int func_id = func_ids[thread_id];
+    int rss_offset_idx = func_id * total_bands;
+    int xidx = thread_id * 5;  
+    double P, G, BP, B, H;
+    double f;
   
-  P = x[xidx];
-  G = x[xidx+1];
-  BP = x[xidx+2];
-  B = x[xidx+3];
-  H = x[xidx+4];
-
-  f = obj_fun(P, G, BP, B, H, thread_id * total_bands, rss_calc_device, image_device, spectral_input, powf_spectral_43, yexp_device);
-  F[thread_id] = f; 
+    P = x[xidx];
+    G = x[xidx+1];
+    BP = x[xidx+2];
+    B = x[xidx+3];
+    H = x[xidx+4];
+
+    f = obj_fun(P, G, BP, B, H, rss_offset_idx, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas);
+    F[thread_id] = f; 
  
-  // calculate gradient with forward method
-  g[xidx] =   (obj_fun(P+h, G, BP, B, H, thread_id * total_bands, rss_calc_device, image_device, spectral_input, powf_spectral_43, yexp_device) - f ) / h;
-  g[xidx+1] = (obj_fun(P, G+h, BP, B, H, thread_id * total_bands, rss_calc_device, image_device, spectral_input, powf_spectral_43, yexp_device) - f ) / h;
-  g[xidx+2] = (obj_fun(P, G, BP+h, B, H, thread_id * total_bands, rss_calc_device, image_device, spectral_input, powf_spectral_43, yexp_device) - f ) / h;
-  g[xidx+3] = (obj_fun(P, G, BP, B+h, H, thread_id * total_bands, rss_calc_device, image_device, spectral_input, powf_spectral_43, yexp_device) - f ) / h;
-  g[xidx+4] = (obj_fun(P, G, BP, B, H+h, thread_id * total_bands, rss_calc_device, image_device, spectral_input, powf_spectral_43, yexp_device) - f ) / h;
+    // calculate gradient with forward method
+    g[xidx] =   (obj_fun(P+h, G, BP, B, H, rss_offset_idx, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[xidx+1] = (obj_fun(P, G+h, BP, B, H, rss_offset_idx, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[xidx+2] = (obj_fun(P, G, BP+h, B, H, rss_offset_idx, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[xidx+3] = (obj_fun(P, G, BP, B+h, H, rss_offset_idx, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[xidx+4] = (obj_fun(P, G, BP, B, H+h, rss_offset_idx, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+  }
+}
+
+
+
+// eval_kernel variants (see evalVariants in parallel_eval.cpp), same arguments as eval_kernel
+
+// the measured bands of the pixel in local memory, each work-item only uses its
+// own part of the __local array so no barriers are needed
+__kernel __attribute__((reqd_work_group_size(EVAL_LOCAL_GROUP_SIZE, 1, 1))) void
+eval_kernel_local(
+    __global int *func_ids,
+    __global double *F,
+    __global double *x,
+    __global double *g,
+    __global double *image_device,
+    __constant double *spectral_input,
+    __constant double *powf_spectral_43,
+    __constant double *exp_spectral,
+    __global double *pow_yexp,
+    __global double *sum2_meas,
+    int slot_end
+    )
+
+{
+  __local double image_group[EVAL_LOCAL_GROUP_SIZE * total_bands];
+
+  __local double *image_local = image_group + get_local_id(0) * total_bands;
+
+  for(int thread_id = get_global_id(0); thread_id < slot_end; thread_id += get_global_size(0))
+  {
+    int func_id = func_ids[thread_id];
+    int rss_offset_idx = func_id * total_bands;
+    int xidx = thread_id * 5;  
+    double P, G, BP, B, H;
+    double f;
+    double sum2 = sum2_meas[func_id];
+    __global double *pow_yexp_pixel = pow_yexp + rss_offset_idx;
+
+    for(int i = 0; i < total_bands; i++)
+      image_local[i] = image_device[rss_offset_idx + i];
+  
+    P = x[xidx];
+    G = x[xidx+1];
+    BP = x[xidx+2];
+    B = x[xidx+3];
+    H = x[xidx+4];
+
+    f = obj_fun_local(P, G, BP, B, H, sum2, image_local, pow_yexp_pixel, spectral_input, powf_spectral_43, exp_spectral);
+    F[thread_id] = f; 
+ 
+    // calculate gradient with forward method
+    g[xidx] =   (obj_fun_local(P+h, G, BP, B, H, sum2, image_local, pow_yexp_pixel, spectral_input, powf_spectral_43, exp_spectral) - f ) / h;
+    g[xidx+1] = (obj_fun_local(P, G+h, BP, B, H, sum2, image_local, pow_yexp_pixel, spectral_input, powf_spectral_43, exp_spectral) - f ) / h;
+    g[xidx+2] = (obj_fun_local(P, G, BP+h, B, H, sum2, image_local, pow_yexp_pixel, spectral_input, powf_spectral_43, exp_spectral) - f ) / h;
+    g[xidx+3] = (obj_fun_local(P, G, BP, B+h, H, sum2, image_local, pow_yexp_pixel, spectral_input, powf_spectral_43, exp_spectral) - f ) / h;
+    g[xidx+4] = (obj_fun_local(P, G, BP, B, H+h, sum2, image_local, pow_yexp_pixel, spectral_input, powf_spectral_43, exp_spectral) - f ) / h;
+  }
+}
+
+
+// evaluates f and its analytic gradient in one pass over the bands
+// (same arguments as eval_kernel)
+__kernel void
+eval_kernel_analytic(
+    __global int *func_ids,
+    __global double *F,
+    __global double *x,
+    __global double *g,
+    __global double *image_device,
+    __constant double *spectral_input,
+    __constant double *powf_spectral_43,
+    __constant double *exp_spectral,
+    __global double *pow_yexp,
+    __global double *sum2_meas,
+    int slot_end
+    )
+
+{
+  for(int thread_id = get_global_id(0); thread_id < slot_end; thread_id += get_global_size(0))
+  {
+    // x, F and g are packed: slot thread_id holds image element func_ids[thread_id]
+    int func_id = func_ids[thread_id];
+    int rss_offset_idx = func_id * total_bands;
+    int xidx = thread_id * 5;  
+
+    F[thread_id] = obj_fun_grad(x[xidx], x[xidx+1], x[xidx+2], x[xidx+3], x[xidx+4], rss_offset_idx, 
+          image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas, g + xidx);
+  }
+}
+
+
+// eval_kernel_analytic() in single precision (the "float" variant, see obj_fun_grad_float())
+__kernel void
+eval_kernel_analytic_float(
+    __global int *func_ids,
+    __global double *F,
+    __global double *x,
+    __global double *g,
+    __global double *image_device,
+    __constant double *spectral_input,
+    __constant double *powf_spectral_43,
+    __constant double *exp_spectral,
+    __global double *pow_yexp,
+    __global double *sum2_meas,
+    int slot_end
+    )
+
+{
+  for(int thread_id = get_global_id(0); thread_id < slot_end; thread_id += get_global_size(0))
+  {
+    int func_id = func_ids[thread_id];
+    int rss_offset_idx = func_id * total_bands;
+    int xidx = thread_id * 5;  
+
+    F[thread_id] = obj_fun_grad_float(x[xidx], x[xidx+1], x[xidx+2], x[xidx+3], x[xidx+4], rss_offset_idx, 
+          image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas, g + xidx);
+  }
+}
+
+
+
+// number of values eval_kernel_analytic_lm() writes to g per slot: the gradient
+// and the upper triangle of J'J (LM_ENGINE_JTJ_SIZE(5) in lm_engine.h)
+#define LM_G_STRIDE 20
+
+// obj_fun_grad() that also returns the Gauss-Newton matrix J'J of the scaled
+// residuals (rss - Meas)/sqrt(sum2) in g[5] to g[19] (the upper triangle row by
+// row), the model the Levenberg-Marquardt engine (lm_engine.h) steps with.
+// f and the gradient are the same as obj_fun_grad().
+double
+obj_fun_grad_jtj(double P, double G, double BP, double B, double H, int rss_offset_index,
+     __global double *image_device,
+     __constant double *spectral_input,
+     __constant double *powf_spectral_43,
+     __constant double *exp_spectral,
+     __global double *pow_yexp,
+     __global double *sum2_meas,
+     __global double *g
+     ) 
+{
+   double sum1 = 0;
+   double g_P = 0; double g_G = 0; double g_BP = 0; double g_B = 0; double g_H = 0;
+   double a00 = 0; double a01 = 0; double a02 = 0; double a03 = 0; double a04 = 0;
+   double a11 = 0; double a12 = 0; double a13 = 0; double a14 = 0;
+   double a22 = 0; double a23 = 0; double a24 = 0;
+   double a33 = 0; double a34 = 0;
+   double a44 = 0;
+   double lp = log(P);
+
+   for(int j = 0; j < total_bands; j++) {
+      // the bands between b675 and b720 are not part of the error
+      if(j > b675_id && j < b720_id) continue;
+
+      int spect_offset_index = j*6;
+
+      double eg = exp_spectral[j];
+      double pw = pow_yexp[rss_offset_index + j];
+
+      double at = spectral_input[spect_offset_index + 3] + (P *
+          (spectral_input[spect_offset_index + 1] + lp *
+           spectral_input[spect_offset_index + 2])) + (G * eg);
+
+      double bb = 0.0038 * powf_spectral_43[j] + BP * pw;
+
+      double u =  bb / (at + bb);
+      double karpa = at + bb;
+      double sc = sqrt(1 + 2.4 * u);
+      double sb = sqrt(1 + 5.4 * u);
+      double duc = 1.03 * sc;
+      double dub = 1.04 * sb;
+      double kc = (inv_cosz) + duc*inv_cosv;
+      double kb = (inv_cosz) + dub*inv_cosv;
+
+      double q = (0.084+(0.17*u))*u;
+      double ec = exp(-karpa*H*kc);
+      double eb = exp((-karpa) * H * kb);
+
+      double rss_c = q*(1.0-ec);
+      double rss_b = (1.0/PI)*B*spectral_input[spect_offset_index+4] * eb;
+
+      double d = 1.0-1.5*(rss_c+rss_b);
+      double rss = (0.5*(rss_c+rss_b))/d;
+      double diff = rss - image_device[rss_offset_index + j];
+
+      sum1 += diff * diff;                                 // (Meas-est)^2
+
+      // derivatives of rss_c+rss_b with respect to u, karpa and H
+      double dr_du = (0.084+(0.34*u))*(1.0-ec) + 
+         karpa*H*inv_cosv*(q*ec*(1.236/sc) - rss_b*(2.808/sb));
+      double dr_dk = H*(q*ec*kc - rss_b*kb);
+      double dr_dH = karpa*(q*ec*kc - rss_b*kb);
+
+      // the row of the Jacobian of rss: chain rule through u = bb/(at+bb),
+      // karpa = at+bb and d(rss)/d(rss_c+rss_b)
+      double dd = 0.5/(d*d);
+      double dr_dat = dr_dk - dr_du*u/karpa;
+      double dr_dbb = dr_dk + dr_du*(1.0-u)/karpa;
+
+      double j0 = dd*dr_dat*(spectral_input[spect_offset_index + 1] + 
+         (lp + 1.0)*spectral_input[spect_offset_index + 2]);
+      double j1 = dd*dr_dat*eg;
+      double j2 = dd*dr_dbb*pw;
+      double j3 = dd*(1.0/PI)*spectral_input[spect_offset_index+4]*eb;
+      double j4 = dd*dr_dH;
+
+      g_P += diff*j0;
+      g_G += diff*j1;
+      g_BP += diff*j2;
+      g_B += diff*j3;
+      g_H += diff*j4;
+
+      a00 += j0*j0; a01 += j0*j1; a02 += j0*j2; a03 += j0*j3; a04 += j0*j4;
+      a11 += j1*j1; a12 += j1*j2; a13 += j1*j3; a14 += j1*j4;
+      a22 += j2*j2; a23 += j2*j3; a24 += j2*j4;
+      a33 += j3*j3; a34 += j3*j4;
+      a44 += j4*j4;
+   }
+
+   double sum2 = sum2_meas[rss_offset_index / total_bands];
+   double err = sqrt((sum1)/(sum2));
+
+   // d(err) = d(sum1) / (2 * err * sum2), the 2 cancels with the one of d(sum1)
+   double scale = 0;
+   if(err > 0) scale = 1.0/(err*sum2);
+
+   g[0] = g_P*scale;
+   g[1] = g_G*scale;
+   g[2] = g_BP*scale;
+   g[3] = g_B*scale;
+   g[4] = g_H*scale;
+
+   // J'J of the residuals scaled by 1/sqrt(sum2)
+   double ascale = 1.0/sum2;
+
+   g[5] = a00*ascale; g[6] = a01*ascale; g[7] = a02*ascale; g[8] = a03*ascale; g[9] = a04*ascale;
+   g[10] = a11*ascale; g[11] = a12*ascale; g[12] = a13*ascale; g[13] = a14*ascale;
+   g[14] = a22*ascale; g[15] = a23*ascale; g[16] = a24*ascale;
+   g[17] = a33*ascale; g[18] = a34*ascale;
+   g[19] = a44*ascale;
+
+   return err;
+}
+
+
+// eval_kernel_analytic() for the Levenberg-Marquardt engine: g holds LM_G_STRIDE
+// values per slot, the gradient and J'J (see obj_fun_grad_jtj())
+__kernel void
+eval_kernel_analytic_lm(
+    __global int *func_ids,
+    __global double *F,
+    __global double *x,
+    __global double *g,
+    __global double *image_device,
+    __constant double *spectral_input,
+    __constant double *powf_spectral_43,
+    __constant double *exp_spectral,
+    __global double *pow_yexp,
+    __global double *sum2_meas,
+    int slot_end
+    )
+
+{
+  for(int thread_id = get_global_id(0); thread_id < slot_end; thread_id += get_global_size(0))
+  {
+    int func_id = func_ids[thread_id];
+    int rss_offset_idx = func_id * total_bands;
+    int xidx = thread_id * 5;  
+
+    F[thread_id] = obj_fun_grad_jtj(x[xidx], x[xidx+1], x[xidx+2], x[xidx+3], x[xidx+4], rss_offset_idx, 
+          image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas, g + thread_id*LM_G_STRIDE);
+  }
+}
+
+// solve kernels: the whole L-BFGS-B solve of each pixel runs on the device with the
+// engine of lbfgsb.cl, launch_iterations iterations per launch. The solver state of slot 
+// i (pixel first+i) is kept in state, work and iwork between the launches, x, F and
+// g are indexed by pixel. Every slot that is not finished at the end of the launch
+// counts itself in *active, the host launches again until there are none.
+// (see pEval::deviceSolve() in parallel_eval.cpp)
+
+// f and the forward difference gradient of eval_kernel in g
+double
+obj_fun_fd_grad(double P, double G, double BP, double B, double H, int rss_offset_index,
+     __global double *image_device,
+     __constant double *spectral_input,
+     __constant double *powf_spectral_43,
+     __constant double *exp_spectral,
+     __global double *pow_yexp,
+     __global double *sum2_meas,
+     __global double *g
+     ) 
+{
+    double f = obj_fun(P, G, BP, B, H, rss_offset_index, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas);
+
+    g[0] = (obj_fun(P+h, G, BP, B, H, rss_offset_index, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[1] = (obj_fun(P, G+h, BP, B, H, rss_offset_index, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[2] = (obj_fun(P, G, BP+h, B, H, rss_offset_index, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[3] = (obj_fun(P, G, BP, B+h, H, rss_offset_index, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+    g[4] = (obj_fun(P, G, BP, B, H+h, rss_offset_index, image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas) - f ) / h;
+
+    return f;
+}
+
+
+// solves with the analytic gradient (obj_fun_grad())
+__kernel void
+eval_kernel_analytic_solve(
+    int first,
+    int start,
+    int launch_iterations,
+    int max_iterations,
+    int m,
+    double factr,
+    double pgtol,
+    __global double *bounds,
+    __global int *nbd,
+    __global double *F,
+    __global double *x,
+    __global double *g,
+    __global lbfgsb_state *state,
+    __global double *work,
+    __global int *iwork,
+    __global int *active,
+    __global double *image_device,
+    __constant double *spectral_input,
+    __constant double *powf_spectral_43,
+    __constant double *exp_spectral,
+    __global double *pow_yexp,
+    __global double *sum2_meas,
+    int slot_end
+    )
+
+{
+  for(int slot = get_global_id(0); slot < slot_end; slot += get_global_size(0))
+  {
+    // finished in an earlier launch
+    if(!start && state[slot].task != LBFGSB_CL_NEW_X) continue;
+
+    int func_id = first + slot;
+    int rss_offset_idx = func_id * total_bands;
+    int xidx = func_id * 5;
+    lbfgsb_engine e;
+
+    lbfgsb_init(&e, 5, m, factr, pgtol, x + xidx, F + func_id, g + xidx, bounds, bounds + 5, nbd,
+          work + (size_t) slot * LBFGSB_CL_WORK_SIZE(5, m), iwork + slot * LBFGSB_CL_IWORK_SIZE(5));
+
+    if(start) lbfgsb_start(&e);
+    else e.s = state[slot];
+
+    int iterations_left = launch_iterations;
+
+    while(lbfgsb_run(&e, max_iterations, &iterations_left))
+    {
+      F[func_id] = obj_fun_grad(x[xidx], x[xidx+1], x[xidx+2], x[xidx+3], x[xidx+4], rss_offset_idx, 
+            image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas, g + xidx);
+
+      lbfgsb_step(&e);
+    }
+
+    state[slot] = e.s;
+    if(e.s.task == LBFGSB_CL_NEW_X) atomic_inc(active);
+  }
 }
 
+
+// solves with the forward difference gradient of eval_kernel (same arguments as eval_kernel_analytic_solve)
+__kernel void
+eval_kernel_solve(
+    int first,
+    int start,
+    int launch_iterations,
+    int max_iterations,
+    int m,
+    double factr,
+    double pgtol,
+    __global double *bounds,
+    __global int *nbd,
+    __global double *F,
+    __global double *x,
+    __global double *g,
+    __global lbfgsb_state *state,
+    __global double *work,
+    __global int *iwork,
+    __global int *active,
+    __global double *image_device,
+    __constant double *spectral_input,
+    __constant double *powf_spectral_43,
+    __constant double *exp_spectral,
+    __global double *pow_yexp,
+    __global double *sum2_meas,
+    int slot_end
+    )
+
+{
+  for(int slot = get_global_id(0); slot < slot_end; slot += get_global_size(0))
+  {
+    if(!start && state[slot].task != LBFGSB_CL_NEW_X) continue;
+
+    int func_id = first + slot;
+    int rss_offset_idx = func_id * total_bands;
+    int xidx = func_id * 5;
+    lbfgsb_engine e;
+
+    lbfgsb_init(&e, 5, m, factr, pgtol, x + xidx, F + func_id, g + xidx, bounds, bounds + 5, nbd,
+          work + (size_t) slot * LBFGSB_CL_WORK_SIZE(5, m), iwork + slot * LBFGSB_CL_IWORK_SIZE(5));
+
+    if(start) lbfgsb_start(&e);
+    else e.s = state[slot];
+
+    int iterations_left = launch_iterations;
+
+    while(lbfgsb_run(&e, max_iterations, &iterations_left))
+    {
+      F[func_id] = obj_fun_fd_grad(x[xidx], x[xidx+1], x[xidx+2], x[xidx+3], x[xidx+4], rss_offset_idx, 
+            image_device, spectral_input, powf_spectral_43, exp_spectral, pow_yexp, sum2_meas, g + xidx);
+
+      lbfgsb_step(&e);
+    }
+
+    state[slot] = e.s;
+    if(e.s.task == LBFGSB_CL_NEW_X) atomic_inc(active);
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef LBFGSB_CL_H
+#define LBFGSB_CL_H
+
+// Sizes and tasks of the OpenCL L-BFGS-B engine (lbfgsb.cl), shared by the
+// host (parallel_eval.cpp) and the OpenCL programs that include lbfgsb.cl.
+//
+// The host allocates LBFGSB_CL_STATE_SIZE bytes for the saved state of every
+// problem solved on the device (the engine's lbfgsb_state fits in them), a
+// workspace of LBFGSB_CL_WORK_SIZE(n, m) doubles and one of LBFGSB_CL_IWORK_SIZE(n)
+// ints, laid out one problem after the other in three device buffers.
+
+#define LBFGSB_CL_STATE_SIZE 384					// bytes (lbfgsb.cl checks that lbfgsb_state fits)
+#define LBFGSB_CL_WORK_SIZE(n, m) (2*(n)*(m) + 11*(m)*(m) + 4*(n) + 8*(m))	// ws, wy, sy, ss, wt, wn, snd, z, r, d, t, wa
+#define LBFGSB_CL_IWORK_SIZE(n) (3*(n))				// index, iwhere, indx2
+
+// task of a problem (lbfgsb_state.task), like LbfgsbTask in lbfgsb_engine.h
+#define LBFGSB_CL_FG 0				// evaluate f and g at x, then call lbfgsb_step()
+#define LBFGSB_CL_NEW_X 1			// x is a new iterate, call lbfgsb_step() to go on
+#define LBFGSB_CL_CONVERGED 2		// converged (projected gradient or relative reduction of f)
+#define LBFGSB_CL_ABNORMAL 3		// the line search could not find a better point
+#define LBFGSB_CL_ERROR 4			// error in the input (factr, bound types or bounds)
+#define LBFGSB_CL_STOP 5			// stopped after the maximum number of iterations
+
+#endif